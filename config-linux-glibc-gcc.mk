@@ -25,7 +25,7 @@ FS_IMPL_EXTRA_SOURCES = fstatat_native.c fd_utils.c fs_helpers.c
 FS_IMPL_EXTRA_GEN_HEADERS = fstatat.h
 FS_IMPL_EXTRA_IFACE_DEFS = FSTATAT_DEF=native
 
-EVENT_LOOP_IMPL = select
+EVENT_LOOP_IMPL = epoll
 EVENT_LOOP_IMPL_EXTRA_SOURCES = uptime_${UPTIME_IMPL}.c
 EVENT_LOOP_IMPL_EXTRA_GEN_HEADERS = sockets.h uptime.h
 EVENT_LOOP_IMPL_EXTRA_IFACE_DEFS = SOCKETS_DEF=${SOCKETS_IMPL} UPTIME_DEF=${UPTIME_IMPL}
@@ -46,6 +46,7 @@ CFLAGS_DYN = -fPIC
 CXXFLAGS_DYN = -fPIC
 
 CXX_LIBS = -lstdc++
+THREAD_LIBS = -pthread
 
 # compiler and linker
 CC = gcc
@@ -24,6 +24,7 @@
 #define __SOCKET_COMMON_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -41,6 +42,12 @@ set_socket_non_blocking(socket_t sock);
 bool
 ignore_sigpipe();
 
+/* sends up to `count` bytes of the file `fd`, starting at `offset`,
+   without copying through userspace where the platform allows it.
+   otherwise behaves like send() */
+socket_ssize_t
+sendfile_x(socket_t sock, int fd, uint64_t offset, size_t count);
+
 #ifdef __cplusplus
 }
 #endif
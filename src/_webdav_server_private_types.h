@@ -19,6 +19,8 @@
 #ifndef __WEBDAV_SERVER_PRIVATE_TYPES_H
 #define __WEBDAV_SERVER_PRIVATE_TYPES_H
 
+#include "arena.h"
+#include "http_helpers.h"
 #include "http_server.h"
 #include "uthread.h"
 #include "util.h"
@@ -37,7 +39,10 @@ typedef unsigned webdav_timeout_t;
 /* private events */
 
 typedef struct {
+  /* if `fd` isn't -1 the data comes from the file instead of `buf` */
   const void *buf;
+  int fd;
+  uint64_t offset;
   size_t nbyte;
   event_handler_t cb;
   void *cb_ud;
@@ -73,6 +78,8 @@ typedef struct {
   owner_xml_t owner_xml;
   char *lock_token;
   webdav_timeout_t timeout_in_seconds;
+  /* in uptime seconds */
+  uint64_t expires_at;
   bool is_collection;
 } WebdavLockDescriptor;
 
@@ -96,19 +103,43 @@ struct webdav_propfind_entry {
   webdav_resource_time_t creation_time;
   bool is_collection;
   webdav_resource_size_t length;
+  webdav_resource_id_t id;
 };
 
+enum {
+  /* enough for three 64-bit hex numbers, the separators and the quotes */
+  WEBDAV_ETAG_SIZE = 64,
+};
+
+struct webdav_server_shared;
+
 struct webdav_server {
   http_server_t http;
-  linked_list_t locks;
+  event_loop_handle_t loop;
+  /* the lock table, possibly shared with servers on other loops */
+  struct webdav_server_shared *shared;
+  /* next server in `shared`'s list, protected by its lock */
+  struct webdav_server *next_shared;
+  /* lets other servers sharing our state stop us from their thread */
+  socket_t stop_sockets[2];
+  event_loop_watch_key_t stop_watch_key;
+  event_loop_timeout_key_t lock_reaper_key;
+  /* in uptime seconds, only valid while `lock_reaper_key` is set */
+  uint64_t lock_reaper_expires_at;
+  bool is_stopped;
   webdav_backend_t fs;
   char *public_uri_root;
   char *internal_root;
+  /* recycled memory for the requests' arenas */
+  ArenaChunkCache arena_chunks;
 };
 
 struct handler_context {
   UTHR_CTX_BASE;
   struct webdav_server *serv;
+  /* request-scoped allocations, released all at once
+     when the request is done */
+  Arena arena;
   HTTPRequestHeaders rhs;
   HTTPResponseHeaders resp;
   http_request_handle_t rh;
@@ -134,12 +165,26 @@ struct handler_context {
     } delete_x;
     struct get_context {
       coroutine_position_t pos;
+      /* only send the headers a GET would have */
+      bool is_head;
       char *resource_uri;
       bool set_size_hint;
       bool sent_headers;
       size_t amt_sent;
       struct webdav_propfind_entry entry;
+      bool has_etag;
+      char etag[WEBDAV_ETAG_SIZE];
+      linked_list_t headers;
       WebdavGetRequestWriteEvent rwev;
+      webdav_error_t error;
+      /* NULL unless only part of the resource is being sent */
+      HTTPByteRange *ranges;
+      size_t num_ranges;
+      size_t cur_range;
+      bool sent_part_header;
+      /* for multipart/byteranges responses */
+      char boundary[32];
+      char part_header[128];
     } get;
     struct lock_context {
       coroutine_position_t pos;
@@ -155,8 +200,8 @@ struct handler_context {
       char *resource_tag_path;
       char *refresh_uri;
       bool is_locked;
-      const char *lock_token;
-      const char *status_path;
+      char *lock_token;
+      char *status_path;
       bool status_path_is_collection;
       bool is_exclusive;
       webdav_depth_t depth;
@@ -178,9 +223,11 @@ struct handler_context {
       char *buf;
       size_t buf_used, buf_size;
       char *out_buf;
-      size_t out_buf_size;
+      size_t out_buf_used, out_buf_size;
       linked_list_t props_to_get;
       webdav_propfind_req_type_t propfind_req_type;
+      linked_list_t entries;
+      struct _propfind_response_generator *gen;
     } propfind;
     struct proppatch_context {
       coroutine_position_t pos;
@@ -195,6 +242,9 @@ struct handler_context {
       char *request_relative_uri;
       char *response_body;
       size_t response_body_len;
+      bool resource_existed;
+      char etag[WEBDAV_ETAG_SIZE];
+      linked_list_t headers;
     } put;
   } sub;
 };
@@ -214,6 +264,12 @@ create_webdav_proppatch_directive(webdav_proppatch_directive_type_t type,
 void
 free_webdav_proppatch_directive(WebdavProppatchDirective *wp);
 
+/* writes the (strong) entity tag of `entry` into `buf`, quotes included,
+   returns false if there isn't enough information to generate one */
+bool
+webdav_propfind_entry_etag(const struct webdav_propfind_entry *entry,
+                           char *buf, size_t buf_size);
+
 #ifdef __cplusplus
 }
 #endif
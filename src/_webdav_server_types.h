@@ -65,6 +65,8 @@ typedef enum {
 
 typedef long long webdav_resource_time_t;
 typedef size_t webdav_resource_size_t;
+/* identifies a file for as long as it exists, e.g. its inode number */
+typedef uintmax_t webdav_resource_id_t;
 
 /* NB: not totally sure about defining constants like this,
    a #define might be better */
@@ -72,6 +74,8 @@ HEADER_CONST const
 webdav_resource_time_t INVALID_WEBDAV_RESOURCE_TIME = LLONG_MAX;
 HEADER_CONST const
 webdav_resource_size_t INVALID_WEBDAV_RESOURCE_SIZE = SIZE_MAX;
+HEADER_CONST const
+webdav_resource_id_t INVALID_WEBDAV_RESOURCE_ID = UINTMAX_MAX;
 
 /* opaque forward decls */
 struct webdav_propfind_entry;
@@ -88,7 +92,8 @@ webdav_new_propfind_entry(const char *relative_uri,
                           webdav_resource_time_t modified_time,
                           webdav_resource_time_t creation_time,
                           bool is_collection,
-                          webdav_resource_size_t length);
+                          webdav_resource_size_t length,
+                          webdav_resource_id_t id);
 
 void
 webdav_destroy_propfind_entry(webdav_propfind_entry_t pfe);
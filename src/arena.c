@@ -0,0 +1,215 @@
+/*
+  davfuse: FUSE file systems as WebDAV servers
+  Copyright (C) 2012, 2013 Rian Hunter <rian@alum.mit.edu>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+typedef union {
+  long double ld;
+  long long ll;
+  double d;
+  void *p;
+  void (*fn)(void);
+} arena_align_t;
+
+struct _arena_chunk {
+  struct _arena_chunk *next;
+  size_t size;
+  arena_align_t data[];
+};
+
+enum {
+  /* including the chunk header, so a chunk is one malloc()
+     of a friendly size */
+  ARENA_CHUNK_ALLOC_SIZE = 4096,
+  ARENA_CHUNK_SIZE = ARENA_CHUNK_ALLOC_SIZE - sizeof(struct _arena_chunk),
+  /* bigger allocations get a chunk of their own, this keeps
+     them from wasting most of a shared chunk */
+  ARENA_MAX_SHARED_ALLOC = ARENA_CHUNK_SIZE / 4,
+  /* a cache never holds on to more than this many idle chunks */
+  ARENA_MAX_CACHED_CHUNKS = 64,
+};
+
+static char *
+chunk_start(struct _arena_chunk *chunk) {
+  return (char *) chunk->data;
+}
+
+static void
+release_chunk(ArenaChunkCache *cache, struct _arena_chunk *chunk) {
+  if (cache &&
+      chunk->size == ARENA_CHUNK_SIZE &&
+      cache->num_chunks < ARENA_MAX_CACHED_CHUNKS) {
+    chunk->next = cache->chunks;
+    cache->chunks = chunk;
+    cache->num_chunks += 1;
+  }
+  else {
+    free(chunk);
+  }
+}
+
+static struct _arena_chunk *
+new_chunk(ArenaChunkCache *cache, size_t size) {
+  struct _arena_chunk *chunk;
+  if (size == ARENA_CHUNK_SIZE && cache && cache->chunks) {
+    chunk = cache->chunks;
+    cache->chunks = chunk->next;
+    cache->num_chunks -= 1;
+    return chunk;
+  }
+
+  if (size > SIZE_MAX - sizeof(*chunk)) return NULL;
+
+  chunk = malloc(sizeof(*chunk) + size);
+  if (!chunk) return NULL;
+  chunk->size = size;
+  return chunk;
+}
+
+void
+arena_chunk_cache_init(ArenaChunkCache *cache) {
+  *cache = (ArenaChunkCache) {.chunks = NULL, .num_chunks = 0};
+}
+
+void
+arena_chunk_cache_destroy(ArenaChunkCache *cache) {
+  while (cache->chunks) {
+    struct _arena_chunk *const next = cache->chunks->next;
+    free(cache->chunks);
+    cache->chunks = next;
+  }
+  cache->num_chunks = 0;
+}
+
+void
+arena_init(Arena *arena, ArenaChunkCache *cache) {
+  *arena = (Arena) {
+    .chunks = NULL,
+    .cur = NULL,
+    .end = NULL,
+    .cache = cache,
+  };
+}
+
+void
+arena_reset(Arena *arena) {
+  arena_rewind(arena, (ArenaMark) {.chunk = NULL, .cur = NULL, .end = NULL});
+}
+
+void *
+arena_alloc(Arena *arena, size_t size) {
+  /* keep every allocation aligned */
+  const size_t align = sizeof(arena_align_t);
+  if (size > SIZE_MAX - align) return NULL;
+  size = (size + align - 1) / align * align;
+
+  if (arena->cur && (size_t) (arena->end - arena->cur) >= size) {
+    void *const toret = arena->cur;
+    arena->cur += size;
+    return toret;
+  }
+
+  const bool is_shared = size <= ARENA_MAX_SHARED_ALLOC;
+  struct _arena_chunk *const chunk =
+    new_chunk(arena->cache, is_shared ? (size_t) ARENA_CHUNK_SIZE : size);
+  if (!chunk) return NULL;
+
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+
+  /* a private chunk doesn't replace the one we're bumping through */
+  if (is_shared) {
+    arena->cur = chunk_start(chunk) + size;
+    arena->end = chunk_start(chunk) + chunk->size;
+  }
+
+  return chunk_start(chunk);
+}
+
+char *
+arena_strndup(Arena *arena, const char *s, size_t n) {
+  size_t len = 0;
+  while (len < n && s[len]) ++len;
+
+  char *const toret = arena_alloc(arena, len + 1);
+  if (!toret) return NULL;
+
+  memcpy(toret, s, len);
+  toret[len] = '\0';
+  return toret;
+}
+
+char *
+arena_strdup(Arena *arena, const char *s) {
+  return arena_strndup(arena, s, SIZE_MAX);
+}
+
+char *
+arena_strcat(Arena *arena, const char *first, ...) {
+  va_list ap;
+
+  size_t required_size = 0;
+  va_start(ap, first);
+  for (const char *next = first; next; next = va_arg(ap, const char *)) {
+    required_size += strlen(next);
+  }
+  va_end(ap);
+
+  char *const toret = arena_alloc(arena, required_size + 1);
+  if (!toret) return NULL;
+
+  size_t offset = 0;
+  va_start(ap, first);
+  for (const char *next = first; next; next = va_arg(ap, const char *)) {
+    const size_t adding = strlen(next);
+    memcpy(toret + offset, next, adding);
+    offset += adding;
+  }
+  va_end(ap);
+
+  toret[offset] = '\0';
+  return toret;
+}
+
+ArenaMark
+arena_mark(const Arena *arena) {
+  return (ArenaMark) {
+    .chunk = arena->chunks,
+    .cur = arena->cur,
+    .end = arena->end,
+  };
+}
+
+void
+arena_rewind(Arena *arena, ArenaMark mark) {
+  while (arena->chunks != mark.chunk) {
+    struct _arena_chunk *const chunk = arena->chunks;
+    assert(chunk);
+    arena->chunks = chunk->next;
+    release_chunk(arena->cache, chunk);
+  }
+
+  arena->cur = mark.cur;
+  arena->end = mark.end;
+}
@@ -0,0 +1,100 @@
+/*
+  davfuse: FUSE file systems as WebDAV servers
+  Copyright (C) 2012, 2013 Rian Hunter <rian@alum.mit.edu>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* bump allocator for memory that lives exactly as long as some
+   unit of work (e.g. a request). nothing is freed individually,
+   everything allocated from an arena goes away at once when it's
+   reset.
+
+   chunks are recycled through an ArenaChunkCache so a steady stream
+   of short-lived arenas doesn't touch malloc() at all. neither an
+   arena nor its cache is thread-safe, they are meant to be used from
+   a single event loop */
+
+struct _arena_chunk;
+
+typedef struct {
+  struct _arena_chunk *chunks;
+  size_t num_chunks;
+} ArenaChunkCache;
+
+typedef struct {
+  /* most recently added chunk first */
+  struct _arena_chunk *chunks;
+  char *cur;
+  char *end;
+  ArenaChunkCache *cache;
+} Arena;
+
+/* a position in an arena, see arena_rewind() */
+typedef struct {
+  struct _arena_chunk *chunk;
+  char *cur;
+  char *end;
+} ArenaMark;
+
+void
+arena_chunk_cache_init(ArenaChunkCache *cache);
+
+void
+arena_chunk_cache_destroy(ArenaChunkCache *cache);
+
+/* `cache` may be NULL */
+void
+arena_init(Arena *arena, ArenaChunkCache *cache);
+
+/* frees everything allocated from `arena`, the arena can still be used */
+void
+arena_reset(Arena *arena);
+
+/* suitably aligned for any type, returns NULL on failure */
+void *
+arena_alloc(Arena *arena, size_t size);
+
+char *
+arena_strdup(Arena *arena, const char *s);
+
+char *
+arena_strndup(Arena *arena, const char *s, size_t n);
+
+/* like super_strcat(), the argument list is terminated by NULL */
+char *
+arena_strcat(Arena *arena, const char *first, ...);
+
+ArenaMark
+arena_mark(const Arena *arena);
+
+/* frees everything allocated from `arena` since `mark` was taken */
+void
+arena_rewind(Arena *arena, ArenaMark mark);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ARENA_H */
@@ -0,0 +1,337 @@
+/*
+  davfuse: FUSE file systems as WebDAV servers
+  Copyright (C) 2012, 2013 Rian Hunter <rian@alum.mit.edu>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "async_tree.h"
+#include "events.h"
+#include "fs.h"
+#include "logging.h"
+#include "util.h"
+#include "util_fs.h"
+#include "worker_pool.h"
+
+#include "async_fs_helpers.h"
+
+typedef struct {
+  fs_handle_t fs;
+  worker_pool_t pool;
+  char *src;
+  char *dst;
+  bool is_move;
+  /* source directories that were recreated at the destination,
+     children come before their parents */
+  linked_list_t moved_dirs;
+  linked_list_t failed;
+  event_handler_t cb;
+  void *cb_ud;
+} AsyncFsTreeCtx;
+
+/* one expand or apply step on a single path */
+typedef struct {
+  AsyncFsTreeCtx *top;
+  char *path;
+  event_handler_t cb;
+  void *cb_ud;
+  /* filled in by the worker */
+  linked_list_t stack;
+  bool failed;
+  bool is_moved_dir;
+} AsyncFsTreeJob;
+
+static AsyncFsTreeJob *
+_async_fs_tree_job_new(AsyncFsTreeCtx *top, char *path,
+                       event_handler_t cb, void *cb_ud) {
+  AsyncFsTreeJob *const job = malloc_or_abort(sizeof(*job));
+  *job = (AsyncFsTreeJob) {
+    .top = top,
+    .path = path,
+    .cb = cb,
+    .cb_ud = cb_ud,
+    .stack = LINKED_LIST_INITIALIZER,
+    .failed = false,
+    .is_moved_dir = false,
+  };
+  return job;
+}
+
+static void
+_async_fs_expand_work(void *ud) {
+  AsyncFsTreeJob *const job = ud;
+  job->stack = util_fs_prepend_children(job->top->fs, job->path, job->stack);
+}
+
+static
+EVENT_HANDLER_DEFINE(_async_fs_expand_done, ev_type, ev, ud) {
+  AsyncFsTreeJob *const job = ud;
+
+  UNUSED(ev_type);
+  UNUSED(ev);
+  assert(ev_type == WORKER_POOL_RUN_DONE_EVENT);
+
+  const event_handler_t cb = job->cb;
+  void *const cb_ud = job->cb_ud;
+  AsyncTreeExpandFnDoneEvent expand_done_ev = {
+    .error = false,
+    .new_stack = job->stack,
+  };
+  free(job);
+
+  cb(ASYNC_TREE_EXPAND_FN_DONE_EVENT, &expand_done_ev, cb_ud);
+}
+
+static void
+_async_fs_expand(void *user_data, linked_list_t stack, void *elt,
+                 event_handler_t cb, void *cb_ud) {
+  AsyncFsTreeCtx *const ctx = user_data;
+  AsyncFsTreeJob *const job = _async_fs_tree_job_new(ctx, elt, cb, cb_ud);
+  job->stack = stack;
+  worker_pool_run(ctx->pool, _async_fs_expand_work, job,
+                  _async_fs_expand_done, job);
+}
+
+/* runs on the loop's thread, takes ownership of the job's path */
+static
+EVENT_HANDLER_DEFINE(_async_fs_apply_done, ev_type, ev, ud) {
+  AsyncFsTreeJob *const job = ud;
+  AsyncFsTreeCtx *const ctx = job->top;
+
+  UNUSED(ev_type);
+  UNUSED(ev);
+  assert(ev_type == WORKER_POOL_RUN_DONE_EVENT);
+
+  if (job->failed) {
+    ctx->failed = linked_list_prepend(ctx->failed, job->path);
+  }
+  else if (job->is_moved_dir) {
+    ctx->moved_dirs = linked_list_prepend(ctx->moved_dirs, job->path);
+  }
+  else {
+    free(job->path);
+  }
+
+  const event_handler_t cb = job->cb;
+  void *const cb_ud = job->cb_ud;
+  AsyncTreeApplyFnDoneEvent apply_done_ev = {.error = job->failed};
+  free(job);
+
+  cb(ASYNC_TREE_APPLY_FN_DONE_EVENT, &apply_done_ev, cb_ud);
+}
+
+static void
+_async_fs_apply_rmtree_work(void *ud) {
+  AsyncFsTreeJob *const job = ud;
+
+  log_debug("Deleting %s", job->path);
+  const fs_error_t ret_remove = fs_remove(job->top->fs, job->path);
+  if (ret_remove) {
+    /* failed to delete, just move on */
+    log_debug("Failed to delete %s: %s",
+              job->path, util_fs_strerror(ret_remove));
+    job->failed = true;
+  }
+}
+
+static void
+_async_fs_apply_rmtree(void *user_data, void *elt,
+                       event_handler_t cb, void *cb_ud) {
+  AsyncFsTreeCtx *const ctx = user_data;
+  AsyncFsTreeJob *const job = _async_fs_tree_job_new(ctx, elt, cb, cb_ud);
+  worker_pool_run(ctx->pool, _async_fs_apply_rmtree_work, job,
+                  _async_fs_apply_done, job);
+}
+
+static
+EVENT_HANDLER_DEFINE(_async_fs_rmtree_done, ev_type, ev, ud) {
+  AsyncFsTreeCtx *const ctx = ud;
+
+  UNUSED(ev_type);
+  UNUSED(ev);
+  assert(ev_type == ASYNC_TREE_APPLY_DONE_EVENT);
+
+  const event_handler_t cb = ctx->cb;
+  void *const cb_ud = ctx->cb_ud;
+  AsyncFsRmtreeDoneEvent rmtree_done_ev = {
+    .failed_to_delete = ctx->failed,
+  };
+  free(ctx);
+
+  cb(ASYNC_FS_RMTREE_DONE_EVENT, &rmtree_done_ev, cb_ud);
+}
+
+void
+async_fs_rmtree(fs_handle_t fs, worker_pool_t pool,
+                const char *path,
+                event_handler_t cb, void *ud) {
+  AsyncFsTreeCtx *const ctx = malloc_or_abort(sizeof(*ctx));
+  *ctx = (AsyncFsTreeCtx) {
+    .fs = fs,
+    .pool = pool,
+    .moved_dirs = LINKED_LIST_INITIALIZER,
+    .failed = LINKED_LIST_INITIALIZER,
+    .cb = cb,
+    .cb_ud = ud,
+  };
+
+  const bool is_postorder = true;
+  char *const init_path = davfuse_util_strdup(path);
+  ASSERT_NOT_NULL(init_path);
+  return async_tree_apply(ctx,
+                          _async_fs_apply_rmtree,
+                          _async_fs_expand,
+                          (void *) init_path,
+                          is_postorder,
+                          _async_fs_rmtree_done, ctx);
+}
+
+static void
+_async_fs_apply_copytree_work(void *ud) {
+  AsyncFsTreeJob *const job = ud;
+  AsyncFsTreeCtx *const ctx = job->top;
+  char *dest_path = NULL;
+
+  bool is_dir;
+  const fs_error_t ret_is_dir = util_fs_file_is_dir(ctx->fs, job->path, &is_dir);
+  if (ret_is_dir) {
+    job->failed = ret_is_dir != FS_ERROR_DOES_NOT_EXIST;
+    goto done;
+  }
+
+  dest_path = util_fs_path_reparent(ctx->fs, ctx->src, ctx->dst, job->path);
+  if (!dest_path) {
+    job->failed = true;
+    goto done;
+  }
+
+  log_debug("Copying %s to %s", job->path, dest_path);
+
+  if (is_dir) {
+    const fs_error_t ret_mkdir = fs_mkdir(ctx->fs, dest_path);
+    if (ret_mkdir) {
+      log_info("Error calling fs_mkdir(\"%s\"): %s",
+               dest_path, util_fs_strerror(ret_mkdir));
+    }
+    job->failed = ret_mkdir;
+    job->is_moved_dir = !ret_mkdir && ctx->is_move;
+  }
+  else {
+    const fs_error_t ret_copyfile =
+      util_fs_copyfile(ctx->fs, job->path, dest_path);
+    if (ret_copyfile) {
+      log_info("Error calling util_fs_copyfile(\"%s\", \"%s\"): %s",
+               job->path, dest_path, util_fs_strerror(ret_copyfile));
+    }
+
+    job->failed = ret_copyfile;
+    if (!job->failed && ctx->is_move) {
+      /* eagerly delete this entry */
+      const fs_error_t ret_remove = fs_remove(ctx->fs, job->path);
+      if (ret_remove && ret_remove != FS_ERROR_DOES_NOT_EXIST) {
+        log_warning("Failed to delete %s after copying: %s",
+                    job->path, util_fs_strerror(ret_remove));
+      }
+    }
+  }
+
+ done:
+  free(dest_path);
+}
+
+static void
+_async_fs_apply_copytree(void *user_data, void *elt,
+                         event_handler_t cb, void *cb_ud) {
+  AsyncFsTreeCtx *const ctx = user_data;
+  AsyncFsTreeJob *const job = _async_fs_tree_job_new(ctx, elt, cb, cb_ud);
+  worker_pool_run(ctx->pool, _async_fs_apply_copytree_work, job,
+                  _async_fs_apply_done, job);
+}
+
+static void
+_async_fs_copytree_cleanup_work(void *ud) {
+  AsyncFsTreeCtx *const ctx = ud;
+
+  /* the moved directories should be empty by now, children
+     are listed before their parents */
+  LINKED_LIST_FOR(char, path, ctx->moved_dirs) {
+    const fs_error_t ret_remove = fs_remove(ctx->fs, path);
+    if (ret_remove && ret_remove != FS_ERROR_DOES_NOT_EXIST) {
+      log_warning("Failed to delete %s after copying: %s",
+                  path, util_fs_strerror(ret_remove));
+    }
+  }
+}
+
+static
+EVENT_HANDLER_DEFINE(_async_fs_copytree_done, ev_type, ev, ud) {
+  AsyncFsTreeCtx *const ctx = ud;
+
+  UNUSED(ev);
+
+  if (ev_type == ASYNC_TREE_APPLY_DONE_EVENT && ctx->moved_dirs) {
+    return worker_pool_run(ctx->pool, _async_fs_copytree_cleanup_work, ctx,
+                           _async_fs_copytree_done, ctx);
+  }
+
+  assert(ev_type == ASYNC_TREE_APPLY_DONE_EVENT ||
+         ev_type == WORKER_POOL_RUN_DONE_EVENT);
+
+  const event_handler_t cb = ctx->cb;
+  void *const cb_ud = ctx->cb_ud;
+  AsyncFsCopytreeDoneEvent copytree_done_ev = {
+    .failed_to_copy = ctx->failed,
+  };
+  linked_list_free(ctx->moved_dirs, free);
+  free(ctx->src);
+  free(ctx->dst);
+  free(ctx);
+
+  cb(ASYNC_FS_COPYTREE_DONE_EVENT, &copytree_done_ev, cb_ud);
+}
+
+void
+async_fs_copytree(fs_handle_t fs, worker_pool_t pool,
+                  const char *src, const char *dst,
+                  bool is_move,
+                  event_handler_t cb, void *ud) {
+  AsyncFsTreeCtx *const ctx = malloc_or_abort(sizeof(*ctx));
+  *ctx = (AsyncFsTreeCtx) {
+    .fs = fs,
+    .pool = pool,
+    .src = davfuse_util_strdup(src),
+    .dst = davfuse_util_strdup(dst),
+    .is_move = is_move,
+    .moved_dirs = LINKED_LIST_INITIALIZER,
+    .failed = LINKED_LIST_INITIALIZER,
+    .cb = cb,
+    .cb_ud = ud,
+  };
+  ASSERT_NOT_NULL(ctx->src);
+  ASSERT_NOT_NULL(ctx->dst);
+
+  const bool is_postorder = false;
+  char *const init_path = davfuse_util_strdup(src);
+  ASSERT_NOT_NULL(init_path);
+  return async_tree_apply(ctx,
+                          _async_fs_apply_copytree,
+                          _async_fs_expand,
+                          (void *) init_path,
+                          is_postorder,
+                          _async_fs_copytree_done, ctx);
+}
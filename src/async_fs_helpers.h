@@ -0,0 +1,52 @@
+/*
+  davfuse: FUSE file systems as WebDAV servers
+  Copyright (C) 2012, 2013 Rian Hunter <rian@alum.mit.edu>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef ASYNC_FS_HELPERS_H
+#define ASYNC_FS_HELPERS_H
+
+#include <stdbool.h>
+
+#include "events.h"
+#include "fs.h"
+#include "util.h"
+#include "worker_pool.h"
+
+/* tree operations over an fs_handle_t that run their file system calls
+   on `pool` (several at a time, see async_tree.h) instead of blocking
+   the calling thread, completion is signaled on the loop's thread */
+
+typedef struct {
+  linked_list_t failed_to_copy;
+} AsyncFsCopytreeDoneEvent;
+
+typedef struct {
+  linked_list_t failed_to_delete;
+} AsyncFsRmtreeDoneEvent;
+
+void
+async_fs_rmtree(fs_handle_t fs, worker_pool_t pool,
+                const char *path,
+                event_handler_t cb, void *ud);
+
+void
+async_fs_copytree(fs_handle_t fs, worker_pool_t pool,
+                  const char *src, const char *dst,
+                  bool is_move,
+                  event_handler_t cb, void *ud);
+
+#endif
@@ -20,18 +20,25 @@
 #define _POSIX_C_SOURCE 199309L
 #define _BSD_SOURCE
 
+#include <pthread.h>
 #include <unistd.h>
 
 #include <assert.h>
 #include <errno.h>
-#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
+#ifdef __linux__
+#include <sys/eventfd.h>
+#define USE_EVENTFD
+#endif
+
 #define FUSE_USE_VERSION 26
 #include "fuse.h"
 #undef FUSE_USE_VERSION
 
-#include "async_rdwr_lock.h"
 #include "event_loop.h"
 #include "fd_utils.h"
 #include "logging.h"
@@ -40,56 +47,12 @@
 
 #include "async_fuse_fs.h"
 
-typedef union {
-  int all[2];
-  struct {
-    /* read from out */
-    int out;
-    /* write to in */
-    int in;
-  } named;
-} Channel;
-
-#define CHANNEL_INITIALIZER ((Channel) {.all = {-1, -1}})
-
-static bool
-channel_init(Channel *chan) {
-  int ret = pipe(chan->all);
-  return !ret;
-}
-
-static bool
-channel_deinit(Channel *chan) {
-  if (chan->named.in >= 0) {
-    int ret_1 = close(chan->named.in);
-    if (ret_1) {
-      return false;
-    }
-  }
-
-  if (chan->named.out >= 0) {
-    close_or_abort(chan->named.out);
-  }
-
-  return true;
-}
-
-struct async_fuse_fs {
-  Channel to_worker;
-  Channel to_server;
-  event_loop_handle_t loop;
-  /* TODO: get rid of this */
-  async_rdwr_lock_t to_server_lock;
-};
-
 typedef enum {
-  MESSAGE_TYPE_QUIT,
   MESSAGE_TYPE_OPEN,
   MESSAGE_TYPE_READ,
   MESSAGE_TYPE_GETATTR,
   MESSAGE_TYPE_MKDIR,
   MESSAGE_TYPE_MKNOD,
-  MESSAGE_TYPE_REPLY,
   MESSAGE_TYPE_GETDIR,
   MESSAGE_TYPE_UNLINK,
   MESSAGE_TYPE_RMDIR,
@@ -100,20 +63,15 @@ typedef enum {
 } worker_message_type_t;
 
 #define MESSAGE_HDR worker_message_type_t type
-#define REQUEST_MESSAGE_HDR worker_message_type_t type; Channel *reply_chan
 
 typedef struct {
   MESSAGE_HDR;
-} QuitMessage;
-
-typedef struct {
-  REQUEST_MESSAGE_HDR;
   const char *path;
   struct fuse_file_info *fi;
 } OpenMessage;
 
 typedef struct {
-  REQUEST_MESSAGE_HDR;
+  MESSAGE_HDR;
   const char *path;
   char *buf;
   size_t size;
@@ -122,43 +80,43 @@ typedef struct {
 } ReadMessage;
 
 typedef struct {
-  REQUEST_MESSAGE_HDR;
+  MESSAGE_HDR;
   const char *path;
   struct stat *st;
 } GetattrMessage;
 
 typedef struct {
-  REQUEST_MESSAGE_HDR;
+  MESSAGE_HDR;
   const char *path;
   mode_t mode;
 } MkdirMessage;
 
 typedef struct {
-  REQUEST_MESSAGE_HDR;
+  MESSAGE_HDR;
   const char *path;
   mode_t mode;
   dev_t dev;
 } MknodMessage;
 
 typedef struct {
-  REQUEST_MESSAGE_HDR;
+  MESSAGE_HDR;
   const char *path;
   fuse_dirh_t h;
   fuse_dirfil_t fn;
 } GetdirMessage;
 
 typedef struct {
-  REQUEST_MESSAGE_HDR;
+  MESSAGE_HDR;
   const char *path;
 } UnlinkMessage;
 
 typedef struct {
-  REQUEST_MESSAGE_HDR;
+  MESSAGE_HDR;
   const char *path;
 } RmdirMessage;
 
 typedef struct {
-  REQUEST_MESSAGE_HDR;
+  MESSAGE_HDR;
   const char *path;
   const char *buf;
   size_t size;
@@ -167,44 +125,34 @@ typedef struct {
 } WriteMessage;
 
 typedef struct {
-  REQUEST_MESSAGE_HDR;
+  MESSAGE_HDR;
   const char *path;
   struct fuse_file_info *fi;
 } ReleaseMessage;
 
 typedef struct {
-  REQUEST_MESSAGE_HDR;
+  MESSAGE_HDR;
   const char *path;
   struct stat *buf;
   struct fuse_file_info *fi;
 } FgetattrMessage;
 
 typedef struct {
-  REQUEST_MESSAGE_HDR;
+  MESSAGE_HDR;
   const char *src;
   const char *dst;
 } RenameMessage;
 
-typedef struct {
-  MESSAGE_HDR;
-  int ret;
-} ReplyMessage;
-
 typedef union {
   struct {
     MESSAGE_HDR;
   } generic;
-  struct {
-    REQUEST_MESSAGE_HDR;
-  } request;
-  QuitMessage quit;
   OpenMessage open;
   ReadMessage read;
   GetattrMessage getattr;
   MkdirMessage mkdir;
   MknodMessage mknod;
   GetdirMessage getdir;
-  ReplyMessage reply;
   UnlinkMessage unlink;
   RmdirMessage rmdir;
   WriteMessage write;
@@ -213,227 +161,161 @@ typedef union {
   RenameMessage rename;
 } Message;
 
+typedef struct _send_request_ctx {
+  UTHR_CTX_BASE;
+  /* args */
+  struct async_fuse_fs *fs;
+  Message msg;
+  event_type_t done_event_type;
+  event_handler_t cb;
+  void *cb_ud;
+  /* ctx */
+  struct _send_request_ctx *next;
+  int ret;
+} SendRequestCtx;
+
+/* requests are passed between threads by linking their contexts
+   into these queues, nothing is copied */
 typedef struct {
-  bool error;
-} SendMessageDoneEvent;
+  SendRequestCtx *head;
+  SendRequestCtx *tail;
+} RequestQueue;
+
+enum {
+  WAKEUP_FD_READ,
+  WAKEUP_FD_WRITE,
+};
+
+struct async_fuse_fs {
+  event_loop_handle_t loop;
+  /* only touched by the server thread */
+  size_t num_in_flight;
+  bool is_watching_replies;
+  /* on linux this is a single eventfd, otherwise a pipe */
+  int wakeup_fd[2];
+  bool initted_lock;
+  bool initted_cond;
+  /* protects everything below */
+  pthread_mutex_t lock;
+  pthread_cond_t request_available;
+  RequestQueue to_worker;
+  RequestQueue to_server;
+  bool sent_wakeup;
+  bool should_quit;
+};
 
 typedef struct {
-  bool error;
-  ReplyMessage msg;
+  int ret;
 } ReceiveReplyMessageDoneEvent;
 
-static bool
-send_atomic_message(Channel *chan, Message *msg) {
-  assert(sizeof(*msg) <= PIPE_BUF);
-  /* TODO: read the necessary size depending on the message type */
-  ssize_t ret;
-  while (true) {
-    ret = write(chan->named.in, msg, sizeof(*msg));
-    if (!(ret < 0 && errno == EINTR)) {
-      break;
-    }
+static void
+_request_queue_push(RequestQueue *queue, SendRequestCtx *ctx) {
+  ctx->next = NULL;
+  if (queue->tail) {
+    queue->tail->next = ctx;
   }
-  if (ret < 0) {
-    log_error("Erroring while sending atomic message: %s", strerror(errno));
+  else {
+    queue->head = ctx;
   }
-  assert(ret < 0 || ret == sizeof(*msg));
-  return ret >= 0;
+  queue->tail = ctx;
 }
 
-static bool
-receive_atomic_message(Channel *chan, Message *msg) {
-  assert(sizeof(*msg) <= PIPE_BUF);
-  /* TODO: send the necessary size depending on the message type */
-  ssize_t ret;
-  while (true) {
-    ret = read(chan->named.out, msg, sizeof(*msg));
-    if (!(ret < 0 && errno == EINTR)) {
-      break;
-    }
-  }
-  if (ret < 0) {
-    log_error("Erroring while receiving atomic message: %s", strerror(errno));
+static SendRequestCtx *
+_request_queue_pop(RequestQueue *queue) {
+  SendRequestCtx *const ctx = queue->head;
+  if (ctx) {
+    queue->head = ctx->next;
+    if (!queue->head) queue->tail = NULL;
   }
-  assert(ret < 0 || ret == sizeof(*msg));
-  return ret >= 0;
+  return ctx;
 }
 
-static bool
-send_quit_message_blocking(Channel *chan) {
-  bool success_set_blocking = set_blocking(chan->named.in);
-  if (!success_set_blocking) {
-    return false;
-  }
-
-  Message msg = {.quit = {.type = MESSAGE_TYPE_QUIT}};
-  int ret_send_atomic_message = send_atomic_message(chan, &msg);
-
-  bool success_set_non_blocking = set_non_blocking(chan->named.in);
-  if (!success_set_non_blocking) {
-    /* this can't fail */
-    abort();
-  }
-
-  return ret_send_atomic_message >= 0;
+static void
+_async_fuse_fs_lock(struct async_fuse_fs *fs) {
+  const int ret = pthread_mutex_lock(&fs->lock);
+  ASSERT_TRUE(!ret);
 }
 
-typedef struct {
-  UTHR_CTX_BASE;
-  /* args */
-  event_loop_handle_t loop;
-  Channel *to_chan;
-  Message *msg;
-  event_handler_t cb;
-  void *ud;
-  /* ctx */
-} SendMessageCtx;
-
-static
-UTHR_DEFINE(_send_message) {
-  bool error;
-
-  UTHR_HEADER(SendMessageCtx, ctx);
+static void
+_async_fuse_fs_unlock(struct async_fuse_fs *fs) {
+  const int ret = pthread_mutex_unlock(&fs->lock);
+  ASSERT_TRUE(!ret);
+}
 
-  while (true) {
-    bool success_sent = send_atomic_message(ctx->to_chan, ctx->msg);
-    if (success_sent) {
-      error = false;
-      break;
-    }
+static bool
+_wakeup_init(int wakeup_fd[2]) {
+#ifdef USE_EVENTFD
+  const int fd = eventfd(0, EFD_NONBLOCK);
+  if (fd < 0) return false;
+  wakeup_fd[WAKEUP_FD_READ] = wakeup_fd[WAKEUP_FD_WRITE] = fd;
+  return true;
+#else
+  const int ret_pipe = pipe(wakeup_fd);
+  if (ret_pipe) return false;
+  return set_non_blocking(wakeup_fd[WAKEUP_FD_READ]);
+#endif
+}
 
-    if (errno == EAGAIN) {
-      bool ret = event_loop_fd_watch_add(ctx->loop, ctx->to_chan->named.in,
-                                         create_stream_events(false, true),
-                                         _send_message,
-                                         ctx,
-                                         NULL);
-      ASSERT_TRUE(ret);
-      UTHR_YIELD(ctx, 0);
-      UTHR_RECEIVE_EVENT(EVENT_LOOP_FD_EVENT, EventLoopFdEvent, fd_ev);
-      if (fd_ev->error) {
-        log_error("error during fd watch");
-        error = true;
-        break;
-      }
-    }
-    else {
-      error = true;
-      break;
-    }
+static void
+_wakeup_deinit(int wakeup_fd[2]) {
+  if (wakeup_fd[WAKEUP_FD_READ] >= 0) {
+    close_or_abort(wakeup_fd[WAKEUP_FD_READ]);
   }
 
-  SendMessageDoneEvent ev = {
-    .error = error,
-  };
-  UTHR_RETURN(ctx,
-              ctx->cb(SEND_MESSAGE_DONE_EVENT, &ev, ctx->ud));
-
-  UTHR_FOOTER();
+  if (wakeup_fd[WAKEUP_FD_WRITE] >= 0 &&
+      wakeup_fd[WAKEUP_FD_WRITE] != wakeup_fd[WAKEUP_FD_READ]) {
+    close_or_abort(wakeup_fd[WAKEUP_FD_WRITE]);
+  }
 }
 
 static void
-send_message(event_loop_handle_t loop,
-             Channel *to_chan,
-             Message *msg,
-             event_handler_t cb, void *ud) {
-  UTHR_CALL6(_send_message, SendMessageCtx,
-             .loop = loop,
-             .to_chan = to_chan,
-             .msg = msg,
-             .cb = cb,
-             .ud = ud);
-}
-
-typedef struct {
-  UTHR_CTX_BASE;
-  /* args */
-  event_loop_handle_t loop;
-  Channel *from_chan;
-  event_handler_t cb;
-  void *ud;
-  /* ctx */
-  Message msg;
-} ReceiveReplyMessageCtx;
-
-static
-UTHR_DEFINE(_receive_reply_message) {
-  bool error;
-
-  UTHR_HEADER(ReceiveReplyMessageCtx, ctx);
-
+_wakeup_signal(int wakeup_fd[2]) {
+#ifdef USE_EVENTFD
+  const uint64_t toadd = 1;
+#else
+  const char toadd = 1;
+#endif
+  ssize_t ret;
   while (true) {
-    bool success_receive =
-      receive_atomic_message(ctx->from_chan, &ctx->msg);
-    if (success_receive) {
-      error = false;
-      break;
-    }
-
-    if (errno == EAGAIN) {
-      bool ret = event_loop_fd_watch_add(ctx->loop, ctx->from_chan->named.out,
-                                         create_stream_events(true, false),
-                                         _receive_reply_message,
-                                         ctx,
-                                         NULL);
-      ASSERT_TRUE(ret);
-      UTHR_YIELD(ctx, 0);
-      UTHR_RECEIVE_EVENT(EVENT_LOOP_FD_EVENT, EventLoopFdEvent, fd_ev);
-      if (fd_ev->error) {
-        log_error("error during fd watch");
-        error = true;
-        break;
-      }
-    }
-    else {
-      error = true;
-      break;
-    }
+    ret = write(wakeup_fd[WAKEUP_FD_WRITE], &toadd, sizeof(toadd));
+    if (!(ret < 0 && errno == EINTR)) break;
   }
-
-  ReceiveReplyMessageDoneEvent ev = {
-    .error = error,
-    .msg = ctx->msg.reply,
-  };
-  UTHR_RETURN(ctx,
-              ctx->cb(RECEIVE_REPLY_MESSAGE_DONE_EVENT, &ev, ctx->ud));
-
-  UTHR_FOOTER();
+  /* only one signal is ever pending so this can't block or fail */
+  ASSERT_TRUE(ret == sizeof(toadd));
 }
 
 static void
-receive_reply_message(event_loop_handle_t loop,
-                      Channel *from_chan,
-                      event_handler_t cb, void *ud) {
-  UTHR_CALL4(_receive_reply_message, ReceiveReplyMessageCtx,
-             .loop = loop,
-             .from_chan = from_chan,
-             .cb = cb,
-             .ud = ud);
+_wakeup_clear(int wakeup_fd[2]) {
+#ifdef USE_EVENTFD
+  uint64_t toread;
+#else
+  char toread;
+#endif
+  ssize_t ret;
+  while (true) {
+    ret = read(wakeup_fd[WAKEUP_FD_READ], &toread, sizeof(toread));
+    if (!(ret < 0 && errno == EINTR)) break;
+  }
+  ASSERT_TRUE(ret == sizeof(toread));
 }
 
 static bool
 _async_fuse_fs_destroy(async_fuse_fs_t fs) {
   assert(fs);
+  assert(!fs->num_in_flight);
+  assert(!fs->to_worker.head);
+  assert(!fs->to_server.head);
 
-  if (fs->to_server_lock) {
-    bool success_destroy =
-      async_rdwr_destroy_sync(fs->to_server_lock);
-    /* this can't fail */
-    ASSERT_TRUE_MSG(success_destroy, "Couldn't destroy read write lock");
-  }
+  _wakeup_deinit(fs->wakeup_fd);
 
-  int ret_chan_deinit_1 = channel_deinit(&fs->to_worker);
-  if (!ret_chan_deinit_1) {
-    /* can't recover from this */
-    log_critical("Couldn't deinit \"to worker\" channel");
-    abort();
+  if (fs->initted_cond) {
+    const int ret_cond_destroy = pthread_cond_destroy(&fs->request_available);
+    ASSERT_TRUE(!ret_cond_destroy);
   }
 
-  int ret_chan_deinit_2 = channel_deinit(&fs->to_server);
-  if (!ret_chan_deinit_2) {
-    /* can't recover from this */
-    log_critical("Couldn't deinit \"to server\" channel");
-    abort();
+  if (fs->initted_lock) {
+    const int ret_mutex_destroy = pthread_mutex_destroy(&fs->lock);
+    ASSERT_TRUE(!ret_mutex_destroy);
   }
 
   free(fs);
@@ -449,44 +331,36 @@ async_fuse_fs_new(event_loop_handle_t loop) {
     goto error;
   }
 
-  toret->to_server_lock = async_rdwr_new();
-  if (!toret->to_server_lock) {
-    log_error("Couldn't create async read write lock");
-    goto error;
-  }
-
-  toret->to_worker = CHANNEL_INITIALIZER;
-  toret->to_server = CHANNEL_INITIALIZER;
-
-  bool success_channel_init_1 = channel_init(&toret->to_worker);
-  if (!success_channel_init_1) {
-    log_error("Couldn't create \"to worker\" channel");
-    goto error;
-  }
+  *toret = (struct async_fuse_fs) {
+    .loop = loop,
+    .num_in_flight = 0,
+    .is_watching_replies = false,
+    .wakeup_fd = {-1, -1},
+    .to_worker = {.head = NULL, .tail = NULL},
+    .to_server = {.head = NULL, .tail = NULL},
+  };
 
-  bool success_channel_init_2 = channel_init(&toret->to_server);
-  if (!success_channel_init_2) {
-    log_error("Couldn't create \"to server\" channel");
+  const int ret_mutex_init = pthread_mutex_init(&toret->lock, NULL);
+  if (ret_mutex_init) {
+    log_error("Couldn't create lock: %s", strerror(ret_mutex_init));
     goto error;
   }
+  toret->initted_lock = true;
 
-  /* set to_server.read and to_worker.write as non-blocking */
-  bool success_set_non_blocking_1 =
-    set_non_blocking(toret->to_worker.named.in);
-  if (!success_set_non_blocking_1) {
-    log_error("Couldn't make `to_worker.write` non-blocking");
+  const int ret_cond_init =
+    pthread_cond_init(&toret->request_available, NULL);
+  if (ret_cond_init) {
+    log_error("Couldn't create condition: %s", strerror(ret_cond_init));
     goto error;
   }
+  toret->initted_cond = true;
 
-  bool success_set_non_blocking_2 =
-    set_non_blocking(toret->to_server.named.out);
-  if (!success_set_non_blocking_2) {
-    log_error("Couldn't make `to_server.read` non-blocking");
+  const bool success_wakeup_init = _wakeup_init(toret->wakeup_fd);
+  if (!success_wakeup_init) {
+    log_error("Couldn't create wakeup fd: %s", strerror(errno));
     goto error;
   }
 
-  toret->loop = loop;
-
   return toret;
 
  error:
@@ -497,86 +371,102 @@ async_fuse_fs_new(event_loop_handle_t loop) {
   return NULL;
 }
 
-typedef struct {
-  UTHR_CTX_BASE;
-  /* args */
-  struct async_fuse_fs *fs;
-  Message msg;
-  event_type_t done_event_type;
-  event_handler_t cb;
-  void *cb_ud;
-  /* ctx */
-  bool set_in_use;
-} SendRequestCtx;
+static
+UTHR_DECLARE(_send_request_uthr);
 
 static
-UTHR_DEFINE(_send_request_uthr) {
-  FuseFsOpDoneEvent ev;
+EVENT_HANDLER_DECLARE(_receive_replies_handler);
 
-  UTHR_HEADER(SendRequestCtx, ctx);
+static void
+_watch_replies(struct async_fuse_fs *fs) {
+  if (fs->is_watching_replies) return;
+
+  bool ret = event_loop_fd_watch_add(fs->loop, fs->wakeup_fd[WAKEUP_FD_READ],
+                                     create_stream_events(true, false),
+                                     _receive_replies_handler,
+                                     fs,
+                                     NULL);
+  ASSERT_TRUE(ret);
+  fs->is_watching_replies = true;
+}
+
+/* replies can come back in any order, take all that are available
+   and resume the request each one belongs to */
+static
+EVENT_HANDLER_DEFINE(_receive_replies_handler, ev_type, ev, ud) {
+  struct async_fuse_fs *const fs = ud;
 
-  ctx->set_in_use = false;
+  UNUSED(ev_type);
+  assert(ev_type == EVENT_LOOP_FD_EVENT);
+  EventLoopFdEvent *const fd_ev = ev;
 
-  UTHR_SUBCALL(ctx,
-               async_rdwr_write_lock(ctx->fs->to_server_lock,
-                                     _send_request_uthr, ctx),
-               ASYNC_RDWR_WRITE_LOCK_DONE_EVENT,
-               AsyncRdwrWriteLockDoneEvent, lock_done_ev);
-  if (!lock_done_ev->success) {
-    ev.ret = -ENOMEM;
-    goto done;
+  /* watches are one-shot */
+  fs->is_watching_replies = false;
+
+  if (fd_ev->error) {
+    /* this is pretty hard to recover from, just abort for now */
+    log_critical("error during fd watch");
+    abort();
+  }
+
+  _async_fuse_fs_lock(fs);
+  SendRequestCtx *ctx = fs->to_server.head;
+  fs->to_server = (RequestQueue) {.head = NULL, .tail = NULL};
+  if (fs->sent_wakeup) {
+    _wakeup_clear(fs->wakeup_fd);
+    fs->sent_wakeup = false;
   }
+  _async_fuse_fs_unlock(fs);
 
-  ctx->set_in_use = true;
+  while (ctx) {
+    SendRequestCtx *const next = ctx->next;
 
-  ctx->msg.request.reply_chan = &ctx->fs->to_server;
+    assert(fs->num_in_flight);
+    fs->num_in_flight -= 1;
 
-  UTHR_YIELD(ctx,
-             send_message(ctx->fs->loop,
-                          &ctx->fs->to_worker,
-                          &ctx->msg,
-                          _send_request_uthr, ctx));
-  UTHR_RECEIVE_EVENT(SEND_MESSAGE_DONE_EVENT,
-                     SendMessageDoneEvent, send_msg_done_ev);
-  if (send_msg_done_ev->error) {
-    ev.ret = -EIO;
-    goto done;
+    ReceiveReplyMessageDoneEvent reply_ev = {
+      .ret = ctx->ret,
+    };
+    _send_request_uthr(RECEIVE_REPLY_MESSAGE_DONE_EVENT, &reply_ev, ctx);
+
+    ctx = next;
   }
 
-  /* okay now that we sent off message, wait for the reply */
-  UTHR_YIELD(ctx,
-             receive_reply_message(ctx->fs->loop,
-                                   &ctx->fs->to_server,
-                                   _send_request_uthr, ctx));
+  if (fs->num_in_flight) _watch_replies(fs);
+}
+
+static
+UTHR_DEFINE(_send_request_uthr) {
+  FuseFsOpDoneEvent ev;
+
+  UTHR_HEADER(SendRequestCtx, ctx);
+
+  ctx->fs->num_in_flight += 1;
+  _watch_replies(ctx->fs);
+
+  /* signaling is a no-op in the common case that all workers are busy */
+  _async_fuse_fs_lock(ctx->fs);
+  _request_queue_push(&ctx->fs->to_worker, ctx);
+  _async_fuse_fs_unlock(ctx->fs);
+  const int ret_signal = pthread_cond_signal(&ctx->fs->request_available);
+  ASSERT_TRUE(!ret_signal);
+
+  /* okay now that we sent off the request, wait for the reply */
+  UTHR_YIELD(ctx, 0);
   UTHR_RECEIVE_EVENT(RECEIVE_REPLY_MESSAGE_DONE_EVENT,
                      ReceiveReplyMessageDoneEvent,
                      receive_reply_message_done_ev);
-  if (receive_reply_message_done_ev->error) {
-    /* this is pretty hard to recover from, just abort for now */
-    abort();
-  }
 
-  ev.ret = receive_reply_message_done_ev->msg.ret;
+  ev.ret = receive_reply_message_done_ev->ret;
 
-  event_handler_t cb;
- done:
-  cb = ctx->cb;
+  event_handler_t cb = ctx->cb;
   void *cb_ud = ctx->cb_ud;
   event_type_t ev_type = ctx->done_event_type;
-  bool set_in_use = ctx->set_in_use;
-  async_rdwr_lock_t to_server_lock = ctx->fs->to_server_lock;
 
-  free(ctx);
+  UTHR_FREE(ctx);
 
   cb(ev_type, &ev, cb_ud);
 
-  /* unlock after calling the callback,
-     otherwise we won't call our callback until every other locked
-     send_request method is complete */
-  if (set_in_use) {
-    async_rdwr_write_unlock(to_server_lock);
-  }
-
   return;
 
   UTHR_FOOTER();
@@ -834,117 +724,119 @@ async_fuse_fs_rename(async_fuse_fs_t fs,
              .cb_ud = cb_ud);
 }
 
-void
-async_fuse_worker_main_loop(async_fuse_fs_t fs,
-                            const struct fuse_operations *op,
-                            size_t op_size,
-                            void *user_data) {
-  UNUSED(op_size);
-  UNUSED(user_data);
+static SendRequestCtx *
+_receive_request(struct async_fuse_fs *fs) {
+  _async_fuse_fs_lock(fs);
+  /* pending requests are still run after we are asked to quit */
+  while (!fs->to_worker.head && !fs->should_quit) {
+    const int ret_wait =
+      pthread_cond_wait(&fs->request_available, &fs->lock);
+    ASSERT_TRUE(!ret_wait);
+  }
+  SendRequestCtx *const ctx = _request_queue_pop(&fs->to_worker);
+  _async_fuse_fs_unlock(fs);
 
-  /* call init method first */
-  fuse_get_context()->private_data = user_data;
-  struct fuse_conn_info conn = {
-    .proto_major = 2,
-    .proto_minor = 6,
-    .async_read = 0,
-    /* TODO */
-  };
+  return ctx;
+}
 
-  void *init_ret = NULL;
-  if (op->init) {
-    init_ret = op->init(&conn);
-    fuse_get_context()->private_data = init_ret;
+static void
+_send_reply(struct async_fuse_fs *fs, SendRequestCtx *ctx) {
+  _async_fuse_fs_lock(fs);
+  _request_queue_push(&fs->to_server, ctx);
+  /* only one wakeup is ever pending, the server collects all
+     replies each time it's woken up */
+  if (!fs->sent_wakeup) {
+    _wakeup_signal(fs->wakeup_fd);
+    fs->sent_wakeup = true;
   }
+  _async_fuse_fs_unlock(fs);
+}
 
+static void
+_async_fuse_worker_loop(async_fuse_fs_t fs,
+                        const struct fuse_operations *op) {
   while (true) {
-    Message msg;
-
     log_debug("Waiting for worker request");
-    bool success_receive_atomic_message =
-      receive_atomic_message(&fs->to_worker, &msg);
-    if (!success_receive_atomic_message) {
-      log_critical("Error while reading worker msg");
-      abort();
-    }
-
-    if (msg.generic.type == MESSAGE_TYPE_QUIT) {
-      log_info("Received quit message, quitting...");
+    SendRequestCtx *const ctx = _receive_request(fs);
+    if (!ctx) {
+      log_info("Received quit request, quitting...");
       break;
     }
 
+    const Message *const msg = &ctx->msg;
+
     int ret;
-    switch (msg.request.type) {
+    switch (msg->generic.type) {
     case MESSAGE_TYPE_OPEN:
       log_debug("Peforming fuse open(path=\"%s\", fi=%p)",
-                msg.open.path, msg.open.fi);
-      ret = op->open(msg.open.path, msg.open.fi);
+                msg->open.path, msg->open.fi);
+      ret = op->open(msg->open.path, msg->open.fi);
       break;
     case MESSAGE_TYPE_READ:
       log_debug("Peforming fuse read(path=\"%s\", buf=%p, size=%ju, off=%jd, fi=%p)",
-                msg.read.path,
-                msg.read.buf,
-                (uintmax_t) msg.read.size,
-                (intmax_t) msg.read.off,
-                msg.read.fi);
-      ret = op->read(msg.read.path,
-                     msg.read.buf, msg.read.size, msg.read.off,
-                     msg.read.fi);
+                msg->read.path,
+                msg->read.buf,
+                (uintmax_t) msg->read.size,
+                (intmax_t) msg->read.off,
+                msg->read.fi);
+      ret = op->read(msg->read.path,
+                     msg->read.buf, msg->read.size, msg->read.off,
+                     msg->read.fi);
       break;
     case MESSAGE_TYPE_GETATTR:
       log_debug("Peforming fuse getattr(path=\"%s\", st=%p)",
-                msg.getattr.path, msg.getattr.st);
-      ret = op->getattr(msg.getattr.path, msg.getattr.st);
+                msg->getattr.path, msg->getattr.st);
+      ret = op->getattr(msg->getattr.path, msg->getattr.st);
       break;
     case MESSAGE_TYPE_MKDIR:
       log_debug("Peforming fuse mkdir(path=\"%s\", mode=0%o)",
-                msg.mkdir.path, msg.mkdir.mode);
-      ret = op->mkdir(msg.mkdir.path, msg.mkdir.mode);
+                msg->mkdir.path, msg->mkdir.mode);
+      ret = op->mkdir(msg->mkdir.path, msg->mkdir.mode);
       break;
     case MESSAGE_TYPE_MKNOD:
       log_debug("Peforming fuse mknod(path=\"%s\", mode=0%o, dev=%lld)",
-                msg.mknod.path, msg.mknod.mode, (long long) msg.mknod.dev);
-      ret = op->mknod(msg.mknod.path, msg.mknod.mode, msg.mknod.dev);
+                msg->mknod.path, msg->mknod.mode, (long long) msg->mknod.dev);
+      ret = op->mknod(msg->mknod.path, msg->mknod.mode, msg->mknod.dev);
       break;
     case MESSAGE_TYPE_GETDIR:
       log_debug("Peforming fuse getdir(path=\"%s\", h=%p, fn=%p)",
-                msg.getdir.path, msg.getdir.h, msg.getdir.fn);
-      ret = op->getdir(msg.getdir.path, msg.getdir.h, msg.getdir.fn);
+                msg->getdir.path, msg->getdir.h, msg->getdir.fn);
+      ret = op->getdir(msg->getdir.path, msg->getdir.h, msg->getdir.fn);
       break;
     case MESSAGE_TYPE_UNLINK:
       log_debug("Peforming fuse getdir(path=\"%s\")",
-                msg.unlink.path);
-      ret = op->unlink(msg.unlink.path);
+                msg->unlink.path);
+      ret = op->unlink(msg->unlink.path);
       break;
     case MESSAGE_TYPE_RMDIR:
       log_debug("Peforming fuse rmdir(path=\"%s\")",
-                msg.rmdir.path);
-      ret = op->rmdir(msg.rmdir.path);
+                msg->rmdir.path);
+      ret = op->rmdir(msg->rmdir.path);
       break;
     case MESSAGE_TYPE_WRITE:
       log_debug("Peforming fuse write(path=\"%s\", buf=%p, size=%ju, off=%jd, fi=%p)",
-                msg.write.path, msg.write.buf, (uintmax_t) msg.write.size,
-                (intmax_t) msg.write.off, msg.write.fi);
-      ret = op->write(msg.write.path, msg.write.buf, msg.write.size,
-                      msg.write.off, msg.write.fi);
+                msg->write.path, msg->write.buf, (uintmax_t) msg->write.size,
+                (intmax_t) msg->write.off, msg->write.fi);
+      ret = op->write(msg->write.path, msg->write.buf, msg->write.size,
+                      msg->write.off, msg->write.fi);
       break;
     case MESSAGE_TYPE_RELEASE:
       log_debug("Peforming fuse release(path=\"%s\", fi=%p)",
-                msg.release.path, msg.release.fi);
-      ret = op->release(msg.release.path, msg.release.fi);
+                msg->release.path, msg->release.fi);
+      ret = op->release(msg->release.path, msg->release.fi);
       break;
     case MESSAGE_TYPE_FGETATTR:
       log_debug("Peforming fuse fgetattr(path=\"%s\", buf=%p, fi=%p)",
-                msg.fgetattr.path, msg.fgetattr.buf, msg.fgetattr.fi);
-      ret = op->fgetattr(msg.fgetattr.path, msg.fgetattr.buf, msg.fgetattr.fi);
+                msg->fgetattr.path, msg->fgetattr.buf, msg->fgetattr.fi);
+      ret = op->fgetattr(msg->fgetattr.path, msg->fgetattr.buf, msg->fgetattr.fi);
       break;
     case MESSAGE_TYPE_RENAME:
       log_debug("Peforming fuse rename(src=\"%s\", dst=\"%s\")",
-                msg.rename.src, msg.rename.dst);
-      ret = op->rename(msg.rename.src, msg.rename.dst);
+                msg->rename.src, msg->rename.dst);
+      ret = op->rename(msg->rename.src, msg->rename.dst);
       break;
     default:
-      log_critical("Received unknown message type: %d", msg.request.type);
+      log_critical("Received unknown message type: %d", msg->generic.type);
       abort();
       break;
     }
@@ -956,20 +848,91 @@ async_fuse_worker_main_loop(async_fuse_fs_t fs,
       log_debug("Return code was %d", ret);
     }
 
+    ctx->ret = ret;
+    _send_reply(fs, ctx);
+  }
+}
 
-    Message reply_msg = {
-      .reply = {
-        .type = MESSAGE_TYPE_REPLY,
-        .ret = ret,
-      },
-    };
-    bool success_send_atomic_message =
-      send_atomic_message(msg.request.reply_chan, &reply_msg);
-    if (!success_send_atomic_message) {
-      /* this can't fail because it's a reply message */
-      abort();
+typedef struct {
+  async_fuse_fs_t fs;
+  const struct fuse_operations *op;
+  void *private_data;
+} WorkerThreadArgs;
+
+static void *
+_async_fuse_worker_thread(void *ud) {
+  WorkerThreadArgs *const args = ud;
+
+  /* every thread has its own fuse context */
+  fuse_get_context()->private_data = args->private_data;
+
+  _async_fuse_worker_loop(args->fs, args->op);
+
+  return NULL;
+}
+
+void
+async_fuse_worker_main_loop(async_fuse_fs_t fs,
+                            const struct fuse_operations *op,
+                            size_t op_size,
+                            void *user_data,
+                            size_t num_threads) {
+  UNUSED(op_size);
+
+  assert(num_threads);
+
+  /* call init method first */
+  fuse_get_context()->private_data = user_data;
+  struct fuse_conn_info conn = {
+    .proto_major = 2,
+    .proto_minor = 6,
+    .async_read = 0,
+    /* TODO */
+  };
+
+  void *init_ret = NULL;
+  if (op->init) {
+    init_ret = op->init(&conn);
+    fuse_get_context()->private_data = init_ret;
+  }
+
+  WorkerThreadArgs args = {
+    .fs = fs,
+    .op = op,
+    .private_data = init_ret,
+  };
+
+  /* the calling thread is the first worker */
+  pthread_t *const threads = num_threads > 1
+    ? malloc(sizeof(threads[0]) * (num_threads - 1))
+    : NULL;
+  size_t num_started = 0;
+  if (threads) {
+    for (; num_started < num_threads - 1; ++num_started) {
+      const int ret_create =
+        pthread_create(&threads[num_started], NULL,
+                       _async_fuse_worker_thread, &args);
+      if (ret_create) {
+        log_warning("Couldn't create FUSE worker thread: %s",
+                    strerror(ret_create));
+        break;
+      }
     }
   }
+  else if (num_threads > 1) {
+    log_warning("Couldn't allocate FUSE worker threads");
+  }
+
+  log_info("Running FUSE file system on %lu thread(s)",
+           (unsigned long) num_started + 1);
+
+  _async_fuse_worker_loop(fs, op);
+
+  for (size_t i = 0; i < num_started; ++i) {
+    const int ret_join = pthread_join(threads[i], NULL);
+    ASSERT_TRUE(!ret_join);
+  }
+  free(threads);
 
   if (op->destroy) {
     op->destroy(init_ret);
@@ -980,7 +943,13 @@ async_fuse_worker_main_loop(async_fuse_fs_t fs,
 
 bool
 async_fuse_fs_stop_blocking(async_fuse_fs_t fs) {
-  return send_quit_message_blocking(&fs->to_worker);
+  _async_fuse_fs_lock(fs);
+  fs->should_quit = true;
+  const int ret_broadcast = pthread_cond_broadcast(&fs->request_available);
+  ASSERT_TRUE(!ret_broadcast);
+  _async_fuse_fs_unlock(fs);
+
+  return true;
 }
 
 bool
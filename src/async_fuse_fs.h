@@ -101,11 +101,15 @@ async_fuse_fs_release(async_fuse_fs_t fs,
                       const char *path, struct fuse_file_info *fi,
                       event_handler_t cb, void *cb_ud);
 
+/* runs the file system on the calling thread plus `num_threads` - 1
+   extra threads until async_fuse_fs_stop_blocking() is called,
+   the file system must be thread-safe if `num_threads` > 1 */
 void
 async_fuse_worker_main_loop(async_fuse_fs_t fs,
                             const struct fuse_operations *op,
                             size_t op_size,
-                            void *user_data);
+                            void *user_data,
+                            size_t num_threads);
 
 bool
 async_fuse_fs_stop_blocking(async_fuse_fs_t fs);
@@ -16,105 +16,196 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 
-#include <inttypes.h>
+#include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
 
-#include "uthread.h"
+#include "events.h"
+#include "logging.h"
 #include "util.h"
 
 #include "async_tree.h"
 
+enum {
+  /* how often (in applied elements) to log the walk's progress */
+  ASYNC_TREE_PROGRESS_INTERVAL=10000,
+};
+
+typedef struct _async_tree_node {
+  void *elt;
+  /* only used in postorder: the parent is applied once
+     `pending_children` of it drops to zero */
+  struct _async_tree_node *parent;
+  size_t pending_children;
+  /* only used in preorder: children are held back until
+     this node has been applied */
+  linked_list_t children;
+} AsyncTreeNode;
+
 typedef struct {
-  UTHR_CTX_BASE;
   /* args */
   void *op_ud;
   async_tree_apply_fn_t apply_fn;
   async_tree_expand_fn_t expand_fn;
-  void *root;
-  bool is_postorder : 1;
-  bool is_preorder_node : 1;
+  bool is_postorder;
   event_handler_t cb;
   void *cb_ud;
   /* ctx */
-  linked_list_t stack;
-  linked_list_t old_stack;
-  void *curnode;
-  void *next;
+  linked_list_t to_expand;
+  linked_list_t to_apply;
+  size_t in_flight;
+  bool is_dispatching;
+  uintmax_t num_applied;
 } AsyncTreeApplyCtx;
 
-static bool
-pointer_is_preorder(void *p) {
-  return !(((intptr_t) p) & 0x1);
+typedef struct {
+  AsyncTreeApplyCtx *tree;
+  AsyncTreeNode *node;
+} AsyncTreeOpCtx;
+
+static void
+_async_tree_dispatch(AsyncTreeApplyCtx *ctx);
+
+static AsyncTreeNode *
+_async_tree_node_new(void *elt, AsyncTreeNode *parent) {
+  AsyncTreeNode *const node = malloc_or_abort(sizeof(*node));
+  *node = (AsyncTreeNode) {
+    .elt = elt,
+    .parent = parent,
+    .pending_children = 0,
+    .children = LINKED_LIST_INITIALIZER,
+  };
+  return node;
 }
 
-static void *
-make_pointer_postorder(void *p) {
-  return (void *)(((intptr_t) p) | 0x1);
+static AsyncTreeOpCtx *
+_async_tree_op_new(AsyncTreeApplyCtx *tree, AsyncTreeNode *node) {
+  AsyncTreeOpCtx *const op = malloc_or_abort(sizeof(*op));
+  *op = (AsyncTreeOpCtx) {
+    .tree = tree,
+    .node = node,
+  };
+  return op;
 }
 
-static void *
-clear_pointer_postorder(void *p) {
-  return (void *)(((intptr_t) p) & ~0x1);
+static
+EVENT_HANDLER_DEFINE(_async_tree_expand_done, ev_type, ev, ud) {
+  AsyncTreeOpCtx *const op = ud;
+  AsyncTreeApplyCtx *const ctx = op->tree;
+  AsyncTreeNode *const node = op->node;
+  free(op);
+
+  UNUSED(ev_type);
+  assert(ev_type == ASYNC_TREE_EXPAND_FN_DONE_EVENT);
+  const AsyncTreeExpandFnDoneEvent *const expand_fn_done_ev = ev;
+  ASSERT_TRUE(!expand_fn_done_ev->error);
+
+  ctx->in_flight -= 1;
+
+  linked_list_t children = expand_fn_done_ev->new_stack;
+  if (!children) {
+    /* this entry didn't extend, it's just a leaf */
+    ctx->to_apply = linked_list_prepend(ctx->to_apply, node);
+  }
+  else if (ctx->is_postorder) {
+    /* children go first, this node is applied after the last one is */
+    while (children) {
+      void *elt;
+      children = linked_list_popleft(children, &elt);
+      ctx->to_expand = linked_list_prepend(ctx->to_expand,
+                                           _async_tree_node_new(elt, node));
+      node->pending_children += 1;
+    }
+  }
+  else {
+    /* this node goes first, children are released once it's applied */
+    while (children) {
+      void *elt;
+      children = linked_list_popleft(children, &elt);
+      node->children = linked_list_prepend(node->children,
+                                           _async_tree_node_new(elt, NULL));
+    }
+    ctx->to_apply = linked_list_prepend(ctx->to_apply, node);
+  }
+
+  _async_tree_dispatch(ctx);
 }
 
-UTHR_DEFINE(_async_tree_apply_uthr) {
-  UTHR_HEADER(AsyncTreeApplyCtx, ctx);
-
-  ctx->stack = linked_list_prepend(LINKED_LIST_INITIALIZER, ctx->root);
-
-  while (ctx->stack) {
-    ctx->stack = linked_list_popleft(ctx->stack, &ctx->curnode);
-
-    /* first yield this node */
-    ctx->is_preorder_node = pointer_is_preorder(ctx->curnode);
-    ctx->next = clear_pointer_postorder(ctx->curnode);
-
-    /* if this is pre-order then populate the stack with
-       the post-order node and its child entries */
-    if (ctx->is_preorder_node) {
-      if (ctx->is_postorder) {
-        ctx->stack = linked_list_prepend(ctx->stack,
-                                         make_pointer_postorder(ctx->curnode));
-      }
-
-      /* XXX: it would be good to assert that each one of these nodes
-         don't have their 0th bit set */
-      /* XXX: also that none of them are NULL */
-      ctx->old_stack = ctx->stack;
-      UTHR_YIELD(ctx,
-                 ctx->expand_fn(ctx->op_ud, ctx->stack, ctx->curnode,
-                                _async_tree_apply_uthr, ctx));
-      UTHR_RECEIVE_EVENT(ASYNC_TREE_EXPAND_FN_DONE_EVENT,
-                         AsyncTreeExpandFnDoneEvent, expand_fn_done_ev);
-      ASSERT_TRUE(!expand_fn_done_ev->error);
-      ctx->stack = expand_fn_done_ev->new_stack;
-
-      if (ctx->old_stack == ctx->stack) {
-        /* this entry didn't extend, it's just a leaf */
-        ctx->is_preorder_node = false;
-        if (ctx->is_postorder) {
-          ctx->stack = linked_list_popleft(ctx->stack, NULL);
-        }
-      }
+static
+EVENT_HANDLER_DEFINE(_async_tree_apply_done, ev_type, ev, ud) {
+  AsyncTreeOpCtx *const op = ud;
+  AsyncTreeApplyCtx *const ctx = op->tree;
+  AsyncTreeNode *const node = op->node;
+  free(op);
+
+  UNUSED(ev_type);
+  assert(ev_type == ASYNC_TREE_APPLY_FN_DONE_EVENT);
+  /* TODO: don't do anything with the result,
+     maybe in the future we can terminate early
+  */
+  UNUSED(ev);
+
+  ctx->in_flight -= 1;
+  ctx->num_applied += 1;
+  if (!(ctx->num_applied % ASYNC_TREE_PROGRESS_INTERVAL)) {
+    log_info("Tree walk has processed %ju entries (%lu in flight)",
+             ctx->num_applied, (unsigned long) ctx->in_flight);
+  }
+
+  while (node->children) {
+    void *child;
+    node->children = linked_list_popleft(node->children, &child);
+    ctx->to_expand = linked_list_prepend(ctx->to_expand, child);
+  }
+
+  AsyncTreeNode *const parent = node->parent;
+  free(node);
+
+  if (parent) {
+    assert(parent->pending_children);
+    parent->pending_children -= 1;
+    if (!parent->pending_children) {
+      ctx->to_apply = linked_list_prepend(ctx->to_apply, parent);
     }
+  }
+
+  _async_tree_dispatch(ctx);
+}
 
-    if (!(ctx->is_preorder_node && ctx->is_postorder)) {
-      UTHR_YIELD(ctx,
-                 ctx->apply_fn(ctx->op_ud, ctx->next,
-                               _async_tree_apply_uthr, ctx));
-      UTHR_RECEIVE_EVENT(ASYNC_TREE_APPLY_FN_DONE_EVENT,
-                         AsyncTreeApplyFnDoneEvent, apply_fn_done_ev);
-      /* TODO: don't do anything with the result,
-         maybe in the future we can terminate early
-      */
-      UNUSED(apply_fn_done_ev);
+static void
+_async_tree_dispatch(AsyncTreeApplyCtx *ctx) {
+  /* expand/apply functions may complete synchronously, in that case
+     the outer call picks up whatever they queued */
+  if (ctx->is_dispatching) return;
+  ctx->is_dispatching = true;
+
+  while (ctx->in_flight < ASYNC_TREE_MAX_IN_FLIGHT &&
+         (ctx->to_apply || ctx->to_expand)) {
+    AsyncTreeNode *node;
+    ctx->in_flight += 1;
+    /* finishing elements first keeps the amount of
+       pending state small */
+    if (ctx->to_apply) {
+      ctx->to_apply = linked_list_popleft(ctx->to_apply, (void **) &node);
+      ctx->apply_fn(ctx->op_ud, node->elt,
+                    _async_tree_apply_done, _async_tree_op_new(ctx, node));
+    }
+    else {
+      ctx->to_expand = linked_list_popleft(ctx->to_expand, (void **) &node);
+      ctx->expand_fn(ctx->op_ud, LINKED_LIST_INITIALIZER, node->elt,
+                     _async_tree_expand_done, _async_tree_op_new(ctx, node));
     }
   }
 
-  UTHR_RETURN(ctx,
-              ctx->cb(ASYNC_TREE_APPLY_DONE_EVENT, NULL, ctx->cb_ud));
+  ctx->is_dispatching = false;
 
-  UTHR_FOOTER();
+  if (!ctx->in_flight && !ctx->to_apply && !ctx->to_expand) {
+    const event_handler_t cb = ctx->cb;
+    void *const cb_ud = ctx->cb_ud;
+    free(ctx);
+    cb(ASYNC_TREE_APPLY_DONE_EVENT, NULL, cb_ud);
+  }
 }
 
 void
@@ -124,12 +215,22 @@ async_tree_apply(void *op_ud,
                  void *root,
                  bool is_postorder,
                  event_handler_t cb, void *cb_ud) {
-  UTHR_CALL7(_async_tree_apply_uthr, AsyncTreeApplyCtx,
-             .op_ud = op_ud,
-             .apply_fn = apply_fn,
-             .expand_fn = expand_fn,
-             .root = root,
-             .is_postorder = is_postorder,
-             .cb = cb,
-             .cb_ud = cb_ud);
+  AsyncTreeApplyCtx *const ctx = malloc_or_abort(sizeof(*ctx));
+  *ctx = (AsyncTreeApplyCtx) {
+    .op_ud = op_ud,
+    .apply_fn = apply_fn,
+    .expand_fn = expand_fn,
+    .is_postorder = is_postorder,
+    .cb = cb,
+    .cb_ud = cb_ud,
+    .to_expand = LINKED_LIST_INITIALIZER,
+    .to_apply = LINKED_LIST_INITIALIZER,
+    .in_flight = 0,
+    .is_dispatching = false,
+    .num_applied = 0,
+  };
+
+  ctx->to_expand = linked_list_prepend(ctx->to_expand,
+                                       _async_tree_node_new(root, NULL));
+  _async_tree_dispatch(ctx);
 }
@@ -21,6 +21,23 @@
 
 #include "util.h"
 
+/* async_tree_apply() walks the tree rooted at `root`, using `expand_fn`
+   to list the children of each element and calling `apply_fn` once on
+   every element (which then owns it).
+
+   up to ASYNC_TREE_MAX_IN_FLIGHT expand/apply calls are kept running at
+   the same time, so both functions must tolerate being called concurrently
+   on different elements. ordering is still guaranteed along each path:
+   in preorder an element is applied before any of its children, in
+   postorder it's applied only after all of its children have been.
+
+   `expand_fn` is called with an empty stack and should return the
+   children prepended to it, an empty result marks a leaf */
+
+enum {
+  ASYNC_TREE_MAX_IN_FLIGHT=8,
+};
+
 typedef void (*async_tree_apply_fn_t)(void *user_data,
                                       void *elt,
                                       event_handler_t cb, void *ud);
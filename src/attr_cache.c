@@ -0,0 +1,235 @@
+/*
+  davfuse: FUSE file systems as WebDAV servers
+  Copyright (C) 2012, 2013 Rian Hunter <rian@alum.mit.edu>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#define _ISOC99_SOURCE
+
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "c_util.h"
+#include "uptime.h"
+#include "util.h"
+
+#include "attr_cache.h"
+
+enum {
+  ATTR_CACHE_NUM_BUCKETS = 1024,
+};
+
+typedef struct _attr_cache_entry {
+  struct _attr_cache_entry *next;
+  uint64_t expires_ms;
+  struct stat st;
+  char *path;
+} AttrCacheEntry;
+
+struct _attr_cache {
+  uint64_t ttl_ms;
+  size_t max_entries;
+  size_t num_entries;
+  attr_cache_generation_t generation;
+  AttrCacheEntry *buckets[ATTR_CACHE_NUM_BUCKETS];
+};
+
+static bool
+_now_ms(uint64_t *out) {
+  UptimeTimespec uptime;
+  const bool success_time = uptime_time(&uptime);
+  if (!success_time) return false;
+  *out = uptime.seconds * 1000 + uptime.nanoseconds / 1000000;
+  return true;
+}
+
+/* FNV-1a */
+static size_t
+_path_bucket(const char *path) {
+  uint32_t hash = 2166136261U;
+  for (const char *c = path; *c; ++c) {
+    hash ^= (unsigned char) *c;
+    hash *= 16777619U;
+  }
+  return hash % ATTR_CACHE_NUM_BUCKETS;
+}
+
+static void
+_attr_cache_remove(attr_cache_t cache, AttrCacheEntry **entryp) {
+  AttrCacheEntry *const entry = *entryp;
+  *entryp = entry->next;
+  free(entry->path);
+  free(entry);
+  assert(cache->num_entries);
+  cache->num_entries -= 1;
+}
+
+static AttrCacheEntry **
+_attr_cache_find(attr_cache_t cache, const char *path) {
+  AttrCacheEntry **entryp = &cache->buckets[_path_bucket(path)];
+  for (; *entryp; entryp = &(*entryp)->next) {
+    if (str_equals((*entryp)->path, path)) break;
+  }
+  return entryp;
+}
+
+static void
+_attr_cache_expire(attr_cache_t cache, uint64_t now_ms) {
+  for (size_t i = 0; i < NELEMS(cache->buckets); ++i) {
+    AttrCacheEntry **entryp = &cache->buckets[i];
+    while (*entryp) {
+      if ((*entryp)->expires_ms <= now_ms) {
+        _attr_cache_remove(cache, entryp);
+      }
+      else {
+        entryp = &(*entryp)->next;
+      }
+    }
+  }
+}
+
+attr_cache_t
+attr_cache_new(uint64_t ttl_ms, size_t max_entries) {
+  attr_cache_t cache = malloc(sizeof(*cache));
+  if (!cache) return NULL;
+
+  *cache = (struct _attr_cache) {
+    .ttl_ms = ttl_ms,
+    .max_entries = max_entries,
+  };
+
+  return cache;
+}
+
+void
+attr_cache_destroy(attr_cache_t cache) {
+  for (size_t i = 0; i < NELEMS(cache->buckets); ++i) {
+    while (cache->buckets[i]) {
+      _attr_cache_remove(cache, &cache->buckets[i]);
+    }
+  }
+  assert(!cache->num_entries);
+  free(cache);
+}
+
+bool
+attr_cache_lookup(attr_cache_t cache, const char *path, struct stat *st) {
+  if (!cache->ttl_ms) return false;
+
+  AttrCacheEntry **const entryp = _attr_cache_find(cache, path);
+  if (!*entryp) return false;
+
+  uint64_t now_ms;
+  const bool success_now = _now_ms(&now_ms);
+  if (!success_now || (*entryp)->expires_ms <= now_ms) {
+    _attr_cache_remove(cache, entryp);
+    return false;
+  }
+
+  *st = (*entryp)->st;
+  return true;
+}
+
+attr_cache_generation_t
+attr_cache_generation(attr_cache_t cache) {
+  return cache->generation;
+}
+
+void
+attr_cache_insert(attr_cache_t cache, const char *path,
+                  const struct stat *st,
+                  attr_cache_generation_t generation) {
+  if (!cache->ttl_ms || generation != cache->generation) return;
+
+  uint64_t now_ms;
+  const bool success_now = _now_ms(&now_ms);
+  if (!success_now) return;
+
+  AttrCacheEntry **const entryp = _attr_cache_find(cache, path);
+  if (*entryp) {
+    (*entryp)->st = *st;
+    (*entryp)->expires_ms = now_ms + cache->ttl_ms;
+    return;
+  }
+
+  if (cache->num_entries >= cache->max_entries) {
+    _attr_cache_expire(cache, now_ms);
+    /* still full, the entry just isn't cached */
+    if (cache->num_entries >= cache->max_entries) return;
+  }
+
+  AttrCacheEntry *const entry = malloc(sizeof(*entry));
+  if (!entry) return;
+
+  char *const path_copy = davfuse_util_strdup(path);
+  if (!path_copy) {
+    free(entry);
+    return;
+  }
+
+  /* the bucket chain may have changed in `_attr_cache_expire()` */
+  AttrCacheEntry **const bucketp = &cache->buckets[_path_bucket(path)];
+  *entry = (AttrCacheEntry) {
+    .next = *bucketp,
+    .expires_ms = now_ms + cache->ttl_ms,
+    .st = *st,
+    .path = path_copy,
+  };
+  *bucketp = entry;
+  cache->num_entries += 1;
+}
+
+static bool
+_path_is_parent(const char *path, const char *entry_path) {
+  /* the parent of "/a/b" is "/a", the parent of "/a" is "/" */
+  const char *const last_slash = strrchr(path, '/');
+  if (!last_slash) return false;
+  const size_t parent_len = last_slash == path ? 1 : last_slash - path;
+  return (strlen(entry_path) == parent_len &&
+          !memcmp(path, entry_path, parent_len));
+}
+
+static bool
+_path_is_at_or_below(const char *path, const char *entry_path) {
+  if (str_equals(path, "/")) return true;
+  const size_t path_len = strlen(path);
+  return (!strncmp(entry_path, path, path_len) &&
+          (entry_path[path_len] == '\0' || entry_path[path_len] == '/'));
+}
+
+void
+attr_cache_invalidate(attr_cache_t cache, const char *path) {
+  cache->generation += 1;
+
+  if (!cache->num_entries) return;
+
+  for (size_t i = 0; i < NELEMS(cache->buckets); ++i) {
+    AttrCacheEntry **entryp = &cache->buckets[i];
+    while (*entryp) {
+      if (_path_is_at_or_below(path, (*entryp)->path) ||
+          _path_is_parent(path, (*entryp)->path)) {
+        _attr_cache_remove(cache, entryp);
+      }
+      else {
+        entryp = &(*entryp)->next;
+      }
+    }
+  }
+}
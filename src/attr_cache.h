@@ -0,0 +1,71 @@
+/*
+  davfuse: FUSE file systems as WebDAV servers
+  Copyright (C) 2012, 2013 Rian Hunter <rian@alum.mit.edu>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _ATTR_CACHE_H
+#define _ATTR_CACHE_H
+
+#include <sys/stat.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* a path-keyed cache of file attributes, entries expire after a fixed
+   time to live (like FUSE's attr_timeout), this isn't thread-safe */
+
+struct _attr_cache;
+
+typedef struct _attr_cache *attr_cache_t;
+
+/* bumped by every invalidation */
+typedef uint64_t attr_cache_generation_t;
+
+/* with `ttl_ms` == 0 nothing is ever cached */
+attr_cache_t
+attr_cache_new(uint64_t ttl_ms, size_t max_entries);
+
+void
+attr_cache_destroy(attr_cache_t cache);
+
+bool
+attr_cache_lookup(attr_cache_t cache, const char *path, struct stat *st);
+
+attr_cache_generation_t
+attr_cache_generation(attr_cache_t cache);
+
+/* `generation` is what attr_cache_generation() returned before the
+   attributes were fetched, the entry is dropped if anything was
+   invalidated in the meantime since it may be stale */
+void
+attr_cache_insert(attr_cache_t cache, const char *path,
+                  const struct stat *st,
+                  attr_cache_generation_t generation);
+
+/* forgets `path`, everything below it and its parent directory */
+void
+attr_cache_invalidate(attr_cache_t cache, const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
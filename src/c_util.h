@@ -69,6 +69,14 @@ extern "C" {
 #define DYNAMICALLY_LINKED_FUNCTION_ATTR
 #endif
 
+#if defined(__GNUC__)
+#define THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#error "THREAD_LOCAL isn't defined for this compiler"
+#endif
+
 #define HEADER_FUNCTION static UNUSED_FUNCTION_ATTR
 #define HEADER_CONST static UNUSED_CONST_ATTR
 
@@ -0,0 +1,81 @@
+/*
+  davfuse: FUSE file systems as WebDAV servers
+  Copyright (C) 2012, 2013 Rian Hunter <rian@alum.mit.edu>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "c_util.h"
+
+#include "deferred_queue.h"
+
+void
+deferred_queue_init(DeferredQueue *queue) {
+  *queue = (DeferredQueue) {
+    .calls = NULL,
+    .head = 0,
+    .size = 0,
+    .capacity = 0,
+  };
+}
+
+void
+deferred_queue_destroy(DeferredQueue *queue) {
+  free(queue->calls);
+  deferred_queue_init(queue);
+}
+
+bool
+deferred_queue_push(DeferredQueue *queue, event_handler_t handler, void *ud) {
+  if (queue->size == queue->capacity) {
+    const size_t new_capacity = MAX(16, queue->capacity * 2);
+    DeferredCall *const new_calls =
+      malloc(sizeof(*new_calls) * new_capacity);
+    if (!new_calls) return false;
+
+    /* unwrap the ring while copying it over */
+    for (size_t i = 0; i < queue->size; ++i) {
+      new_calls[i] = queue->calls[(queue->head + i) % queue->capacity];
+    }
+
+    free(queue->calls);
+    queue->calls = new_calls;
+    queue->head = 0;
+    queue->capacity = new_capacity;
+  }
+
+  queue->calls[(queue->head + queue->size) % queue->capacity] =
+    (DeferredCall) {.handler = handler, .ud = ud};
+  queue->size += 1;
+
+  return true;
+}
+
+void
+deferred_queue_run(DeferredQueue *queue) {
+  for (size_t to_run = queue->size; to_run; --to_run) {
+    assert(queue->size);
+
+    /* pop it before the handler has a chance to defer more calls,
+       that may move the ring */
+    const DeferredCall call = queue->calls[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->size -= 1;
+
+    call.handler(EVENT_LOOP_DEFER_EVENT, NULL, call.ud);
+  }
+}
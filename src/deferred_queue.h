@@ -0,0 +1,68 @@
+/*
+  davfuse: FUSE file systems as WebDAV servers
+  Copyright (C) 2012, 2013 Rian Hunter <rian@alum.mit.edu>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _DEFERRED_QUEUE_H
+#define _DEFERRED_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "events.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* FIFO of callbacks to run on the event loop's next turn, shared by
+   the event loop implementations.
+   it's a growable ring buffer so deferring a call doesn't allocate
+   once the queue has reached its working size */
+
+typedef struct {
+  event_handler_t handler;
+  void *ud;
+} DeferredCall;
+
+typedef struct {
+  DeferredCall *calls;
+  size_t head;
+  size_t size;
+  size_t capacity;
+} DeferredQueue;
+
+void
+deferred_queue_init(DeferredQueue *queue);
+
+void
+deferred_queue_destroy(DeferredQueue *queue);
+
+/* O(1) amortized */
+bool
+deferred_queue_push(DeferredQueue *queue, event_handler_t handler, void *ud);
+
+/* runs the calls that were queued when this was called, each gets an
+   EVENT_LOOP_DEFER_EVENT. calls deferred by these handlers wait for
+   the next run */
+void
+deferred_queue_run(DeferredQueue *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _DEFERRED_QUEUE_H */
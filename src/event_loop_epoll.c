@@ -0,0 +1,596 @@
+/*
+  davfuse: FUSE file systems as WebDAV servers
+  Copyright (C) 2012, 2013 Rian Hunter <rian@alum.mit.edu>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <sys/epoll.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "c_util.h"
+#include "deferred_queue.h"
+#include "events.h"
+#include "logging.h"
+#include "sockets.h"
+#include "timeout_heap.h"
+#include "uptime.h"
+#include "util.h"
+
+#include "event_loop_epoll.h"
+
+enum {
+  EPOLL_MAX_EVENTS_PER_WAIT=64,
+};
+
+/* opaque structures */
+typedef struct {
+  bool is_fd_watch;
+  socket_t sock;
+  StreamEvents events;
+  event_handler_t handler;
+  void *ud;
+} EventLoopEpollWatcher;
+
+struct _event_loop_epoll_watch_link {
+  EventLoopEpollWatcher watch;
+  struct _event_loop_epoll_watch_link *next;
+  bool is_active;
+};
+
+struct _event_loop_epoll_timeout_link {
+  /* must be first, we cast from the heap entry back to the link */
+  TimeoutHeapEntry heap_entry;
+  event_handler_t handler;
+  void *ud;
+};
+
+typedef struct _event_loop_epoll_watch_link EventLoopEpollLink;
+typedef struct _event_loop_epoll_timeout_link EventLoopEpollTimeoutLink;
+
+/* every fd that has ever been watched gets one of these,
+   `registered` is what the kernel currently thinks we're interested in,
+   the watches are what we actually want. the two are reconciled
+   lazily right before we call epoll_wait(), this way a one-shot watch
+   that gets immediately re-added by its handler costs at most one
+   system call */
+typedef struct {
+  EventLoopEpollLink *watches;
+  uint32_t registered;
+  /* a watch went away since the last sync, so the owner may have
+     closed the fd and a new one may have shown up under the same
+     number. the kernel drops closed fds from the epoll set on its own,
+     `registered` can't be trusted until we check */
+  bool may_be_stale;
+  bool is_dirty;
+  int next_dirty;
+} EventLoopEpollFdEntry;
+
+typedef struct _event_loop_epoll_handle {
+  int epoll_fd;
+  EventLoopEpollFdEntry *fds;
+  size_t fds_size;
+  int dirty_head;
+  size_t num_registered;
+  TimeoutHeap timeouts;
+  DeferredQueue deferred;
+} EventLoopEpollLoop;
+
+static
+bool
+uptime_in_seconds(uint64_t *out) {
+  UptimeTimespec uptime;
+  bool success_time = uptime_time(&uptime);
+  if (!success_time) return false;
+  *out = uptime.seconds;
+  return true;
+}
+
+static
+uint32_t
+stream_events_to_epoll(StreamEvents events) {
+  return ((events.read ? EPOLLIN : 0) |
+          (events.write ? EPOLLOUT : 0));
+}
+
+static
+void
+_mark_dirty(EventLoopEpollLoop *loop, int fd) {
+  EventLoopEpollFdEntry *const entry = &loop->fds[fd];
+  if (entry->is_dirty) return;
+  entry->is_dirty = true;
+  entry->next_dirty = loop->dirty_head;
+  loop->dirty_head = fd;
+}
+
+static
+void
+_watch_deactivated(EventLoopEpollLoop *loop, int fd) {
+  loop->fds[fd].may_be_stale = true;
+  _mark_dirty(loop, fd);
+}
+
+static
+bool
+_ensure_fd_entry(EventLoopEpollLoop *loop, int fd) {
+  assert(fd >= 0);
+  if ((size_t) fd < loop->fds_size) return true;
+
+  size_t new_size = MAX(16, loop->fds_size);
+  while (new_size <= (size_t) fd) new_size *= 2;
+
+  EventLoopEpollFdEntry *const new_fds =
+    realloc(loop->fds, sizeof(*new_fds) * new_size);
+  if (!new_fds) return false;
+
+  for (size_t i = loop->fds_size; i < new_size; ++i) {
+    new_fds[i] = (EventLoopEpollFdEntry) {
+      .watches = NULL,
+      .registered = 0,
+      .may_be_stale = false,
+      .is_dirty = false,
+      .next_dirty = -1,
+    };
+  }
+
+  loop->fds = new_fds;
+  loop->fds_size = new_size;
+
+  return true;
+}
+
+/* frees inactive watches on `fd` and brings the kernel's interest set
+   in line with the remaining active watches, returns false if
+   the kernel refused to watch the fd */
+static
+bool
+_sync_fd_entry(EventLoopEpollLoop *loop, int fd) {
+  EventLoopEpollFdEntry *const entry = &loop->fds[fd];
+
+  uint32_t wanted = 0;
+  for (EventLoopEpollLink **llp = &entry->watches; *llp;) {
+    EventLoopEpollLink *const ll = *llp;
+    if (!ll->is_active) {
+      *llp = ll->next;
+      free(ll);
+      continue;
+    }
+
+    wanted |= stream_events_to_epoll(ll->watch.events);
+    llp = &ll->next;
+  }
+
+  const bool may_be_stale = entry->may_be_stale;
+  entry->may_be_stale = false;
+
+  if (wanted == entry->registered && !(wanted && may_be_stale)) return true;
+
+  if (!wanted) {
+    /* EPOLLHUP/EPOLLERR can't be masked, so stop watching entirely */
+    const int ret_ctl = epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    /* the fd may have already been closed by its owner,
+       the kernel drops it from the epoll set in that case */
+    if (ret_ctl < 0 && errno != ENOENT && errno != EBADF) {
+      log_error("Error while doing epoll_ctl(EPOLL_CTL_DEL, %d): %s",
+                fd, strerror(errno));
+    }
+    entry->registered = 0;
+    assert(loop->num_registered);
+    loop->num_registered -= 1;
+    return true;
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = wanted;
+  ev.data.fd = fd;
+
+  int ret_ctl = epoll_ctl(loop->epoll_fd,
+                          entry->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                          fd, &ev);
+  if (ret_ctl < 0 && entry->registered && errno == ENOENT) {
+    /* fd was closed and reopened behind our back */
+    ret_ctl = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  }
+
+  if (ret_ctl < 0) {
+    log_error("Error while doing epoll_ctl(%d): %s", fd, strerror(errno));
+    return false;
+  }
+
+  if (!entry->registered) loop->num_registered += 1;
+  entry->registered = wanted;
+
+  return true;
+}
+
+event_loop_epoll_handle_t
+event_loop_epoll_default_new(void) {
+  EventLoopEpollLoop *const loop = malloc(sizeof(*loop));
+  if (!loop) return NULL;
+
+  const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    log_error("Error while doing epoll_create1(): %s", strerror(errno));
+    free(loop);
+    return NULL;
+  }
+
+  *loop = (EventLoopEpollLoop) {
+    .epoll_fd = epoll_fd,
+    .fds = NULL,
+    .fds_size = 0,
+    .dirty_head = -1,
+    .num_registered = 0,
+  };
+  timeout_heap_init(&loop->timeouts);
+  deferred_queue_init(&loop->deferred);
+
+  return loop;
+}
+
+bool
+event_loop_epoll_destroy(event_loop_epoll_handle_t loop) {
+  for (size_t i = 0; i < loop->fds_size; ++i) {
+    for (EventLoopEpollLink *ll = loop->fds[i].watches; ll;) {
+      assert(!ll->is_active);
+      EventLoopEpollLink *const tmpll = ll->next;
+      free(ll);
+      ll = tmpll;
+    }
+  }
+
+  TimeoutHeapEntry *entry;
+  while ((entry = timeout_heap_pop(&loop->timeouts))) {
+    free(entry);
+  }
+  timeout_heap_destroy(&loop->timeouts);
+  deferred_queue_destroy(&loop->deferred);
+
+  close(loop->epoll_fd);
+  free(loop->fds);
+  free(loop);
+  return true;
+}
+
+static
+bool
+_event_loop_epoll_watch_add(event_loop_epoll_handle_t loop,
+                            bool is_fd_watch,
+                            socket_t sock,
+                            StreamEvents events,
+                            event_handler_t handler,
+                            void *ud,
+                            event_loop_epoll_watch_key_t *key) {
+  assert(loop);
+  assert(handler);
+
+  const int fd = fd_from_socket(sock);
+  if (fd < 0) return false;
+
+  if (!_ensure_fd_entry(loop, fd)) return false;
+
+  EventLoopEpollLink *const ll = malloc(sizeof(*ll));
+  if (!ll) return false;
+
+  *ll = (EventLoopEpollLink) {
+    .watch = {
+      .is_fd_watch = is_fd_watch,
+      .sock = sock,
+      .ud = ud,
+      .events = events,
+      .handler = handler,
+    },
+    .next = loop->fds[fd].watches,
+    .is_active = true,
+  };
+
+  loop->fds[fd].watches = ll;
+
+  /* only need to touch the kernel if this watch wants something
+     that isn't already registered */
+  if (stream_events_to_epoll(events) & ~loop->fds[fd].registered) {
+    _mark_dirty(loop, fd);
+  }
+
+  if (key) *key = ll;
+
+  return true;
+}
+
+bool
+event_loop_epoll_socket_watch_add(event_loop_epoll_handle_t loop,
+                                  socket_t sock,
+                                  StreamEvents events,
+                                  event_handler_t handler,
+                                  void *ud,
+                                  event_loop_epoll_watch_key_t *key) {
+  return _event_loop_epoll_watch_add(loop, false, sock, events, handler, ud, key);
+}
+
+bool
+event_loop_epoll_fd_watch_add(event_loop_epoll_handle_t loop,
+                              int fd,
+                              StreamEvents events,
+                              event_handler_t handler,
+                              void *ud,
+                              event_loop_epoll_watch_key_t *key) {
+  socket_t socket = socket_from_fd(fd);
+  if (socket == INVALID_SOCKET) return false;
+  return _event_loop_epoll_watch_add(loop, true, socket, events, handler,
+                                     ud, key);
+}
+
+bool
+event_loop_epoll_watch_remove(event_loop_epoll_handle_t loop,
+                              event_loop_epoll_watch_key_t key) {
+  assert(loop);
+  assert(key);
+  assert(key->is_active);
+  /* TODO: assert that this watch is apart of this loop */
+  key->is_active = false;
+  _watch_deactivated(loop, fd_from_socket(key->watch.sock));
+  return true;
+}
+
+bool
+event_loop_epoll_timeout_add(event_loop_epoll_handle_t loop,
+                             const EventLoopEpollTimeout *timeout,
+                             event_handler_t handler,
+                             void *ud,
+                             event_loop_epoll_timeout_key_t *key) {
+  assert(loop);
+  assert(timeout);
+  assert(handler);
+
+  uint64_t cur_clock;
+  bool success_uptime = uptime_in_seconds(&cur_clock);
+  if (!success_uptime) return false;
+
+  EventLoopEpollTimeoutLink *const ll = malloc(sizeof(*ll));
+  if (!ll) return false;
+
+  *ll = (EventLoopEpollTimeoutLink) {
+    .heap_entry = {
+      .end_clock = timeout->sec + cur_clock,
+    },
+    .handler = handler,
+    .ud = ud,
+  };
+
+  if (!timeout_heap_push(&loop->timeouts, &ll->heap_entry)) {
+    free(ll);
+    return false;
+  }
+
+  if (key) *key = ll;
+
+  return true;
+}
+
+bool
+event_loop_epoll_timeout_remove(event_loop_epoll_handle_t loop,
+                                event_loop_epoll_timeout_key_t key) {
+  assert(loop);
+  assert(key);
+  /* TODO: assert that this timeout is apart of this loop */
+  timeout_heap_remove(&loop->timeouts, &key->heap_entry);
+  free(key);
+  return true;
+}
+
+bool
+event_loop_epoll_defer(event_loop_epoll_handle_t loop,
+                       event_handler_t handler,
+                       void *ud) {
+  assert(loop);
+  assert(handler);
+  return deferred_queue_push(&loop->deferred, handler, ud);
+}
+
+static
+void
+_dispatch_fd(EventLoopEpollLoop *loop, int fd, uint32_t revents) {
+  const bool sock_error = revents & EPOLLERR;
+  /* a hangup is reported as readable & writable so that
+     the watcher discovers it when it next does i/o */
+  const bool hup = revents & EPOLLHUP;
+  const StreamEvents events = sock_error
+    ? create_stream_events(false, false)
+    : create_stream_events(hup || (revents & EPOLLIN),
+                           hup || (revents & EPOLLOUT));
+
+  /* NB: handlers may add new watches to this fd while we iterate,
+     new watches are prepended so they won't be seen here.
+     links are never freed during dispatch so this is safe */
+  for (EventLoopEpollLink *ll = loop->fds[fd].watches; ll; ll = ll->next) {
+    if (!ll->is_active) continue;
+
+    /* if the io event was not triggered, continue */
+    if (!sock_error &&
+        !(events.read && ll->watch.events.read) &&
+        !(events.write && ll->watch.events.write)) continue;
+
+    /* before triggering the handler, mark it inactive
+       (all watches are one-shot) */
+    ll->is_active = false;
+    _watch_deactivated(loop, fd);
+
+    if (ll->watch.is_fd_watch) {
+      EventLoopEpollFdEvent e = {
+        .loop = loop,
+        .fd = fd,
+        .events = events,
+        .error = sock_error,
+      };
+      ll->watch.handler(EVENT_LOOP_FD_EVENT, &e, ll->watch.ud);
+    }
+    else {
+      EventLoopEpollSocketEvent e = {
+        .loop = loop,
+        .socket = ll->watch.sock,
+        .events = events,
+        .error = sock_error,
+      };
+      ll->watch.handler(EVENT_LOOP_SOCKET_EVENT, &e, ll->watch.ud);
+    }
+  }
+
+  /* watches the handlers put back on this fd are its owner carrying
+     on with it, the fd wasn't closed from under them. only a watch added
+     from somewhere else can be for a new fd that reused the number */
+  for (EventLoopEpollLink *ll = loop->fds[fd].watches; ll; ll = ll->next) {
+    if (ll->is_active) {
+      loop->fds[fd].may_be_stale = false;
+      break;
+    }
+  }
+
+  /* nobody wanted this event (the kernel's interest set is stale),
+     make sure we reconcile it before waiting again */
+  if (!loop->fds[fd].is_dirty &&
+      (revents & ~(EPOLLERR | EPOLLHUP)) & ~loop->fds[fd].registered) {
+    _mark_dirty(loop, fd);
+  }
+}
+
+bool
+event_loop_epoll_main_loop(event_loop_epoll_handle_t loop) {
+  log_info("fdevent epoll main loop started");
+
+  while (true) {
+    /* deferred calls go first, the watches they add get
+       reconciled below along with everything else */
+    deferred_queue_run(&loop->deferred);
+
+    /* reconcile the kernel's interest set with our watches,
+       this is O(number of fds touched since the last wait) */
+    while (loop->dirty_head >= 0) {
+      const int fd = loop->dirty_head;
+      loop->dirty_head = loop->fds[fd].next_dirty;
+      loop->fds[fd].is_dirty = false;
+      loop->fds[fd].next_dirty = -1;
+      if (!_sync_fd_entry(loop, fd)) {
+        /* don't leave the watches dangling, fail them like
+           select() would */
+        _dispatch_fd(loop, fd, EPOLLERR);
+      }
+    }
+
+    /* find epoll wait time, NB: done after reconciling since failed
+       registrations may have run handlers that touched the timeouts */
+    const TimeoutHeapEntry *const next_timeout =
+      timeout_heap_peek(&loop->timeouts);
+    const bool stop_clock_is_enabled = next_timeout;
+    const uint64_t stop_clock = next_timeout
+      ? next_timeout->end_clock
+      : UINT64_MAX;
+
+    /* calls deferred by the handlers above must not wait on i/o */
+    const bool has_deferred = loop->deferred.size;
+
+    /* if there is nothing to wait for, then stop the main loop */
+    if (!loop->num_registered && !stop_clock_is_enabled) {
+      if (!has_deferred) return true;
+      continue;
+    }
+
+    struct epoll_event events[EPOLL_MAX_EVENTS_PER_WAIT];
+    int ret_wait;
+    while (true) {
+      int wait_ms;
+      if (has_deferred) wait_ms = 0;
+      else if (stop_clock_is_enabled) {
+        uint64_t curclock;
+        bool success_uptime = uptime_in_seconds(&curclock);
+        if (!success_uptime) {
+          log_error("uptime_in_seconds() failed, just polling...");
+          wait_ms = 0;
+        }
+        else {
+          const uint64_t wait_sec = stop_clock > curclock
+            ? stop_clock - curclock
+            : 0;
+          wait_ms = wait_sec > INT_MAX / 1000
+            ? INT_MAX
+            : (int) (wait_sec * 1000);
+        }
+      }
+      else wait_ms = -1;
+
+      ret_wait = epoll_wait(loop->epoll_fd, events,
+                            NELEMS(events), wait_ms);
+      if (ret_wait < 0 && errno == EINTR) {
+        log_info("epoll_wait() interrupted!");
+        continue;
+      }
+
+      if (ret_wait < 0) {
+        log_error("Error while doing epoll_wait(): %s", strerror(errno));
+      }
+
+      break;
+    }
+
+    /* dispatch io events */
+    if (ret_wait < 0) {
+      /* mimic select()'s behavior and fail every outstanding watch */
+      for (size_t i = 0; i < loop->fds_size; ++i) {
+        if (loop->fds[i].registered) {
+          _dispatch_fd(loop, (int) i, EPOLLERR);
+        }
+      }
+    }
+    else {
+      for (int i = 0; i < ret_wait; ++i) {
+        _dispatch_fd(loop, events[i].data.fd, events[i].events);
+      }
+    }
+
+    /* trigger timeouts that have activated,
+       we intentionally do this after socket dispatch
+     */
+    uint64_t curclock;
+    bool success_uptime = uptime_in_seconds(&curclock);
+    /* TODO: handle this error */
+    ASSERT_TRUE(success_uptime);
+    /* timeouts added by these handlers wait for the next iteration */
+    const uint64_t seq_limit = loop->timeouts.next_seq;
+    while (true) {
+      TimeoutHeapEntry *const entry = timeout_heap_peek(&loop->timeouts);
+      if (!entry ||
+          entry->end_clock > curclock ||
+          entry->seq >= seq_limit) break;
+
+      timeout_heap_remove(&loop->timeouts, entry);
+
+      /* timeouts are one-shot, free it before the handler
+         has a chance to add new ones */
+      EventLoopEpollTimeoutLink *const ll =
+        (EventLoopEpollTimeoutLink *) entry;
+      const event_handler_t handler = ll->handler;
+      void *const ud = ll->ud;
+      free(ll);
+
+      handler(EVENT_LOOP_TIMEOUT_EVENT, NULL, ud);
+    }
+  }
+}
@@ -21,9 +21,11 @@
 #include <stdlib.h>
 
 #include "c_util.h"
+#include "deferred_queue.h"
 #include "events.h"
 #include "logging.h"
 #include "sockets.h"
+#include "timeout_heap.h"
 #include "uptime.h"
 #include "util.h"
 #include "util_sockets.h"
@@ -57,12 +59,6 @@ typedef struct {
   void *ud;
 } EventLoopSelectWatcher;
 
-typedef struct {
-  uint64_t end_clock;
-  event_handler_t handler;
-  void *ud;
-} EventLoopSelectTimeoutCtx;
-
 #define DEFINE_LL(_name, inner_type, inner_name)        \
   struct _name {                                        \
     inner_type inner_name;                              \
@@ -73,15 +69,21 @@ typedef struct {
 
 DEFINE_LL(_event_loop_select_watch_link,
           EventLoopSelectWatcher, watch);
-DEFINE_LL(_event_loop_select_timeout_link,
-          EventLoopSelectTimeoutCtx, timeout);
+
+struct _event_loop_select_timeout_link {
+  /* must be first, we cast from the heap entry back to the link */
+  TimeoutHeapEntry heap_entry;
+  event_handler_t handler;
+  void *ud;
+};
 
 typedef struct _event_loop_select_watch_link EventLoopSelectLink;
 typedef struct _event_loop_select_timeout_link EventLoopSelectTimeoutLink;
 
 typedef struct _event_loop_select_handle {
   EventLoopSelectLink *ll;
-  EventLoopSelectTimeoutLink *timeout_ll;
+  TimeoutHeap timeouts;
+  DeferredQueue deferred;
 } EventLoopSelectLoop;
 
 #define DEFINE_ADD_LL_FN(name, LINK_TYPE, INNER_TYPE, INNER_NAME)  \
@@ -114,9 +116,6 @@ static
 DEFINE_ADD_LL_FN(_add_watch_link, EventLoopSelectLink,
                  EventLoopSelectWatcher, watch);
 
-static
-DEFINE_ADD_LL_FN(_add_timeout_link, EventLoopSelectTimeoutLink,
-                 EventLoopSelectTimeoutCtx, timeout);
 
 #define FREE_LINK(root_ptr, link_ptr) \
   do {                                \
@@ -137,13 +136,6 @@ DEFINE_ADD_LL_FN(_add_timeout_link, EventLoopSelectTimeoutLink,
   }                                   \
   while (false)
 
-static
-bool
-timeout_is_triggered(EventLoopSelectTimeoutCtx *timeout_ctx,
-                     uint64_t curclock) {
-  return timeout_ctx->end_clock <= curclock;
-}
-
 static
 bool
 uptime_in_seconds(uint64_t *out) {
@@ -156,12 +148,22 @@ uptime_in_seconds(uint64_t *out) {
 
 event_loop_select_handle_t
 event_loop_select_default_new(void) {
-  return calloc(1, sizeof(EventLoopSelectLoop));
+  EventLoopSelectLoop *const loop = calloc(1, sizeof(EventLoopSelectLoop));
+  if (!loop) return NULL;
+  timeout_heap_init(&loop->timeouts);
+  deferred_queue_init(&loop->deferred);
+  return loop;
 }
 
 bool
 event_loop_select_destroy(event_loop_select_handle_t a) {
   assert(!a->ll);
+  TimeoutHeapEntry *entry;
+  while ((entry = timeout_heap_pop(&a->timeouts))) {
+    free(entry);
+  }
+  timeout_heap_destroy(&a->timeouts);
+  deferred_queue_destroy(&a->deferred);
   free(a);
   return true;
 }
@@ -286,27 +288,47 @@ event_loop_select_timeout_add(event_loop_select_handle_t loop,
   bool success_uptime = uptime_in_seconds(&cur_clock);
   if (!success_uptime) return false;
 
-  EventLoopSelectTimeoutCtx timeout_ctx = {
-    .end_clock = timeout->sec + cur_clock,
+  EventLoopSelectTimeoutLink *const ll = malloc(sizeof(*ll));
+  if (!ll) return false;
+
+  *ll = (EventLoopSelectTimeoutLink) {
+    .heap_entry = {
+      .end_clock = timeout->sec + cur_clock,
+    },
     .handler = handler,
     .ud = ud,
   };
 
-  return _add_timeout_link(&timeout_ctx, &loop->timeout_ll, key);
+  if (!timeout_heap_push(&loop->timeouts, &ll->heap_entry)) {
+    free(ll);
+    return false;
+  }
+
+  if (key) *key = ll;
+
+  return true;
 }
 
 bool
 event_loop_select_timeout_remove(event_loop_select_handle_t loop,
                                  event_loop_select_timeout_key_t key) {
-  UNUSED(loop);
-  assert(loop->ll);
+  assert(loop);
   assert(key);
-  assert(key->is_active);
   /* TODO: assert that this timeout is apart of this loop */
-  key->is_active = false;
+  timeout_heap_remove(&loop->timeouts, &key->heap_entry);
+  free(key);
   return true;
 }
 
+bool
+event_loop_select_defer(event_loop_select_handle_t loop,
+                        event_handler_t handler,
+                        void *ud) {
+  assert(loop);
+  assert(handler);
+  return deferred_queue_push(&loop->deferred, handler, ud);
+}
+
 bool
 event_loop_select_main_loop(event_loop_select_handle_t loop) {
   log_info("fdevent select main loop started");
@@ -314,23 +336,20 @@ event_loop_select_main_loop(event_loop_select_handle_t loop) {
   while (true) {
     //    log_debug("Looping...");
 
-    /* first clear out inactive timeouts and
-       find select wait time
-     */
-    bool select_stop_clock_is_enabled = false;
-    uint64_t select_stop_clock = UINT64_MAX;
-    for (EventLoopSelectTimeoutLink *ll = loop->timeout_ll; ll;) {
-      if (ll->is_active) {
-        select_stop_clock = MIN(ll->timeout.end_clock, select_stop_clock);
-        if (!select_stop_clock_is_enabled) select_stop_clock_is_enabled = true;
-        ll = ll->next;
-      }
-      else {
-        EventLoopSelectTimeoutLink *tmpll = ll->next;
-        FREE_LINK(&loop->timeout_ll, ll);
-        ll = tmpll;
-      }
-    }
+    /* deferred calls go first, the watches they add are picked up
+       when we build the fd sets below */
+    deferred_queue_run(&loop->deferred);
+
+    /* calls deferred by the handlers above must not wait on i/o */
+    const bool has_deferred = loop->deferred.size;
+
+    /* find select wait time */
+    const TimeoutHeapEntry *const next_timeout =
+      timeout_heap_peek(&loop->timeouts);
+    const bool select_stop_clock_is_enabled = next_timeout;
+    const uint64_t select_stop_clock = next_timeout
+      ? next_timeout->end_clock
+      : UINT64_MAX;
 
     fd_set readfds, writefds, errorfds;
     int nfds = -1;
@@ -372,7 +391,8 @@ event_loop_select_main_loop(event_loop_select_handle_t loop) {
 
     /* if there is nothing to select for, then stop the main loop */
     if (!readfds_watched && !writefds_watched && !select_stop_clock_is_enabled) {
-      return true;
+      if (!has_deferred) return true;
+      continue;
     }
 
     //    log_debug("before select");
@@ -380,7 +400,11 @@ event_loop_select_main_loop(event_loop_select_handle_t loop) {
     while (true) {
       struct timeval *select_timeout_p;
       struct timeval select_timeout;
-      if (select_stop_clock_is_enabled) {
+      if (has_deferred) {
+        select_timeout = (struct timeval) {0, 0};
+        select_timeout_p = &select_timeout;
+      }
+      else if (select_stop_clock_is_enabled) {
         uint64_t curclock;
         bool success_uptime = uptime_in_seconds(&curclock);
         if (!success_uptime) {
@@ -480,12 +504,25 @@ event_loop_select_main_loop(event_loop_select_handle_t loop) {
     bool success_uptime = uptime_in_seconds(&curclock);
     /* TODO: handle this error */
     ASSERT_TRUE(success_uptime);
-    for (EventLoopSelectTimeoutLink *ll = loop->timeout_ll; ll; ll = ll->next) {
-      if (!ll->is_active) continue;
-      if (!timeout_is_triggered(&ll->timeout, curclock)) continue;
-
-      ll->is_active = false;
-      ll->timeout.handler(EVENT_LOOP_TIMEOUT_EVENT, NULL, ll->timeout.ud);
+    /* timeouts added by these handlers wait for the next iteration */
+    const uint64_t seq_limit = loop->timeouts.next_seq;
+    while (true) {
+      TimeoutHeapEntry *const entry = timeout_heap_peek(&loop->timeouts);
+      if (!entry ||
+          entry->end_clock > curclock ||
+          entry->seq >= seq_limit) break;
+
+      timeout_heap_remove(&loop->timeouts, entry);
+
+      /* timeouts are one-shot, free it before the handler
+         has a chance to add new ones */
+      EventLoopSelectTimeoutLink *const ll =
+        (EventLoopSelectTimeoutLink *) entry;
+      const event_handler_t handler = ll->handler;
+      void *const ud = ll->ud;
+      free(ll);
+
+      handler(EVENT_LOOP_TIMEOUT_EVENT, NULL, ud);
     }
   }
 }
@@ -104,6 +104,15 @@ bool
 event_loop_select_timeout_remove(event_loop_select_handle_t loop,
                                  event_loop_select_timeout_key_t key);
 
+/* runs `handler` on the loop's next turn, before it waits for i/o.
+   this is cheaper than a zero timeout and is what handlers should use
+   to unwind the stack */
+NON_NULL_ARGS2(1, 2)
+bool
+event_loop_select_defer(event_loop_select_handle_t loop,
+                        event_handler_t handler,
+                        void *ud);
+
 NON_NULL_ARGS1(1)
 bool
 event_loop_select_main_loop(event_loop_select_handle_t loop);
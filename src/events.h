@@ -46,6 +46,7 @@ typedef enum {
   EVENT_LOOP_SOCKET_EVENT,
   EVENT_LOOP_FD_EVENT,
   EVENT_LOOP_TIMEOUT_EVENT,
+  EVENT_LOOP_DEFER_EVENT,
   C_WRITEALL_DONE_EVENT,
   C_READ_DONE_EVENT,
   WEBDAV_MKCOL_DONE_EVENT,
@@ -56,7 +57,6 @@ typedef enum {
   WEBDAV_COPY_DONE_EVENT,
   WEBDAV_TOUCH_DONE_EVENT,
   HTTP_SERVER_STOP_DONE_EVENT,
-  SEND_MESSAGE_DONE_EVENT,
   RECEIVE_REPLY_MESSAGE_DONE_EVENT,
   ASYNC_FUSE_FS_OPEN_DONE_EVENT,
   ASYNC_FUSE_FS_FGETATTR_DONE_EVENT,
@@ -87,6 +87,9 @@ typedef enum {
   ASYNC_TREE_EXPAND_FN_DONE_EVENT,
   ASYNC_TREE_APPLY_FN_DONE_EVENT,
   ASYNC_TREE_APPLY_DONE_EVENT,
+  ASYNC_FS_RMTREE_DONE_EVENT,
+  ASYNC_FS_COPYTREE_DONE_EVENT,
+  WORKER_POOL_RUN_DONE_EVENT,
 } event_type_t;
 
 #define EVENT_HANDLER_DEFINE(handler, a, b, c) void handler(event_type_t a, void *b, void *c)
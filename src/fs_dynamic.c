@@ -159,6 +159,23 @@ fs_dynamic_close(fs_dynamic_handle_t fs, fs_dynamic_file_handle_t handle) {
   return fs_dyn->ops->close(fs_dyn->fs, handle);
 }
 
+int
+fs_dynamic_fileno(fs_dynamic_handle_t fs, fs_dynamic_file_handle_t handle) {
+  FsDynamic *fs_dyn = fs_handle_to_pointer(fs);
+  if (!fs_dyn->ops->fileno) return -1;
+  /* parenthesized in case the libc defines fileno() as a macro */
+  return (fs_dyn->ops->fileno)(fs_dyn->fs, handle);
+}
+
+fs_error_t
+fs_dynamic_copyfile(fs_dynamic_handle_t fs,
+                    fs_dynamic_file_handle_t src,
+                    fs_dynamic_file_handle_t dst) {
+  FsDynamic *fs_dyn = fs_handle_to_pointer(fs);
+  if (!fs_dyn->ops->copyfile) return FS_ERROR_NOT_SUPPORTED;
+  return fs_dyn->ops->copyfile(fs_dyn->fs, src, dst);
+}
+
 fs_error_t
 fs_dynamic_set_times(fs_dynamic_handle_t fs,
                      const char *path,
@@ -47,6 +47,8 @@ typedef fs_error_t (*fs_dynamic_ftruncate_fn)(void *, void *, fs_off_t);
 typedef fs_error_t (*fs_dynamic_read_fn)(void *, void *, OUT_VAR char *, size_t, fs_off_t, OUT_VAR size_t *);
 typedef fs_error_t (*fs_dynamic_write_fn)(void *, void *, const char *, size_t, fs_off_t, OUT_VAR size_t *);
 typedef fs_error_t (*fs_dynamic_close_fn)(void *, void *);
+typedef int (*fs_dynamic_fileno_fn)(void *, void *);
+typedef fs_error_t (*fs_dynamic_copyfile_fn)(void *, void *, void *);
 typedef fs_error_t (*fs_dynamic_opendir_fn)(void *, const char *, OUT_VAR void **);
 typedef fs_error_t (*fs_dynamic_readdir_fn)(void *, void *, OUT_VAR char **, OUT_VAR bool *, OUT_VAR FsAttrs *);
 typedef fs_error_t (*fs_dynamic_closedir_fn)(void *, void *);
@@ -69,6 +71,10 @@ typedef struct {
   fs_dynamic_read_fn read;
   fs_dynamic_write_fn write;
   fs_dynamic_close_fn close;
+  /* optional, may be NULL */
+  fs_dynamic_fileno_fn fileno;
+  /* optional, may be NULL */
+  fs_dynamic_copyfile_fn copyfile;
   fs_dynamic_opendir_fn opendir;
   fs_dynamic_readdir_fn readdir;
   fs_dynamic_closedir_fn closedir;
@@ -152,6 +158,19 @@ fs_dynamic_rename(fs_dynamic_handle_t fs,
 fs_error_t
 fs_dynamic_close(fs_dynamic_handle_t fs, fs_dynamic_file_handle_t handle);
 
+/* returns the native file descriptor backing `handle` or -1 if
+   there is none, the descriptor is owned by the handle */
+int
+fs_dynamic_fileno(fs_dynamic_handle_t fs, fs_dynamic_file_handle_t handle);
+
+/* copies the contents of `src` into `dst`, which should be empty,
+   returns FS_ERROR_NOT_SUPPORTED if there's no better way to do it
+   than fs_read() and fs_write() */
+fs_error_t
+fs_dynamic_copyfile(fs_dynamic_handle_t fs,
+                    fs_dynamic_file_handle_t src,
+                    fs_dynamic_file_handle_t dst);
+
 fs_error_t
 fs_dynamic_set_times(fs_dynamic_handle_t fs,
                      const char *path,
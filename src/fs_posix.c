@@ -19,6 +19,10 @@
 #define _ISOC99_SOURCE
 /* for dirfd/pread/pwrite */
 #define _POSIX_C_SOURCE 200809L
+#ifdef __linux__
+/* for copy_file_range */
+#define _GNU_SOURCE
+#endif
 
 #include "fs_posix.h"
 
@@ -33,8 +37,13 @@
 
 #include <fcntl.h>
 #include <dirent.h>
+#include <stdlib.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -297,6 +306,97 @@ fs_posix_close(fs_posix_handle_t fs, fs_posix_file_handle_t file_handle) {
   return FS_ERROR_SUCCESS;
 }
 
+int
+fs_posix_fileno(fs_posix_handle_t fs, fs_posix_file_handle_t file_handle) {
+  ASSERT_VALID_FS(fs);
+  return file_handle_to_fd(file_handle);
+}
+
+fs_error_t
+fs_posix_copyfile(fs_posix_handle_t fs,
+                  fs_posix_file_handle_t src,
+                  fs_posix_file_handle_t dst) {
+  enum {
+    COPY_BUF_SIZE = 256 * 1024,
+  };
+  ASSERT_VALID_FS(fs);
+  const int src_fd = file_handle_to_fd(src);
+  const int dst_fd = file_handle_to_fd(dst);
+
+#ifdef FICLONE
+  /* btrfs and xfs can share the blocks of the source,
+     nothing is copied until one of the files is written */
+  if (!ioctl(dst_fd, FICLONE, src_fd)) {
+    return FS_ERROR_SUCCESS;
+  }
+#endif
+
+  off_t offset = 0;
+
+#ifdef __linux__
+  /* the data doesn't go through user space,
+     nfs and cifs can even copy on the server */
+  while (true) {
+    loff_t off_in = offset, off_out = offset;
+    const ssize_t ret_copy =
+      copy_file_range(src_fd, &off_in, dst_fd, &off_out, SSIZE_MAX, 0);
+    if (ret_copy < 0) {
+      /* not supported by the kernel or between these files,
+         copy the rest ourselves */
+      if (errno == ENOSYS || errno == EXDEV ||
+          errno == EINVAL || errno == EOPNOTSUPP) {
+        break;
+      }
+      return errno_to_fs_error();
+    }
+
+    /* EOF */
+    if (!ret_copy) {
+      return FS_ERROR_SUCCESS;
+    }
+
+    offset += ret_copy;
+  }
+#endif
+
+  char *const buf = malloc(COPY_BUF_SIZE);
+  if (!buf) {
+    return FS_ERROR_NO_MEM;
+  }
+
+  fs_error_t toret = FS_ERROR_SUCCESS;
+  while (true) {
+    const ssize_t ret_pread = pread(src_fd, buf, COPY_BUF_SIZE, offset);
+    if (ret_pread < 0) {
+      toret = errno_to_fs_error();
+      break;
+    }
+
+    /* EOF */
+    if (!ret_pread) {
+      break;
+    }
+
+    ssize_t written = 0;
+    while (written < ret_pread) {
+      const ssize_t ret_pwrite =
+        pwrite(dst_fd, buf + written, ret_pread - written, offset + written);
+      if (ret_pwrite < 0) {
+        toret = errno_to_fs_error();
+        goto done;
+      }
+      written += ret_pwrite;
+    }
+
+    offset += written;
+  }
+
+ done:
+  free(buf);
+
+  return toret;
+}
+
 fs_error_t
 fs_posix_opendir(fs_posix_handle_t fs, const char *path,
                  OUT_VAR fs_posix_directory_handle_t *dir_handle) {
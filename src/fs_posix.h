@@ -106,6 +106,19 @@ fs_posix_rename(fs_posix_handle_t fs,
 fs_error_t
 fs_posix_close(fs_posix_handle_t fs, fs_posix_file_handle_t handle);
 
+/* returns the native file descriptor backing `handle` or -1 if
+   there is none, the descriptor is owned by the handle */
+int
+fs_posix_fileno(fs_posix_handle_t fs, fs_posix_file_handle_t handle);
+
+/* copies the contents of `src` into `dst`, which should be empty,
+   returns FS_ERROR_NOT_SUPPORTED if there's no better way to do it
+   than fs_read() and fs_write() */
+fs_error_t
+fs_posix_copyfile(fs_posix_handle_t fs,
+                  fs_posix_file_handle_t src,
+                  fs_posix_file_handle_t dst);
+
 fs_error_t
 fs_posix_set_times(fs_posix_handle_t fs,
                    const char *path,
@@ -413,6 +413,25 @@ fs_win32_close(fs_win32_handle_t fs, fs_win32_file_handle_t file_handle) {
   return FS_ERROR_SUCCESS;
 }
 
+int
+fs_win32_fileno(fs_win32_handle_t fs, fs_win32_file_handle_t file_handle) {
+  ASSERT_VALID_FS(fs);
+  UNUSED(file_handle);
+  /* TODO: TransmitFile() works on HANDLEs, expose those instead */
+  return -1;
+}
+
+fs_error_t
+fs_win32_copyfile(fs_win32_handle_t fs,
+                  fs_win32_file_handle_t src,
+                  fs_win32_file_handle_t dst) {
+  ASSERT_VALID_FS(fs);
+  UNUSED(src);
+  UNUSED(dst);
+  /* TODO: FSCTL_DUPLICATE_EXTENTS_TO_FILE can clone blocks on ReFS */
+  return FS_ERROR_NOT_SUPPORTED;
+}
+
 fs_error_t
 fs_win32_opendir(fs_win32_handle_t fs, const char *path_,
                  OUT_VAR fs_win32_directory_handle_t *dir_handle) {
@@ -109,6 +109,19 @@ fs_win32_set_times(fs_win32_handle_t fs,
 fs_error_t
 fs_win32_close(fs_win32_handle_t fs, fs_win32_file_handle_t handle);
 
+/* returns the native file descriptor backing `handle` or -1 if
+   there is none, the descriptor is owned by the handle */
+int
+fs_win32_fileno(fs_win32_handle_t fs, fs_win32_file_handle_t handle);
+
+/* copies the contents of `src` into `dst`, which should be empty,
+   returns FS_ERROR_NOT_SUPPORTED if there's no better way to do it
+   than fs_read() and fs_write() */
+fs_error_t
+fs_win32_copyfile(fs_win32_handle_t fs,
+                  fs_win32_file_handle_t src,
+                  fs_win32_file_handle_t dst);
+
 bool
 fs_win32_destroy(fs_win32_handle_t fs);
 
@@ -248,12 +248,9 @@ http_request_ignore_body(http_request_handle_t rh,
              .ud = ud);
 }
 
-char *
-decode_urlpath(const char *urlpath, size_t len) {
+size_t
+decoded_urlpath_size(const char *urlpath, size_t len) {
   /* TODO: remove params from /path_segment;param/ */
-  assert(str_startswith(urlpath, "/"));
-
-  /* first figure out length of new string */
   size_t new_size = 0;
   for (size_t i = 0; i < len; ++new_size) {
     /* this should definitely not include any query component,
@@ -267,13 +264,11 @@ decode_urlpath(const char *urlpath, size_t len) {
       : 1;
   }
 
-  /* allocate necessary memory */
-  char *toret = malloc(new_size + 1);
-  if (!toret) {
-    return NULL;
-  }
+  return new_size;
+}
 
-  /* now actually decode */
+size_t
+decode_urlpath_into(const char *urlpath, size_t len, char *out) {
   size_t j = 0;
   for (size_t i = 0; i < len; ++j) {
     if (urlpath[i] == '%' &&
@@ -282,17 +277,36 @@ decode_urlpath(const char *urlpath, size_t len) {
       char hex_temp[3] = {urlpath[i + 1], urlpath[i + 2], '\0'};
       long char_code = strtol(hex_temp, NULL, 16);
       assert(char_code >= 0 && char_code < 256);
-      toret[j] = (unsigned char) char_code;
+      out[j] = (unsigned char) char_code;
       i += 3;
     }
     else {
-      toret[j] = urlpath[i];
+      out[j] = urlpath[i];
       i += 1;
     }
   }
 
-  assert(j == new_size);
-  toret[new_size] = '\0';
+  out[j] = '\0';
+  return j;
+}
+
+char *
+decode_urlpath(const char *urlpath, size_t len) {
+  assert(str_startswith(urlpath, "/"));
+
+  /* first figure out length of new string */
+  const size_t new_size = decoded_urlpath_size(urlpath, len);
+
+  /* allocate necessary memory */
+  char *toret = malloc(new_size + 1);
+  if (!toret) {
+    return NULL;
+  }
+
+  /* now actually decode */
+  const size_t decoded = decode_urlpath_into(urlpath, len, toret);
+  UNUSED(decoded);
+  assert(decoded == new_size);
   return toret;
 }
 
@@ -323,47 +337,62 @@ to_hex_digit(char c) {
   }
 }
 
-char *
-encode_urlpath(const char *urlpath, size_t len) {
-  assert(str_startswith(urlpath, "/"));
+size_t
+encoded_urlpath_size(const char *urlpath, size_t len) {
   /* this encodes the path to be usable in the HTTP request line,
      this only allows: "-" | "_" | "." | "!" | "~" | "*" | "'" | "(" | ")"
      and: alphanum (A-Z,a-z,0-9)
      (reserved characters, ":" | "@" | "&" | "=" | "+" | "$" | ",",
      are technically allowed but not in the path component of a url)
    */
-
   size_t new_size = 0;
   for (size_t i = 0; i < len; ++i) {
     new_size += match_valid_urlpath_set(urlpath[i]) ? 1 : 3;
   }
 
-  char *toret = malloc(new_size + 1);
-  if (!toret) {
-    return NULL;
-  }
+  return new_size;
+}
 
+size_t
+encode_urlpath_into(const char *urlpath, size_t len, char *out) {
   size_t new_pos = 0;
   for (size_t i = 0; i < len; ++i) {
-    assert(new_pos < new_size);
     if (match_valid_urlpath_set(urlpath[i])) {
-      toret[new_pos++] = urlpath[i];
+      out[new_pos++] = urlpath[i];
     }
     else {
-      toret[new_pos++] = '%';
-      toret[new_pos++] = to_hex_digit(((unsigned char) urlpath[i]) / 16);
-      toret[new_pos++] = to_hex_digit(((unsigned char) urlpath[i]) % 16);
+      out[new_pos++] = '%';
+      out[new_pos++] = to_hex_digit(((unsigned char) urlpath[i]) / 16);
+      out[new_pos++] = to_hex_digit(((unsigned char) urlpath[i]) % 16);
     }
   }
 
-  assert(new_pos == new_size);
-  toret[new_pos] = '\0';
+  out[new_pos] = '\0';
+  return new_pos;
+}
+
+char *
+encode_urlpath(const char *urlpath, size_t len) {
+  assert(str_startswith(urlpath, "/"));
+
+  const size_t new_size = encoded_urlpath_size(urlpath, len);
+
+  char *toret = malloc(new_size + 1);
+  if (!toret) {
+    return NULL;
+  }
+
+  const size_t encoded = encode_urlpath_into(urlpath, len, toret);
+  UNUSED(encoded);
+  assert(encoded == new_size);
   return toret;
 }
 
 bool
 generate_http_date(char *buf, size_t buf_size, time_t time_) {
-  struct tm *const tm_ = gmtime(&time_);
+  struct tm tm_buf;
+  struct tm *const tm_ = gmtime_x(&time_, &tm_buf);
+  if (!tm_) return false;
   const char *fmt = "%a, %d %b %Y %H:%M:%S GMT";
   size_t num_chars = strftime(buf, buf_size, fmt, tm_);
   return num_chars && num_chars < buf_size;
@@ -374,7 +403,9 @@ static time_t
 get_gm_offset() {
   time_t currtime = time(NULL);
 
-  struct tm *timeinfo = gmtime(&currtime);
+  struct tm timeinfo_buf;
+  struct tm *timeinfo = gmtime_x(&currtime, &timeinfo_buf);
+  ASSERT_NOT_NULL(timeinfo);
   /* mktime() assumes timeinfo is in localtime,
      this is how we get the offset */
   time_t utc = mktime(timeinfo);
@@ -479,3 +510,140 @@ parse_http_date(const char *buf, time_t *time_) {
 
   return toret;
 }
+
+static const char *
+parse_byte_pos(const char *s, size_t *pos) {
+  if (*s < '0' || *s > '9') return NULL;
+
+  size_t toret = 0;
+  for (; *s >= '0' && *s <= '9'; ++s) {
+    const size_t digit = *s - '0';
+    /* positions past SIZE_MAX are clipped */
+    toret = toret > (SIZE_MAX - digit) / 10 ? SIZE_MAX : toret * 10 + digit;
+  }
+
+  *pos = toret;
+  return s;
+}
+
+bool
+parse_http_byte_ranges(const char *value, size_t entity_length,
+                       size_t max_ranges,
+                       HTTPByteRange **ranges, size_t *num_ranges) {
+  HTTPByteRange *toret = NULL;
+  size_t num_toret = 0;
+  bool saw_range_spec = false;
+
+  value = skip_ws(value);
+  if (!str_case_startswith(value, "bytes")) goto error;
+  value = skip_ws(value + strlen("bytes"));
+  if (*value != '=') goto error;
+  ++value;
+
+  toret = malloc(sizeof(*toret) * max_ranges);
+  if (!toret) goto error;
+
+  while (true) {
+    value = skip_ws(value);
+
+    /* empty list elements are allowed */
+    if (*value == ',') {
+      ++value;
+      continue;
+    }
+
+    if (!*value) break;
+
+    saw_range_spec = true;
+
+    HTTPByteRange range;
+    bool is_satisfiable;
+    if (*value == '-') {
+      /* suffix range, the last N bytes */
+      size_t suffix_length;
+      value = parse_byte_pos(value + 1, &suffix_length);
+      if (!value) goto error;
+
+      is_satisfiable = suffix_length && entity_length;
+      if (is_satisfiable) {
+        range.first = entity_length - MIN(suffix_length, entity_length);
+        range.last = entity_length - 1;
+      }
+    }
+    else {
+      value = parse_byte_pos(value, &range.first);
+      if (!value || *value != '-') goto error;
+      ++value;
+
+      range.last = SIZE_MAX;
+      if (*value >= '0' && *value <= '9') {
+        value = parse_byte_pos(value, &range.last);
+        if (range.last < range.first) goto error;
+      }
+
+      is_satisfiable = range.first < entity_length;
+      if (is_satisfiable) range.last = MIN(range.last, entity_length - 1);
+    }
+
+    value = skip_ws(value);
+    if (*value && *value != ',') goto error;
+
+    if (is_satisfiable) {
+      /* rather than serve lots of (possibly overlapping) ranges,
+         serve the whole entity */
+      if (num_toret == max_ranges) goto error;
+      toret[num_toret++] = range;
+    }
+  }
+
+  /* the range-set needs at least one spec, "bytes=" or "bytes=,"
+     is malformed rather than unsatisfiable */
+  if (!saw_range_spec) goto error;
+
+  *ranges = toret;
+  *num_ranges = num_toret;
+  return true;
+
+ error:
+  free(toret);
+  return false;
+}
+
+bool
+http_etag_list_matches(const char *list, const char *etag,
+                       bool weak_comparison) {
+  list = skip_ws(list);
+  if (*list == '*') return str_equals(skip_ws(list + 1), "");
+
+  if (!etag) return false;
+  const bool etag_is_weak = str_startswith(etag, "W/");
+  if (etag_is_weak && !weak_comparison) return false;
+  const char *const opaque_tag = etag_is_weak ? etag + 2 : etag;
+  const size_t opaque_tag_len = strlen(opaque_tag);
+
+  while (*list) {
+    list = skip_ws(list);
+    if (*list == ',') {
+      ++list;
+      continue;
+    }
+
+    const bool is_weak = str_startswith(list, "W/");
+    if (is_weak) list += 2;
+
+    /* entity tags are quoted and can't contain quotes */
+    if (*list != '"') return false;
+    const char *const end = strchr(list + 1, '"');
+    if (!end) return false;
+
+    if ((!is_weak || weak_comparison) &&
+        (size_t) (end + 1 - list) == opaque_tag_len &&
+        !memcmp(list, opaque_tag, opaque_tag_len)) {
+      return true;
+    }
+
+    list = end + 1;
+  }
+
+  return false;
+}
@@ -17,6 +17,7 @@
  */
 
 #ifndef HTTP_HELPERS_H
+#define HTTP_HELPERS_H
 
 #ifdef __cplusplus
 extern "C" {
@@ -73,12 +74,51 @@ decode_urlpath(const char *urlpath, size_t len);
 char *
 encode_urlpath(const char *urlpath, size_t len);
 
+/* for callers with their own storage: `out` needs room for the
+   returned size plus a NUL, the decoded size is never larger than `len`.
+   `urlpath` doesn't have to start with a slash */
+size_t
+decoded_urlpath_size(const char *urlpath, size_t len);
+
+size_t
+decode_urlpath_into(const char *urlpath, size_t len, char *out);
+
+size_t
+encoded_urlpath_size(const char *urlpath, size_t len);
+
+size_t
+encode_urlpath_into(const char *urlpath, size_t len, char *out);
+
 bool
 generate_http_date(char *buf, size_t buf_size, time_t time);
 
 bool
 parse_http_date(const char *buf, time_t *time);
 
+typedef struct {
+  /* inclusive */
+  size_t first;
+  size_t last;
+} HTTPByteRange;
+
+/* parses the value of a "Range" header for an entity of `entity_length` bytes,
+   on success `*ranges` is a malloc'd array of the satisfiable ranges,
+   there are none if the request can't be satisfied.
+   returns false if the header is malformed (including an empty range-set)
+   or asks for more than `max_ranges`
+   ranges, in that case it should be ignored */
+bool
+parse_http_byte_ranges(const char *value, size_t entity_length,
+                       size_t max_ranges,
+                       HTTPByteRange **ranges, size_t *num_ranges);
+
+/* checks `etag` (quotes included) against the value of an "If-Match"
+   or "If-None-Match" header, "*" matches any entity tag,
+   `etag` is NULL for an existing resource without one */
+bool
+http_etag_list_matches(const char *list, const char *etag,
+                       bool weak_comparison);
+
 #ifdef __cplusplus
 }
 #endif
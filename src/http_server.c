@@ -46,9 +46,24 @@
 #include "http_server.h"
 #undef _IS_HTTP_SERVER_C
 
+enum {
+  /* status line, Date, Server, Connection & Keep-Alive
+     plus every header the handler could have added */
+  OUT_HEADERS_BUF_SIZE = (5 * MAX_RESPONSE_LINE_SIZE +
+                          MAX_NUM_HEADERS * (MAX_HEADER_NAME_SIZE +
+                                             MAX_HEADER_VALUE_SIZE +
+                                             sizeof(": \r\n") - 1) +
+                          sizeof("\r\n") - 1),
+};
+
 /* private structures */
 typedef struct {
   http_request_handle_t request_context;
+  /* if `fd` isn't -1 the body is sent from the file instead of `buf` */
+  const void *buf;
+  int fd;
+  uint64_t offset;
+  size_t nbyte;
   event_handler_t cb;
   void *cb_ud;
 } WriteResponseState;
@@ -60,6 +75,17 @@ typedef struct _http_request_context {
   http_request_read_state_t read_state;
   bool is_connection_close;
   bool is_no_content;
+  /* the response to a HEAD request has the headers the
+     GET response would have but its body is never sent */
+  bool is_head_request;
+  /* set once the request line is parsed */
+  bool client_supports_chunked;
+  /* the handler didn't know the length of the response body, it's either
+     sent chunked or (for HTTP/1.0 clients) delimited by closing the
+     connection */
+  bool is_chunked_response;
+  bool is_close_delimited_response;
+  bool is_response_aborted;
   size_t out_content_length;
   size_t bytes_written;
   bool is_chunked_request;
@@ -100,12 +126,10 @@ typedef struct _http_connection {
   int last_error_number;
   ReadBuffer f;
   unsigned client_generation;
-  /* these might become per-request,
-     right now we only do one request at a time,
-     i.e. no pipe-lining */
+  /* requests are handled one at a time, pipelined requests
+     wait in `f` until the previous response has been written,
+     so responses go out in order */
   union {
-    char buffer[OUT_BUF_SIZE];
-    HTTPResponseHeaders rsp;
     HTTPRequestHeaders req;
     struct {
       event_loop_watch_key_t read_key;
@@ -113,6 +137,18 @@ typedef struct _http_connection {
       event_loop_timeout_key_t timeout_key;
     } wait_until;
   } spare;
+  /* response headers are serialized here and held back until the
+     first body write (or the end of the request), small bodies are
+     appended so the whole response goes out in a single send() */
+  size_t out_buf_used;
+  char out_buf[OUT_HEADERS_BUF_SIZE + OUT_BUF_SIZE];
+  /* the current request's header block, parsed in place, it's
+     reused by later requests unless it grew unusually large */
+  char *header_buf;
+  size_t header_buf_size;
+  size_t header_buf_used;
+  struct _http_request_header *header_pairs;
+  size_t header_pairs_size;
   struct _http_request_context rctx;
 } HTTPConnection;
 
@@ -127,16 +163,24 @@ typedef struct _http_server {
   socket_t stop_sockets[2];
   unsigned client_generation;
   bool client_handlers_should_wake_up;
+  size_t max_request_headers_size;
 } HTTPServer;
 
+const char *const HTTP_HEADER_ACCEPT_RANGES = "Accept-Ranges";
 const char *const HTTP_HEADER_ALLOW = "Allow";
 const char *const HTTP_HEADER_CONNECTION = "Connection";
 const char *const HTTP_HEADER_CONTENT_LENGTH = "Content-Length";
+const char *const HTTP_HEADER_CONTENT_RANGE = "Content-Range";
 const char *const HTTP_HEADER_CONTENT_TYPE = "Content-Type";
 const char *const HTTP_HEADER_DATE = "Date";
+const char *const HTTP_HEADER_ETAG = "ETag";
 const char *const HTTP_HEADER_HOST = "Host";
+const char *const HTTP_HEADER_IF_MATCH = "If-Match";
 const char *const HTTP_HEADER_IF_MODIFIED_SINCE = "If-Modified-Since";
+const char *const HTTP_HEADER_IF_NONE_MATCH = "If-None-Match";
+const char *const HTTP_HEADER_IF_RANGE = "If-Range";
 const char *const HTTP_HEADER_LAST_MODIFIED = "Last-Modified";
+const char *const HTTP_HEADER_RANGE = "Range";
 const char *const HTTP_HEADER_TRANSFER_ENCODING = "Transfer-Encoding";
 
 /* static forward decls */
@@ -190,6 +234,15 @@ _http_connection_write(HTTPConnection *conn, const void *buf, size_t nbyte,
                                       buf, nbyte, cb, ud);
 }
 
+static void
+_http_connection_sendfile(HTTPConnection *conn,
+                          int fd, uint64_t offset, size_t nbyte,
+                          event_handler_t cb, void *ud){
+  return util_event_loop_socket_sendfile(conn->server->loop,
+                                         conn->sock,
+                                         fd, offset, nbyte, cb, ud);
+}
+
 static bool
 _http_connection_close(HTTPConnection *conn) {
   return !closesocket(conn->sock);
@@ -211,6 +264,11 @@ _http_connection_is_old(HTTPConnection *conn) {
   return conn->server->client_generation > conn->client_generation;
 }
 
+static bool
+_http_connection_has_buffered_data(HTTPConnection *conn) {
+  return conn->f.buf_start != conn->f.buf_end;
+}
+
 static bool
 _http_connection_do_another_request(HTTPConnection *conn) {
   return (!_http_connection_has_error(conn) &&
@@ -312,13 +370,10 @@ EVENT_HANDLER_DEFINE(wait_until_ready_start_handler, ev_type, ev_, ud) {
   */
   if (conn->server->client_handlers_should_wake_up) {
     assert(conn->server->waiting_connections);
-    const EventLoopTimeout yield_timeout = {0, 0};
-    bool success_set_timeout =
-      event_loop_timeout_add(conn->server->loop,
-                             &yield_timeout,
-                             wait_until_ready_start_handler, conn,
-                             NULL);
-    ASSERT_TRUE(success_set_timeout);
+    bool success_defer =
+      event_loop_defer(conn->server->loop,
+                       wait_until_ready_start_handler, conn);
+    ASSERT_TRUE(success_defer);
     return;
   }
 
@@ -487,6 +542,7 @@ http_server_new(event_loop_handle_t loop,
     .handler = handler,
     .stop_sockets = {INVALID_SOCKET, INVALID_SOCKET},
     .ud = ud,
+    .max_request_headers_size = MAX_REQUEST_HEADERS_SIZE,
   };
 
   /* create stop signal listener for keep-alive
@@ -500,6 +556,11 @@ http_server_new(event_loop_handle_t loop,
   return http;
 }
 
+void
+http_server_set_max_request_headers_size(http_server_t http, size_t size) {
+  http->max_request_headers_size = size;
+}
+
 bool
 http_server_start(http_server_t http) {
   return _http_server_accept(http);
@@ -538,14 +599,10 @@ typedef struct {
   event_handler_t cb;
   void *ud;
   /* state */
-  int i;
   int c;
-  time_t header_read_start;
-  size_t ei;
-  size_t parsed;
-  char tmpbuf[1024];
   /* this is used for early exit on bad input headers,
      e.g. expect headers we don't understand */
+  http_status_code_t error_code;
   HTTPResponseHeaders *response_headers;
 } GetRequestState;
 
@@ -810,136 +867,144 @@ http_request_read(http_request_handle_t rh,
   }
 }
 
-typedef struct {
-  UTHR_CTX_BASE;
-  /* args */
-  const HTTPResponseHeaders *response_headers;
-  struct _http_request_context *request_context;
-  event_handler_t cb;
-  void *cb_ud;
-  /* state */
-  size_t header_idx;
-  char response_line[MAX_RESPONSE_LINE_SIZE];
-} WriteHeadersState;
+static bool
+_http_connection_out_buf_append(HTTPConnection *conn,
+                                const char *buf, size_t nbyte) {
+  /* leave room for small bodies */
+  if (nbyte > OUT_HEADERS_BUF_SIZE - conn->out_buf_used) return false;
+  memcpy(conn->out_buf + conn->out_buf_used, buf, nbyte);
+  conn->out_buf_used += nbyte;
+  return true;
+}
 
-static
-UTHR_DEFINE(_http_request_write_headers_coroutine) {
-  UTHR_HEADER(WriteHeadersState, whs);
-
-  int myerrno = 0;
-  whs->request_context->write_state = HTTP_REQUEST_WRITE_STATE_WRITING_HEADERS;
-
-#define EMITN(b, n)                                                     \
-  do {                                                                  \
-    UTHR_YIELD(whs,                                                     \
-               _http_connection_write(whs->request_context->conn,       \
-                                      b, n,                             \
-                                      _http_request_write_headers_coroutine, \
-                                      whs));                            \
-    UTHR_RECEIVE_EVENT(HTTP_CONNECTION_WRITE_DONE_EVENT,                \
-                       HTTPConnectionWriteDoneEvent, write_done_ev);    \
-    myerrno = write_done_ev->error;                                     \
-    if (myerrno) {                                                      \
-      goto done;                                                        \
-    }                                                                   \
-  }                                                                     \
+static bool
+_http_connection_out_buf_printf(HTTPConnection *conn,
+                                const char *fmt, ...) {
+  const size_t left = OUT_HEADERS_BUF_SIZE - conn->out_buf_used;
+  va_list ap;
+  va_start(ap, fmt);
+  const int ret = vsnprintf(conn->out_buf + conn->out_buf_used, left, fmt, ap);
+  va_end(ap);
+  if (ret < 0 || (size_t) ret >= left) return false;
+  conn->out_buf_used += ret;
+  return true;
+}
+
+/* `nbyte` == 0 writes the last chunk */
+static bool
+_http_connection_out_buf_chunk_header(HTTPConnection *conn,
+                                      size_t bytes_written, size_t nbyte) {
+  /* this is small enough to always fit after the headers */
+  const size_t left = sizeof(conn->out_buf) - conn->out_buf_used;
+  const int ret = snprintf(conn->out_buf + conn->out_buf_used, left,
+                           "%s%lx\r\n%s",
+                           bytes_written ? "\r\n" : "",
+                           (unsigned long) nbyte,
+                           nbyte ? "" : "\r\n");
+  if (ret < 0 || (size_t) ret >= left) return false;
+  conn->out_buf_used += ret;
+  return true;
+}
+
+static bool
+_http_request_serialize_headers(HTTPRequestContext *rctx,
+                                const HTTPResponseHeaders *response_headers) {
+  HTTPConnection *const conn = rctx->conn;
+
+  assert(!conn->out_buf_used);
+
+#define EMITN(b, n)                                             \
+  do {                                                          \
+    if (!_http_connection_out_buf_append(conn, b, n)) goto error; \
+  }                                                             \
   while (false)
 
 #define EMIT(c) EMITN(c, sizeof(c) - 1)
 #define EMITS(c) EMITN(c, strnlen(c, sizeof(c)))
 
   /* output response code */
-  const int ret = snprintf(whs->response_line,
-                           sizeof(whs->response_line),
-                           "HTTP/1.1 %d %s\r\n",
-                           whs->response_headers->code,
-                           whs->response_headers->message);
-  if (ret < 0 || (size_t) ret >= sizeof(whs->response_line)) {
-    myerrno = ENOMEM;
-    goto done;
-  }
-  http_request_log_debug(whs->request_context,
+  http_request_log_debug(rctx,
                          "Writing HTTP response, %d %s",
-                         whs->response_headers->code,
-                         whs->response_headers->message);
-  EMITN(whs->response_line, ret);
+                         response_headers->code,
+                         response_headers->message);
+  if (!_http_connection_out_buf_printf(conn, "HTTP/1.1 %d %s\r\n",
+                                       response_headers->code,
+                                       response_headers->message)) {
+    goto error;
+  }
 
   /* add date header */
   const time_t tt = time(NULL);
-  struct tm *const tm_ = gmtime(&tt);
+  struct tm tm_buf;
+  struct tm *const tm_ = gmtime_x(&tt, &tm_buf);
+  if (!tm_) goto error;
   const char *const fmt = "Date: %a, %d %b %Y %H:%M:%S GMT\r\n";
-  const int ret_sprint2 =
-    strftime(whs->response_line, sizeof(whs->response_line), fmt, tm_);
-  if (!ret_sprint2) {
-    myerrno = ENOMEM;
-    goto done;
-  }
-  http_request_log_debug(whs->request_context,
+  const size_t ret_strftime =
+    strftime(conn->out_buf + conn->out_buf_used,
+             OUT_HEADERS_BUF_SIZE - conn->out_buf_used, fmt, tm_);
+  if (!ret_strftime) goto error;
+  http_request_log_debug(rctx,
                          "Writing response header: %.*s",
-                         ret_sprint2 - 2, whs->response_line);
-  EMITN(whs->response_line, ret_sprint2);
+                         (int) ret_strftime - 2,
+                         conn->out_buf + conn->out_buf_used);
+  conn->out_buf_used += ret_strftime;
 
-  if (!_get_header_value(whs->response_headers->headers,
-                         whs->response_headers->num_headers,
+  if (!_get_header_value(response_headers->headers,
+                         response_headers->num_headers,
                          "Server")) {
-    http_request_log_debug(whs->request_context,
+    http_request_log_debug(rctx,
                            "Writing response header: Server: Rian's HTTP Server");
-    EMITS("Server: Rian's HTTP Server\r\n");
+    EMIT("Server: Rian's HTTP Server\r\n");
   }
 
-
-  if (!_http_connection_do_another_request(whs->request_context->conn)) {
-    http_request_log_debug(whs->request_context,
+  if (!_http_connection_do_another_request(conn)) {
+    http_request_log_debug(rctx,
                            "Writing response header: Connection: close");
-    EMITS("Connection: close\r\n");
+    EMIT("Connection: close\r\n");
   }
   else {
     /* TODO: only do this client sent "Connection: Keep-Alive",
        not harmful otherwise though, just unnecessary */
-    http_request_log_debug(whs->request_context,
+    http_request_log_debug(rctx,
                            "Writing response header: Connection: Keep-Alive");
-    EMITS("Connection: Keep-Alive\r\n");
-    char out[256];
-    int str_len = snprintf(out, sizeof(out), "Keep-Alive: timeout=%d\r\n",
+    EMIT("Connection: Keep-Alive\r\n");
+    http_request_log_debug(rctx,
+                           "Writing response header: Keep-Alive: timeout=%d",
                            CONN_READ_TIMEOUT);
-    http_request_log_debug(whs->request_context,
-                           "Writing response header: %s", out);
-    EMITN(out, str_len);
+    if (!_http_connection_out_buf_printf(conn, "Keep-Alive: timeout=%d\r\n",
+                                         CONN_READ_TIMEOUT)) {
+      goto error;
+    }
   }
 
   /* output each header */
-  for (whs->header_idx = 0; whs->header_idx < whs->response_headers->num_headers;
-       ++whs->header_idx) {
-    http_request_log_debug(whs->request_context,
+  for (size_t i = 0; i < response_headers->num_headers; ++i) {
+    if (!rctx->is_chunked_response &&
+        ascii_strcaseequal(response_headers->headers[i].name,
+                           HTTP_HEADER_TRANSFER_ENCODING)) {
+      continue;
+    }
+
+    http_request_log_debug(rctx,
                            "Writing response header: %s: %s",
-                           whs->response_headers->headers[whs->header_idx].name,
-                           whs->response_headers->headers[whs->header_idx].value);
-    EMITS(whs->response_headers->headers[whs->header_idx].name);
+                           response_headers->headers[i].name,
+                           response_headers->headers[i].value);
+    EMITS(response_headers->headers[i].name);
     EMIT(": ");
-    EMITS(whs->response_headers->headers[whs->header_idx].value);
+    EMITS(response_headers->headers[i].value);
     EMIT("\r\n");
   }
 
   /* finish headers */
   EMIT("\r\n");
 
- done:
-  if (myerrno) {
-    http_request_log_warning(whs->request_context,
-                             "Error while writing headers to client");
+  if (false) {
+  error:
+    conn->out_buf_used = 0;
+    return false;
   }
 
-  whs->request_context->write_state = HTTP_REQUEST_WRITE_STATE_WROTE_HEADERS;
-  HTTPRequestWriteHeadersDoneEvent write_headers_ev = {
-    .request_handle = whs->request_context,
-    .err = myerrno ? HTTP_GENERIC_ERROR : HTTP_SUCCESS,
-  };
-  whs->request_context->conn->last_error_number = myerrno;
-  UTHR_RETURN(whs,
-              whs->cb(HTTP_REQUEST_WRITE_HEADERS_DONE_EVENT,
-                      &write_headers_ev, whs->cb_ud));
-
-  UTHR_FOOTER();
+  return true;
 
 #undef EMIT
 #undef EMITN
@@ -978,14 +1043,37 @@ http_request_write_headers(http_request_handle_t rh,
 
   /* check if the response has a "Content-Length" header
      this is used as a hint by the handlers to tell the server
-     how much it's going to write, right now it's strictly necessary
-     but we may relax this in the future (esp if we negotiate chunked encoding) */
+     how much it's going to write, handlers that don't know
+     use "Transfer-Encoding: chunked" instead */
   {
     const char *const content_length_str =
       _get_header_value(response_headers->headers,
                         response_headers->num_headers,
                         HTTP_HEADER_CONTENT_LENGTH);
-    if (!rctx->is_no_content) {
+    const char *const transfer_encoding_str =
+      _get_header_value(response_headers->headers,
+                        response_headers->num_headers,
+                        HTTP_HEADER_TRANSFER_ENCODING);
+    if (transfer_encoding_str) {
+      if (rctx->is_no_content || content_length_str ||
+          !ascii_strcaseequal(transfer_encoding_str, "chunked")) {
+        log_error("Handler used a bad transfer encoding header!");
+        goto error;
+      }
+
+      if (rctx->is_head_request) {
+        /* there is no body to delimit */
+      }
+      else if (rctx->client_supports_chunked) {
+        rctx->is_chunked_response = true;
+      }
+      else {
+        /* NB: this must happen before the Connection header is serialized */
+        rctx->is_close_delimited_response = true;
+        rctx->is_connection_close = true;
+      }
+    }
+    else if (!rctx->is_no_content) {
       if (!content_length_str) {
         log_error("Handler did not use a valid content length string!");
         goto error;
@@ -1044,11 +1132,19 @@ http_request_write_headers(http_request_handle_t rh,
     return cb(HTTP_REQUEST_WRITE_HEADERS_DONE_EVENT, &write_headers_ev, cb_ud);
   }
 
-  UTHR_CALL4(_http_request_write_headers_coroutine, WriteHeadersState,
-             .response_headers = response_headers,
-             .request_context = rh,
-             .cb = cb,
-             .cb_ud = cb_ud);
+  /* NB: nothing is sent yet, the serialized headers go out with the
+     first body write or when the request ends */
+  if (!_http_request_serialize_headers(rctx, response_headers)) {
+    http_request_log_warning(rctx, "Error while writing headers to client");
+    goto error;
+  }
+
+  rctx->write_state = HTTP_REQUEST_WRITE_STATE_WROTE_HEADERS;
+  HTTPRequestWriteHeadersDoneEvent write_headers_ev = {
+    .request_handle = rh,
+    .err = HTTP_SUCCESS,
+  };
+  return cb(HTTP_REQUEST_WRITE_HEADERS_DONE_EVENT, &write_headers_ev, cb_ud);
 }
 
 EVENT_HANDLER_DEFINE(_handle_write_done, ev_type, ev, ud) {
@@ -1064,7 +1160,7 @@ EVENT_HANDLER_DEFINE(_handle_write_done, ev_type, ev, ud) {
     rws->request_context->conn->last_error_number = 1;
   }
   else {
-    rws->request_context->bytes_written += write_all_done_event->nbyte;
+    rws->request_context->bytes_written += rws->nbyte;
     rws->request_context->conn->last_error_number = 0;
   }
 
@@ -1076,10 +1172,34 @@ EVENT_HANDLER_DEFINE(_handle_write_done, ev_type, ev, ud) {
   rws->cb(HTTP_REQUEST_WRITE_DONE_EVENT, &write_ev, rws->cb_ud);
 }
 
-void
-http_request_write(http_request_handle_t rh,
-                   const void *buf, size_t nbyte,
-                   event_handler_t cb, void *cb_ud) {
+static
+EVENT_HANDLER_DEFINE(_handle_write_headers_flushed, ev_type, ev, ud) {
+  WriteResponseState *rws = ud;
+
+  UNUSED(ev_type);
+  assert(ev_type == HTTP_CONNECTION_WRITE_DONE_EVENT);
+  HTTPConnectionWriteDoneEvent *write_done_ev = ev;
+
+  /* headers failed, no point in sending the body */
+  if (write_done_ev->error) {
+    return _handle_write_done(ev_type, ev, ud);
+  }
+
+  if (rws->fd >= 0) {
+    return _http_connection_sendfile(rws->request_context->conn,
+                                     rws->fd, rws->offset, rws->nbyte,
+                                     _handle_write_done, rws);
+  }
+
+  _http_connection_write(rws->request_context->conn,
+                         rws->buf, rws->nbyte,
+                         _handle_write_done, rws);
+}
+
+static void
+_http_request_write(http_request_handle_t rh,
+                    const void *buf, int fd, uint64_t offset, size_t nbyte,
+                    event_handler_t cb, void *cb_ud) {
   HTTPRequestContext *rctx = rh;
 
   if (rctx->write_state != HTTP_REQUEST_WRITE_STATE_WROTE_HEADERS) {
@@ -1093,9 +1213,21 @@ http_request_write(http_request_handle_t rh,
     goto error;
   }
 
-  assert(rctx->out_content_length >= rctx->bytes_written);
+  if (rctx->is_head_request) {
+    /* handlers can share code with GET, the body is just dropped */
+    HTTPRequestWriteDoneEvent write_ev = {
+      .request_handle = rh,
+      .err = HTTP_SUCCESS,
+    };
+    return cb(HTTP_REQUEST_WRITE_DONE_EVENT, &write_ev, cb_ud);
+  }
+
+  const bool is_unknown_length =
+    rctx->is_chunked_response || rctx->is_close_delimited_response;
+  assert(is_unknown_length ||
+         rctx->out_content_length >= rctx->bytes_written);
   const size_t left_to_write = rctx->out_content_length - rctx->bytes_written;
-  if (nbyte > left_to_write) {
+  if (!is_unknown_length && nbyte > left_to_write) {
     /* TODO: right now have no facility to do short writes,
        could return write amount when done
     */
@@ -1119,20 +1251,94 @@ http_request_write(http_request_handle_t rh,
     return cb(HTTP_REQUEST_WRITE_DONE_EVENT, &write_ev, cb_ud);
   }
 
+  HTTPConnection *const conn = rctx->conn;
+  if (rctx->is_chunked_response) {
+    /* an empty chunk would end the body */
+    if (!nbyte) {
+      HTTPRequestWriteDoneEvent write_ev = {
+        .request_handle = rh,
+        .err = HTTP_SUCCESS,
+      };
+      return cb(HTTP_REQUEST_WRITE_DONE_EVENT, &write_ev, cb_ud);
+    }
+
+    /* the chunk header goes out with the (possibly still buffered)
+       response headers, the CRLF that ends the previous chunk
+       goes out with it too */
+    if (!_http_connection_out_buf_chunk_header(conn, rctx->bytes_written,
+                                               nbyte)) {
+      goto error;
+    }
+  }
+
   rctx->sub.rws = (WriteResponseState) {
     .request_context = rh,
+    .buf = buf,
+    .fd = fd,
+    .offset = offset,
+    .nbyte = nbyte,
     .cb = cb,
     .cb_ud = cb_ud,
   };
 
   rctx->write_state = HTTP_REQUEST_WRITE_STATE_WRITING;
 
-  _http_connection_write(rctx->conn,
+  if (conn->out_buf_used) {
+    /* headers (or a chunk header) haven't gone out yet,
+       if the body fits send it all in one go */
+    const size_t out_buf_used = conn->out_buf_used;
+    conn->out_buf_used = 0;
+    if (fd < 0 && nbyte <= sizeof(conn->out_buf) - out_buf_used) {
+      memcpy(conn->out_buf + out_buf_used, buf, nbyte);
+      return _http_connection_write(conn,
+                                    conn->out_buf, out_buf_used + nbyte,
+                                    _handle_write_done,
+                                    &rctx->sub.rws);
+    }
+
+    return _http_connection_write(conn,
+                                  conn->out_buf, out_buf_used,
+                                  _handle_write_headers_flushed,
+                                  &rctx->sub.rws);
+  }
+
+  if (fd >= 0) {
+    return _http_connection_sendfile(conn,
+                                     fd, offset, nbyte,
+                                     _handle_write_done,
+                                     &rctx->sub.rws);
+  }
+
+  _http_connection_write(conn,
                          buf, nbyte,
                          _handle_write_done,
                          &rctx->sub.rws);
 }
 
+void
+http_request_write(http_request_handle_t rh,
+                   const void *buf, size_t nbyte,
+                   event_handler_t cb, void *cb_ud) {
+  _http_request_write(rh, buf, -1, 0, nbyte, cb, cb_ud);
+}
+
+void
+http_request_sendfile(http_request_handle_t rh,
+                      int fd, uint64_t offset, size_t nbyte,
+                      event_handler_t cb, void *cb_ud) {
+  assert(fd >= 0);
+  _http_request_write(rh, NULL, fd, offset, nbyte, cb, cb_ud);
+}
+
+void
+http_request_abort_response(http_request_handle_t rh) {
+  HTTPRequestContext *rctx = rh;
+
+  http_request_log_info(rctx, "Aborting response");
+  rctx->is_response_aborted = true;
+  rctx->is_connection_close = true;
+}
+
 void
 http_request_end(http_request_handle_t rh) {
   HTTPRequestContext *rctx = rh;
@@ -1148,7 +1354,14 @@ http_request_end(http_request_handle_t rh) {
 
 const char *
 http_get_header_value(const HTTPRequestHeaders *rhs, const char *header_name) {
-  return _get_header_value(rhs->headers, rhs->num_headers, header_name);
+  /* headers can only be ascii */
+  for (size_t i = 0; i < rhs->num_headers; ++i) {
+    if (ascii_strcaseequal(header_name, rhs->headers[i].name)) {
+      return rhs->headers[i].value;
+    }
+  }
+
+  return NULL;
 }
 
 static
@@ -1178,7 +1391,7 @@ EVENT_HANDLER_DEFINE(accept_handler, ev_type, ev, ud) {
   sock = _http_server_sock_from_accept_event(ev);
   if (sock == INVALID_SOCKET) goto error;
 
-  ctx = malloc(sizeof(*ctx));
+  ctx = UTHR_ALLOC(HTTPConnection);
   if (!ctx) goto error;
 
   /* run client */
@@ -1197,7 +1410,7 @@ EVENT_HANDLER_DEFINE(accept_handler, ev_type, ev, ud) {
   if (false) {
   error:
     log_error("Couldn't allocate resources for new client, dropping connection...");
-    free(ctx);
+    UTHR_FREE(ctx);
     if (sock != INVALID_SOCKET) {
       int ret = closesocket(sock);
       if (ret == SOCKET_ERROR) {
@@ -1207,15 +1420,35 @@ EVENT_HANDLER_DEFINE(accept_handler, ev_type, ev, ud) {
   }
 }
 
+/* a request with unusually large headers shouldn't pin that much
+   memory for the rest of a keep-alive connection, the next request
+   allocates again from the usual size */
+static void
+_http_connection_trim_header_storage(HTTPConnection *conn) {
+  if (conn->header_buf_size > IN_BUF_SIZE) {
+    free(conn->header_buf);
+    conn->header_buf = NULL;
+    conn->header_buf_size = 0;
+  }
+
+  if (conn->header_pairs_size > MAX_NUM_HEADERS) {
+    free(conn->header_pairs);
+    conn->header_pairs = NULL;
+    conn->header_pairs_size = 0;
+  }
+}
+
 static void
 _write_out_internal_server_error(http_request_handle_t rh,
                                  event_handler_t handler, void *ud) {
-  HTTPRequestContext *rctx = rh;
-  HTTPResponseHeaders *rsp = &rctx->conn->spare.rsp;
-
-  http_response_set_code(rsp, HTTP_STATUS_CODE_INTERNAL_SERVER_ERROR);
-  http_response_add_header(rsp, HTTP_HEADER_CONTENT_LENGTH, "%d", 0);
-  http_request_write_headers(rh, rsp, handler, ud);
+  /* the headers are serialized before this returns,
+     so they can live on the stack */
+  HTTPResponseHeaders rsp;
+
+  http_response_init(&rsp);
+  http_response_set_code(&rsp, HTTP_STATUS_CODE_INTERNAL_SERVER_ERROR);
+  http_response_add_header(&rsp, HTTP_HEADER_CONTENT_LENGTH, "%d", 0);
+  http_request_write_headers(rh, &rsp, handler, ud);
 }
 
 static
@@ -1229,6 +1462,7 @@ UTHR_DEFINE(client_coroutine) {
     cc->rctx = (HTTPRequestContext) {
       .conn = cc,
     };
+    cc->out_buf_used = 0;
 
     /* TODO: Prevent against "slowloris" style attacks
        with clients who send their headers very very slowly:
@@ -1236,10 +1470,16 @@ UTHR_DEFINE(client_coroutine) {
     */
 
     /* wait here until connection becomes read ready
-       or we get the server stop signal */
-    UTHR_YIELD(cc, _http_connection_wait_until_ready(cc));
-    void *const data_is_available = UTHR_EVENT();
-    if (!data_is_available) continue;
+       or we get the server stop signal,
+       unless the client already pipelined the next request */
+    if (!_http_connection_has_buffered_data(cc)) {
+      UTHR_YIELD(cc, _http_connection_wait_until_ready(cc));
+      void *const data_is_available = UTHR_EVENT();
+      if (!data_is_available) continue;
+    }
+    else {
+      http_request_log_debug(&cc->rctx, "pipelined request is buffered");
+    }
 
     /* create request event, we can do this on the stack
        because the handler shouldn't use this after */
@@ -1274,10 +1514,13 @@ UTHR_DEFINE(client_coroutine) {
              cc->rctx.persist_ctx.content_length_read.content_length)) {
         http_request_log_debug(&cc->rctx, "handler didn't read entire body...");
       }
+      /* the request is over so its header storage is free to use as
+         scratch space, it was allocated when the headers were read */
+      assert(cc->header_buf);
       while (!_http_connection_has_error(cc)) {
         UTHR_YIELD(cc,
-                   http_request_read(&cc->rctx, cc->spare.buffer,
-                                     sizeof(cc->spare.buffer),
+                   http_request_read(&cc->rctx, cc->header_buf,
+                                     cc->header_buf_size,
                                      client_coroutine, cc));
         assert(UTHR_EVENT_TYPE() == HTTP_REQUEST_READ_DONE_EVENT);
         HTTPRequestReadDoneEvent *read_done_ev = UTHR_EVENT();
@@ -1297,27 +1540,48 @@ UTHR_DEFINE(client_coroutine) {
       assert(UTHR_EVENT_TYPE() == HTTP_REQUEST_WRITE_HEADERS_DONE_EVENT);
     }
 
-    /* write out rest of garbage if request ended prematurely */
+    /* end the chunked body */
     if (!_http_connection_has_error(cc) &&
         cc->rctx.write_state == HTTP_REQUEST_WRITE_STATE_WROTE_HEADERS &&
-        !cc->rctx.is_no_content) {
-      if (cc->rctx.bytes_written < cc->rctx.out_content_length) {
-        http_request_log_debug(&cc->rctx, "handler didn't finish response");
-      }
-      while (!_http_connection_has_error(cc) &&
-             cc->rctx.bytes_written < cc->rctx.out_content_length) {
-        /* initted to zero because static */
-        static char bytes[4096];
-        /* just writing bytes */
-        UTHR_YIELD(cc,
-                   http_request_write(&cc->rctx, bytes,
-                                      /* we must send the exact amount,
-                                         because we don't support chunked responses yet */
-                                      cc->rctx.out_content_length - cc->rctx.bytes_written,
-                                      client_coroutine, cc));
-        assert(UTHR_EVENT_TYPE() == HTTP_REQUEST_WRITE_DONE_EVENT);
+        cc->rctx.is_chunked_response &&
+        !cc->rctx.is_response_aborted) {
+      const bool success_last_chunk =
+        _http_connection_out_buf_chunk_header(cc, cc->rctx.bytes_written, 0);
+      ASSERT_TRUE(success_last_chunk);
+    }
+
+    /* if the request ended before the whole body was written,
+       the only way to tell the client is to close the connection */
+    if (!_http_connection_has_error(cc) &&
+        cc->rctx.write_state == HTTP_REQUEST_WRITE_STATE_WROTE_HEADERS &&
+        !cc->rctx.is_no_content &&
+        !cc->rctx.is_head_request &&
+        !cc->rctx.is_chunked_response &&
+        !cc->rctx.is_close_delimited_response &&
+        cc->rctx.bytes_written < cc->rctx.out_content_length) {
+      http_request_log_info(&cc->rctx,
+                            "handler didn't finish response, "
+                            "closing connection");
+      cc->rctx.is_connection_close = true;
+    }
+
+    /* send out response headers that are still buffered,
+       we do this even on error since the response could be describing it */
+    if (cc->out_buf_used) {
+      UTHR_YIELD(cc,
+                 _http_connection_write(cc, cc->out_buf, cc->out_buf_used,
+                                        client_coroutine, cc));
+      assert(UTHR_EVENT_TYPE() == HTTP_CONNECTION_WRITE_DONE_EVENT);
+      HTTPConnectionWriteDoneEvent *const write_done_ev = UTHR_EVENT();
+      if (write_done_ev->error) {
+        http_request_log_warning(&cc->rctx,
+                                 "Error while writing headers to client");
+        cc->last_error_number = write_done_ev->error;
       }
+      cc->out_buf_used = 0;
     }
+
+    _http_connection_trim_header_storage(cc);
   } while (_http_connection_do_another_request(cc));
 
   http_request_log_debug(&cc->rctx, "Client done, closing conn");
@@ -1326,171 +1590,237 @@ UTHR_DEFINE(client_coroutine) {
     http_request_log_error(&cc->rctx, "error while closing client connection, leaking...");
   }
 
+  free(cc->header_buf);
+  free(cc->header_pairs);
+
   UTHR_RETURN(cc, 0);
 
   UTHR_FOOTER();
 }
 
-static
-UTHR_DEFINE(c_get_request) {
-  UTHR_HEADER(GetRequestState, state);
+/* returns how many bytes of [p, p + len) belong to the header block,
+   i.e. up to and including the "\r\n\r\n" that ends it, or 0 if the end
+   isn't there yet. `tail` is the part of the block that was already
+   stored, the terminator can straddle it */
+static size_t
+_find_header_block_end(const char *tail, size_t tail_len,
+                       const char *p, size_t len) {
+  const char *nl = p;
+  /* memchr() is vectorized by any decent libc */
+  while ((nl = memchr(nl, '\n', p + len - nl))) {
+    const size_t k = nl - p;
+    char prev[3];
+    for (size_t j = 0; j < NELEMS(prev); ++j) {
+      /* the j-th of the three bytes before the '\n' */
+      const size_t back = NELEMS(prev) - j;
+      prev[j] = (k >= back
+                 ? p[k - back]
+                 : tail_len >= back - k
+                 ? tail[tail_len - (back - k)]
+                 : '\0');
+    }
+    if (prev[0] == '\r' && prev[1] == '\n' && prev[2] == '\r') return k + 1;
+    nl += 1;
+  }
 
-#define PEEK()                                          \
-  do {                                                  \
-    if ((state->c = fbpeek(&state->rh->conn->f)) < 0) { \
-      UTHR_YIELD(state,                                 \
-                 c_fbpeek(&state->rh->conn->f,          \
-                          &state->c,                    \
-                          c_get_request, state));       \
-      assert(UTHR_EVENT_TYPE() == C_FBPEEK_DONE_EVENT); \
-    }                                                   \
-    if (state->c == EOF) goto error;                    \
-  }                                                     \
-  while (false)
+  return 0;
+}
 
-#define EXPECT(_c)                                              \
-  do {                                                          \
-    /* first check the synchronous interface, to avoid          \
-       many layers of nesting */                                \
-    if ((state->c = fbgetc(&state->rh->conn->f)) < 0) {         \
-      UTHR_YIELD(state,                                         \
-                 c_fbgetc(&state->rh->conn->f,                  \
-                          &state->c,                            \
-                          c_get_request, state));               \
-      assert(UTHR_EVENT_TYPE() == C_FBGETC_DONE_EVENT);         \
-    }                                                           \
-    if ((char) state->c != (_c)) {                              \
-      if (state->c == EOF) {                                    \
-        log_error("Got EOF, while expecting '%c'", (_c));       \
-      }                                                         \
-      else {                                                    \
-        log_error("Didn't get the character we "                \
-                  "were expecting: '%c' vs '%c'",               \
-                  state->c, (_c));                              \
-      }                                                         \
-      goto error;                                               \
-    }                                                           \
-  }                                                             \
-  while (false)
+static bool
+_http_connection_reserve_header_buf(HTTPConnection *conn, size_t size) {
+  if (size <= conn->header_buf_size) return true;
 
-#define EXPECTS(_s)                                                     \
-  do {                                                                  \
-    for (state->ei = 0; state->ei < sizeof(_s) - 1; ++state->ei) {      \
-      EXPECT(_s[state->ei]);                                            \
-    }                                                                   \
-  }                                                                     \
-  while (false)
+  size_t new_size = conn->header_buf_size ? conn->header_buf_size : IN_BUF_SIZE;
+  while (new_size < size) new_size *= 2;
 
-#define PARSEVAR(var, fn)                                               \
-  do {                                                                  \
-    UTHR_YIELD(state,                                                   \
-               c_getwhile(&state->rh->conn->f,                          \
-                          var, sizeof(var) - 1, fn, &state->parsed,     \
-                          c_get_request, state));                       \
-    assert(UTHR_EVENT_TYPE() == C_GETWHILE_DONE_EVENT);                 \
-    if (state->parsed > sizeof(var) - 1 ||                             \
-        !state->parsed) {						\
-      log_error("parsed too much or not enough!");                      \
-      goto error;							\
-    }									\
-    /* we don't protect against there being a '\0' in the http */       \
-    /* variable the worst that can happen is the var is cut  */         \
-    /* short and fails */                                               \
-    var[state->parsed] = '\0';                                          \
-  }                                                                     \
-  while (false)
+  char *const new_buf = realloc(conn->header_buf, new_size);
+  if (!new_buf) return false;
 
-#define PARSEINTVAR(var)                                        \
-  do {                                                          \
-    long _val;                                                  \
-    PARSEVAR(state->tmpbuf, match_digit);                       \
-    _val = strtol(state->tmpbuf, NULL, 10);                     \
-    if ((_val == 0 && errno == EINVAL) ||                       \
-        _val > INT_MAX || _val < INT_MIN) {                     \
-      log_error("Didn't parse an integer: %s", state->tmpbuf);  \
-      goto error;                                               \
-    }                                                           \
-    var = _val;                                                 \
-  }                                                             \
-  while (false)
+  conn->header_buf = new_buf;
+  conn->header_buf_size = new_size;
+  return true;
+}
 
-  PARSEVAR(state->request_headers->method, match_token);
+/* returns the '\r' that ends the line starting at `p`, or NULL if
+   that '\r' isn't followed by a '\n' (or there isn't one yet) */
+static char *
+_find_crlf(char *p, char *end) {
+  /* memchr() is vectorized by any decent libc */
+  char *const cr = memchr(p, '\r', end - p);
+  if (!cr || end - cr < 2 || cr[1] != '\n') return NULL;
+  return cr;
+}
 
-  EXPECT(' ');
+static bool
+_parse_version_number(const char **pp, const char *end, int *out) {
+  const char *p = *pp;
+  int val = 0;
+  /* anything longer could overflow */
+  for (; p < end && match_digit(*p) && p - *pp < 9; ++p) {
+    val = val * 10 + (*p - '0');
+  }
+  if (p == *pp || (p < end && match_digit(*p))) return false;
+  *pp = p;
+  *out = val;
+  return true;
+}
 
-  http_request_log_debug(state->rh, "Got method '%s'",
-                         state->request_headers->method);
+/* parses the request line and headers of the complete header block
+   stored in the connection's header buffer, the block is split in place
+   so the strings in `request_headers` end up pointing into it */
+static bool
+_parse_buffered_request_headers(HTTPConnection *conn,
+                                HTTPRequestHeaders *request_headers) {
+  char *p = conn->header_buf;
+  char *const end = conn->header_buf + conn->header_buf_used;
 
-  /* request-uri = "*" | absoluteURI | abs_path | authority */
-  /* we don't parse super intelligently here because
-     http URIs aren't LL(1), authority and absoluteURI start with
-     the same prefix string */
-  PARSEVAR(state->request_headers->uri, match_non_null_or_space);
-  EXPECT(' ');
+  assert(end - p >= 4 && !memcmp(end - 4, "\r\n\r\n", 4));
 
-  http_request_log_debug(state->rh, "Got uri '%s'",
-                         state->request_headers->uri);
+  /* request line */
+  char *cr = _find_crlf(p, end);
+  if (!cr || memchr(p, '\0', cr - p)) return false;
 
-  EXPECTS("HTTP/");
-  PARSEINTVAR(state->request_headers->major_version);
-  EXPECT('.');
-  PARSEINTVAR(state->request_headers->minor_version);
-  EXPECTS("\r\n");
+  char *const sp = memchr(p, ' ', cr - p);
+  if (!sp || sp == p) return false;
+  for (const char *m = p; m < sp; ++m) {
+    if (!match_token(*m)) return false;
+  }
 
-  http_request_log_debug(state->rh, "Got version '%d.%d'",
-                         state->request_headers->major_version,
-                         state->request_headers->minor_version);
+  char *const uri = sp + 1;
+  char *const sp2 = memchr(uri, ' ', cr - uri);
+  if (!sp2 || sp2 == uri) return false;
+
+  const char *v = sp2 + 1;
+  if (cr - v < (ptrdiff_t) sizeof("HTTP/") - 1 ||
+      memcmp(v, "HTTP/", sizeof("HTTP/") - 1)) return false;
+  v += sizeof("HTTP/") - 1;
+  if (!_parse_version_number(&v, cr, &request_headers->major_version) ||
+      v == cr || *v++ != '.' ||
+      !_parse_version_number(&v, cr, &request_headers->minor_version) ||
+      v != cr) return false;
+
+  *sp = '\0';
+  *sp2 = '\0';
+  request_headers->method = p;
+  request_headers->uri = uri;
+
+  p = cr + 2;
+
+  /* headers,
+     NB: the block ends in "\r\n\r\n" so we always stop at the blank line */
+  size_t i;
+  for (i = 0; *p != '\r'; ++i) {
+    cr = _find_crlf(p, end);
+    if (!cr || memchr(p, '\0', cr - p)) return false;
+
+    char *const colon = memchr(p, ':', cr - p);
+    if (!colon || colon == p) return false;
+
+    /* we do the bare minimum and skip leading whitespace */
+    char *value = colon + 1;
+    while (value < cr && (*value == ' ' || *value == '\t')) ++value;
+
+    if (i == conn->header_pairs_size) {
+      const size_t new_size =
+        conn->header_pairs_size ? 2 * conn->header_pairs_size : MAX_NUM_HEADERS;
+      struct _http_request_header *const new_pairs =
+        realloc(conn->header_pairs, new_size * sizeof(*new_pairs));
+      if (!new_pairs) return false;
+      conn->header_pairs = new_pairs;
+      conn->header_pairs_size = new_size;
+    }
 
-  http_request_log_debug(state->rh, "Parsed request line");
+    *colon = '\0';
+    *cr = '\0';
+    conn->header_pairs[i] = (struct _http_request_header) {
+      .name = p,
+      .value = value,
+    };
 
-  for (state->i = 0; state->i < (int) NELEMS(state->request_headers->headers);
-       ++state->i) {
-    PEEK();
+    p = cr + 2;
+  }
 
-    if (state->c == '\r') {
-      break;
-    }
+  /* end of the header block */
+  if (end - p != 2 || p[1] != '\n') return false;
 
-    PARSEVAR(state->request_headers->headers[state->i].name,
-             match_non_null_or_colon);
-    EXPECT(':');
+  request_headers->num_headers = i;
+  request_headers->headers = conn->header_pairs;
 
-    /* TODO, turn this into PARSEFIELDVALUE
-       which itself is quite complicated, we do the bare minimum
-       and skip leading whitespace
-    */
-    /* skip lws */
-    while (true) {
-      PEEK();
-      if (state->c == ' ') {
-        EXPECT(' ');
-      }
-      else if (state->c == '\t') {
-        EXPECT('\t');
-      }
-      else {
-        break;
-      }
-    }
+  return true;
+}
 
-    PEEK();
-    if (state->c != '\r') {
-      PARSEVAR(state->request_headers->headers[state->i].value,
-               match_non_null_or_carriage_return);
+static
+UTHR_DEFINE(c_get_request) {
+  UTHR_HEADER(GetRequestState, state);
+
+  /* copy the header block out of the read buffer, the common case
+     is that it all arrived in one read, otherwise we keep reading
+     until the blank line shows up */
+  state->rh->conn->header_buf_used = 0;
+  while (true) {
+    if ((state->c = fbpeek(&state->rh->conn->f)) < 0) {
+      UTHR_YIELD(state,
+                 c_fbpeek(&state->rh->conn->f,
+                          &state->c,
+                          c_get_request, state));
+      assert(UTHR_EVENT_TYPE() == C_FBPEEK_DONE_EVENT);
     }
-    else {
-      state->request_headers->headers[state->i].value[0] = '\0';
+    if (state->c == EOF) goto error;
+
+    HTTPConnection *const conn = state->rh->conn;
+    const size_t avail = conn->f.buf_end - conn->f.buf_start;
+    const size_t block_len =
+      _find_header_block_end(conn->header_buf, conn->header_buf_used,
+                             conn->f.buf_start, avail);
+    const size_t to_copy = block_len ? block_len : avail;
+
+    if (conn->header_buf_used + to_copy >
+        conn->server->max_request_headers_size) {
+      log_error("Request headers are larger than %lu bytes",
+                (unsigned long) conn->server->max_request_headers_size);
+      goto error;
+    }
+
+    if (!_http_connection_reserve_header_buf(conn,
+                                             conn->header_buf_used + to_copy)) {
+      log_error("Couldn't allocate space for request headers");
+      goto error;
     }
 
-    EXPECTS("\r\n");
+    memcpy(conn->header_buf + conn->header_buf_used,
+           conn->f.buf_start, to_copy);
+    conn->header_buf_used += to_copy;
+    conn->f.buf_start += to_copy;
 
-    http_request_log_debug(state->rh, "Parsed header %s: %s",
-                           state->request_headers->headers[state->i].name,
-                           state->request_headers->headers[state->i].value);
+    if (block_len) break;
   }
-  state->request_headers->num_headers = state->i;
 
-  EXPECTS("\r\n");
+  if (!_parse_buffered_request_headers(state->rh->conn,
+                                       state->request_headers)) {
+    log_error("Malformed request headers");
+    goto error;
+  }
+
+  http_request_log_debug(state->rh, "Parsed %s request for '%s' (%lu headers)",
+                         state->request_headers->method,
+                         state->request_headers->uri,
+                         (unsigned long) state->request_headers->num_headers);
+
+  state->rh->is_head_request =
+    ascii_strcaseequal(state->request_headers->method, "HEAD");
+
+  state->rh->client_supports_chunked =
+    (state->request_headers->major_version > 1 ||
+     (state->request_headers->major_version == 1 &&
+      state->request_headers->minor_version >= 1));
+
+  if (strlen(state->request_headers->uri) >= MAX_URI_SIZE) {
+    log_info("Request target is longer than %lu bytes",
+             (unsigned long) MAX_URI_SIZE - 1);
+    state->error_code = HTTP_STATUS_CODE_URI_TOO_LONG;
+    /* we won't read the body, so don't try to parse another request */
+    state->rh->is_connection_close = true;
+  }
 
   int err = HTTP_SUCCESS;
   if (false) {
@@ -1553,15 +1883,15 @@ UTHR_DEFINE(c_get_request) {
   }
 
   /* deal with the "Expect" request header */
-  if (!err) {
+  if (!err && !state->error_code) {
     const char *expect_str = http_get_header_value(state->request_headers, "expect");
     if (expect_str) {
       if (str_equals(expect_str, "100-continue")) {
         /* write out 100 continue response */
         UTHR_YIELD(state,
                    _http_connection_write(state->rh->conn,
-                                          "HTTP/1.1 100 Continue\r\n",
-                                          sizeof("HTTP/1.1 100 Continue\r\n") - 1,
+                                          "HTTP/1.1 100 Continue\r\n\r\n",
+                                          sizeof("HTTP/1.1 100 Continue\r\n\r\n") - 1,
                                           c_get_request,
                                           state));
         UTHR_RECEIVE_EVENT(HTTP_CONNECTION_WRITE_DONE_EVENT,
@@ -1574,29 +1904,34 @@ UTHR_DEFINE(c_get_request) {
       }
       else {
         /* we don't understand this, have to send an 417 (Expectation Failed) */
-        state->response_headers = malloc(sizeof(HTTPResponseHeaders));
+        state->error_code = HTTP_STATUS_CODE_EXPECTATION_FAILED;
+      }
+    }
+  }
 
-        assert(state->response_headers);
-        http_response_init(state->response_headers);
-        bool ret = http_response_set_code(state->response_headers,
-                                          HTTP_STATUS_CODE_EXPECTATION_FAILED);
-        ASSERT_TRUE(ret);
-        ret = http_response_add_header(state->response_headers,
-                                       HTTP_HEADER_CONTENT_LENGTH, "%d", 0);
-        ASSERT_TRUE(ret);
+  /* answer requests we won't handle ourselves */
+  if (!err && state->error_code) {
+    state->response_headers = malloc(sizeof(HTTPResponseHeaders));
 
-        UTHR_YIELD(state,
-                   http_request_write_headers(state->rh, state->response_headers,
-                                              c_get_request, state));
+    assert(state->response_headers);
+    http_response_init(state->response_headers);
+    bool ret = http_response_set_code(state->response_headers,
+                                      state->error_code);
+    ASSERT_TRUE(ret);
+    ret = http_response_add_header(state->response_headers,
+                                   HTTP_HEADER_CONTENT_LENGTH, "%d", 0);
+    ASSERT_TRUE(ret);
 
-        free(state->response_headers);
+    UTHR_YIELD(state,
+               http_request_write_headers(state->rh, state->response_headers,
+                                          c_get_request, state));
 
-        assert(UTHR_EVENT_TYPE() == HTTP_REQUEST_WRITE_HEADERS_DONE_EVENT);
+    free(state->response_headers);
 
-        /* return an error to the user's handler so it stops processing */
-        err = HTTP_GENERIC_ERROR;
-      }
-    }
+    assert(UTHR_EVENT_TYPE() == HTTP_REQUEST_WRITE_HEADERS_DONE_EVENT);
+
+    /* return an error to the user's handler so it stops processing */
+    err = HTTP_GENERIC_ERROR;
   }
 
   state->rh->read_state = HTTP_REQUEST_READ_STATE_READ_HEADERS;
@@ -1615,11 +1950,6 @@ UTHR_DEFINE(c_get_request) {
                         &read_headers_events,
                         state->ud));
 
-#undef PARSEINTVAR
-#undef PARSEVAR
-#undef EXPECTS
-#undef EXPECT
-
   UTHR_FOOTER();
 }
 
@@ -1641,10 +1971,12 @@ http_response_add_header(HTTPResponseHeaders *rsp,
   int best_string_size = vsnprintf(rsp->headers[rsp->num_headers].value,
                                    sizeof(rsp->headers[rsp->num_headers].value),
                                    value_fmt, ap);
+  va_end(ap);
   /* poor man's error handling */
   ASSERT_TRUE(best_string_size >= 0);
-  ASSERT_TRUE((size_t) best_string_size <= (sizeof(rsp->headers[rsp->num_headers].value) - 1));
-  va_end(ap);
+  if ((size_t) best_string_size > sizeof(rsp->headers[rsp->num_headers].value) - 1) {
+    return false;
+  }
 
   rsp->num_headers += 1;
 
@@ -33,21 +33,33 @@ extern "C" {
 #endif
 
 #ifndef _IS_HTTP_SERVER__C
+extern const char *const HTTP_HEADER_ACCEPT_RANGES;
+extern const char *const HTTP_HEADER_ALLOW;
 extern const char *const HTTP_HEADER_CONTENT_LENGTH;
+extern const char *const HTTP_HEADER_CONTENT_RANGE;
 extern const char *const HTTP_HEADER_CONTENT_TYPE;
+extern const char *const HTTP_HEADER_ETAG;
 extern const char *const HTTP_HEADER_LAST_MODIFIED;
 extern const char *const HTTP_HEADER_HOST;
+extern const char *const HTTP_HEADER_IF_MATCH;
 extern const char *const HTTP_HEADER_IF_MODIFIED_SINCE;
+extern const char *const HTTP_HEADER_IF_NONE_MATCH;
+extern const char *const HTTP_HEADER_IF_RANGE;
+extern const char *const HTTP_HEADER_RANGE;
+extern const char *const HTTP_HEADER_TRANSFER_ENCODING;
 #endif
 
 enum {
   IN_BUF_SIZE=4096,
   MAX_LINE_SIZE=1024,
-  MAX_METHOD_SIZE=16,
-  MAX_URI_SIZE=1024,
+  /* default limit on the request line plus all request headers,
+     see http_server_set_max_request_headers_size() */
+  MAX_REQUEST_HEADERS_SIZE=64 * 1024,
   MAX_VERSION_SIZE=8,
   MAX_HEADER_NAME_SIZE=64,
   MAX_HEADER_VALUE_SIZE=256,
+  /* longer request targets get a 414 */
+  MAX_URI_SIZE=1024,
   MAX_NUM_HEADERS=16,
   MAX_MESSAGE_SIZE=64,
   OUT_BUF_SIZE=4096,
@@ -66,13 +78,20 @@ struct _header_pair {
   char value[MAX_HEADER_VALUE_SIZE];
 };
 
+struct _http_request_header {
+  const char *name;
+  const char *value;
+};
+
+/* the strings point into storage owned by the connection,
+   they stay valid until the request is over */
 typedef struct {
-  char method[MAX_METHOD_SIZE];
-  char uri[MAX_URI_SIZE];
+  const char *method;
+  const char *uri;
   int major_version;
   int minor_version;
   size_t num_headers;
-  struct _header_pair headers[MAX_NUM_HEADERS];
+  const struct _http_request_header *headers;
 } HTTPRequestHeaders;
 
 typedef enum {
@@ -85,6 +104,7 @@ typedef enum {
   HTTP_STATUS_CODE_OK=200,
   HTTP_STATUS_CODE_CREATED=201,
   HTTP_STATUS_CODE_NO_CONTENT=204,
+  HTTP_STATUS_CODE_PARTIAL_CONTENT=206,
   HTTP_STATUS_CODE_MULTI_STATUS=207,
   HTTP_STATUS_CODE_MOVED_PERMANENTLY=301,
   HTTP_STATUS_CODE_NOT_MODIFIED=304,
@@ -94,7 +114,9 @@ typedef enum {
   HTTP_STATUS_CODE_METHOD_NOT_ALLOWED=405,
   HTTP_STATUS_CODE_CONFLICT=409,
   HTTP_STATUS_CODE_PRECONDITION_FAILED=412,
+  HTTP_STATUS_CODE_URI_TOO_LONG=414,
   HTTP_STATUS_CODE_UNSUPPORTED_MEDIA_TYPE=415,
+  HTTP_STATUS_CODE_RANGE_NOT_SATISFIABLE=416,
   HTTP_STATUS_CODE_EXPECTATION_FAILED=417,
   HTTP_STATUS_CODE_LOCKED=423,
   HTTP_STATUS_CODE_INTERNAL_SERVER_ERROR=500,
@@ -153,6 +175,12 @@ NON_NULL_ARGS1(1)
 bool
 http_server_destroy(http_server_t http);
 
+/* requests whose request line plus headers are larger than `size` bytes
+   are rejected, the default is MAX_REQUEST_HEADERS_SIZE */
+NON_NULL_ARGS1(1)
+void
+http_server_set_max_request_headers_size(http_server_t http, size_t size);
+
 NON_NULL_ARGS1(1)
 bool
 http_server_start(http_server_t http);
@@ -180,6 +208,11 @@ NON_NULL_ARGS1(1)
 http_error_code_t
 http_request_force_connection_close(http_request_handle_t rh);
 
+/* the response headers must have either a "Content-Length" header or,
+   when the length of the body isn't known ahead of time,
+   a "Transfer-Encoding: chunked" header. in the latter case each
+   http_request_write() is sent as a chunk and the body ends
+   when the request ends */
 NON_NULL_ARGS3(1, 2, 3) void
 http_request_write_headers(http_request_handle_t rh,
 			   const HTTPResponseHeaders *response_headers,
@@ -191,6 +224,19 @@ http_request_write(http_request_handle_t rh,
 		   const void *buf, size_t nbyte,
 		   event_handler_t cb, void *cb_ud);
 
+/* same as http_request_write() except the body comes straight from
+   `nbyte` bytes of the file `fd` starting at `offset` */
+NON_NULL_ARGS2(1, 5) void
+http_request_sendfile(http_request_handle_t rh,
+                      int fd, uint64_t offset, size_t nbyte,
+                      event_handler_t cb, void *cb_ud);
+
+/* for handlers that can't finish a response they've started,
+   the connection is closed when the request ends instead of
+   completing the body, so the client knows it's truncated */
+NON_NULL_ARGS() void
+http_request_abort_response(http_request_handle_t rh);
+
 NON_NULL_ARGS() void
 http_request_end(http_request_handle_t rh);
 
@@ -203,6 +249,8 @@ http_response_init(HTTPResponseHeaders *rsp) {
   return true;
 }
 
+/* returns false if there are too many headers
+   or the formatted value is too long */
 NON_NULL_ARGS3(1, 2, 3) bool
 http_response_add_header(HTTPResponseHeaders *rsp, const char *name,
                          const char *value_fmt, ...);
@@ -226,6 +274,7 @@ http_response_set_code(HTTPResponseHeaders *rsp, http_status_code_t code) {
     SCS(HTTP_STATUS_CODE_OK, "OK");
     SCS(HTTP_STATUS_CODE_CREATED, "Created");
     SCS(HTTP_STATUS_CODE_NO_CONTENT, "No Content");
+    SCS(HTTP_STATUS_CODE_PARTIAL_CONTENT, "Partial Content");
     SCS(HTTP_STATUS_CODE_MULTI_STATUS, "Multi-Status");
     SCS(HTTP_STATUS_CODE_MOVED_PERMANENTLY, "Moved Permanently");
     SCS(HTTP_STATUS_CODE_NOT_MODIFIED, "Not Modified");
@@ -235,7 +284,9 @@ http_response_set_code(HTTPResponseHeaders *rsp, http_status_code_t code) {
     SCS(HTTP_STATUS_CODE_METHOD_NOT_ALLOWED, "Method Not Allowed");
     SCS(HTTP_STATUS_CODE_CONFLICT, "Conflict");
     SCS(HTTP_STATUS_CODE_PRECONDITION_FAILED, "Precondition Failed");
+    SCS(HTTP_STATUS_CODE_URI_TOO_LONG, "URI Too Long");
     SCS(HTTP_STATUS_CODE_UNSUPPORTED_MEDIA_TYPE, "Unsupported Media Type");
+    SCS(HTTP_STATUS_CODE_RANGE_NOT_SATISFIABLE, "Range Not Satisfiable");
     SCS(HTTP_STATUS_CODE_EXPECTATION_FAILED, "Expectation Failed");
     SCS(HTTP_STATUS_CODE_LOCKED, "Locked");
     SCS(HTTP_STATUS_CODE_INTERNAL_SERVER_ERROR, "Internal Server Error");
@@ -27,8 +27,10 @@
 #include <unistd.h>
 
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -50,12 +52,22 @@
 #include "webdav_backend.h"
 #include "webdav_backend_async_fuse.h"
 #include "webdav_server.h"
+#include "uthread_pool.h"
 #include "util.h"
 #include "util_sockets.h"
 
 ASSERT_SAME_IMPL(LOG_PRINTER_IMPL, LOG_PRINTER_STDIO_IMPL);
 ASSERT_SAME_IMPL(WEBDAV_BACKEND_IMPL, WEBDAV_BACKEND_ASYNC_FUSE_IMPL);
 
+enum {
+  DEFAULT_NUM_WORKER_THREADS = 4,
+  MAX_NUM_WORKER_THREADS = 256,
+  /* same as FUSE's default attr_timeout */
+  DEFAULT_ATTR_TIMEOUT_MS = 1000,
+  MAX_ATTR_TIMEOUT_MS = 24 * 60 * 60 * 1000,
+  LARGEST_MAX_REQUEST_HEADERS_SIZE = 16 * 1024 * 1024,
+};
+
 typedef struct {
   bool singlethread : 1;
 } FuseOptions;
@@ -65,6 +77,10 @@ typedef struct {
   char *listen_str;
   char *public_uri_root;
   char *internal_root;
+  size_t num_worker_threads;
+  uint64_t attr_timeout_ms;
+  /* 0 keeps the server's default */
+  size_t max_request_headers_size;
 } DavOptions;
 
 typedef struct {
@@ -72,6 +88,8 @@ typedef struct {
   char *listen_str;
   char *public_uri_root;
   char *internal_root;
+  uint64_t attr_timeout_ms;
+  size_t max_request_headers_size;
   event_loop_handle_t loop;
 } HTTPThreadArguments;
 
@@ -104,6 +122,56 @@ parse_environment(DavOptions *options) {
   options->listen_str = NULL;
   options->public_uri_root = davfuse_util_strdup("http://localhost:8080/");
   options->internal_root = davfuse_util_strdup("/");
+  options->num_worker_threads = DEFAULT_NUM_WORKER_THREADS;
+
+  const char *const num_threads_env = getenv("DAVFUSE_WORKER_THREADS");
+  if (num_threads_env) {
+    char *endptr;
+    errno = 0;
+    const long num_threads = strtol(num_threads_env, &endptr, 10);
+    if (errno || *endptr || endptr == num_threads_env ||
+        num_threads <= 0 || num_threads > MAX_NUM_WORKER_THREADS) {
+      log_critical("Bad DAVFUSE_WORKER_THREADS value: \"%s\"",
+                   num_threads_env);
+      return false;
+    }
+    options->num_worker_threads = num_threads;
+  }
+
+  /* in seconds, like the attr_timeout FUSE mount option */
+  options->attr_timeout_ms = DEFAULT_ATTR_TIMEOUT_MS;
+  const char *const attr_timeout_env = getenv("DAVFUSE_ATTR_TIMEOUT");
+  if (attr_timeout_env) {
+    char *endptr;
+    errno = 0;
+    const double attr_timeout = strtod(attr_timeout_env, &endptr);
+    if (errno || *endptr || endptr == attr_timeout_env ||
+        !(attr_timeout >= 0 && attr_timeout * 1000 <= MAX_ATTR_TIMEOUT_MS)) {
+      log_critical("Bad DAVFUSE_ATTR_TIMEOUT value: \"%s\"",
+                   attr_timeout_env);
+      return false;
+    }
+    options->attr_timeout_ms = attr_timeout * 1000;
+  }
+
+  /* in bytes, covers the request line plus all request headers */
+  options->max_request_headers_size = 0;
+  const char *const max_request_headers_size_env =
+    getenv("DAVFUSE_MAX_REQUEST_HEADERS_SIZE");
+  if (max_request_headers_size_env) {
+    char *endptr;
+    errno = 0;
+    const long max_request_headers_size =
+      strtol(max_request_headers_size_env, &endptr, 10);
+    if (errno || *endptr || endptr == max_request_headers_size_env ||
+        max_request_headers_size <= 0 ||
+        max_request_headers_size > LARGEST_MAX_REQUEST_HEADERS_SIZE) {
+      log_critical("Bad DAVFUSE_MAX_REQUEST_HEADERS_SIZE value: \"%s\"",
+                   max_request_headers_size_env);
+      return false;
+    }
+    options->max_request_headers_size = max_request_headers_size;
+  }
 
   return true;
 }
@@ -141,7 +209,8 @@ http_thread(void *ud) {
 
   /* create webdav backend */
   log_info("Create webdav server backend");
-  webdav_backend = webdav_backend_async_fuse_new(args->async_fuse_fs);
+  webdav_backend = webdav_backend_async_fuse_new(args->async_fuse_fs,
+                                                 args->attr_timeout_ms);
   if (!webdav_backend) {
     log_critical("Couldn't create WebDAV backend");
     goto done;
@@ -160,6 +229,11 @@ http_thread(void *ud) {
     goto done;
   }
 
+  if (args->max_request_headers_size) {
+    webdav_server_set_max_request_headers_size(wd_serv,
+                                               args->max_request_headers_size);
+  }
+
   bool success_server_start = webdav_server_start(wd_serv);
   if (!success_server_start) {
     log_critical("Couldn't start webdav server");
@@ -199,6 +273,8 @@ http_thread(void *ud) {
     abort();
   }
 
+  uthread_pool_drain();
+
   return NULL;
 }
 
@@ -323,10 +399,10 @@ fuse_main_real(int argc,
     goto error;
   }
 
-  if (!fuse_options.singlethread) {
-    log_critical("We only support single threaded mode right now");
-    goto error;
-  }
+  /* -s means the file system isn't thread-safe */
+  const size_t num_worker_threads = fuse_options.singlethread
+    ? 1
+    : dav_options.num_worker_threads;
 
   /* create event loop */
   log_info("Creating event loop");
@@ -352,6 +428,8 @@ fuse_main_real(int argc,
     .listen_str = dav_options.listen_str,
     .public_uri_root = dav_options.public_uri_root,
     .internal_root = dav_options.internal_root,
+    .attr_timeout_ms = dav_options.attr_timeout_ms,
+    .max_request_headers_size = dav_options.max_request_headers_size,
   };
   pthread_t new_thread;
   const int ret_pthread_create =
@@ -364,7 +442,8 @@ fuse_main_real(int argc,
 
   /* start fuse worker thread */
   log_info("Starting async FUSE worker main loop");
-  async_fuse_worker_main_loop(async_fuse_fs, op, op_size, user_data);
+  async_fuse_worker_main_loop(async_fuse_fs, op, op_size, user_data,
+                              num_worker_threads);
   log_info("FUSE main loop is done");
 
   /* wait on server thread to complete */
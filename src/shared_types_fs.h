@@ -45,6 +45,7 @@ typedef enum {
   FS_ERROR_CROSS_DEVICE,
   FS_ERROR_INVALID_ARG,
   FS_ERROR_NO_MEM,
+  FS_ERROR_NOT_SUPPORTED,
 } fs_error_t;
 
 typedef intmax_t fs_time_t;
@@ -17,8 +17,13 @@
  */
 
 #define _ISOC99_SOURCE
+/* for pread */
+#define _POSIX_C_SOURCE 200809L
 
 #include <fcntl.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include <signal.h>
 #include <stdbool.h>
@@ -62,3 +67,22 @@ bool ignore_sigpipe() {
   }
   return success;
 }
+
+socket_ssize_t
+sendfile_x(socket_t sock, int fd, uint64_t offset, size_t count) {
+#ifdef __linux__
+  off_t off = offset;
+  const ssize_t ret_sendfile = sendfile(sock, fd, &off, count);
+  /* EINVAL/ENOSYS mean this file can't be used with sendfile(),
+     just copy it ourselves */
+  if (ret_sendfile >= 0 || (errno != EINVAL && errno != ENOSYS)) {
+    return ret_sendfile;
+  }
+#endif
+
+  char buf[16 * 1024];
+  const ssize_t ret_pread = pread(fd, buf, MIN(count, sizeof(buf)), offset);
+  if (ret_pread <= 0) return ret_pread;
+
+  return send(sock, buf, ret_pread, 0);
+}
@@ -66,6 +66,17 @@ bool ignore_sigpipe() {
   return true;
 }
 
+socket_ssize_t
+sendfile_x(socket_t sock, int fd, uint64_t offset, size_t count) {
+  /* TODO: use TransmitFile() */
+  UNUSED(sock);
+  UNUSED(fd);
+  UNUSED(offset);
+  UNUSED(count);
+  WSASetLastError(WSAEOPNOTSUPP);
+  return SOCKET_ERROR;
+}
+
 const char *
 socket_error_message(socket_error_t err_code) {
   static wchar_t error_buf_wide[1024];
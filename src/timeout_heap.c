@@ -0,0 +1,134 @@
+/*
+  davfuse: FUSE file systems as WebDAV servers
+  Copyright (C) 2012, 2013 Rian Hunter <rian@alum.mit.edu>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <assert.h>
+#include <stdlib.h>
+
+#include "c_util.h"
+
+#include "timeout_heap.h"
+
+static bool
+entry_less_than(const TimeoutHeapEntry *a, const TimeoutHeapEntry *b) {
+  return (a->end_clock < b->end_clock ||
+          (a->end_clock == b->end_clock && a->seq < b->seq));
+}
+
+static void
+set_entry(TimeoutHeap *heap, size_t idx, TimeoutHeapEntry *entry) {
+  heap->entries[idx] = entry;
+  entry->heap_index = idx;
+}
+
+static void
+sift_up(TimeoutHeap *heap, size_t idx) {
+  TimeoutHeapEntry *const entry = heap->entries[idx];
+  while (idx) {
+    const size_t parent = (idx - 1) / 2;
+    if (!entry_less_than(entry, heap->entries[parent])) break;
+    set_entry(heap, idx, heap->entries[parent]);
+    idx = parent;
+  }
+  set_entry(heap, idx, entry);
+}
+
+static void
+sift_down(TimeoutHeap *heap, size_t idx) {
+  TimeoutHeapEntry *const entry = heap->entries[idx];
+  while (true) {
+    const size_t left = 2 * idx + 1;
+    if (left >= heap->size) break;
+
+    const size_t right = left + 1;
+    const size_t smallest =
+      (right < heap->size &&
+       entry_less_than(heap->entries[right], heap->entries[left]))
+      ? right
+      : left;
+
+    if (!entry_less_than(heap->entries[smallest], entry)) break;
+    set_entry(heap, idx, heap->entries[smallest]);
+    idx = smallest;
+  }
+  set_entry(heap, idx, entry);
+}
+
+void
+timeout_heap_init(TimeoutHeap *heap) {
+  *heap = (TimeoutHeap) {
+    .entries = NULL,
+    .size = 0,
+    .capacity = 0,
+    .next_seq = 0,
+  };
+}
+
+void
+timeout_heap_destroy(TimeoutHeap *heap) {
+  free(heap->entries);
+  timeout_heap_init(heap);
+}
+
+bool
+timeout_heap_push(TimeoutHeap *heap, TimeoutHeapEntry *entry) {
+  if (heap->size == heap->capacity) {
+    const size_t new_capacity = MAX(16, heap->capacity * 2);
+    TimeoutHeapEntry **const new_entries =
+      realloc(heap->entries, sizeof(*new_entries) * new_capacity);
+    if (!new_entries) return false;
+    heap->entries = new_entries;
+    heap->capacity = new_capacity;
+  }
+
+  entry->seq = heap->next_seq++;
+  heap->entries[heap->size] = entry;
+  heap->size += 1;
+  sift_up(heap, heap->size - 1);
+
+  return true;
+}
+
+void
+timeout_heap_remove(TimeoutHeap *heap, TimeoutHeapEntry *entry) {
+  const size_t idx = entry->heap_index;
+  assert(idx < heap->size && heap->entries[idx] == entry);
+
+  heap->size -= 1;
+  if (idx == heap->size) return;
+
+  /* move the last entry into the hole, it may need to go either way */
+  set_entry(heap, idx, heap->entries[heap->size]);
+  if (idx && entry_less_than(heap->entries[idx],
+                             heap->entries[(idx - 1) / 2])) {
+    sift_up(heap, idx);
+  }
+  else {
+    sift_down(heap, idx);
+  }
+}
+
+TimeoutHeapEntry *
+timeout_heap_peek(const TimeoutHeap *heap) {
+  return heap->size ? heap->entries[0] : NULL;
+}
+
+TimeoutHeapEntry *
+timeout_heap_pop(TimeoutHeap *heap) {
+  TimeoutHeapEntry *const entry = timeout_heap_peek(heap);
+  if (entry) timeout_heap_remove(heap, entry);
+  return entry;
+}
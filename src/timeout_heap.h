@@ -0,0 +1,75 @@
+/*
+  davfuse: FUSE file systems as WebDAV servers
+  Copyright (C) 2012, 2013 Rian Hunter <rian@alum.mit.edu>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _TIMEOUT_HEAP_H
+#define _TIMEOUT_HEAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* binary min-heap of timeouts ordered by deadline, shared by the
+   event loop implementations.
+   entries are owned by the caller and embedded in its own timeout
+   structure, the heap only stores pointers to them */
+
+typedef struct {
+  uint64_t end_clock;
+  /* breaks ties between equal deadlines so timeouts fire in the
+     order they were added */
+  uint64_t seq;
+  size_t heap_index;
+} TimeoutHeapEntry;
+
+typedef struct {
+  TimeoutHeapEntry **entries;
+  size_t size;
+  size_t capacity;
+  uint64_t next_seq;
+} TimeoutHeap;
+
+void
+timeout_heap_init(TimeoutHeap *heap);
+
+void
+timeout_heap_destroy(TimeoutHeap *heap);
+
+/* O(log n), `entry->end_clock` must already be set */
+bool
+timeout_heap_push(TimeoutHeap *heap, TimeoutHeapEntry *entry);
+
+/* O(log n), `entry` must currently be in `heap` */
+void
+timeout_heap_remove(TimeoutHeap *heap, TimeoutHeapEntry *entry);
+
+/* O(1), returns NULL if the heap is empty */
+TimeoutHeapEntry *
+timeout_heap_peek(const TimeoutHeap *heap);
+
+/* O(log n), returns NULL if the heap is empty */
+TimeoutHeapEntry *
+timeout_heap_pop(TimeoutHeap *heap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _TIMEOUT_HEAP_H */
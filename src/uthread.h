@@ -23,6 +23,7 @@
 
 #include "coroutine.h"
 #include "c_util.h"
+#include "uthread_pool.h"
 
 #define UTHR_DEFINE(name) void name(event_type_t __ev_type, void *__ev, void *__tctx)
 #define UTHR_DECLARE(name) UTHR_DEFINE(name)
@@ -42,8 +43,10 @@
 #define UTHR_YIELD(ctx, ret) CRYIELD(ctx->__coropos, (void) (ret))
 #define UTHR_RETURN(ctx, ret) \
   CRRETURN(ctx->__coropos,                                              \
-           ((void) ret, free(ctx)))
-#define UTHR_FREE(ctx) free(ctx)
+           ((void) ret, UTHR_FREE(ctx)))
+/* contexts come from the calling thread's uthread pool */
+#define UTHR_ALLOC(type) ((type *) uthread_pool_alloc(sizeof(type)))
+#define UTHR_FREE(ctx) uthread_pool_free(ctx, sizeof(*(ctx)))
 
 #define UTHR_RUN(coro, ctx)                     \
   do {                                          \
@@ -56,7 +59,7 @@
 
 #define UTHR_CALL(fn, type, init)               \
   do {                                          \
-    type *const __ctx = malloc(sizeof(*__ctx)); \
+    type *const __ctx = UTHR_ALLOC(type);       \
     if (!__ctx) { abort(); }                    \
     *__ctx = init;                              \
     UTHR_RUN(fn, __ctx);                        \
@@ -65,7 +68,7 @@
 
 #define _UTHR_CALL(fn, type, ...)               \
   do {                                          \
-    type *const __ctx = malloc(sizeof(*__ctx)); \
+    type *const __ctx = UTHR_ALLOC(type);       \
     if (!__ctx) { abort(); }                    \
     *__ctx = (type) {__VA_ARGS__};              \
     UTHR_RUN(fn, __ctx);                        \
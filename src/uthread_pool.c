@@ -0,0 +1,143 @@
+/*
+  davfuse: FUSE file systems as WebDAV servers
+  Copyright (C) 2012, 2013 Rian Hunter <rian@alum.mit.edu>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <stdlib.h>
+
+#include "c_util.h"
+#include "logging.h"
+
+#include "uthread_pool.h"
+
+enum {
+  /* classes go 64, 96, 128, 192, 256, ... up to 128 KiB,
+     big enough for the contexts that embed a transfer buffer */
+  UTHREAD_POOL_MIN_CLASS_SIZE = 64,
+  UTHREAD_POOL_NUM_CLASSES = 23,
+  /* a free list keeps at most this much memory idle... */
+  UTHREAD_POOL_MAX_IDLE_BYTES_PER_CLASS = 1024 * 1024,
+  /* ...but always at least this many blocks */
+  UTHREAD_POOL_MIN_IDLE_BLOCKS = 8,
+};
+
+struct _free_block {
+  struct _free_block *next;
+};
+
+typedef struct {
+  struct _free_block *head;
+  size_t num_blocks;
+} FreeList;
+
+typedef struct {
+  FreeList classes[UTHREAD_POOL_NUM_CLASSES];
+  UthreadPoolStats stats;
+} UthreadPool;
+
+static THREAD_LOCAL UthreadPool pool;
+
+/* returns UTHREAD_POOL_NUM_CLASSES if `size` is too big to pool */
+static size_t
+class_for_size(size_t size, size_t *class_size) {
+  size_t idx = 0;
+  size_t cur = UTHREAD_POOL_MIN_CLASS_SIZE;
+  while (cur < size && idx < UTHREAD_POOL_NUM_CLASSES) {
+    /* alternate between growing by 3/2 and by 4/3 */
+    cur = idx % 2 ? cur / 3 * 4 : cur / 2 * 3;
+    idx += 1;
+  }
+
+  *class_size = cur;
+  return idx;
+}
+
+static size_t
+max_idle_blocks(size_t class_size) {
+  return MAX((size_t) UTHREAD_POOL_MIN_IDLE_BLOCKS,
+             UTHREAD_POOL_MAX_IDLE_BYTES_PER_CLASS / class_size);
+}
+
+void *
+uthread_pool_alloc(size_t size) {
+  size_t class_size;
+  const size_t idx = class_for_size(size, &class_size);
+
+  pool.stats.allocs += 1;
+
+  if (idx < UTHREAD_POOL_NUM_CLASSES && pool.classes[idx].head) {
+    FreeList *const list = &pool.classes[idx];
+    struct _free_block *const block = list->head;
+    list->head = block->next;
+    list->num_blocks -= 1;
+    pool.stats.idle_bytes -= class_size;
+    return block;
+  }
+
+  pool.stats.mallocs += 1;
+  return malloc(idx < UTHREAD_POOL_NUM_CLASSES ? class_size : size);
+}
+
+void
+uthread_pool_free(void *ptr, size_t size) {
+  if (!ptr) return;
+
+  size_t class_size;
+  const size_t idx = class_for_size(size, &class_size);
+
+  pool.stats.frees += 1;
+
+  if (idx < UTHREAD_POOL_NUM_CLASSES &&
+      pool.classes[idx].num_blocks < max_idle_blocks(class_size)) {
+    FreeList *const list = &pool.classes[idx];
+    struct _free_block *const block = ptr;
+    block->next = list->head;
+    list->head = block;
+    list->num_blocks += 1;
+    pool.stats.idle_bytes += class_size;
+    return;
+  }
+
+  pool.stats.releases += 1;
+  free(ptr);
+}
+
+void
+uthread_pool_get_stats(UthreadPoolStats *stats) {
+  *stats = pool.stats;
+}
+
+void
+uthread_pool_drain(void) {
+  log_debug("uthread pool: %lu contexts allocated, %lu from malloc(), "
+            "%lu freed, %lu to free()",
+            (unsigned long) pool.stats.allocs,
+            (unsigned long) pool.stats.mallocs,
+            (unsigned long) pool.stats.frees,
+            (unsigned long) pool.stats.releases);
+
+  for (size_t i = 0; i < UTHREAD_POOL_NUM_CLASSES; ++i) {
+    FreeList *const list = &pool.classes[i];
+    while (list->head) {
+      struct _free_block *const next = list->head->next;
+      free(list->head);
+      list->head = next;
+    }
+    list->num_blocks = 0;
+  }
+
+  pool.stats.idle_bytes = 0;
+}
@@ -0,0 +1,74 @@
+/*
+  davfuse: FUSE file systems as WebDAV servers
+  Copyright (C) 2012, 2013 Rian Hunter <rian@alum.mit.edu>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _UTHREAD_POOL_H
+#define _UTHREAD_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* size-classed free lists backing UTHR_CALL() and UTHR_RETURN().
+
+   the lists are thread-local. an event loop and all the uthreads it
+   drives live on one thread, so each loop effectively gets its own
+   pool and nothing is locked. a context freed on another thread
+   than the one that allocated it just moves to that thread's pool.
+
+   blocks come straight from malloc() and carry no header, so a
+   pooled block can still be passed to free() */
+
+typedef struct {
+  /* contexts handed out */
+  uint64_t allocs;
+  /* ... of which had to come from malloc() */
+  uint64_t mallocs;
+  /* contexts given back */
+  uint64_t frees;
+  /* ... of which went to free() because their list was full
+     or they were too big to pool */
+  uint64_t releases;
+  /* currently sitting in the free lists */
+  size_t idle_bytes;
+} UthreadPoolStats;
+
+/* returns NULL on failure */
+void *
+uthread_pool_alloc(size_t size);
+
+/* `size` must be the size `ptr` was allocated with */
+void
+uthread_pool_free(void *ptr, size_t size);
+
+/* counters for the calling thread */
+void
+uthread_pool_get_stats(UthreadPoolStats *stats);
+
+/* frees the calling thread's idle blocks, call before a thread
+   that ran uthreads exits */
+void
+uthread_pool_drain(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _UTHREAD_POOL_H */
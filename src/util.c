@@ -16,10 +16,16 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 
+#ifndef _WIN32
+/* for gmtime_r() */
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "c_util.h"
 #include "util.h"
@@ -191,6 +197,15 @@ strndup_x(const char *s, size_t n) {
   return toret;
 }
 
+struct tm *
+gmtime_x(const time_t *timep, struct tm *result) {
+#ifdef _WIN32
+  return gmtime_s(result, timep) ? NULL : result;
+#else
+  return gmtime_r(timep, result);
+#endif
+}
+
 char *
 super_strcat(const char *first, ...) {
   va_list ap;
@@ -29,6 +29,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 
 #include "c_util.h"
 #include "events.h"
@@ -100,6 +101,10 @@ davfuse_util_strdup(const char *s);
 PURE_FUNCTION char *
 strndup_x(const char *s, size_t n);
 
+/* gmtime() that's safe to call from multiple threads */
+struct tm *
+gmtime_x(const time_t *timep, struct tm *result);
+
 HEADER_FUNCTION CONST_FUNCTION char
 ascii_to_lower(char a) {
   enum {
@@ -20,6 +20,7 @@
 
 #include "util_event_loop.h"
 
+#include "c_util.h"
 #include "events.h"
 #include "sockets.h"
 #include "logging.h"
@@ -27,6 +28,29 @@
 #include "util.h"
 #include "util_sockets.h"
 
+enum {
+  /* i/o that is ready right away completes inline until this many
+     completion callbacks are nested, then one trip through the
+     event loop unwinds the stack */
+  UTIL_EVENT_LOOP_MAX_INLINE_DEPTH = 16,
+};
+
+/* completion callbacks currently on this thread's stack,
+   an event loop and its handlers all run on one thread */
+static THREAD_LOCAL unsigned callback_depth;
+
+static bool
+_should_unwind_stack(void) {
+  return callback_depth >= UTIL_EVENT_LOOP_MAX_INLINE_DEPTH;
+}
+
+static void
+_run_callback(event_handler_t cb, event_type_t ev_type, void *ev, void *ud) {
+  callback_depth += 1;
+  cb(ev_type, ev, ud);
+  callback_depth -= 1;
+}
+
 typedef struct {
   UTHR_CTX_BASE;
   /* args */
@@ -53,15 +77,13 @@ UTHR_DEFINE(_util_event_loop_socket_read_uthr) {
   while (true) {
     ctx->ret = recv(ctx->sock, ctx->buf, ctx->nbyte, 0);
     if (ctx->ret != SOCKET_ERROR) {
-      /* set a 0-timeout to reset stack
-         this is roughly okay because system reads are implicitly expensive */
-      EventLoopTimeout timeout = {0, 0};
-      bool success_wait = event_loop_timeout_add(ctx->loop, &timeout,
-                                                 _util_event_loop_socket_read_uthr, ctx,
-                                                 NULL);
-      if (!success_wait) log_warning("Couldn't set up stack-reset timeout");
-      else {
-        UTHR_YIELD(ctx, 0);
+      if (_should_unwind_stack()) {
+        bool success_defer =
+          event_loop_defer(ctx->loop, _util_event_loop_socket_read_uthr, ctx);
+        if (!success_defer) log_warning("Couldn't defer to reset stack");
+        else {
+          UTHR_YIELD(ctx, 0);
+        }
       }
       break;
     }
@@ -155,8 +177,8 @@ UTHR_DEFINE(_util_event_loop_socket_read_uthr) {
     .nbyte = (size_t) ctx->ret,
   };
   UTHR_RETURN(ctx,
-              ctx->cb(UTIL_EVENT_LOOP_SOCKET_READ_DONE_EVENT,
-                      &ev, ctx->cb_ud));
+              _run_callback(ctx->cb, UTIL_EVENT_LOOP_SOCKET_READ_DONE_EVENT,
+                            &ev, ctx->cb_ud));
 
   UTHR_FOOTER();
 }
@@ -199,15 +221,12 @@ typedef struct {
 UTHR_DEFINE(_util_event_loop_write_uthr) {
   UTHR_HEADER(SocketWriteCtx, state);
 
-  /* set a 0-timeout to reset stack
-     this is roughly okay because system writes are implicitly expensive */
-  EventLoopTimeout timeout = {0, 0};
-  bool success_wait = event_loop_timeout_add(state->loop, &timeout,
-                                             _util_event_loop_write_uthr, state,
-                                             NULL);
-  if (!success_wait) log_warning("Couldn't set up stack-reset timeout");
-  else {
-    UTHR_YIELD(state, 0);
+  if (_should_unwind_stack()) {
+    bool success_defer = event_loop_defer(state->loop, _util_event_loop_write_uthr, state);
+    if (!success_defer) log_warning("Couldn't defer to reset stack");
+    else {
+      UTHR_YIELD(state, 0);
+    }
   }
 
   state->buf_loc = state->buf;
@@ -256,8 +275,8 @@ UTHR_DEFINE(_util_event_loop_write_uthr) {
     .nbyte = state->nbyte - state->count_left,
   };
   UTHR_RETURN(state,
-              state->cb(UTIL_EVENT_LOOP_SOCKET_WRITE_DONE_EVENT,
-                        &ev, state->cb_ud));
+              _run_callback(state->cb, UTIL_EVENT_LOOP_SOCKET_WRITE_DONE_EVENT,
+                            &ev, state->cb_ud));
 
   UTHR_FOOTER();
 }
@@ -276,3 +295,101 @@ util_event_loop_socket_write(event_loop_handle_t loop,
              .cb = cb,
              .cb_ud = cb_ud);
 }
+
+typedef struct {
+  UTHR_CTX_BASE;
+  /* args */
+  event_loop_handle_t loop;
+  socket_t sock;
+  int fd;
+  uint64_t offset;
+  size_t nbyte;
+  event_handler_t cb;
+  void *cb_ud;
+  /* state */
+  size_t count_left;
+} SocketSendfileCtx;
+
+UTHR_DEFINE(_util_event_loop_sendfile_uthr) {
+  UTHR_HEADER(SocketSendfileCtx, state);
+
+  if (_should_unwind_stack()) {
+    bool success_defer = event_loop_defer(state->loop, _util_event_loop_sendfile_uthr, state);
+    if (!success_defer) log_warning("Couldn't defer to reset stack");
+    else {
+      UTHR_YIELD(state, 0);
+    }
+  }
+
+  state->count_left = state->nbyte;
+
+  socket_ssize_t ret;
+  while (state->count_left) {
+    ret = sendfile_x(state->sock, state->fd,
+                     state->offset, state->count_left);
+    if (ret == SOCKET_ERROR) {
+      if (last_socket_error() == SOCKET_EAGAIN) {
+        bool success_watch =
+          event_loop_socket_watch_add(state->loop,
+                                      state->sock,
+                                      create_stream_events(false, true),
+                                      _util_event_loop_sendfile_uthr,
+                                      state,
+                                      NULL);
+        if (!success_watch) {
+          log_error("Couldn't add fdevent watch!");
+          break;
+        }
+        else {
+          UTHR_YIELD(state, 0);
+          UTHR_RECEIVE_EVENT(EVENT_LOOP_SOCKET_EVENT, EventLoopSocketEvent, socket_ev);
+          if (socket_ev->error) {
+            log_error("error during socket watch");
+            break;
+          } else continue;
+        }
+      }
+      else {
+        log_error("Error while calling sendfile_x(): %d",
+                  last_socket_error());
+        break;
+      }
+    }
+
+    if (!ret) {
+      log_error("File ended with %lu bytes left to send",
+                (unsigned long) state->count_left);
+      break;
+    }
+
+    assert(state->count_left >= (size_t) ret);
+    state->count_left -= ret;
+    state->offset += ret;
+  }
+
+  UtilEventLoopSocketWriteDoneEvent ev = {
+    .error = state->count_left,
+    .nbyte = state->nbyte - state->count_left,
+  };
+  UTHR_RETURN(state,
+              _run_callback(state->cb, UTIL_EVENT_LOOP_SOCKET_WRITE_DONE_EVENT,
+                            &ev, state->cb_ud));
+
+  UTHR_FOOTER();
+}
+
+void
+util_event_loop_socket_sendfile(event_loop_handle_t loop,
+                                socket_t sock,
+                                int fd, uint64_t offset, size_t nbyte,
+                                event_handler_t cb,
+                                void *cb_ud) {
+  UTHR_CALL7(_util_event_loop_sendfile_uthr, SocketSendfileCtx,
+             .loop = loop,
+             .sock = sock,
+             .fd = fd,
+             .offset = offset,
+             .nbyte = nbyte,
+             .cb = cb,
+             .cb_ud = cb_ud);
+}
@@ -19,6 +19,8 @@
 #ifndef _UTIL_EVENT_LOOP_H
 #define _UTIL_EVENT_LOOP_H
 
+#include <stdint.h>
+
 #include "coroutine_io.h"
 #include "event_loop.h"
 #include "sockets.h"
@@ -45,6 +47,16 @@ util_event_loop_socket_write(event_loop_handle_t loop,
                              event_handler_t cb,
                              void *cb_ud);
 
+/* like util_event_loop_socket_write() but the data comes from
+   `nbyte` bytes of the file `fd` starting at `offset`,
+   it's an error if the file ends early */
+void
+util_event_loop_socket_sendfile(event_loop_handle_t loop,
+                                socket_t sock,
+                                int fd, uint64_t offset, size_t nbyte,
+                                event_handler_t cb,
+                                void *cb_ud);
+
 #ifdef __cplusplus
 }
 #endif
@@ -22,6 +22,7 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "dfs.h"
@@ -47,6 +48,7 @@ util_fs_strerror(fs_error_t error) {
     M(FS_ERROR_ACCESS, "Access Denied");
     M(FS_ERROR_INVALID_ARG, "Invalid Argument");
     M(FS_ERROR_NO_MEM, "No memory");
+    M(FS_ERROR_NOT_SUPPORTED, "Not supported");
   default:
     return "Unknown error";
   }
@@ -124,11 +126,8 @@ util_fs_touch(fs_handle_t fs, const char *file_path, bool *created) {
   return ret_open;
 }
 
-static linked_list_t
-_rm_tree_expand(void *ud, void *node, linked_list_t ll) {
-  const fs_handle_t fs = (fs_handle_t) ud;
-  char *const path = (char *) node;
-
+linked_list_t
+util_fs_prepend_children(fs_handle_t fs, const char *path, linked_list_t ll) {
   fs_directory_handle_t dir_handle;
   const fs_error_t ret_opendir = fs_opendir(fs, path, &dir_handle);
   if (ret_opendir) {
@@ -169,6 +168,11 @@ _rm_tree_expand(void *ud, void *node, linked_list_t ll) {
   return ll;
 }
 
+static linked_list_t
+_rm_tree_expand(void *ud, void *node, linked_list_t ll) {
+  return util_fs_prepend_children((fs_handle_t) ud, (char *) node, ll);
+}
+
 linked_list_t
 util_fs_rmtree(fs_handle_t fs, const char *fpath_) {
   linked_list_t failed_to_delete = LINKED_LIST_INITIALIZER;
@@ -209,10 +213,11 @@ util_fs_copyfile(fs_handle_t fs,
                  const char *from_path,
                  const char *to_path) {
   enum {
-    BUF_SIZE=2 << 5,
+    BUF_SIZE=64 * 1024,
   };
   fs_file_handle_t src_handle = (fs_file_handle_t) 0;
   fs_file_handle_t dst_handle = (fs_file_handle_t) 0;
+  char *buffer = NULL;
   fs_error_t toret;
 
   const bool create = false;
@@ -227,20 +232,39 @@ util_fs_copyfile(fs_handle_t fs,
   const fs_error_t ret_open_2 =
     fs_open(fs, to_path, create2, &dst_handle, NULL);
   if (ret_open_2) {
-    toret = ret_open;
+    toret = ret_open_2;
+    goto done;
+  }
+
+  /* the destination may have existed */
+  const fs_error_t ret_truncate = fs_ftruncate(fs, dst_handle, 0);
+  if (ret_truncate) {
+    toret = ret_truncate;
+    goto done;
+  }
+
+  /* let the file system copy it if it knows a faster way */
+  const fs_error_t ret_copyfile = fs_copyfile(fs, src_handle, dst_handle);
+  if (ret_copyfile != FS_ERROR_NOT_SUPPORTED) {
+    toret = ret_copyfile;
+    goto done;
+  }
+
+  buffer = malloc(BUF_SIZE);
+  if (!buffer) {
+    toret = FS_ERROR_NO_MEM;
     goto done;
   }
 
   fs_off_t offset = 0;
   while (true) {
-    char buffer[BUF_SIZE];
     /* need to initialize `amt` to avoid spurious
        -Wmaybe-uninitialized warnings from GCC */
     size_t amt = 0;
     const fs_error_t ret_read =
-      fs_read(fs, src_handle, buffer, sizeof(buffer), offset, &amt);
+      fs_read(fs, src_handle, buffer, BUF_SIZE, offset, &amt);
     if (ret_read) {
-      toret = ret_open;
+      toret = ret_read;
       goto done;
     }
 
@@ -259,7 +283,7 @@ util_fs_copyfile(fs_handle_t fs,
                  buffer + written, amt - written,
                  offset + written, &just_wrote);
       if (ret_write) {
-        toret = ret_open;
+        toret = ret_write;
         goto done;
       }
       written += just_wrote;
@@ -271,6 +295,8 @@ util_fs_copyfile(fs_handle_t fs,
   toret = FS_ERROR_SUCCESS;
 
  done:
+  free(buffer);
+
   if (src_handle) {
     util_fs_close_or_abort(fs, src_handle);
   }
@@ -282,10 +308,10 @@ util_fs_copyfile(fs_handle_t fs,
   return toret;
 }
 
-static char *
-reparent_path(fs_handle_t fs,
-              const char *from_path, const char *to_path,
-              const char *to_transform) {
+char *
+util_fs_path_reparent(fs_handle_t fs,
+                      const char *from_path, const char *to_path,
+                      const char *to_transform) {
   char *p = NULL;
   char *new_path = NULL;
   linked_list_t ll = (linked_list_t) 0;
@@ -358,7 +384,7 @@ util_fs_copytree(fs_handle_t fs,
       goto done;
     }
 
-    dest_path = reparent_path(fs, from_path, to_path, path);
+    dest_path = util_fs_path_reparent(fs, from_path, to_path, path);
     log_debug("Copying %s to %s", path, dest_path);
 
     bool copy_success;
@@ -407,7 +433,7 @@ util_fs_copytree(fs_handle_t fs,
                      _rm_tree_expand, dfs_ignore_user_data_free,
                      (void *) fs);
     while ((path = dfs_next(dfs))) {
-      char *dest_path = reparent_path(fs, from_path, to_path, path);
+      char *dest_path = util_fs_path_reparent(fs, from_path, to_path, path);
       bool path_is_dir, dest_path_is_dir;
       const fs_error_t is_dir_ret_1 = util_fs_file_is_dir(fs, path, &path_is_dir);
       const fs_error_t is_dir_ret_2 = util_fs_file_is_dir(fs, path, &dest_path_is_dir);
@@ -46,6 +46,11 @@ util_fs_file_is_dir(fs_handle_t fs, const char *path, bool *is_dir);
 fs_error_t
 util_fs_touch(fs_handle_t fs, const char *path, bool *created);
 
+/* prepends the paths of the entries in the directory at `path` to `ll`,
+   `ll` is returned unchanged if `path` isn't a directory */
+linked_list_t
+util_fs_prepend_children(fs_handle_t fs, const char *path, linked_list_t ll);
+
 linked_list_t
 util_fs_rmtree(fs_handle_t fs, const char *path);
 
@@ -74,6 +79,13 @@ bool
 util_fs_path_is_parent(fs_handle_t fs,
                        const char *a, const char *b);
 
+/* maps `path`, which is `from_path` or a descendant of it,
+   to the corresponding path under `to_path` */
+char *
+util_fs_path_reparent(fs_handle_t fs,
+                      const char *from_path, const char *to_path,
+                      const char *path);
+
 char *
 util_fs_path_join(fs_handle_t fs, const char *path, const char *name);
 
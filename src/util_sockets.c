@@ -16,6 +16,11 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 
+/* for SO_REUSEPORT, glibc hides it in strict c99 mode */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
 #include "util_sockets.h"
 
 #include "sockets.h"
@@ -37,8 +42,9 @@ init_sockaddr_in(struct sockaddr_in *addr, ipv4_t ip, port_t port) {
   addr->sin_addr.s_addr = htonl(ip);
 }
 
-socket_t
-create_bound_socket(const struct sockaddr *addr, socklen_t addr_len) {
+static socket_t
+_create_bound_socket(const struct sockaddr *addr, socklen_t addr_len,
+                     bool reuse_port) {
   int ret;
   socket_t socket_fd = INVALID_SOCKET;
 
@@ -56,6 +62,20 @@ create_bound_socket(const struct sockaddr *addr, socklen_t addr_len) {
     goto error;
   }
 
+  if (reuse_port) {
+#ifdef SO_REUSEPORT
+    ret = setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT,
+                     (void *) &reuse, sizeof(reuse));
+    if (ret) {
+      log_error("setsockopt: %s", last_socket_error_message());
+      goto error;
+    }
+#else
+    log_error("SO_REUSEPORT isn't supported on this platform");
+    goto error;
+#endif
+  }
+
   ret = bind(socket_fd, addr, addr_len);
   if (ret) {
     log_error("bind: %s", last_socket_error_message());
@@ -79,6 +99,16 @@ create_bound_socket(const struct sockaddr *addr, socklen_t addr_len) {
   return -1;
 }
 
+socket_t
+create_bound_socket(const struct sockaddr *addr, socklen_t addr_len) {
+  return _create_bound_socket(addr, addr_len, false);
+}
+
+socket_t
+create_reuseport_bound_socket(const struct sockaddr *addr, socklen_t addr_len) {
+  return _create_bound_socket(addr, addr_len, true);
+}
+
 socket_t
 create_ipv4_bound_socket(ipv4_t ip, port_t port) {
   struct sockaddr_in listen_addr;
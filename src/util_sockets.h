@@ -49,6 +49,13 @@ init_sockaddr_in(struct sockaddr_in *addr, ipv4_t ip, port_t port);
 socket_t
 create_bound_socket(const struct sockaddr *addr, socklen_t address_len);
 
+/* like create_bound_socket() but other sockets created with this
+   can listen on the same address, the kernel balances
+   incoming connections between them.
+   fails where SO_REUSEPORT isn't supported */
+socket_t
+create_reuseport_bound_socket(const struct sockaddr *addr, socklen_t address_len);
+
 socket_t
 create_ipv4_bound_socket(ipv4_t ip, port_t port);
 
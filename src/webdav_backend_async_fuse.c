@@ -23,6 +23,7 @@
 
 #include "async_fuse_fs.h"
 #include "async_fuse_fs_helpers.h"
+#include "attr_cache.h"
 #include "uthread.h"
 #include "util.h"
 #include "webdav_server.h"
@@ -31,10 +32,14 @@
 
 enum {
   TRANSFER_BUF_SIZE = 4096,
+  ATTR_CACHE_MAX_ENTRIES = 16384,
 };
 
 typedef struct _webdav_backend_async_fuse {
   async_fuse_fs_t fuse_fs;
+  /* only used for PROPFIND, everything that modifies the file system
+     through us invalidates the paths it touched */
+  attr_cache_t attr_cache;
 } WebdavBackendAsyncFuse;
 
 static char *
@@ -212,6 +217,15 @@ UTHR_DEFINE(_fuse_copy_move_uthr) {
   err = WEBDAV_ERROR_NONE;
 
  done:
+  /* even failed operations may have changed something */
+  if (ctx->destination_path) {
+    attr_cache_invalidate(ctx->fbctx->attr_cache, ctx->destination_path);
+  }
+
+  if (ctx->is_move && ctx->file_path) {
+    attr_cache_invalidate(ctx->fbctx->attr_cache, ctx->file_path);
+  }
+
   free(ctx->file_path);
   free(ctx->destination_path);
   free(ctx->destination_path_copy);
@@ -308,6 +322,8 @@ UTHR_DEFINE(_fuse_delete_uthr) {
     .failed_to_delete = rmtree_done_ev->failed_to_delete,
   };
 
+  attr_cache_invalidate(ctx->fbctx->attr_cache, ctx->file_path);
+
  done:
   free(ctx->file_path);
 
@@ -333,6 +349,8 @@ typedef struct {
   /* args */
   WebdavBackendAsyncFuse *fbctx;
   const char *relative_uri;
+  webdav_resource_size_t range_start;
+  webdav_resource_size_t range_length;
   webdav_get_request_ctx_t get_ctx;
   /* ctx */
   struct fuse_file_info fi;
@@ -342,6 +360,7 @@ typedef struct {
   struct stat st;
   char buf[TRANSFER_BUF_SIZE];
   off_t offset;
+  size_t amount_left;
   int amount_read;
 } FuseGetCtx;
 
@@ -407,12 +426,20 @@ UTHR_DEFINE(_fuse_get_uthr) {
     goto done;
   }
 
-  ctx->offset = 0;
-  while (true) {
+  /* only send the part of the file that was asked for */
+  ctx->amount_left = 0;
+  if ((uintmax_t) ctx->st.st_size > ctx->range_start) {
+    ctx->amount_left =
+      MIN((uintmax_t) ctx->st.st_size - ctx->range_start, ctx->range_length);
+  }
+
+  ctx->offset = ctx->range_start;
+  while (ctx->amount_left) {
     UTHR_SUBCALL(ctx,
                  async_fuse_fs_read(ctx->fbctx->fuse_fs,
                                     ctx->path,
-                                    ctx->buf, sizeof(ctx->buf),
+                                    ctx->buf,
+                                    MIN(sizeof(ctx->buf), ctx->amount_left),
                                     ctx->offset, &ctx->fi,
                                     _fuse_get_uthr, ctx),
                  ASYNC_FUSE_FS_READ_DONE_EVENT,
@@ -442,9 +469,11 @@ UTHR_DEFINE(_fuse_get_uthr) {
     }
 
     ctx->offset += ctx->amount_read;
+    ctx->amount_left -= ctx->amount_read;
   }
 
-  log_debug("We sent a total of %jd bytes", (intmax_t) ctx->offset);
+  log_debug("We sent a total of %jd bytes",
+            (intmax_t) (ctx->offset - ctx->range_start));
   ctx->error = WEBDAV_ERROR_NONE;
 
  done:
@@ -479,9 +508,13 @@ UTHR_DEFINE(_fuse_get_uthr) {
 void
 webdav_backend_async_fuse_get(webdav_backend_async_fuse_t backend_ctx,
                               const char *relative_uri,
+                              webdav_resource_size_t offset,
+                              webdav_resource_size_t length,
                               webdav_get_request_ctx_t get_ctx) {
-  UTHR_CALL3(_fuse_get_uthr, FuseGetCtx,
+  UTHR_CALL5(_fuse_get_uthr, FuseGetCtx,
              .fbctx = backend_ctx,
+             .range_start = offset,
+             .range_length = length,
              .relative_uri = relative_uri,
              .get_ctx = get_ctx);
 }
@@ -538,6 +571,10 @@ UTHR_DEFINE(_fuse_mkcol_uthr) {
     ctx->ev.error = WEBDAV_ERROR_GENERAL;
   }
 
+  if (!ctx->ev.error) {
+    attr_cache_invalidate(ctx->fbctx->attr_cache, ctx->path);
+  }
+
  done:
   free(ctx->path);
 
@@ -581,7 +618,8 @@ create_propfind_entry_from_stat(const char *relative_uri, struct stat *st) {
                                    /* mod_dav from apache also uses mtime as creation time */
                                    st->st_mtime,
                                    S_ISDIR(st->st_mode),
-                                   st->st_size);
+                                   st->st_size,
+                                   st->st_ino);
 }
 
 typedef struct {
@@ -603,6 +641,7 @@ typedef struct {
   char *file_path;
   size_t file_path_len;
   struct stat scratch_st;
+  attr_cache_generation_t attr_cache_generation;
 } FusePropfindCtx;
 
 static int
@@ -702,9 +741,51 @@ UTHR_DEFINE(_fuse_propfind_uthr) {
     /* now for every path in ctx->to_getattr, add the info */
     for (ctx->to_getattr_iter = ctx->to_getattr; ctx->to_getattr_iter;
          ctx->to_getattr_iter = ctx->to_getattr_iter->next) {
+      const bool is_cached =
+        attr_cache_lookup(ctx->fbctx->attr_cache,
+                          ctx->to_getattr_iter->elt, &ctx->scratch_st);
+      if (!is_cached) {
+        ctx->attr_cache_generation =
+          attr_cache_generation(ctx->fbctx->attr_cache);
+        UTHR_SUBCALL(ctx,
+                     async_fuse_fs_getattr(ctx->fbctx->fuse_fs,
+                                           ctx->to_getattr_iter->elt,
+                                           &ctx->scratch_st,
+                                           _fuse_propfind_uthr, ctx),
+                     ASYNC_FUSE_FS_GETATTR_DONE_EVENT,
+                     FuseFsOpDoneEvent,
+                     getattr_done_ev);
+        if (getattr_done_ev->ret < 0) {
+          log_info("Couldn't do getattr on \"%s\": %s",
+                   (char *) ctx->to_getattr_iter->elt,
+                   strerror(-getattr_done_ev->ret));
+          ctx->ev.error = WEBDAV_ERROR_GENERAL;
+          goto done;
+        }
+
+        attr_cache_insert(ctx->fbctx->attr_cache,
+                          ctx->to_getattr_iter->elt, &ctx->scratch_st,
+                          ctx->attr_cache_generation);
+      }
+
+      webdav_propfind_entry_t pfe =
+        create_propfind_entry_from_stat(ctx->to_getattr_iter->elt,
+                                        &ctx->scratch_st);
+      ASSERT_TRUE(pfe);
+      ctx->ev.entries = linked_list_prepend(ctx->ev.entries, pfe);
+    }
+  }
+  else {
+    /* if no depth is request, then just check this one path */
+    const bool is_cached =
+      attr_cache_lookup(ctx->fbctx->attr_cache,
+                        ctx->file_path, &ctx->scratch_st);
+    if (!is_cached) {
+      ctx->attr_cache_generation =
+        attr_cache_generation(ctx->fbctx->attr_cache);
       UTHR_SUBCALL(ctx,
                    async_fuse_fs_getattr(ctx->fbctx->fuse_fs,
-                                         ctx->to_getattr_iter->elt,
+                                         ctx->file_path,
                                          &ctx->scratch_st,
                                          _fuse_propfind_uthr, ctx),
                    ASYNC_FUSE_FS_GETATTR_DONE_EVENT,
@@ -712,36 +793,16 @@ UTHR_DEFINE(_fuse_propfind_uthr) {
                    getattr_done_ev);
       if (getattr_done_ev->ret < 0) {
         log_info("Couldn't do getattr on \"%s\": %s",
-                 (char *) ctx->to_getattr_iter->elt,
-                 strerror(-getattr_done_ev->ret));
-        ctx->ev.error = WEBDAV_ERROR_GENERAL;
+                 ctx->file_path, strerror(-getattr_done_ev->ret));
+        ctx->ev.error = -getattr_done_ev->ret == ENOENT
+          ? WEBDAV_ERROR_DOES_NOT_EXIST
+          : WEBDAV_ERROR_GENERAL;
         goto done;
       }
 
-      webdav_propfind_entry_t pfe =
-        create_propfind_entry_from_stat(ctx->to_getattr_iter->elt,
-                                        &ctx->scratch_st);
-      ASSERT_TRUE(pfe);
-      ctx->ev.entries = linked_list_prepend(ctx->ev.entries, pfe);
-    }
-  }
-  else {
-    /* if no depth is request, then just check this one path */
-    UTHR_SUBCALL(ctx,
-                 async_fuse_fs_getattr(ctx->fbctx->fuse_fs,
-                                       ctx->file_path,
-                                       &ctx->scratch_st,
-                                       _fuse_propfind_uthr, ctx),
-                 ASYNC_FUSE_FS_GETATTR_DONE_EVENT,
-                 FuseFsOpDoneEvent,
-                 getattr_done_ev);
-    if (getattr_done_ev->ret < 0) {
-      log_info("Couldn't do getattr on \"%s\": %s",
-               ctx->file_path, strerror(-getattr_done_ev->ret));
-      ctx->ev.error = -getattr_done_ev->ret == ENOENT
-        ? WEBDAV_ERROR_DOES_NOT_EXIST
-        : WEBDAV_ERROR_GENERAL;
-      goto done;
+      attr_cache_insert(ctx->fbctx->attr_cache,
+                        ctx->file_path, &ctx->scratch_st,
+                        ctx->attr_cache_generation);
     }
 
     webdav_propfind_entry_t pfe =
@@ -907,6 +968,10 @@ UTHR_DEFINE(_fuse_put_uthr) {
     }
   }
 
+  if (ctx->file_path) {
+    attr_cache_invalidate(ctx->fbctx->attr_cache, ctx->file_path);
+  }
+
   free(ctx->file_path);
 
   UTHR_RETURN(ctx,
@@ -966,6 +1031,10 @@ UTHR_DEFINE(_fuse_touch_uthr) {
     .resource_existed = mknod_done_ev->ret,
   };
 
+  if (!ctx->ev.resource_existed) {
+    attr_cache_invalidate(ctx->fbctx->attr_cache, ctx->file_path);
+  }
+
  done:
   free(ctx->file_path);
 
@@ -987,14 +1056,22 @@ webdav_backend_async_fuse_touch(webdav_backend_async_fuse_t backend_ctx,
 }
 
 webdav_backend_async_fuse_t
-webdav_backend_async_fuse_new(async_fuse_fs_t fs) {
+webdav_backend_async_fuse_new(async_fuse_fs_t fs, uint64_t attr_timeout_ms) {
   WebdavBackendAsyncFuse *ret = malloc(sizeof(*ret));
   if (!ret) {
     return NULL;
   }
 
+  attr_cache_t attr_cache =
+    attr_cache_new(attr_timeout_ms, ATTR_CACHE_MAX_ENTRIES);
+  if (!attr_cache) {
+    free(ret);
+    return NULL;
+  }
+
   *ret = (WebdavBackendAsyncFuse) {
     .fuse_fs = fs,
+    .attr_cache = attr_cache,
   };
 
   return ret;
@@ -1002,6 +1079,7 @@ webdav_backend_async_fuse_new(async_fuse_fs_t fs) {
 
 bool
 webdav_backend_async_fuse_destroy(webdav_backend_async_fuse_t backend) {
+  attr_cache_destroy(backend->attr_cache);
   free(backend);
   return true;
 }
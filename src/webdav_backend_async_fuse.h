@@ -19,6 +19,8 @@
 #ifndef _WEBDAV_BACKEND_ASYNC_FUSE_H
 #define _WEBDAV_BACKEND_ASYNC_FUSE_H
 
+#include <stdint.h>
+
 #include "async_fuse_fs.h"
 #include "iface_util.h"
 #include "_webdav_server_types.h"
@@ -31,8 +33,9 @@ struct _webdav_backend_async_fuse;
 
 typedef struct _webdav_backend_async_fuse *webdav_backend_async_fuse_t;
 
+/* PROPFIND results are cached for `attr_timeout_ms`, 0 turns that off */
 webdav_backend_async_fuse_t
-webdav_backend_async_fuse_new(async_fuse_fs_t fs);
+webdav_backend_async_fuse_new(async_fuse_fs_t fs, uint64_t attr_timeout_ms);
 
 bool
 webdav_backend_async_fuse_destroy(webdav_backend_async_fuse_t backend);
@@ -40,6 +43,8 @@ webdav_backend_async_fuse_destroy(webdav_backend_async_fuse_t backend);
 void
 webdav_backend_async_fuse_get(webdav_backend_async_fuse_t backend,
                               const char *relative_uri,
+                              webdav_resource_size_t offset,
+                              webdav_resource_size_t length,
                               webdav_get_request_ctx_t get_ctx);
 
 void
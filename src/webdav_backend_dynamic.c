@@ -48,8 +48,10 @@ webdav_backend_destroy(webdav_backend_t fs) {
 void
 webdav_backend_get(webdav_backend_t fs,
                    const char *relative_uri,
+                   webdav_resource_size_t offset,
+                   webdav_resource_size_t length,
                    webdav_get_request_ctx_t get_ctx) {
-  return fs->op->get(fs->user_data, relative_uri, get_ctx);
+  return fs->op->get(fs->user_data, relative_uri, offset, length, get_ctx);
 }
 
 void
@@ -26,8 +26,12 @@ typedef struct {
   void (*delete_x)(void *backend_user_data,
                  const char *relative_uri,
                  event_handler_t cb, void *ud);
+  /* sends at most `length` bytes of the resource starting at `offset`,
+     the size hint is always the size of the whole resource */
   void (*get)(void *backend_user_data,
               const char *relative_uri,
+              webdav_resource_size_t offset,
+              webdav_resource_size_t length,
               webdav_get_request_ctx_t get_ctx);
   void (*mkcol)(void *backend_user_data,
                 const char *relative_uri,
@@ -18,15 +18,18 @@
 
 #define _ISOC99_SOURCE
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "async_fs_helpers.h"
 #include "iface_util.h"
 #include "fs.h"
 #include "uthread.h"
 #include "util.h"
 #include "util_fs.h"
 #include "webdav_server.h"
+#include "worker_pool.h"
 
 #include "webdav_backend_fs.h"
 
@@ -37,10 +40,21 @@ enum {
 
 typedef struct _webdav_backend_fs {
   fs_handle_t fs;
+  worker_pool_t pool;
   char *base_path;
   size_t base_path_len;
 } WebdavBackendFs;
 
+/* runs `work(ctx)` on the worker pool and resumes the calling uthread
+   once it's done */
+#define UTHR_RUN_IN_WORKER(ctx, work, uthr)                             \
+  do {                                                                  \
+    UTHR_YIELD(ctx,                                                     \
+               worker_pool_run(ctx->pbctx->pool, work, ctx, uthr, ctx)); \
+    assert(UTHR_EVENT_TYPE() == WORKER_POOL_RUN_DONE_EVENT);            \
+  }                                                                     \
+  while (false)
+
 static char *
 path_from_uri(WebdavBackendFs *pbctx, const char *real_uri) {
   char *toret = NULL;
@@ -85,7 +99,7 @@ path_from_uri(WebdavBackendFs *pbctx, const char *real_uri) {
 }
 
 webdav_backend_fs_t
-webdav_backend_fs_new(fs_handle_t fs, const char *root) {
+webdav_backend_fs_new(fs_handle_t fs, worker_pool_t pool, const char *root) {
   char *base_path = NULL;
 
   if (!fs_path_is_valid(fs, root)) {
@@ -105,6 +119,7 @@ webdav_backend_fs_new(fs_handle_t fs, const char *root) {
 
   *backend = (WebdavBackendFs) {
     .fs = fs,
+    .pool = pool,
     .base_path = base_path,
     .base_path_len = strlen(base_path),
   };
@@ -123,83 +138,133 @@ typedef struct {
   /* args */
   WebdavBackendFs *pbctx;
   const char *relative_uri;
+  webdav_resource_size_t range_start;
+  webdav_resource_size_t range_length;
   webdav_get_request_ctx_t get_ctx;
   /* ctx */
   char *file_path;
   char buf[TRANSFER_BUF_SIZE];
   fs_file_handle_t fd;
   fs_off_t offset;
+  size_t amt_left;
   size_t amt_read;
+  int native_fd;
+  fs_error_t ret_open;
+  fs_error_t ret_fs;
+  FsAttrs attrs;
+  webdav_error_t error;
 } WebdavBackendFsGetCtx;
 
+static void
+_webdav_backend_fs_get_open_work(void *ud) {
+  WebdavBackendFsGetCtx *const ctx = ud;
+
+  const bool create_file = false;
+  ctx->ret_open = fs_open(ctx->pbctx->fs, ctx->file_path,
+                          create_file, &ctx->fd, NULL);
+  if (ctx->ret_open) return;
+
+  ctx->ret_fs = fs_fgetattr(ctx->pbctx->fs, ctx->fd, &ctx->attrs);
+}
+
+static void
+_webdav_backend_fs_get_read_work(void *ud) {
+  WebdavBackendFsGetCtx *const ctx = ud;
+  ctx->ret_fs = fs_read(ctx->pbctx->fs, ctx->fd,
+                        ctx->buf, MIN(sizeof(ctx->buf), ctx->amt_left),
+                        ctx->offset, &ctx->amt_read);
+}
+
+static void
+_webdav_backend_fs_get_close_work(void *ud) {
+  WebdavBackendFsGetCtx *const ctx = ud;
+  ctx->ret_fs = fs_close(ctx->pbctx->fs, ctx->fd);
+}
+
 static
 UTHR_DEFINE(_webdav_backend_fs_get_uthr) {
-  webdav_error_t error;
-
   UTHR_HEADER(WebdavBackendFsGetCtx, ctx);
 
   ctx->fd = (fs_file_handle_t) 0;
 
   ctx->file_path = path_from_uri(ctx->pbctx, ctx->relative_uri);
   if (!ctx->file_path) {
-    error = WEBDAV_ERROR_GENERAL;
+    ctx->error = WEBDAV_ERROR_GENERAL;
     goto done;
   }
 
-  const bool create_file = false;
-  const fs_error_t ret_open = fs_open(ctx->pbctx->fs, ctx->file_path,
-                                      create_file, &ctx->fd, NULL);
-  if (ret_open) {
-    if (ret_open == FS_ERROR_IS_DIR) {
+  /* need to initialize `is_directory` & `size` to avoid spurious
+     -Wmaybe-uninitialized warnings from GCC */
+  ctx->attrs = (FsAttrs) {
+    .size = 0,
+    .is_directory = false,
+  };
+  UTHR_RUN_IN_WORKER(ctx, _webdav_backend_fs_get_open_work,
+                     _webdav_backend_fs_get_uthr);
+  if (ctx->ret_open) {
+    if (ctx->ret_open == FS_ERROR_IS_DIR) {
       /* TODO: maybe generate directory listing */
-      error = WEBDAV_ERROR_IS_COL;
+      ctx->error = WEBDAV_ERROR_IS_COL;
     }
     else {
-      error = ret_open == FS_ERROR_DOES_NOT_EXIST
+      ctx->error = ctx->ret_open == FS_ERROR_DOES_NOT_EXIST
         ? WEBDAV_ERROR_DOES_NOT_EXIST
         : WEBDAV_ERROR_GENERAL;
     }
     goto done;
   }
 
-  /* need to initialize `is_directory` & `size` to avoid spurious
-     -Wmaybe-uninitialized warnings from GCC */
-  FsAttrs attrs = {
-    .size = 0,
-    .is_directory = false,
-  };
-  const fs_error_t ret_fgetattr = fs_fgetattr(ctx->pbctx->fs, ctx->fd, &attrs);
-  if (ret_fgetattr) {
-    error = WEBDAV_ERROR_GENERAL;
+  if (ctx->ret_fs) {
+    ctx->error = WEBDAV_ERROR_GENERAL;
     goto done;
   }
 
   /* this should never happen */
-  ASSERT_TRUE(!attrs.is_directory);
+  ASSERT_TRUE(!ctx->attrs.is_directory);
 
   /* write out the size hint */
   /* TODO: remove this, the file might end up
      being larger or smaller than this */
   UTHR_YIELD(ctx,
-             webdav_get_request_size_hint(ctx->get_ctx, attrs.size,
+             webdav_get_request_size_hint(ctx->get_ctx, ctx->attrs.size,
                                           _webdav_backend_fs_get_uthr, ctx));
   UTHR_RECEIVE_EVENT(WEBDAV_GET_REQUEST_SIZE_HINT_DONE_EVENT,
                      WebdavGetRequestSizeHintDoneEvent, size_hint_ev);
   if (size_hint_ev->error) {
-    error = size_hint_ev->error;
+    ctx->error = size_hint_ev->error;
     goto done;
   }
 
-  ctx->offset = 0;
-  while (true) {
-    const fs_error_t read_ret = fs_read(ctx->pbctx->fs, ctx->fd,
-                                        ctx->buf, sizeof(ctx->buf), ctx->offset,
-                                        &ctx->amt_read);
-    if (read_ret) {
+  /* only send the part of the file that was asked for */
+  ctx->amt_left = 0;
+  if ((uintmax_t) ctx->attrs.size > ctx->range_start) {
+    ctx->amt_left =
+      MIN((uintmax_t) ctx->attrs.size - ctx->range_start, ctx->range_length);
+  }
+
+  /* if the file system exposes a native descriptor let the http layer
+     send the file directly, otherwise fall back to buffered reads */
+  ctx->native_fd = fs_fileno(ctx->pbctx->fs, ctx->fd);
+  if (ctx->native_fd >= 0 && ctx->amt_left) {
+    UTHR_YIELD(ctx,
+               webdav_get_request_sendfile(ctx->get_ctx, ctx->native_fd,
+                                           ctx->range_start, ctx->amt_left,
+                                           _webdav_backend_fs_get_uthr, ctx));
+    UTHR_RECEIVE_EVENT(WEBDAV_GET_REQUEST_WRITE_DONE_EVENT,
+                       WebdavGetRequestWriteDoneEvent, sendfile_done_ev);
+    ctx->error = sendfile_done_ev->error;
+    goto done;
+  }
+
+  ctx->offset = ctx->range_start;
+  while (ctx->amt_left) {
+    UTHR_RUN_IN_WORKER(ctx, _webdav_backend_fs_get_read_work,
+                       _webdav_backend_fs_get_uthr);
+    if (ctx->ret_fs) {
       log_error("Error while reading from %s at offset %d: %s",
                 ctx->file_path, (int) ctx->offset,
-                util_fs_strerror(read_ret));
-      error = WEBDAV_ERROR_GENERAL;
+                util_fs_strerror(ctx->ret_fs));
+      ctx->error = WEBDAV_ERROR_GENERAL;
       goto done;
     }
 
@@ -214,35 +279,41 @@ UTHR_DEFINE(_webdav_backend_fs_get_uthr) {
     UTHR_RECEIVE_EVENT(WEBDAV_GET_REQUEST_WRITE_DONE_EVENT,
                        WebdavGetRequestWriteDoneEvent, write_done_ev);
     if (write_done_ev->error) {
-      error = write_done_ev->error;
+      ctx->error = write_done_ev->error;
       goto done;
     }
 
     ctx->offset += ctx->amt_read;
+    ctx->amt_left -= ctx->amt_read;
   }
 
-  error = WEBDAV_ERROR_NONE;
+  ctx->error = WEBDAV_ERROR_NONE;
 
  done:
   if (ctx->fd) {
-    const fs_error_t ret_close = fs_close(ctx->pbctx->fs, ctx->fd);
-    ASSERT_TRUE(!ret_close);
+    UTHR_RUN_IN_WORKER(ctx, _webdav_backend_fs_get_close_work,
+                       _webdav_backend_fs_get_uthr);
+    ASSERT_TRUE(!ctx->ret_fs);
   }
 
   free(ctx->file_path);
 
   UTHR_RETURN(ctx,
-              webdav_get_request_end(ctx->get_ctx, error));
+              webdav_get_request_end(ctx->get_ctx, ctx->error));
 
   UTHR_FOOTER();
 }
 
 void
 webdav_backend_fs_get(WebdavBackendFs *backend_handle, const char *relative_uri,
+                      webdav_resource_size_t offset,
+                      webdav_resource_size_t length,
                       webdav_get_request_ctx_t get_ctx) {
-  UTHR_CALL3(_webdav_backend_fs_get_uthr, WebdavBackendFsGetCtx,
+  UTHR_CALL5(_webdav_backend_fs_get_uthr, WebdavBackendFsGetCtx,
              .pbctx = backend_handle,
              .relative_uri = relative_uri,
+             .range_start = offset,
+             .range_length = length,
              .get_ctx = get_ctx);
 }
 
@@ -257,48 +328,97 @@ typedef struct {
   char *file_path;
   bool resource_existed;
   size_t total_amount_transferred;
+  size_t amount_read;
+  fs_error_t ret_open;
+  fs_error_t ret_fs;
+  webdav_error_t error;
   char buf[TRANSFER_BUF_SIZE];
 } WebdavBackendFsPutCtx;
 
+static void
+_webdav_backend_fs_put_open_work(void *ud) {
+  WebdavBackendFsPutCtx *const ctx = ud;
+
+  bool created;
+  const bool create = true;
+  ctx->ret_open = fs_open(ctx->pbctx->fs, ctx->file_path,
+                          create, &ctx->fd, &created);
+  if (ctx->ret_open) {
+    log_info("Error opening \"%s\": %s", ctx->file_path,
+             util_fs_strerror(ctx->ret_open));
+    return;
+  }
+
+  ctx->resource_existed = !created;
+
+  ctx->ret_fs = fs_ftruncate(ctx->pbctx->fs, ctx->fd, 0);
+  if (ctx->ret_fs) {
+    log_info("Error truncated \"%s\": %s", ctx->file_path,
+             util_fs_strerror(ctx->ret_fs));
+  }
+}
+
+static void
+_webdav_backend_fs_put_write_work(void *ud) {
+  WebdavBackendFsPutCtx *const ctx = ud;
+
+  size_t amount_written = 0;
+  while (amount_written < ctx->amount_read) {
+    /* need to initialize `new_amount_written` to avoid
+       spurious -Wmaybe-uninitialized warnings from GCC */
+    size_t new_amount_written = 0;
+    ctx->ret_fs = fs_write(ctx->pbctx->fs, ctx->fd,
+                           ctx->buf + amount_written,
+                           ctx->amount_read - amount_written,
+                           amount_written + ctx->total_amount_transferred,
+                           &new_amount_written);
+    if (ctx->ret_fs) {
+      log_error("Couldn't write to resource \"%s\" (fd: %p)",
+                ctx->relative_uri, (void *) ctx->fd);
+      return;
+    }
+
+    assert(new_amount_written);
+    amount_written += new_amount_written;
+  }
+
+  assert(amount_written == ctx->amount_read);
+  ctx->total_amount_transferred += amount_written;
+}
+
+static void
+_webdav_backend_fs_put_close_work(void *ud) {
+  WebdavBackendFsPutCtx *const ctx = ud;
+  ctx->ret_fs = fs_close(ctx->pbctx->fs, ctx->fd);
+}
+
 static
 UTHR_DEFINE(_webdav_backend_fs_put_uthr) {
   UTHR_HEADER(WebdavBackendFsPutCtx, ctx);
 
-  webdav_error_t error;
-
   ctx->fd = (fs_file_handle_t) 0;
+  ctx->resource_existed = false;
 
   ctx->file_path = path_from_uri(ctx->pbctx, ctx->relative_uri);
   if (!ctx->file_path) {
-    error = WEBDAV_ERROR_GENERAL;
+    ctx->error = WEBDAV_ERROR_GENERAL;
     goto done;
   }
 
-  bool created;
-  bool create = true;
-  const fs_error_t ret_open =
-    fs_open(ctx->pbctx->fs, ctx->file_path,
-            create, &ctx->fd, &created);
-  if (ret_open) {
-    log_info("Error opening \"%s\": %s", ctx->file_path,
-             util_fs_strerror(ret_open));
-    switch (ret_open) {
-    case FS_ERROR_DOES_NOT_EXIST: error = WEBDAV_ERROR_DOES_NOT_EXIST; break;
-    case FS_ERROR_NOT_DIR: error = WEBDAV_ERROR_NOT_COLLECTION; break;
-    case FS_ERROR_IS_DIR: error = WEBDAV_ERROR_IS_COL; break;
-    default: error = WEBDAV_ERROR_GENERAL; break;
+  UTHR_RUN_IN_WORKER(ctx, _webdav_backend_fs_put_open_work,
+                     _webdav_backend_fs_put_uthr);
+  if (ctx->ret_open) {
+    switch (ctx->ret_open) {
+    case FS_ERROR_DOES_NOT_EXIST: ctx->error = WEBDAV_ERROR_DOES_NOT_EXIST; break;
+    case FS_ERROR_NOT_DIR: ctx->error = WEBDAV_ERROR_NOT_COLLECTION; break;
+    case FS_ERROR_IS_DIR: ctx->error = WEBDAV_ERROR_IS_COL; break;
+    default: ctx->error = WEBDAV_ERROR_GENERAL; break;
     }
     goto done;
   }
 
-  ctx->resource_existed = !created;
-
-  const fs_error_t ret_truncate =
-    fs_ftruncate(ctx->pbctx->fs, ctx->fd, 0);
-  if (ret_truncate) {
-    log_info("Error truncated \"%s\": %s", ctx->file_path,
-             util_fs_strerror(ret_truncate));
-    error = WEBDAV_ERROR_GENERAL;
+  if (ctx->ret_fs) {
+    ctx->error = WEBDAV_ERROR_GENERAL;
     goto done;
   }
 
@@ -314,7 +434,7 @@ UTHR_DEFINE(_webdav_backend_fs_put_uthr) {
     if (read_done_ev->error) {
       log_info("Error while reading data for %s: %d",
                ctx->relative_uri, read_done_ev->error);
-      error = read_done_ev->error;
+      ctx->error = read_done_ev->error;
       goto done;
     }
 
@@ -323,47 +443,32 @@ UTHR_DEFINE(_webdav_backend_fs_put_uthr) {
       break;
     }
 
-    const size_t amount_read = read_done_ev->nbyte;
-    size_t amount_written = 0;
-    while (amount_written < amount_read) {
-      /* need to initialize `new_amount_written` to avoid
-         spurious -Wmaybe-uninitialized warnings from GCC */
-      size_t new_amount_written = 0;
-      const fs_error_t ret_write = fs_write(ctx->pbctx->fs, ctx->fd,
-                                            ctx->buf + amount_written,
-                                            amount_read - amount_written,
-                                            amount_written + ctx->total_amount_transferred,
-                                            &new_amount_written);
-      if (ret_write) {
-        log_error("Couldn't write to resource \"%s\" (fd: %p)",
-                  ctx->relative_uri, (void *) ctx->fd);
-        error = WEBDAV_ERROR_GENERAL;
-        goto done;
-      }
-
-      assert(new_amount_written);
-      amount_written += new_amount_written;
+    ctx->amount_read = read_done_ev->nbyte;
+    UTHR_RUN_IN_WORKER(ctx, _webdav_backend_fs_put_write_work,
+                       _webdav_backend_fs_put_uthr);
+    if (ctx->ret_fs) {
+      ctx->error = WEBDAV_ERROR_GENERAL;
+      goto done;
     }
-
-    assert(amount_written == amount_read);
-    ctx->total_amount_transferred += amount_written;
   }
 
   log_info("Resource \"%s\" created with %lu bytes",
            ctx->relative_uri,
            (unsigned long) ctx->total_amount_transferred);
-  error = WEBDAV_ERROR_NONE;
+  ctx->error = WEBDAV_ERROR_NONE;
 
  done:
   free(ctx->file_path);
 
   if (ctx->fd) {
-    const fs_error_t ret_close = fs_close(ctx->pbctx->fs, ctx->fd);
-    ASSERT_TRUE(!ret_close);
+    UTHR_RUN_IN_WORKER(ctx, _webdav_backend_fs_put_close_work,
+                       _webdav_backend_fs_put_uthr);
+    ASSERT_TRUE(!ctx->ret_fs);
   }
 
   UTHR_RETURN(ctx,
-              webdav_put_request_end(ctx->put_ctx, error, ctx->resource_existed));
+              webdav_put_request_end(ctx->put_ctx, ctx->error,
+                                     ctx->resource_existed));
 
   UTHR_FOOTER();
 }
@@ -377,11 +482,77 @@ webdav_backend_fs_put(WebdavBackendFs *backend_handle, const char *relative_uri,
              .put_ctx = put_ctx);
 }
 
-void
-webdav_backend_fs_mkcol(webdav_backend_fs_t backend_handle, const char *relative_uri,
-                        event_handler_t cb, void *ud) {
+/* these operations don't interact with the client while
+   they run, so they are run on the worker pool as a whole */
+
+typedef union {
+  WebdavMkcolDoneEvent mkcol;
+  WebdavPropfindDoneEvent propfind;
+  WebdavTouchDoneEvent touch;
+  WebdavDeleteDoneEvent delete_x;
+  WebdavMoveDoneEvent move;
+  WebdavCopyDoneEvent copy;
+} WebdavBackendFsDoneEvent;
+
+typedef struct {
+  WebdavBackendFs *pbctx;
+  event_handler_t cb;
+  void *cb_ud;
+  /* args */
+  const char *relative_uri;
+  webdav_depth_t depth;
+  webdav_propfind_req_type_t propfind_req_type;
+  /* filled in by the worker */
+  event_type_t done_ev_type;
+  WebdavBackendFsDoneEvent done_ev;
+} WebdavBackendFsJob;
+
+static WebdavBackendFsJob *
+_webdav_backend_fs_job_new(WebdavBackendFs *pbctx,
+                           event_handler_t cb, void *cb_ud) {
+  WebdavBackendFsJob *const job = malloc(sizeof(*job));
+  /* same policy as UTHR_CALL() */
+  if (!job) abort();
+
+  *job = (WebdavBackendFsJob) {
+    .pbctx = pbctx,
+    .cb = cb,
+    .cb_ud = cb_ud,
+  };
+
+  return job;
+}
+
+static
+EVENT_HANDLER_DEFINE(_webdav_backend_fs_job_done, ev_type, ev, ud) {
+  WebdavBackendFsJob *const job = ud;
+
+  UNUSED(ev_type);
+  UNUSED(ev);
+  assert(ev_type == WORKER_POOL_RUN_DONE_EVENT);
+
+  const event_handler_t cb = job->cb;
+  void *const cb_ud = job->cb_ud;
+  const event_type_t done_ev_type = job->done_ev_type;
+  WebdavBackendFsDoneEvent done_ev = job->done_ev;
+  free(job);
+
+  return cb(done_ev_type, &done_ev, cb_ud);
+}
+
+static void
+_webdav_backend_fs_run_job(WebdavBackendFsJob *job,
+                           worker_pool_work_fn_t work) {
+  worker_pool_run(job->pbctx->pool, work, job,
+                  _webdav_backend_fs_job_done, job);
+}
+
+static void
+_webdav_backend_fs_mkcol_work(void *ud) {
+  WebdavBackendFsJob *const job = ud;
+  WebdavBackendFs *const pbctx = job->pbctx;
+  const char *const relative_uri = job->relative_uri;
   WebdavMkcolDoneEvent ev;
-  WebdavBackendFs *const pbctx = backend_handle;
 
   char *const file_path = path_from_uri(pbctx, relative_uri);
   if (!file_path) {
@@ -416,7 +587,18 @@ webdav_backend_fs_mkcol(webdav_backend_fs_t backend_handle, const char *relative
 
  done:
   free(file_path);
-  return cb(WEBDAV_MKCOL_DONE_EVENT, &ev, ud);
+
+  job->done_ev_type = WEBDAV_MKCOL_DONE_EVENT;
+  job->done_ev.mkcol = ev;
+}
+
+void
+webdav_backend_fs_mkcol(webdav_backend_fs_t backend_handle, const char *relative_uri,
+                        event_handler_t cb, void *ud) {
+  WebdavBackendFsJob *const job =
+    _webdav_backend_fs_job_new(backend_handle, cb, ud);
+  job->relative_uri = relative_uri;
+  _webdav_backend_fs_run_job(job, _webdav_backend_fs_mkcol_work);
 }
 
 static webdav_propfind_entry_t
@@ -431,14 +613,17 @@ create_propfind_entry_from_stat(const char *relative_uri, FsAttrs *attrs) {
                                    attrs->is_directory,
                                    (attrs->is_directory
                                     ? INVALID_WEBDAV_RESOURCE_SIZE
-                                    : ((webdav_resource_size_t) attrs->size)));
+                                    : ((webdav_resource_size_t) attrs->size)),
+                                   attrs->file_id);
 }
 
-void
-webdav_backend_fs_propfind(WebdavBackendFs *pbctx,
-                           const char *relative_uri, webdav_depth_t depth,
-                           webdav_propfind_req_type_t propfind_req_type,
-                           event_handler_t cb, void *cb_ud) {
+static void
+_webdav_backend_fs_propfind_work(void *ud) {
+  WebdavBackendFsJob *const job = ud;
+  WebdavBackendFs *const pbctx = job->pbctx;
+  const char *const relative_uri = job->relative_uri;
+  const webdav_depth_t depth = job->depth;
+  const webdav_propfind_req_type_t propfind_req_type = job->propfind_req_type;
   WebdavPropfindDoneEvent ev = {
     .entries = LINKED_LIST_INITIALIZER,
     .error = 0,
@@ -594,16 +779,29 @@ webdav_backend_fs_propfind(WebdavBackendFs *pbctx,
   free(child_path);
   free(entry_name);
 
-  return cb(WEBDAV_PROPFIND_DONE_EVENT, &ev, cb_ud);
+  job->done_ev_type = WEBDAV_PROPFIND_DONE_EVENT;
+  job->done_ev.propfind = ev;
 }
 
 void
-webdav_backend_fs_touch(WebdavBackendFs *pbctx,
-                        const char *relative_uri,
-                        event_handler_t cb, void *ud) {
+webdav_backend_fs_propfind(WebdavBackendFs *pbctx,
+                           const char *relative_uri, webdav_depth_t depth,
+                           webdav_propfind_req_type_t propfind_req_type,
+                           event_handler_t cb, void *cb_ud) {
+  WebdavBackendFsJob *const job = _webdav_backend_fs_job_new(pbctx, cb, cb_ud);
+  job->relative_uri = relative_uri;
+  job->depth = depth;
+  job->propfind_req_type = propfind_req_type;
+  _webdav_backend_fs_run_job(job, _webdav_backend_fs_propfind_work);
+}
+
+static void
+_webdav_backend_fs_touch_work(void *ud) {
+  WebdavBackendFsJob *const job = ud;
+  WebdavBackendFs *const pbctx = job->pbctx;
   WebdavTouchDoneEvent ev;
 
-  char *file_path = path_from_uri(pbctx, relative_uri);
+  char *file_path = path_from_uri(pbctx, job->relative_uri);
   if (!file_path) {
     ev.error = WEBDAV_ERROR_GENERAL;
     goto done;
@@ -624,65 +822,136 @@ webdav_backend_fs_touch(WebdavBackendFs *pbctx,
  done:
   free(file_path);
 
-  return cb(WEBDAV_TOUCH_DONE_EVENT, &ev, ud);
+  job->done_ev_type = WEBDAV_TOUCH_DONE_EVENT;
+  job->done_ev.touch = ev;
 }
 
 void
-webdav_backend_fs_delete(WebdavBackendFs *pbctx,
-                         const char *relative_uri,
-                         event_handler_t cb, void *ud) {
+webdav_backend_fs_touch(WebdavBackendFs *pbctx,
+                        const char *relative_uri,
+                        event_handler_t cb, void *ud) {
+  WebdavBackendFsJob *const job = _webdav_backend_fs_job_new(pbctx, cb, ud);
+  job->relative_uri = relative_uri;
+  _webdav_backend_fs_run_job(job, _webdav_backend_fs_touch_work);
+}
+
+/* deleting, copying and moving trees can take arbitrarily long, so
+   these keep their state on the loop's thread and only hand out the
+   individual file system calls to the worker pool (see async_fs_helpers.h) */
+
+typedef struct {
+  UTHR_CTX_BASE;
+  /* args */
+  WebdavBackendFs *pbctx;
+  const char *relative_uri;
+  event_handler_t cb;
+  void *cb_ud;
+  /* ctx */
+  char *file_path;
+  bool exists;
+  fs_error_t ret_exists;
   WebdavDeleteDoneEvent ev;
-  char *file_path = path_from_uri(pbctx, relative_uri);
-  if (!file_path) {
-    ev.error = WEBDAV_ERROR_GENERAL;
+} WebdavBackendFsDeleteCtx;
+
+static void
+_webdav_backend_fs_delete_exists_work(void *ud) {
+  WebdavBackendFsDeleteCtx *const ctx = ud;
+  ctx->ret_exists = util_fs_file_exists(ctx->pbctx->fs, ctx->file_path,
+                                        &ctx->exists);
+}
+
+static
+UTHR_DEFINE(_webdav_backend_fs_delete_uthr) {
+  UTHR_HEADER(WebdavBackendFsDeleteCtx, ctx);
+
+  ctx->ev = (WebdavDeleteDoneEvent) {
+    .error = WEBDAV_ERROR_NONE,
+    .failed_to_delete = LINKED_LIST_INITIALIZER,
+  };
+
+  ctx->file_path = path_from_uri(ctx->pbctx, ctx->relative_uri);
+  if (!ctx->file_path) {
+    ctx->ev.error = WEBDAV_ERROR_GENERAL;
     goto done;
   }
 
-  bool exists;
-  fs_error_t ret_exists = util_fs_file_exists(pbctx->fs, file_path, &exists);
-  if (ret_exists) {
-    ev.error = WEBDAV_ERROR_GENERAL;
+  UTHR_RUN_IN_WORKER(ctx, _webdav_backend_fs_delete_exists_work,
+                     _webdav_backend_fs_delete_uthr);
+  if (ctx->ret_exists) {
+    ctx->ev.error = WEBDAV_ERROR_GENERAL;
     goto done;
   }
-  else if (!exists) {
-    ev.error = WEBDAV_ERROR_DOES_NOT_EXIST;
+  else if (!ctx->exists) {
+    ctx->ev.error = WEBDAV_ERROR_DOES_NOT_EXIST;
     goto done;
   }
 
-  linked_list_t failed_to_delete = util_fs_rmtree(pbctx->fs, file_path);
-
-  ev = (WebdavDeleteDoneEvent) {
-    .error = WEBDAV_ERROR_NONE,
-    .failed_to_delete = failed_to_delete,
-  };
+  UTHR_YIELD(ctx,
+             async_fs_rmtree(ctx->pbctx->fs, ctx->pbctx->pool, ctx->file_path,
+                             _webdav_backend_fs_delete_uthr, ctx));
+  UTHR_RECEIVE_EVENT(ASYNC_FS_RMTREE_DONE_EVENT,
+                     AsyncFsRmtreeDoneEvent, rmtree_done_ev);
+  ctx->ev.failed_to_delete = rmtree_done_ev->failed_to_delete;
 
  done:
-  free(file_path);
+  free(ctx->file_path);
+
+  UTHR_RETURN(ctx,
+              ctx->cb(WEBDAV_DELETE_DONE_EVENT, &ctx->ev, ctx->cb_ud));
 
-  return cb(WEBDAV_DELETE_DONE_EVENT, &ev, ud);
+  UTHR_FOOTER();
 }
 
 void
-_webdav_backend_fs_copy_move(WebdavBackendFs *pbctx,
-                             bool is_move,
-                             const char *src_relative_uri, const char *dst_relative_uri,
-                             bool overwrite, webdav_depth_t depth,
-                             event_handler_t cb, void *ud) {
-  assert(depth == DEPTH_INF ||
-	 (depth == DEPTH_0 && !is_move));
+webdav_backend_fs_delete(WebdavBackendFs *pbctx,
+                         const char *relative_uri,
+                         event_handler_t cb, void *ud) {
+  UTHR_CALL4(_webdav_backend_fs_delete_uthr, WebdavBackendFsDeleteCtx,
+             .pbctx = pbctx,
+             .relative_uri = relative_uri,
+             .cb = cb,
+             .cb_ud = ud);
+}
 
-  webdav_error_t err;
+typedef struct {
+  UTHR_CTX_BASE;
+  /* args */
+  WebdavBackendFs *pbctx;
+  bool is_move;
+  const char *src_relative_uri;
+  const char *dst_relative_uri;
+  bool overwrite;
+  webdav_depth_t depth;
+  event_handler_t cb;
+  void *cb_ud;
+  /* ctx */
+  char *file_path;
+  char *destination_path;
   bool dst_existed;
+  bool is_finished;
+  bool copy_failed;
+  webdav_error_t error;
+  event_type_t done_ev_type;
+  WebdavBackendFsDoneEvent done_ev;
+} WebdavBackendFsCopyMoveCtx;
 
-  char *const file_path = path_from_uri(pbctx, src_relative_uri);
-  char *const destination_path = path_from_uri(pbctx, dst_relative_uri);
+/* checks the source & destination, and does the whole operation if
+   it's a move that can be done with a rename */
+static void
+_webdav_backend_fs_copy_move_check_work(void *ud) {
+  WebdavBackendFsCopyMoveCtx *const ctx = ud;
+  WebdavBackendFs *const pbctx = ctx->pbctx;
+  const char *const file_path = ctx->file_path;
+  const char *const destination_path = ctx->destination_path;
+
+  ctx->is_finished = true;
 
   char *const destination_path_dirname =
     util_fs_path_dirname(pbctx->fs, destination_path);
   if (!destination_path_dirname) {
     log_info("Error while getting the dirname of: %s",
              destination_path);
-    err =  WEBDAV_ERROR_GENERAL;
+    ctx->error = WEBDAV_ERROR_GENERAL;
     goto done;
   }
 
@@ -692,13 +961,13 @@ _webdav_backend_fs_copy_move(WebdavBackendFs *pbctx,
                         &destination_directory_exists);
   if (ret_exists) {
     log_info("Error while checking if \"%s\" existed", destination_path_dirname);
-    err = WEBDAV_ERROR_GENERAL;
+    ctx->error = WEBDAV_ERROR_GENERAL;
     goto done;
   }
   else if (!destination_directory_exists) {
     log_debug("Destination directory \"%s\" does not exist!",
               destination_path_dirname);
-    err = WEBDAV_ERROR_DESTINATION_DOES_NOT_EXIST;
+    ctx->error = WEBDAV_ERROR_DESTINATION_DOES_NOT_EXIST;
     goto done;
   }
 
@@ -707,20 +976,20 @@ _webdav_backend_fs_copy_move(WebdavBackendFs *pbctx,
     util_fs_file_exists(pbctx->fs, file_path, &src_exists);
   if (ret_exists_2) {
     log_info("Error while checking if \"%s\" existed", file_path);
-    err = WEBDAV_ERROR_GENERAL;
+    ctx->error = WEBDAV_ERROR_GENERAL;
     goto done;
   }
   else if (!src_exists) {
-    err = WEBDAV_ERROR_DOES_NOT_EXIST;
+    ctx->error = WEBDAV_ERROR_DOES_NOT_EXIST;
     goto done;
   }
 
   const int ret_exists_3 = util_fs_file_exists(pbctx->fs, destination_path,
-                                               &dst_existed);
+                                               &ctx->dst_existed);
   if (ret_exists_3) {
     log_info("Error while checking if \"%s\" existed",
              destination_path);
-    err = WEBDAV_ERROR_GENERAL;
+    ctx->error = WEBDAV_ERROR_GENERAL;
     goto done;
   }
 
@@ -730,113 +999,187 @@ _webdav_backend_fs_copy_move(WebdavBackendFs *pbctx,
      (otherwise we'll delete the source inadvertently while trying to
      delete whatever is at the destination)
      */
-  if (is_move && overwrite) {
+  if (ctx->is_move && ctx->overwrite) {
     fs_error_t ret_rename = fs_rename(pbctx->fs, file_path, destination_path);
     if (ret_rename) {
       log_info("Error while calling eagerly calling rename(\"%s\", \"%s\")",
                file_path, destination_path);
     }
     else {
-      err = WEBDAV_ERROR_NONE;
+      ctx->error = WEBDAV_ERROR_NONE;
       goto done;
     }
   }
 
-  /* kill directory if we're overwriting it */
-  if (dst_existed) {
-    if (!overwrite) {
-      err = WEBDAV_ERROR_DESTINATION_EXISTS;
-      goto done;
-    }
-
-    linked_list_t failed_to_remove = util_fs_rmtree(pbctx->fs, destination_path);
-    linked_list_free(failed_to_remove, free);
+  if (ctx->dst_existed && !ctx->overwrite) {
+    ctx->error = WEBDAV_ERROR_DESTINATION_EXISTS;
+    goto done;
   }
 
-  bool copy_failed = true;
-  if (is_move) {
+  ctx->is_finished = false;
+
+ done:
+  free(destination_path_dirname);
+}
+
+/* runs after the destination has been cleared, sets `copy_failed` if
+   the source still has to be copied over entry by entry */
+static void
+_webdav_backend_fs_copy_move_rename_work(void *ud) {
+  WebdavBackendFsCopyMoveCtx *const ctx = ud;
+  WebdavBackendFs *const pbctx = ctx->pbctx;
+  const char *const file_path = ctx->file_path;
+  const char *const destination_path = ctx->destination_path;
+
+  ctx->is_finished = true;
+  ctx->copy_failed = true;
+
+  if (ctx->is_move) {
     /* first try moving */
     fs_error_t ret_rename = fs_rename(pbctx->fs, file_path, destination_path);
     if (ret_rename && ret_rename != FS_ERROR_CROSS_DEVICE) {
       log_info("Error while calling rename(\"%s\", \"%s\")",
 	       file_path, destination_path);
-      err = WEBDAV_ERROR_GENERAL;
-      goto done;
+      ctx->error = WEBDAV_ERROR_GENERAL;
+      return;
     }
-    copy_failed = ret_rename;
+    ctx->copy_failed = ret_rename;
   }
 
-  if (copy_failed) {
-    if (depth == DEPTH_0) {
-      bool is_dir;
-      const fs_error_t ret_isdir =
-        util_fs_file_is_dir(pbctx->fs, file_path, &is_dir);
-      if (ret_isdir) {
-        log_info("Error while determining if %s was a dir", file_path);
-        err = WEBDAV_ERROR_GENERAL;
-        goto done;
-      }
+  if (ctx->copy_failed && ctx->depth == DEPTH_0) {
+    bool is_dir;
+    const fs_error_t ret_isdir =
+      util_fs_file_is_dir(pbctx->fs, file_path, &is_dir);
+    if (ret_isdir) {
+      log_info("Error while determining if %s was a dir", file_path);
+      ctx->error = WEBDAV_ERROR_GENERAL;
+      return;
+    }
 
-      if (is_dir) {
-	const fs_error_t ret_mkdir =
-          fs_mkdir(pbctx->fs, destination_path);
-	if (ret_mkdir) {
-	  log_info("Failure to mkdir(\"%s\")",
-		   destination_path);
-	  err = WEBDAV_ERROR_GENERAL;
-	  goto done;
-	}
-      }
-      else {
-	const fs_error_t ret_copyfile =
-          util_fs_copyfile(pbctx->fs,
-                           file_path, destination_path);
-	if (ret_copyfile) {
-	  log_info("Failure to copyfile(\"%s\", \"%s\")",
-                   file_path, destination_path);
-	  err = WEBDAV_ERROR_GENERAL;
-	  goto done;
-	}
+    if (is_dir) {
+      const fs_error_t ret_mkdir =
+        fs_mkdir(pbctx->fs, destination_path);
+      if (ret_mkdir) {
+        log_info("Failure to mkdir(\"%s\")",
+                 destination_path);
+        ctx->error = WEBDAV_ERROR_GENERAL;
+        return;
       }
-
-      copy_failed = false;
     }
     else {
-      const linked_list_t failed_to_copy =
-	util_fs_copytree(pbctx->fs, file_path, destination_path, is_move);
-      copy_failed = failed_to_copy;
-      linked_list_free(failed_to_copy, free);
+      const fs_error_t ret_copyfile =
+        util_fs_copyfile(pbctx->fs,
+                         file_path, destination_path);
+      if (ret_copyfile) {
+        log_info("Failure to copyfile(\"%s\", \"%s\")",
+                 file_path, destination_path);
+        ctx->error = WEBDAV_ERROR_GENERAL;
+        return;
+      }
     }
+
+    ctx->copy_failed = false;
   }
 
-  err = copy_failed
+  ctx->is_finished = false;
+}
+
+static
+UTHR_DEFINE(_webdav_backend_fs_copy_move_uthr) {
+  UTHR_HEADER(WebdavBackendFsCopyMoveCtx, ctx);
+
+  assert(ctx->depth == DEPTH_INF ||
+	 (ctx->depth == DEPTH_0 && !ctx->is_move));
+
+  ctx->dst_existed = false;
+
+  ctx->file_path = path_from_uri(ctx->pbctx, ctx->src_relative_uri);
+  ctx->destination_path = path_from_uri(ctx->pbctx, ctx->dst_relative_uri);
+  if (!ctx->file_path || !ctx->destination_path) {
+    ctx->error = WEBDAV_ERROR_GENERAL;
+    goto done;
+  }
+
+  UTHR_RUN_IN_WORKER(ctx, _webdav_backend_fs_copy_move_check_work,
+                     _webdav_backend_fs_copy_move_uthr);
+  if (ctx->is_finished) goto done;
+
+  /* kill directory if we're overwriting it */
+  if (ctx->dst_existed) {
+    UTHR_YIELD(ctx,
+               async_fs_rmtree(ctx->pbctx->fs, ctx->pbctx->pool,
+                               ctx->destination_path,
+                               _webdav_backend_fs_copy_move_uthr, ctx));
+    UTHR_RECEIVE_EVENT(ASYNC_FS_RMTREE_DONE_EVENT,
+                       AsyncFsRmtreeDoneEvent, rmtree_done_ev);
+    linked_list_free(rmtree_done_ev->failed_to_delete, free);
+  }
+
+  UTHR_RUN_IN_WORKER(ctx, _webdav_backend_fs_copy_move_rename_work,
+                     _webdav_backend_fs_copy_move_uthr);
+  if (ctx->is_finished) goto done;
+
+  if (ctx->copy_failed) {
+    UTHR_YIELD(ctx,
+               async_fs_copytree(ctx->pbctx->fs, ctx->pbctx->pool,
+                                 ctx->file_path, ctx->destination_path,
+                                 ctx->is_move,
+                                 _webdav_backend_fs_copy_move_uthr, ctx));
+    UTHR_RECEIVE_EVENT(ASYNC_FS_COPYTREE_DONE_EVENT,
+                       AsyncFsCopytreeDoneEvent, copytree_done_ev);
+    ctx->copy_failed = copytree_done_ev->failed_to_copy;
+    linked_list_free(copytree_done_ev->failed_to_copy, free);
+  }
+
+  ctx->error = ctx->copy_failed
     ? WEBDAV_ERROR_GENERAL
     : WEBDAV_ERROR_NONE;
 
  done:
-  free(file_path);
-  free(destination_path);
-  free(destination_path_dirname);
+  free(ctx->file_path);
+  free(ctx->destination_path);
 
-  bool initted_dst_existed = err ? false : dst_existed;
-  if (is_move) {
-    WebdavMoveDoneEvent move_done_ev = {
-      .error = err,
+  bool initted_dst_existed = ctx->error ? false : ctx->dst_existed;
+  if (ctx->is_move) {
+    ctx->done_ev_type = WEBDAV_MOVE_DONE_EVENT;
+    ctx->done_ev.move = (WebdavMoveDoneEvent) {
+      .error = ctx->error,
       /* TODO: implement */
       .failed_to_move = LINKED_LIST_INITIALIZER,
       .dst_existed = initted_dst_existed,
     };
-    return cb(WEBDAV_MOVE_DONE_EVENT, &move_done_ev, ud);
   }
   else {
-    WebdavCopyDoneEvent copy_done_ev = {
-      .error = err,
+    ctx->done_ev_type = WEBDAV_COPY_DONE_EVENT;
+    ctx->done_ev.copy = (WebdavCopyDoneEvent) {
+      .error = ctx->error,
       /* TODO: implement */
       .failed_to_copy = LINKED_LIST_INITIALIZER,
       .dst_existed = initted_dst_existed,
     };
-    return cb(WEBDAV_COPY_DONE_EVENT, &copy_done_ev, ud);
   }
+
+  UTHR_RETURN(ctx,
+              ctx->cb(ctx->done_ev_type, &ctx->done_ev, ctx->cb_ud));
+
+  UTHR_FOOTER();
+}
+
+static void
+_webdav_backend_fs_copy_move(WebdavBackendFs *pbctx,
+                             bool is_move,
+                             const char *src_relative_uri, const char *dst_relative_uri,
+                             bool overwrite, webdav_depth_t depth,
+                             event_handler_t cb, void *ud) {
+  UTHR_CALL8(_webdav_backend_fs_copy_move_uthr, WebdavBackendFsCopyMoveCtx,
+             .pbctx = pbctx,
+             .is_move = is_move,
+             .src_relative_uri = src_relative_uri,
+             .dst_relative_uri = dst_relative_uri,
+             .overwrite = overwrite,
+             .depth = depth,
+             .cb = cb,
+             .cb_ud = ud);
 }
 
 void
@@ -21,6 +21,7 @@
 
 #include "iface_util.h"
 #include "fs.h"
+#include "worker_pool.h"
 #include "_webdav_server_types.h"
 
 #ifdef __cplusplus
@@ -31,8 +32,9 @@ struct _webdav_backend_fs;
 
 typedef struct _webdav_backend_fs *webdav_backend_fs_t;
 
+/* blocking fs calls are run on `pool`, the pool must outlive the backend */
 webdav_backend_fs_t
-webdav_backend_fs_new(fs_handle_t fs, const char *root);
+webdav_backend_fs_new(fs_handle_t fs, worker_pool_t pool, const char *root);
 
 void
 webdav_backend_fs_destroy(webdav_backend_fs_t backend);
@@ -40,6 +42,8 @@ webdav_backend_fs_destroy(webdav_backend_fs_t backend);
 void
 webdav_backend_fs_get(webdav_backend_fs_t backend,
                       const char *relative_uri,
+                      webdav_resource_size_t offset,
+                      webdav_resource_size_t length,
                       webdav_get_request_ctx_t get_ctx);
 
 void
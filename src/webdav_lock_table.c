@@ -0,0 +1,520 @@
+/*
+  davfuse: FUSE file systems as WebDAV servers
+  Copyright (C) 2012, 2013 Rian Hunter <rian@alum.mit.edu>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#define _ISOC99_SOURCE
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "c_util.h"
+#include "timeout_heap.h"
+#include "util.h"
+
+#include "webdav_lock_table.h"
+
+enum {
+  /* must be a power of two */
+  LOCK_TABLE_INITIAL_NUM_BUCKETS = 64,
+};
+
+typedef struct _lock_table_link {
+  struct _lock_table_link *next;
+  const char *key;
+  size_t key_len;
+  uint32_t hash;
+} LockTableLink;
+
+/* a chained hash map of string keys, the links are embedded
+   in the values */
+typedef struct {
+  LockTableLink **buckets;
+  size_t num_buckets;
+  size_t num_entries;
+} LockTableMap;
+
+struct _lock_table_entry;
+
+/* there is a node for each locked path and for each of their
+   ancestors, the nodes form a tree mirroring the paths */
+typedef struct _lock_table_node {
+  /* keyed on `path`, must be first */
+  LockTableLink link;
+  char *path;
+  struct _lock_table_node *parent;
+  struct _lock_table_node *first_child;
+  struct _lock_table_node *prev_sibling;
+  struct _lock_table_node *next_sibling;
+  /* the locks on exactly this path */
+  struct _lock_table_entry *locks;
+  /* counts for this node and everything below it,
+     a node is freed once these drop to zero */
+  size_t num_locks;
+  size_t num_exclusive_locks;
+} LockTableNode;
+
+typedef struct _lock_table_entry {
+  /* keyed on the lock token, must be first */
+  LockTableLink link;
+  WebdavLockDescriptor *lock;
+  LockTableNode *node;
+  struct _lock_table_entry *next_at_node;
+  TimeoutHeapEntry expiry;
+} LockTableEntry;
+
+struct _webdav_lock_table {
+  LockTableMap by_token;
+  LockTableMap by_path;
+  TimeoutHeap by_expiry;
+};
+
+static LockTableEntry *
+_entry_from_expiry(TimeoutHeapEntry *expiry) {
+  return (LockTableEntry *)
+    ((char *) expiry - offsetof(LockTableEntry, expiry));
+}
+
+/* FNV-1a */
+static uint32_t
+_hash_key(const char *key, size_t key_len) {
+  uint32_t hash = 2166136261U;
+  for (size_t i = 0; i < key_len; ++i) {
+    hash ^= (unsigned char) key[i];
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+static bool
+_map_init(LockTableMap *map) {
+  *map = (LockTableMap) {
+    .buckets = calloc(LOCK_TABLE_INITIAL_NUM_BUCKETS, sizeof(map->buckets[0])),
+    .num_buckets = LOCK_TABLE_INITIAL_NUM_BUCKETS,
+    .num_entries = 0,
+  };
+  return map->buckets;
+}
+
+static void
+_map_deinit(LockTableMap *map) {
+  assert(!map->num_entries);
+  free(map->buckets);
+}
+
+static LockTableLink *
+_map_find(const LockTableMap *map, const char *key, size_t key_len) {
+  const uint32_t hash = _hash_key(key, key_len);
+  for (LockTableLink *link = map->buckets[hash & (map->num_buckets - 1)];
+       link; link = link->next) {
+    if (link->hash == hash && link->key_len == key_len &&
+        !memcmp(link->key, key, key_len)) {
+      return link;
+    }
+  }
+  return NULL;
+}
+
+static void
+_map_grow(LockTableMap *map) {
+  const size_t new_num_buckets = map->num_buckets * 2;
+  LockTableLink **const new_buckets =
+    calloc(new_num_buckets, sizeof(new_buckets[0]));
+  /* not fatal, the chains just get longer */
+  if (!new_buckets) return;
+
+  for (size_t i = 0; i < map->num_buckets; ++i) {
+    LockTableLink *link = map->buckets[i];
+    while (link) {
+      LockTableLink *const next = link->next;
+      LockTableLink **const bucketp =
+        &new_buckets[link->hash & (new_num_buckets - 1)];
+      link->next = *bucketp;
+      *bucketp = link;
+      link = next;
+    }
+  }
+
+  free(map->buckets);
+  map->buckets = new_buckets;
+  map->num_buckets = new_num_buckets;
+}
+
+static void
+_map_insert(LockTableMap *map, LockTableLink *link,
+            const char *key, size_t key_len) {
+  if (map->num_entries >= map->num_buckets) _map_grow(map);
+
+  link->key = key;
+  link->key_len = key_len;
+  link->hash = _hash_key(key, key_len);
+
+  LockTableLink **const bucketp =
+    &map->buckets[link->hash & (map->num_buckets - 1)];
+  link->next = *bucketp;
+  *bucketp = link;
+  map->num_entries += 1;
+}
+
+static void
+_map_remove(LockTableMap *map, LockTableLink *link) {
+  LockTableLink **linkp = &map->buckets[link->hash & (map->num_buckets - 1)];
+  while (*linkp != link) {
+    assert(*linkp);
+    linkp = &(*linkp)->next;
+  }
+  *linkp = link->next;
+  assert(map->num_entries);
+  map->num_entries -= 1;
+}
+
+/* "/a/b" -> "/a", "/a" -> "/", returns 0 when there is no parent */
+static size_t
+_parent_path_len(const char *path, size_t path_len) {
+  if (path_len <= 1) return 0;
+  size_t i = path_len - 1;
+  while (i && path[i] != '/') --i;
+  return i ? i : 1;
+}
+
+static LockTableNode *
+_find_node(webdav_lock_table_t table, const char *path, size_t path_len) {
+  return (LockTableNode *) _map_find(&table->by_path, path, path_len);
+}
+
+static void
+_prune_node(webdav_lock_table_t table, LockTableNode *node) {
+  while (node && !node->num_locks) {
+    assert(!node->locks);
+    assert(!node->first_child);
+
+    LockTableNode *const parent = node->parent;
+
+    if (node->prev_sibling) {
+      node->prev_sibling->next_sibling = node->next_sibling;
+    }
+    else if (parent) {
+      parent->first_child = node->next_sibling;
+    }
+
+    if (node->next_sibling) {
+      node->next_sibling->prev_sibling = node->prev_sibling;
+    }
+
+    _map_remove(&table->by_path, &node->link);
+    free(node->path);
+    free(node);
+
+    node = parent;
+  }
+}
+
+static LockTableNode *
+_get_node(webdav_lock_table_t table, const char *path, size_t path_len) {
+  LockTableNode *node = _find_node(table, path, path_len);
+  if (node) return node;
+
+  LockTableNode *parent = NULL;
+  const size_t parent_len = _parent_path_len(path, path_len);
+  if (parent_len) {
+    parent = _get_node(table, path, parent_len);
+    if (!parent) return NULL;
+  }
+
+  node = malloc(sizeof(*node));
+  char *const path_copy = strndup_x(path, path_len);
+  if (!node || !path_copy) {
+    free(node);
+    free(path_copy);
+    _prune_node(table, parent);
+    return NULL;
+  }
+
+  *node = (LockTableNode) {
+    .path = path_copy,
+    .parent = parent,
+    .next_sibling = parent ? parent->first_child : NULL,
+  };
+
+  if (parent) {
+    if (parent->first_child) parent->first_child->prev_sibling = node;
+    parent->first_child = node;
+  }
+
+  _map_insert(&table->by_path, &node->link, node->path, path_len);
+
+  return node;
+}
+
+static WebdavLockDescriptor *
+_node_find_lock(const LockTableNode *node,
+                bool exclusive_only, bool depth_infinity_only) {
+  for (LockTableEntry *entry = node->locks; entry;
+       entry = entry->next_at_node) {
+    if ((!exclusive_only || entry->lock->is_exclusive) &&
+        (!depth_infinity_only || entry->lock->depth == DEPTH_INF)) {
+      return entry->lock;
+    }
+  }
+  return NULL;
+}
+
+static WebdavLockDescriptor *
+_node_find_lock_below(const LockTableNode *node, bool exclusive_only) {
+  for (LockTableNode *child = node->first_child; child;
+       child = child->next_sibling) {
+    if (!(exclusive_only ? child->num_exclusive_locks : child->num_locks)) {
+      continue;
+    }
+
+    WebdavLockDescriptor *const lock =
+      _node_find_lock(child, exclusive_only, false);
+    if (lock) return lock;
+
+    /* the counts say there is one further down */
+    return _node_find_lock_below(child, exclusive_only);
+  }
+
+  return NULL;
+}
+
+static void
+_remove_entry(webdav_lock_table_t table, LockTableEntry *entry) {
+  LockTableNode *const node = entry->node;
+
+  LockTableEntry **entryp = &node->locks;
+  while (*entryp != entry) {
+    assert(*entryp);
+    entryp = &(*entryp)->next_at_node;
+  }
+  *entryp = entry->next_at_node;
+
+  _map_remove(&table->by_token, &entry->link);
+  timeout_heap_remove(&table->by_expiry, &entry->expiry);
+
+  for (LockTableNode *n = node; n; n = n->parent) {
+    assert(n->num_locks);
+    n->num_locks -= 1;
+    if (entry->lock->is_exclusive) {
+      assert(n->num_exclusive_locks);
+      n->num_exclusive_locks -= 1;
+    }
+  }
+
+  free(entry);
+
+  _prune_node(table, node);
+}
+
+webdav_lock_table_t
+webdav_lock_table_new(void) {
+  struct _webdav_lock_table *const table = malloc(sizeof(*table));
+  if (!table) return NULL;
+
+  const bool success_init_1 = _map_init(&table->by_token);
+  const bool success_init_2 = _map_init(&table->by_path);
+  if (!success_init_1 || !success_init_2) {
+    free(table->by_token.buckets);
+    free(table->by_path.buckets);
+    free(table);
+    return NULL;
+  }
+
+  timeout_heap_init(&table->by_expiry);
+
+  return table;
+}
+
+void
+webdav_lock_table_destroy(webdav_lock_table_t table,
+                          webdav_lock_table_free_fn_t free_lock) {
+  for (size_t i = 0; i < table->by_token.num_buckets; ++i) {
+    while (table->by_token.buckets[i]) {
+      LockTableEntry *const entry =
+        (LockTableEntry *) table->by_token.buckets[i];
+      WebdavLockDescriptor *const lock = entry->lock;
+      _remove_entry(table, entry);
+      free_lock(lock);
+    }
+  }
+
+  _map_deinit(&table->by_token);
+  _map_deinit(&table->by_path);
+  timeout_heap_destroy(&table->by_expiry);
+  free(table);
+}
+
+bool
+webdav_lock_table_insert(webdav_lock_table_t table,
+                         WebdavLockDescriptor *lock) {
+  assert(!webdav_lock_table_find_token(table, lock->lock_token));
+
+  LockTableEntry *const entry = malloc(sizeof(*entry));
+  if (!entry) return false;
+
+  LockTableNode *const node =
+    _get_node(table, lock->path, strlen(lock->path));
+  if (!node) {
+    free(entry);
+    return false;
+  }
+
+  *entry = (LockTableEntry) {
+    .lock = lock,
+    .node = node,
+    .next_at_node = node->locks,
+    .expiry = {.end_clock = lock->expires_at},
+  };
+
+  const bool success_push = timeout_heap_push(&table->by_expiry,
+                                              &entry->expiry);
+  if (!success_push) {
+    free(entry);
+    _prune_node(table, node);
+    return false;
+  }
+
+  node->locks = entry;
+
+  _map_insert(&table->by_token, &entry->link,
+              lock->lock_token, strlen(lock->lock_token));
+
+  for (LockTableNode *n = node; n; n = n->parent) {
+    n->num_locks += 1;
+    if (lock->is_exclusive) n->num_exclusive_locks += 1;
+  }
+
+  return true;
+}
+
+void
+webdav_lock_table_remove(webdav_lock_table_t table,
+                         WebdavLockDescriptor *lock) {
+  LockTableEntry *const entry =
+    (LockTableEntry *) _map_find(&table->by_token, lock->lock_token,
+                                 strlen(lock->lock_token));
+  ASSERT_TRUE(entry && entry->lock == lock);
+  _remove_entry(table, entry);
+}
+
+WebdavLockDescriptor *
+webdav_lock_table_find_token(webdav_lock_table_t table,
+                             const char *lock_token) {
+  LockTableEntry *const entry =
+    (LockTableEntry *) _map_find(&table->by_token, lock_token,
+                                 strlen(lock_token));
+  return entry ? entry->lock : NULL;
+}
+
+WebdavLockDescriptor *
+webdav_lock_table_find_covering(webdav_lock_table_t table,
+                                const char *path,
+                                bool exclusive_only) {
+  size_t path_len = strlen(path);
+  LockTableNode *node = _find_node(table, path, path_len);
+  if (node) {
+    WebdavLockDescriptor *const lock =
+      _node_find_lock(node, exclusive_only, false);
+    if (lock) return lock;
+    node = node->parent;
+  }
+  else {
+    /* find the closest ancestor in the table,
+       all of its own ancestors are in the table too */
+    while (!node && (path_len = _parent_path_len(path, path_len))) {
+      node = _find_node(table, path, path_len);
+    }
+  }
+
+  for (; node; node = node->parent) {
+    WebdavLockDescriptor *const lock =
+      _node_find_lock(node, exclusive_only, true);
+    if (lock) return lock;
+  }
+
+  return NULL;
+}
+
+WebdavLockDescriptor *
+webdav_lock_table_find_descendant(webdav_lock_table_t table,
+                                  const char *path,
+                                  bool exclusive_only) {
+  LockTableNode *const node = _find_node(table, path, strlen(path));
+  if (!node) return NULL;
+  return _node_find_lock_below(node, exclusive_only);
+}
+
+void
+webdav_lock_table_remove_tree(webdav_lock_table_t table,
+                              const char *path,
+                              webdav_lock_table_free_fn_t free_lock) {
+  const size_t path_len = strlen(path);
+  LockTableNode *node;
+  /* the node goes away along with the last lock at or below it */
+  while ((node = _find_node(table, path, path_len))) {
+    WebdavLockDescriptor *lock = _node_find_lock(node, false, false);
+    if (!lock) lock = _node_find_lock_below(node, false);
+    ASSERT_NOT_NULL(lock);
+
+    webdav_lock_table_remove(table, lock);
+    free_lock(lock);
+  }
+}
+
+void
+webdav_lock_table_set_expiry(webdav_lock_table_t table,
+                             WebdavLockDescriptor *lock,
+                             uint64_t expires_at) {
+  LockTableEntry *const entry =
+    (LockTableEntry *) _map_find(&table->by_token, lock->lock_token,
+                                 strlen(lock->lock_token));
+  ASSERT_TRUE(entry && entry->lock == lock);
+
+  /* re-pushing can't fail since the entry's slot was just freed */
+  timeout_heap_remove(&table->by_expiry, &entry->expiry);
+  lock->expires_at = expires_at;
+  entry->expiry.end_clock = expires_at;
+  const bool success_push = timeout_heap_push(&table->by_expiry,
+                                              &entry->expiry);
+  ASSERT_TRUE(success_push);
+}
+
+bool
+webdav_lock_table_next_expiry(webdav_lock_table_t table,
+                              uint64_t *expires_at) {
+  const TimeoutHeapEntry *const expiry = timeout_heap_peek(&table->by_expiry);
+  if (!expiry) return false;
+  *expires_at = expiry->end_clock;
+  return true;
+}
+
+void
+webdav_lock_table_remove_expired(webdav_lock_table_t table,
+                                 uint64_t now,
+                                 webdav_lock_table_free_fn_t free_lock) {
+  TimeoutHeapEntry *expiry;
+  while ((expiry = timeout_heap_peek(&table->by_expiry)) &&
+         expiry->end_clock <= now) {
+    LockTableEntry *const entry = _entry_from_expiry(expiry);
+    WebdavLockDescriptor *const lock = entry->lock;
+    _remove_entry(table, entry);
+    free_lock(lock);
+  }
+}
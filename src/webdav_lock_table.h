@@ -0,0 +1,100 @@
+/*
+  davfuse: FUSE file systems as WebDAV servers
+  Copyright (C) 2012, 2013 Rian Hunter <rian@alum.mit.edu>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _WEBDAV_LOCK_TABLE_H
+#define _WEBDAV_LOCK_TABLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "_webdav_server_private_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the set of held WebDAV locks, indexed by lock token and by path so
+   that none of the queries below have to look at every lock */
+
+typedef struct _webdav_lock_table *webdav_lock_table_t;
+
+typedef void (*webdav_lock_table_free_fn_t)(WebdavLockDescriptor *);
+
+webdav_lock_table_t
+webdav_lock_table_new(void);
+
+/* `free_lock` is called on every lock still in the table */
+void
+webdav_lock_table_destroy(webdav_lock_table_t table,
+                          webdav_lock_table_free_fn_t free_lock);
+
+/* the table doesn't own `lock`, it's only indexed by `lock->path`,
+   `lock->lock_token` and `lock->expires_at`, none of which may change
+   while it's in the table except through the functions below */
+bool
+webdav_lock_table_insert(webdav_lock_table_t table,
+                         WebdavLockDescriptor *lock);
+
+void
+webdav_lock_table_remove(webdav_lock_table_t table,
+                         WebdavLockDescriptor *lock);
+
+WebdavLockDescriptor *
+webdav_lock_table_find_token(webdav_lock_table_t table,
+                             const char *lock_token);
+
+/* finds a lock on `path` itself or a depth infinity lock on
+   one of its ancestors */
+WebdavLockDescriptor *
+webdav_lock_table_find_covering(webdav_lock_table_t table,
+                                const char *path,
+                                bool exclusive_only);
+
+/* finds a lock on any path strictly below `path` */
+WebdavLockDescriptor *
+webdav_lock_table_find_descendant(webdav_lock_table_t table,
+                                  const char *path,
+                                  bool exclusive_only);
+
+/* removes and frees every lock on `path` and below it */
+void
+webdav_lock_table_remove_tree(webdav_lock_table_t table,
+                              const char *path,
+                              webdav_lock_table_free_fn_t free_lock);
+
+void
+webdav_lock_table_set_expiry(webdav_lock_table_t table,
+                             WebdavLockDescriptor *lock,
+                             uint64_t expires_at);
+
+/* returns false if the table is empty */
+bool
+webdav_lock_table_next_expiry(webdav_lock_table_t table,
+                              uint64_t *expires_at);
+
+/* removes and frees every lock with `expires_at` <= `now` */
+void
+webdav_lock_table_remove_expired(webdav_lock_table_t table,
+                                 uint64_t now,
+                                 webdav_lock_table_free_fn_t free_lock);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
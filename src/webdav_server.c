@@ -21,6 +21,10 @@
 */
 #define _ISOC99_SOURCE
 
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
 #include <assert.h>
 #include <limits.h>
 #include <stdbool.h>
@@ -29,6 +33,7 @@
 #include <strings.h>
 #include <time.h>
 
+#include "arena.h"
 #include "events.h"
 #include "event_loop.h"
 #include "http_helpers.h"
@@ -38,7 +43,9 @@
 #include "uptime.h"
 #include "uthread.h"
 #include "util.h"
+#include "util_sockets.h"
 #include "webdav_backend.h"
+#include "webdav_lock_table.h"
 #include "webdav_server_xml.h"
 #include "_webdav_server_types.h"
 #include "_webdav_server_private_types.h"
@@ -57,6 +64,42 @@ static const char *const WEBDAV_HEADER_LOCK_TOKEN = "Lock-Token";
 static const char *const WEBDAV_HEADER_OVERWRITE = "Overwrite";
 static const char *const WEBDAV_HEADER_TIMEOUT = "Timeout";
 
+/* a macro so OPTIONS can build its Allow header with sizeof() */
+#define COLLECTION_ALLOWED_METHODS \
+  "LOCK,UNLOCK,PROPFIND,DELETE,MOVE,COPY,OPTIONS,PROPPATCH"
+
+enum {
+  /* used when the client doesn't ask for a timeout we understand */
+  WEBDAV_DEFAULT_LOCK_TIMEOUT = 60,
+  /* clients can't hold a lock longer than this without refreshing it */
+  WEBDAV_MAX_LOCK_TIMEOUT = 60 * 60,
+};
+
+enum {
+  /* PROPFIND responses are sent in chunks of about this size */
+  PROPFIND_RESPONSE_CHUNK_SIZE = 8192,
+  /* GET requests for more byte ranges than this get the whole resource */
+  MAX_GET_RANGES = 16,
+};
+
+enum {
+  STOP_SOCKET_RECV,
+  STOP_SOCKET_SEND,
+};
+
+/* state shared by servers created with webdav_server_new_shared(),
+   each of them may be running its own event loop on its own thread */
+struct webdav_server_shared {
+#ifndef _WIN32
+  /* protects everything below */
+  pthread_mutex_t lock;
+#endif
+  webdav_lock_table_t locks;
+  unsigned long next_lock_id;
+  /* linked through `next_shared` */
+  struct webdav_server *servers;
+};
+
 static EVENT_HANDLER_DECLARE(handle_request);
 static EVENT_HANDLER_DECLARE(handle_copy_request);
 static EVENT_HANDLER_DECLARE(handle_delete_request);
@@ -70,6 +113,7 @@ static EVENT_HANDLER_DECLARE(handle_proppatch_request);
 static EVENT_HANDLER_DECLARE(handle_put_request);
 static EVENT_HANDLER_DECLARE(handle_unlock_request);
 
+/* the returned path lives in the request's arena */
 static char *
 path_from_request_uri(struct handler_context *hc, const char *uri) {
   const char *abs_path_start;
@@ -89,7 +133,7 @@ path_from_request_uri(struct handler_context *hc, const char *uri) {
 
   if (!str_equals(hc->serv->internal_root, "/")) {
     if (str_equals(abs_path_start, hc->serv->internal_root)) {
-      return davfuse_util_strdup("/");
+      return arena_strdup(&hc->arena, "/");
     }
 
     /* now `abs_path_start` must start with the internal root,
@@ -118,8 +162,15 @@ path_from_request_uri(struct handler_context *hc, const char *uri) {
     abs_path_end -= 1;
   }
 
-  /* path could be something like /hai%20;there/sup, this fixes that */
-  return decode_urlpath(abs_path_start, abs_path_end - abs_path_start);
+  /* path could be something like /hai%20;there/sup, this fixes that,
+     decoding never makes it longer */
+  const size_t abs_path_len = abs_path_end - abs_path_start;
+  char *const path = arena_alloc(&hc->arena, abs_path_len + 1);
+  if (!path) return NULL;
+
+  decode_urlpath_into(abs_path_start, abs_path_len, path);
+
+  return path;
 }
 
 static char *
@@ -134,37 +185,34 @@ path_from_public_uri(struct handler_context *hc, const char *uri) {
 }
 
 
+/* the returned uri lives in the request's arena */
 static char *
 public_uri_from_path(struct handler_context *hc, const char *path, bool is_collection) {
-  UNUSED(is_collection);
   assert(str_startswith(path, "/"));
   assert(str_equals(path, "/") || !str_endswith(path, "/"));
 
-  char *const encoded_path = encode_urlpath(path, strlen(path));
+  const size_t path_len = strlen(path);
+  char *const encoded_path =
+    arena_alloc(&hc->arena, encoded_urlpath_size(path, path_len) + 1);
+  if (!encoded_path) return NULL;
+  encode_urlpath_into(path, path_len, encoded_path);
 
   const bool internal_root_is_root = str_equals(hc->serv->internal_root, "/");
   const bool path_is_root = str_equals(path, "/");
 
-  char *const real_uri = super_strcat(hc->serv->public_uri_root,
-                                      hc->serv->internal_root + 1,
-                                      internal_root_is_root
-                                      ? ""
-                                      : (path_is_root
-                                         ? ""
-                                         : "/"),
-                                      encoded_path + 1,
-                                      (!internal_root_is_root || !path_is_root) && is_collection
-                                      ? "/"
-                                      : "",
-                                      NULL);
-  if (!real_uri) {
-    goto done;
-  }
-
- done:
-  free(encoded_path);
-
-  return real_uri;
+  return arena_strcat(&hc->arena,
+                      hc->serv->public_uri_root,
+                      hc->serv->internal_root + 1,
+                      internal_root_is_root
+                      ? ""
+                      : (path_is_root
+                         ? ""
+                         : "/"),
+                      encoded_path + 1,
+                      (!internal_root_is_root || !path_is_root) && is_collection
+                      ? "/"
+                      : "",
+                      NULL);
 }
 
 static bool
@@ -285,7 +333,6 @@ UTHR_DEFINE(_request_uri_is_collection_uthr) {
   ctx->ev.is_collection = propfind_done_ev->entry.is_collection;
 
  done:
-  free(ctx->path);
   UTHR_RETURN(ctx,
               ctx->cb(REQUEST_URI_IS_COLLECTION_DONE_EVENT,
                       &ctx->ev, ctx->cb_ud));
@@ -326,14 +373,51 @@ webdav_get_depth(const HTTPRequestHeaders *rhs) {
   return depth;
 }
 
+/* true if `c` can follow a complete TimeType token */
+static bool
+is_timeout_token_end(char c) {
+  return c == '\0' || c == ',' || c == ' ' || c == '\t';
+}
+
 static webdav_timeout_t
 webdav_get_timeout(const HTTPRequestHeaders *rhs) {
-  UNUSED(rhs);
-  UNUSED(WEBDAV_HEADER_TIMEOUT);
-  /* just lock for 60 seconds for now,
-     we don't have to honor timeout headers */
-  /* TODO: fix this */
-  return 60;
+  const char *timeout_str = http_get_header_value(rhs, WEBDAV_HEADER_TIMEOUT);
+  if (!timeout_str) return WEBDAV_DEFAULT_LOCK_TIMEOUT;
+
+  /* Timeout is a list of "Infinite" or "Second-N" values in order of
+     preference, take the first one we understand (RFC 4918, 10.7) */
+  static const char infinite_str[] = "Infinite";
+  static const char second_str[] = "Second-";
+  while (true) {
+    timeout_str = skip_ws(timeout_str);
+
+    if (!ascii_strncasecmp(timeout_str, infinite_str,
+                           sizeof(infinite_str) - 1) &&
+        is_timeout_token_end(timeout_str[sizeof(infinite_str) - 1])) {
+      return WEBDAV_MAX_LOCK_TIMEOUT;
+    }
+
+    if (!ascii_strncasecmp(timeout_str, second_str,
+                           sizeof(second_str) - 1)) {
+      const char *const num_str = timeout_str + sizeof(second_str) - 1;
+      if (isdigit((unsigned char) *num_str)) {
+        errno = 0;
+        const unsigned long long ret = strtoull(num_str, NULL, 10);
+        if (errno == ERANGE || ret > WEBDAV_MAX_LOCK_TIMEOUT) {
+          return WEBDAV_MAX_LOCK_TIMEOUT;
+        }
+        return MAX(ret, 1);
+      }
+    }
+
+    timeout_str = strchr(timeout_str, ',');
+    if (!timeout_str) break;
+    timeout_str += 1;
+  }
+
+  log_info("Client sent up bad timeout header: %s",
+           http_get_header_value(rhs, WEBDAV_HEADER_TIMEOUT));
+  return WEBDAV_DEFAULT_LOCK_TIMEOUT;
 }
 
 enum {
@@ -395,7 +479,7 @@ webdav_get_if_lock_token(struct handler_context *hc, char **resource_tag, char *
 
     size_t len_of_uri = end_of_uri - (if_header + i);
     *resource_tag =
-      strndup_x(if_header + i, len_of_uri);
+      arena_strndup(&hc->arena, if_header + i, len_of_uri);
 
     if (!*resource_tag) {
       toret = IF_LOCK_TOKEN_ERR_INTERNAL;
@@ -410,11 +494,12 @@ webdav_get_if_lock_token(struct handler_context *hc, char **resource_tag, char *
     /* no resource tag passed in, this lock token is related to the method uri */
     if (str_startswith(rhs->uri, "/")) {
       /* if this was relative uri, make sure to make it into a public uri */
-      *resource_tag = super_strcat(hc->serv->public_uri_root,
+      *resource_tag = arena_strcat(&hc->arena,
+                                   hc->serv->public_uri_root,
                                    &rhs->uri[1], NULL);
     }
     else {
-      *resource_tag = davfuse_util_strdup(rhs->uri);
+      *resource_tag = arena_strdup(&hc->arena, rhs->uri);
     }
   }
 
@@ -440,7 +525,7 @@ webdav_get_if_lock_token(struct handler_context *hc, char **resource_tag, char *
   }
 
   *lock_token =
-    strndup_x(if_header + i, end_of_uri - (if_header + i));
+    arena_strndup(&hc->arena, if_header + i, end_of_uri - (if_header + i));
   if (!*lock_token) {
     toret = IF_LOCK_TOKEN_ERR_INTERNAL;
     goto error;
@@ -448,9 +533,7 @@ webdav_get_if_lock_token(struct handler_context *hc, char **resource_tag, char *
 
   if (false) {
   error:
-    free(*resource_tag);
     *resource_tag = NULL;
-    free(*lock_token);
     *lock_token = NULL;
   }
   else {
@@ -469,14 +552,101 @@ is_parent_path(const char *potential_parent, const char *potential_child) {
 }
 
 static void
-free_webdav_lock_descriptor(void *ld) {
-  WebdavLockDescriptor *wdld = ld;
+free_webdav_lock_descriptor(WebdavLockDescriptor *wdld) {
   free(wdld->path);
   owner_xml_free(wdld->owner_xml);
   free(wdld->lock_token);
-  free(ld);
+  free(wdld);
+}
+
+/* the lock table may be shared with servers running on other threads,
+   nothing that points into it may be used after unlocking */
+static void
+_webdav_server_shared_lock(struct webdav_server_shared *shared) {
+#ifndef _WIN32
+  const int ret = pthread_mutex_lock(&shared->lock);
+  ASSERT_TRUE(!ret);
+#else
+  UNUSED(shared);
+#endif
+}
+
+static void
+_webdav_server_shared_unlock(struct webdav_server_shared *shared) {
+#ifndef _WIN32
+  const int ret = pthread_mutex_unlock(&shared->lock);
+  ASSERT_TRUE(!ret);
+#else
+  UNUSED(shared);
+#endif
+}
+
+static
+EVENT_HANDLER_DECLARE(lock_reaper_handler);
+
+/* expired locks are reaped in bulk from a single timer armed for the
+   earliest expiry in the table, instead of being checked on each request */
+static void
+schedule_lock_reaper(struct webdav_server *ws) {
+  if (ws->is_stopped) return;
+
+  uint64_t next_expiry;
+  _webdav_server_shared_lock(ws->shared);
+  const bool has_locks =
+    webdav_lock_table_next_expiry(ws->shared->locks, &next_expiry);
+  _webdav_server_shared_unlock(ws->shared);
+  if (!has_locks) return;
+
+  /* an already armed timer that fires no later is good enough,
+     it will reschedule itself */
+  if (ws->lock_reaper_key) {
+    if (ws->lock_reaper_expires_at <= next_expiry) return;
+    const bool success_remove =
+      event_loop_timeout_remove(ws->loop, ws->lock_reaper_key);
+    ASSERT_TRUE(success_remove);
+    ws->lock_reaper_key = 0;
+  }
+
+  UptimeTimespec uptime;
+  const bool success_uptime = uptime_time(&uptime);
+  ASSERT_TRUE(success_uptime);
+
+  const EventLoopTimeout timeout = {
+    .sec = next_expiry > uptime.seconds ? next_expiry - uptime.seconds : 0,
+    .nsec = 0,
+  };
+  const bool success_timeout =
+    event_loop_timeout_add(ws->loop, &timeout,
+                           lock_reaper_handler, ws,
+                           &ws->lock_reaper_key);
+  /* TODO: handle this better */
+  ASSERT_TRUE(success_timeout);
+  ws->lock_reaper_expires_at = next_expiry;
 }
 
+static
+EVENT_HANDLER_DEFINE(lock_reaper_handler, ev_type, ev, ud) {
+  struct webdav_server *const ws = ud;
+
+  UNUSED(ev_type);
+  UNUSED(ev);
+
+  /* timeouts are one-shot */
+  ws->lock_reaper_key = 0;
+
+  UptimeTimespec uptime;
+  const bool success_uptime = uptime_time(&uptime);
+  ASSERT_TRUE(success_uptime);
+
+  _webdav_server_shared_lock(ws->shared);
+  webdav_lock_table_remove_expired(ws->shared->locks, uptime.seconds,
+                                   free_webdav_lock_descriptor);
+  _webdav_server_shared_unlock(ws->shared);
+
+  schedule_lock_reaper(ws);
+}
+
+/* `lock_token` and `status_path` are copies owned by the caller */
 static bool
 perform_write_lock(struct webdav_server *ws,
                    const char *file_path,
@@ -486,37 +656,47 @@ perform_write_lock(struct webdav_server *ws,
                    bool is_exclusive,
                    owner_xml_t owner_xml,
                    bool *is_locked,
-                   const char **lock_token,
-                   const char **status_path,
+                   char **lock_token,
+                   char **status_path,
                    bool *status_path_is_collection) {
-  /* go through lock list and see if this path (or any descendants if depth != 0)
-     have an incompatible lock
-     if so then set that path as the status_path and return *is_locked = true
-  */
-  LINKED_LIST_FOR (WebdavLockDescriptor, elt, ws->locks) {
-    bool parent_locks_us = false;
-    if ((str_equals(elt->path, file_path) ||
-         (depth == DEPTH_INF && is_parent_path(file_path, elt->path)) ||
-         (parent_locks_us = (elt->depth == DEPTH_INF && is_parent_path(elt->path, file_path)))) &&
-        (is_exclusive || elt->is_exclusive)) {
-      *is_locked = true;
-      *status_path = parent_locks_us ? file_path : elt->path;
-      *status_path_is_collection = parent_locks_us ? is_collection : elt->is_collection;
-      /* if the davfuse_util_strdup failed then we return false */
-      return *status_path;
-    }
-  }
-
-  /* generate a lock token */
   UptimeTimespec uptime;
   bool success_uptime = uptime_time(&uptime);
   if (!success_uptime) return false;
 
+  _webdav_server_shared_lock(ws->shared);
+
+  /* go through lock list and see if this path (or any descendants if depth != 0)
+     have an incompatible lock
+     if so then set that path as the status_path and return *is_locked = true
+  */
+  /* a shared lock only conflicts with exclusive locks */
+  WebdavLockDescriptor *elt =
+    webdav_lock_table_find_covering(ws->shared->locks, file_path, !is_exclusive);
+  /* a covering lock on another path must be on an ancestor */
+  const bool parent_locks_us = elt && !str_equals(elt->path, file_path);
+  if (!elt && depth == DEPTH_INF) {
+    elt = webdav_lock_table_find_descendant(ws->shared->locks, file_path,
+                                            !is_exclusive);
+  }
+
+  if (elt) {
+    *is_locked = true;
+    *status_path = davfuse_util_strdup(parent_locks_us ? file_path : elt->path);
+    ASSERT_NOT_NULL(*status_path);
+    *status_path_is_collection = parent_locks_us ? is_collection : elt->is_collection;
+    _webdav_server_shared_unlock(ws->shared);
+    return true;
+  }
+
+  /* generate a lock token, the id keeps it unique between
+     servers that generate tokens within the same nanosecond */
   char s_lock_token[256];
-  int len = snprintf(s_lock_token, sizeof(s_lock_token), "x-this-lock-token:///%lu.%lu",
-                     (long unsigned) uptime.seconds, (long unsigned) uptime.nanoseconds);
+  int len = snprintf(s_lock_token, sizeof(s_lock_token), "x-this-lock-token:///%lu.%lu.%lu",
+                     (long unsigned) uptime.seconds, (long unsigned) uptime.nanoseconds,
+                     ws->shared->next_lock_id++);
   if (len < 0 || (size_t) len >= sizeof(s_lock_token)) {
     /* lock token string was too long */
+    _webdav_server_shared_unlock(ws->shared);
     return false;
   }
 
@@ -530,6 +710,7 @@ perform_write_lock(struct webdav_server *ws,
     .owner_xml = owner_xml_copy(owner_xml),
     .lock_token = davfuse_util_strdup(s_lock_token),
     .timeout_in_seconds = timeout_in_seconds,
+    .expires_at = uptime.seconds + timeout_in_seconds,
     .is_collection = is_collection,
   };
 
@@ -540,13 +721,18 @@ perform_write_lock(struct webdav_server *ws,
     abort();
   }
 
-  *lock_token = new_lock->lock_token;
+  *lock_token = davfuse_util_strdup(new_lock->lock_token);
+  ASSERT_NOT_NULL(*lock_token);
 
-  ws->locks = linked_list_prepend(ws->locks, new_lock);
-  if (!ws->locks) {
+  const bool success_insert = webdav_lock_table_insert(ws->shared->locks, new_lock);
+  if (!success_insert) {
     abort();
   }
 
+  _webdav_server_shared_unlock(ws->shared);
+
+  schedule_lock_reaper(ws);
+
   *is_locked = false;
 
   return true;
@@ -559,16 +745,15 @@ unlock_resource(struct webdav_server *ws,
                 bool *unlocked) {
   *unlocked = false;
 
-  for (linked_list_t *llp = &ws->locks; *llp; llp = *llp ? &(*llp)->next : llp) {
-    WebdavLockDescriptor *elt = (*llp)->elt;
-    if (str_equals(elt->path, file_path) &&
-        str_equals(elt->lock_token, lock_token)) {
-      WebdavLockDescriptor *popped_elt = linked_list_pop_link(llp);
-      free_webdav_lock_descriptor(popped_elt);
-      *unlocked = true;
-      break;
-    }
+  _webdav_server_shared_lock(ws->shared);
+  WebdavLockDescriptor *elt =
+    webdav_lock_table_find_token(ws->shared->locks, lock_token);
+  if (elt && str_equals(elt->path, file_path)) {
+    webdav_lock_table_remove(ws->shared->locks, elt);
+    free_webdav_lock_descriptor(elt);
+    *unlocked = true;
   }
+  _webdav_server_shared_unlock(ws->shared);
 
   return true;
 }
@@ -576,18 +761,15 @@ unlock_resource(struct webdav_server *ws,
 static bool
 unconditionally_unlock_resource_and_descendants(struct webdav_server *ws,
                                                 const char *file_path) {
-  for (linked_list_t *llp = &ws->locks; *llp; llp = *llp ? &(*llp)->next : llp) {
-    WebdavLockDescriptor *elt = (*llp)->elt;
-    if (str_equals(file_path, elt->path) ||
-        is_parent_path(file_path, elt->path)) {
-      WebdavLockDescriptor *popped_elt = linked_list_pop_link(llp);
-      free_webdav_lock_descriptor(popped_elt);
-    }
-  }
+  _webdav_server_shared_lock(ws->shared);
+  webdav_lock_table_remove_tree(ws->shared->locks, file_path,
+                                free_webdav_lock_descriptor);
+  _webdav_server_shared_unlock(ws->shared);
 
   return true;
 }
 
+/* on success `owner_xml` is a copy owned by the caller */
 static bool
 refresh_lock(struct webdav_server *ws,
              const char *file_path, const char *lock_token,
@@ -597,69 +779,83 @@ refresh_lock(struct webdav_server *ws,
              webdav_depth_t *depth) {
   *refreshed = false;
 
-  LINKED_LIST_FOR (WebdavLockDescriptor, elt, ws->locks) {
-    if (str_equals(elt->lock_token, lock_token) &&
-        (str_equals(elt->path, file_path) ||
-         is_parent_path(elt->path, file_path))) {
-      /* we don't necessarily have to do this, but just do it for now */
-      elt->timeout_in_seconds = new_timeout;
-      *refreshed = true;
-      *owner_xml = elt->owner_xml;
-      *is_exclusive = elt->is_exclusive;
-      *depth = elt->depth;
-      break;
-    }
-  }
+  UptimeTimespec uptime;
+  const bool success_uptime = uptime_time(&uptime);
+  if (!success_uptime) return false;
+
+  _webdav_server_shared_lock(ws->shared);
+  WebdavLockDescriptor *elt =
+    webdav_lock_table_find_token(ws->shared->locks, lock_token);
+  if (elt &&
+      (str_equals(elt->path, file_path) ||
+       is_parent_path(elt->path, file_path))) {
+    elt->timeout_in_seconds = new_timeout;
+    webdav_lock_table_set_expiry(ws->shared->locks, elt,
+                                 uptime.seconds + new_timeout);
+    *refreshed = true;
+    *owner_xml = owner_xml_copy(elt->owner_xml);
+    ASSERT_NOT_NULL(*owner_xml);
+    *is_exclusive = elt->is_exclusive;
+    *depth = elt->depth;
+  }
+  _webdav_server_shared_unlock(ws->shared);
+
+  if (*refreshed) schedule_lock_reaper(ws);
 
   return true;
 }
 
+/* `locked_path` and `locked_lock_token` are copies owned by the caller */
 static bool
 is_resource_locked(struct webdav_server *ws,
                    const char *file_path,
                    bool *is_locked,
-                   const char **locked_path,
-                   const char **locked_lock_token,
+                   char **locked_path,
+                   char **locked_lock_token,
                    bool *is_locked_path_collection) {
   *is_locked = false;
 
-  LINKED_LIST_FOR (WebdavLockDescriptor, elt, ws->locks) {
-    if (str_equals(elt->path, file_path) ||
-        (elt->depth == DEPTH_INF &&
-         is_parent_path(elt->path, file_path))) {
-      *is_locked = true;
-      if (locked_path) {
-        *locked_path = elt->path;
-      }
-      if (locked_lock_token) {
-        *locked_lock_token = elt->lock_token;
-      }
-      if (is_locked_path_collection) {
-        *is_locked_path_collection = elt->is_collection;
-      }
-      break;
+  _webdav_server_shared_lock(ws->shared);
+  WebdavLockDescriptor *elt =
+    webdav_lock_table_find_covering(ws->shared->locks, file_path, false);
+  if (elt) {
+    *is_locked = true;
+    if (locked_path) {
+      *locked_path = davfuse_util_strdup(elt->path);
+      ASSERT_NOT_NULL(*locked_path);
+    }
+    if (locked_lock_token) {
+      *locked_lock_token = davfuse_util_strdup(elt->lock_token);
+      ASSERT_NOT_NULL(*locked_lock_token);
+    }
+    if (is_locked_path_collection) {
+      *is_locked_path_collection = elt->is_collection;
     }
   }
+  _webdav_server_shared_unlock(ws->shared);
 
   return true;
 }
 
+/* `locked_descendant` is a copy owned by the caller */
 static bool
 are_any_descendants_locked(struct webdav_server *ws,
                            const char *file_path,
                            bool *is_descendant_locked,
-                           const char **locked_descendant,
+                           char **locked_descendant,
                            bool *locked_descendant_is_collection) {
   *is_descendant_locked = false;
 
-  LINKED_LIST_FOR (WebdavLockDescriptor, elt, ws->locks) {
-    if (is_parent_path(file_path, elt->path)) {
-      *is_descendant_locked = true;
-      *locked_descendant = elt->path;
-      *locked_descendant_is_collection = elt->is_collection;
-      break;
-    }
+  _webdav_server_shared_lock(ws->shared);
+  WebdavLockDescriptor *elt =
+    webdav_lock_table_find_descendant(ws->shared->locks, file_path, false);
+  if (elt) {
+    *is_descendant_locked = true;
+    *locked_descendant = davfuse_util_strdup(elt->path);
+    ASSERT_NOT_NULL(*locked_descendant);
+    *locked_descendant_is_collection = elt->is_collection;
   }
+  _webdav_server_shared_unlock(ws->shared);
 
   return true;
 }
@@ -684,8 +880,8 @@ _can_modify_path(struct handler_context *hc,
 
   /* check if the path is locked or is a descendant of a locked path
      (directly or indirectly locked) */
-  const char *locked_path = NULL;
-  const char *locked_lock_token = NULL;
+  char *locked_path = NULL;
+  char *locked_lock_token = NULL;
   bool is_locked;
   /* NB: normally wouldn't have to set this but there
      is a bug in the GCC optimizer that doesn't realize that:
@@ -718,7 +914,6 @@ _can_modify_path(struct handler_context *hc,
                                status_code,
                                response_body,
                                response_body_len);
-    free(public_uri);
     if (!success_generate) {
       *status_code = HTTP_STATUS_CODE_INTERNAL_SERVER_ERROR;
     }
@@ -731,7 +926,8 @@ _can_modify_path(struct handler_context *hc,
     *status_code = HTTP_STATUS_CODE_PRECONDITION_FAILED;
   }
 
-  free(lock_token_fpath);
+  free(locked_path);
+  free(locked_lock_token);
 }
 
 static void
@@ -752,12 +948,12 @@ can_modify_path(struct handler_context *hc,
 
   if (if_lock_token_err == IF_LOCK_TOKEN_ERR_INTERNAL) {
     *status_code = HTTP_STATUS_CODE_INTERNAL_SERVER_ERROR;
-    goto done;
+    return;
   }
 
   if (if_lock_token_err == IF_LOCK_TOKEN_ERR_BAD_PARSE) {
     *status_code = HTTP_STATUS_CODE_BAD_REQUEST;
-    goto done;
+    return;
   }
 
   _can_modify_path(hc, if_lock_token_err,
@@ -766,10 +962,6 @@ can_modify_path(struct handler_context *hc,
                    fpath,
                    status_code,
                    response_body, response_body_len);
-
- done:
-  free(lock_resource);
-  free(lock_token);
 }
 
 static void
@@ -790,12 +982,12 @@ can_unlink_path(struct handler_context *hc,
 
   if (if_lock_token_err == IF_LOCK_TOKEN_ERR_INTERNAL) {
     *status_code = HTTP_STATUS_CODE_INTERNAL_SERVER_ERROR;
-    goto done;
+    return;
   }
 
   if (if_lock_token_err == IF_LOCK_TOKEN_ERR_BAD_PARSE) {
     *status_code = HTTP_STATUS_CODE_BAD_REQUEST;
-    goto done;
+    return;
   }
 
   _can_modify_path(hc, if_lock_token_err,
@@ -809,14 +1001,14 @@ can_unlink_path(struct handler_context *hc,
     /* if we haven't gotten a status code yet,
        then check if any descendant is locked */
     bool is_descendant_locked;
-    const char *locked_descendant;
+    char *locked_descendant = NULL;
     bool locked_descendant_is_collection;
     bool success_child_locked =
       are_any_descendants_locked(hc->serv, fpath,
                                  &is_descendant_locked, &locked_descendant, &locked_descendant_is_collection);
     if (!success_child_locked) {
       *status_code = HTTP_STATUS_CODE_INTERNAL_SERVER_ERROR;
-      goto done;
+      return;
     }
 
     if (is_descendant_locked) {
@@ -828,17 +1020,14 @@ can_unlink_path(struct handler_context *hc,
                                             status_code,
                                             response_body,
                                             response_body_len);
-      free(public_uri);
 
       if (!success_generate) {
         *status_code = HTTP_STATUS_CODE_INTERNAL_SERVER_ERROR;
       }
     }
-  }
 
- done:
-  free(lock_resource);
-  free(lock_token);
+    free(locked_descendant);
+  }
 }
 
 
@@ -848,9 +1037,7 @@ UTHR_DEFINE(request_proc) {
 
   UTHR_HEADER(struct handler_context, hc);
 
-  const http_error_code_t err = http_request_force_connection_close(hc->rh);
-  (void) err;
-  assert(err == HTTP_SUCCESS);
+  arena_init(&hc->arena, &hc->serv->arena_chunks);
 
   http_request_log_info(hc->rh, "New request!");
 
@@ -888,7 +1075,15 @@ UTHR_DEFINE(request_proc) {
 
       bool success_set_location_header =
         http_response_add_header(&hc->resp, "Location", "%s/", hc->rhs.uri);
-      ASSERT_TRUE(success_set_location_header);
+      if (!success_set_location_header) {
+        /* the target is too long to fit in a response header */
+        http_request_log_info(hc->rh, "Can't redirect to '%s/'", hc->rhs.uri);
+        success_init = http_response_init(&hc->resp);
+        ASSERT_TRUE(success_init);
+        bool success_set_too_long_code =
+          http_response_set_code(&hc->resp, HTTP_STATUS_CODE_URI_TOO_LONG);
+        ASSERT_TRUE(success_set_too_long_code);
+      }
 
       bool success_set_content_length_header =
         http_response_add_header(&hc->resp, HTTP_HEADER_CONTENT_LENGTH, "0");
@@ -935,6 +1130,12 @@ UTHR_DEFINE(request_proc) {
   }
   else if (str_case_equals(hc->rhs.method, "GET")) {
     ctx->handler = handle_get_request;
+    hc->sub.get.is_head = false;
+  }
+  else if (str_case_equals(hc->rhs.method, "HEAD")) {
+    /* same as get but the backend isn't asked for the body */
+    ctx->handler = handle_get_request;
+    hc->sub.get.is_head = true;
   }
   else if (str_case_equals(hc->rhs.method, "LOCK")) {
     ctx->handler = handle_lock_request;
@@ -988,6 +1189,8 @@ UTHR_DEFINE(request_proc) {
 
   http_request_end(hc->rh);
 
+  arena_reset(&hc->arena);
+
   UTHR_RETURN(hc, 0);
 
   UTHR_FOOTER();
@@ -1131,9 +1334,6 @@ EVENT_HANDLER_DEFINE(handle_copy_request, ev_type, ev, ud) {
   }
 
  done:
-  free(ctx->src_relative_uri);
-  free(ctx->dst_relative_uri);
-
   CRYIELD(ctx->pos,
           http_request_simple_response(hc->rh,
                                        status_code,
@@ -1225,7 +1425,6 @@ EVENT_HANDLER_DEFINE(handle_delete_request, ev_type, ev, ud) {
 
  done:
   assert(status_code);
-  free(ctx->request_relative_uri);
 
   CRYIELD(ctx->pos,
           http_request_simple_response(hc->rh,
@@ -1244,21 +1443,31 @@ EVENT_HANDLER_DEFINE(handle_delete_request, ev_type, ev, ud) {
   CREND();
 }
 
-void
-webdav_get_request_size_hint(webdav_get_request_ctx_t hc,
-                             size_t size,
-                             event_handler_t cb, void *cb_ud) {
-  struct get_context *ctx = &hc->sub.get;
+/* for extra headers passed to http_request_simple_response(),
+   `value` isn't copied, the list lives in the request's arena */
+static linked_list_t
+prepend_header(struct handler_context *hc, linked_list_t headers,
+               const char *name, const char *value) {
+  HeaderPair *const hp = arena_alloc(&hc->arena, sizeof(*hp));
+  ASSERT_NOT_NULL(hp);
+  hp->name = (char *) name;
+  hp->value = (char *) value;
+
+  struct _ll *const link = arena_alloc(&hc->arena, sizeof(*link));
+  ASSERT_NOT_NULL(link);
+  *link = (struct _ll) {.elt = hp, .next = headers};
+  return link;
+}
 
-  bool success_set_code = http_response_set_code(&hc->resp, HTTP_STATUS_CODE_OK);
-  ASSERT_TRUE(success_set_code);
+static void
+add_get_entity_headers(struct handler_context *hc) {
+  struct get_context *ctx = &hc->sub.get;
 
-  assert(size <= ULONG_MAX);
-  bool success_add_header =
-    http_response_add_header(&hc->resp,
-                             HTTP_HEADER_CONTENT_LENGTH, "%lu",
-                             (unsigned long) size);
-  ASSERT_TRUE(success_add_header);
+  if (ctx->has_etag) {
+    bool success_add_etag_header =
+      http_response_add_header(&hc->resp, HTTP_HEADER_ETAG, "%s", ctx->etag);
+    ASSERT_TRUE(success_add_etag_header);
+  }
 
   if (ctx->entry.modified_time != INVALID_WEBDAV_RESOURCE_TIME) {
     char time_buf[400];
@@ -1273,7 +1482,154 @@ webdav_get_request_size_hint(webdav_get_request_ctx_t hc,
     ASSERT_TRUE(success_add_last_modified_header);
   }
 
+  if (ctx->entry.length != INVALID_WEBDAV_RESOURCE_SIZE) {
+    bool success_add_accept_ranges_header =
+      http_response_add_header(&hc->resp,
+                               HTTP_HEADER_ACCEPT_RANGES, "bytes");
+    ASSERT_TRUE(success_add_accept_ranges_header);
+  }
+}
+
+static void
+set_get_response_headers(struct handler_context *hc,
+                         bool is_length_known, size_t size) {
+  struct get_context *ctx = &hc->sub.get;
+
+  bool success_set_code = http_response_set_code(&hc->resp, HTTP_STATUS_CODE_OK);
+  ASSERT_TRUE(success_set_code);
+
+  bool success_add_header;
+  if (is_length_known) {
+    assert(size <= ULONG_MAX);
+    success_add_header =
+      http_response_add_header(&hc->resp,
+                               HTTP_HEADER_CONTENT_LENGTH, "%lu",
+                               (unsigned long) size);
+  }
+  else {
+    success_add_header =
+      http_response_add_header(&hc->resp,
+                               HTTP_HEADER_TRANSFER_ENCODING, "chunked");
+  }
+  ASSERT_TRUE(success_add_header);
+
+  add_get_entity_headers(hc);
+
   ctx->set_size_hint = true;
+}
+
+/* generates the delimiter and headers that precede part `range_idx`
+   of a multipart/byteranges body, or the final delimiter if
+   `range_idx` is `num_ranges`, returns the length it would have
+   had if `buf` was big enough */
+static size_t
+generate_byteranges_part_header(struct get_context *ctx, size_t range_idx,
+                                char *buf, size_t buf_size) {
+  int len;
+  if (range_idx == ctx->num_ranges) {
+    len = snprintf(buf, buf_size, "\r\n--%s--\r\n", ctx->boundary);
+  }
+  else {
+    assert(ctx->entry.length <= ULONG_MAX);
+    len = snprintf(buf, buf_size,
+                   "\r\n--%s\r\n"
+                   "Content-Range: bytes %lu-%lu/%lu\r\n"
+                   "\r\n",
+                   ctx->boundary,
+                   (unsigned long) ctx->ranges[range_idx].first,
+                   (unsigned long) ctx->ranges[range_idx].last,
+                   (unsigned long) ctx->entry.length);
+  }
+  ASSERT_TRUE(len >= 0);
+  return len;
+}
+
+static void
+set_range_response_headers(struct handler_context *hc) {
+  struct get_context *ctx = &hc->sub.get;
+
+  bool success_set_code =
+    http_response_set_code(&hc->resp, HTTP_STATUS_CODE_PARTIAL_CONTENT);
+  ASSERT_TRUE(success_set_code);
+
+  bool success_add_header;
+  size_t content_length = 0;
+  if (ctx->num_ranges == 1) {
+    assert(ctx->entry.length <= ULONG_MAX);
+    success_add_header =
+      http_response_add_header(&hc->resp,
+                               HTTP_HEADER_CONTENT_RANGE, "bytes %lu-%lu/%lu",
+                               (unsigned long) ctx->ranges[0].first,
+                               (unsigned long) ctx->ranges[0].last,
+                               (unsigned long) ctx->entry.length);
+    ASSERT_TRUE(success_add_header);
+    content_length = ctx->ranges[0].last - ctx->ranges[0].first + 1;
+  }
+  else {
+    UptimeTimespec uptime;
+    const bool success_uptime = uptime_time(&uptime);
+    ASSERT_TRUE(success_uptime);
+    int len = snprintf(ctx->boundary, sizeof(ctx->boundary), "%08lx%08lx",
+                       (unsigned long) uptime.seconds,
+                       (unsigned long) uptime.nanoseconds);
+    ASSERT_TRUE(len >= 0 && (size_t) len < sizeof(ctx->boundary));
+
+    success_add_header =
+      http_response_add_header(&hc->resp,
+                               HTTP_HEADER_CONTENT_TYPE,
+                               "multipart/byteranges; boundary=%s",
+                               ctx->boundary);
+    ASSERT_TRUE(success_add_header);
+
+    for (size_t i = 0; i <= ctx->num_ranges; ++i) {
+      content_length += generate_byteranges_part_header(ctx, i, NULL, 0);
+      if (i < ctx->num_ranges) {
+        content_length += ctx->ranges[i].last - ctx->ranges[i].first + 1;
+      }
+    }
+  }
+
+  assert(content_length <= ULONG_MAX);
+  success_add_header =
+    http_response_add_header(&hc->resp,
+                             HTTP_HEADER_CONTENT_LENGTH, "%lu",
+                             (unsigned long) content_length);
+  ASSERT_TRUE(success_add_header);
+
+  add_get_entity_headers(hc);
+
+  ctx->set_size_hint = true;
+}
+
+/* a range request is only honored if the resource
+   hasn't changed since the client's copy */
+static bool
+if_range_matches(struct handler_context *hc) {
+  struct get_context *ctx = &hc->sub.get;
+
+  const char *if_range_value =
+    http_get_header_value(&hc->rhs, HTTP_HEADER_IF_RANGE);
+  if (!if_range_value) return true;
+
+  /* entity tags must match exactly, weak ones never match */
+  if_range_value = skip_ws(if_range_value);
+  if (*if_range_value == '"' || str_startswith(if_range_value, "W/")) {
+    return ctx->has_etag && str_equals(if_range_value, ctx->etag);
+  }
+
+  time_t if_range_time;
+  return (ctx->entry.modified_time != INVALID_WEBDAV_RESOURCE_TIME &&
+          parse_http_date(if_range_value, &if_range_time) &&
+          ctx->entry.modified_time == if_range_time);
+}
+
+void
+webdav_get_request_size_hint(webdav_get_request_ctx_t hc,
+                             size_t size,
+                             event_handler_t cb, void *cb_ud) {
+  /* range responses know their size up front */
+  if (!hc->sub.get.ranges) set_get_response_headers(hc, true, size);
+
   WebdavGetRequestSizeHintDoneEvent ev = {.error = WEBDAV_ERROR_NONE};
   return cb(WEBDAV_GET_REQUEST_SIZE_HINT_DONE_EVENT, &ev, cb_ud);
 }
@@ -1284,6 +1640,24 @@ webdav_get_request_write(webdav_get_request_ctx_t get_ctx,
                          event_handler_t cb, void *cb_ud) {
   WebdavGetRequestWriteEvent ev = {
     .buf = buf,
+    .fd = -1,
+    .nbyte = nbyte,
+    .cb = cb,
+    .cb_ud = cb_ud,
+  };
+
+  return handle_get_request(WEBDAV_GET_REQUEST_WRITE_EVENT, &ev, get_ctx);
+}
+
+void
+webdav_get_request_sendfile(webdav_get_request_ctx_t get_ctx,
+                            int fd, uint64_t offset, size_t nbyte,
+                            event_handler_t cb, void *cb_ud) {
+  assert(fd >= 0);
+  WebdavGetRequestWriteEvent ev = {
+    .buf = NULL,
+    .fd = fd,
+    .offset = offset,
     .nbyte = nbyte,
     .cb = cb,
     .cb_ud = cb_ud,
@@ -1311,6 +1685,11 @@ EVENT_HANDLER_DEFINE(handle_get_request, ev_type, ev, ud) {
 
   http_status_code_t code;
 
+  ctx->ranges = NULL;
+  ctx->num_ranges = 0;
+  ctx->has_etag = false;
+  ctx->headers = LINKED_LIST_INITIALIZER;
+
   ctx->resource_uri = path_from_request_uri(hc, hc->rhs.uri);
   if (!ctx->resource_uri) {
     http_request_log_info(hc->rh,
@@ -1338,10 +1717,34 @@ EVENT_HANDLER_DEFINE(handle_get_request, ev_type, ev, ud) {
   }
 
   ctx->entry = propfind_done_event->entry;
+  ctx->has_etag = webdav_propfind_entry_etag(&ctx->entry,
+                                             ctx->etag, sizeof(ctx->etag));
+
+  const char *if_match_value =
+    http_get_header_value(&hc->rhs, HTTP_HEADER_IF_MATCH);
+  if (if_match_value &&
+      !http_etag_list_matches(if_match_value,
+                              ctx->has_etag ? ctx->etag : NULL,
+                              false)) {
+    code = HTTP_STATUS_CODE_PRECONDITION_FAILED;
+    goto done;
+  }
+
+  /* if-none-match takes precedence over if-modified-since */
+  const char *if_none_match_value =
+    http_get_header_value(&hc->rhs, HTTP_HEADER_IF_NONE_MATCH);
+  if (if_none_match_value &&
+      http_etag_list_matches(if_none_match_value,
+                             ctx->has_etag ? ctx->etag : NULL,
+                             true)) {
+    code = HTTP_STATUS_CODE_NOT_MODIFIED;
+    goto done;
+  }
 
   const char *if_modified_since_value =
     http_get_header_value(&hc->rhs, HTTP_HEADER_IF_MODIFIED_SINCE);
   if (ctx->entry.modified_time != INVALID_WEBDAV_RESOURCE_TIME &&
+      !if_none_match_value &&
       if_modified_since_value) {
     time_t if_modified_since_time_value;
     bool success_parse =
@@ -1367,67 +1770,187 @@ EVENT_HANDLER_DEFINE(handle_get_request, ev_type, ev, ud) {
     }
   }
 
-  CRYIELD(ctx->pos,
-          webdav_backend_get(hc->serv->fs, ctx->resource_uri, hc));
-  ctx->amt_sent = 0;
-  while (ev_type != WEBDAV_GET_REQUEST_END_EVENT) {
-    assert(ev_type == WEBDAV_GET_REQUEST_WRITE_EVENT);
-    ctx->rwev = *((WebdavGetRequestWriteEvent *) ev);
-
-    if (!ctx->set_size_hint) {
-      /* this is an error */
-      http_request_log_error(hc->rh, "Backend did not set size hint, failing write request");
-      goto loop_error;
+  if (ctx->is_head) {
+    /* the backends don't define a body for collections */
+    if (ctx->entry.is_collection) {
+      code = HTTP_STATUS_CODE_METHOD_NOT_ALLOWED;
+      goto done;
     }
 
-    if (!ctx->sent_headers) {
+    set_get_response_headers(hc,
+                             ctx->entry.length != INVALID_WEBDAV_RESOURCE_SIZE,
+                             ctx->entry.length);
+    CRYIELD(ctx->pos,
+            http_request_write_headers(hc->rh, &hc->resp,
+                                       handle_get_request, hc));
+    assert(ev_type == HTTP_REQUEST_WRITE_HEADERS_DONE_EVENT);
+    ctx->sent_headers = true;
+    goto done;
+  }
+
+  /* a malformed or unsatisfiable range header is ignored,
+     the whole resource is sent instead */
+  const char *range_value = http_get_header_value(&hc->rhs, HTTP_HEADER_RANGE);
+  if (range_value &&
+      !ctx->entry.is_collection &&
+      ctx->entry.length != INVALID_WEBDAV_RESOURCE_SIZE &&
+      if_range_matches(hc)) {
+    bool success_parse =
+      parse_http_byte_ranges(range_value, ctx->entry.length, MAX_GET_RANGES,
+                             &ctx->ranges, &ctx->num_ranges);
+    if (success_parse && !ctx->num_ranges) {
+      http_request_log_debug(hc->rh, "Unsatisfiable range: \"%s\"",
+                             range_value);
+      free(ctx->ranges);
+      ctx->ranges = NULL;
+
+      bool success_set_code =
+        http_response_set_code(&hc->resp,
+                               HTTP_STATUS_CODE_RANGE_NOT_SATISFIABLE);
+      ASSERT_TRUE(success_set_code);
+      assert(ctx->entry.length <= ULONG_MAX);
+      bool success_add_header =
+        http_response_add_header(&hc->resp,
+                                 HTTP_HEADER_CONTENT_RANGE, "bytes */%lu",
+                                 (unsigned long) ctx->entry.length);
+      ASSERT_TRUE(success_add_header);
+      success_add_header =
+        http_response_add_header(&hc->resp, HTTP_HEADER_CONTENT_LENGTH, "0");
+      ASSERT_TRUE(success_add_header);
+
       CRYIELD(ctx->pos,
               http_request_write_headers(hc->rh, &hc->resp,
                                          handle_get_request, hc));
       assert(ev_type == HTTP_REQUEST_WRITE_HEADERS_DONE_EVENT);
-      HTTPRequestWriteHeadersDoneEvent *write_headers_ev = ev;
-      assert(write_headers_ev->request_handle == hc->rh);
-      if (write_headers_ev->err != HTTP_SUCCESS) {
-        http_request_log_error(hc->rh,
-                               "Error while writing headers, failing write request: %s",
-                               http_error_to_string(write_headers_ev->err));
+      ctx->sent_headers = true;
+      goto done;
+    }
+
+    if (ctx->num_ranges) set_range_response_headers(hc);
+  }
+
+  /* the backend is called once per range,
+     or once for the whole resource */
+  ctx->amt_sent = 0;
+  ctx->cur_range = 0;
+  while (true) {
+    ctx->sent_part_header = false;
+    CRYIELD(ctx->pos,
+            webdav_backend_get(hc->serv->fs, ctx->resource_uri,
+                               ctx->ranges ? ctx->ranges[ctx->cur_range].first : 0,
+                               ctx->ranges
+                               ? ctx->ranges[ctx->cur_range].last - ctx->ranges[ctx->cur_range].first + 1
+                               : SIZE_MAX,
+                               hc));
+    while (ev_type != WEBDAV_GET_REQUEST_END_EVENT) {
+      assert(ev_type == WEBDAV_GET_REQUEST_WRITE_EVENT);
+      ctx->rwev = *((WebdavGetRequestWriteEvent *) ev);
+
+      if (!ctx->set_size_hint) {
+        /* backend doesn't know the size, send it chunked */
+        set_get_response_headers(hc, false, 0);
+      }
+
+      if (!ctx->sent_headers) {
+        CRYIELD(ctx->pos,
+                http_request_write_headers(hc->rh, &hc->resp,
+                                           handle_get_request, hc));
+        assert(ev_type == HTTP_REQUEST_WRITE_HEADERS_DONE_EVENT);
+        HTTPRequestWriteHeadersDoneEvent *write_headers_ev = ev;
+        assert(write_headers_ev->request_handle == hc->rh);
+        if (write_headers_ev->err != HTTP_SUCCESS) {
+          http_request_log_error(hc->rh,
+                                 "Error while writing headers, failing write request: %s",
+                                 http_error_to_string(write_headers_ev->err));
+          goto loop_error;
+        }
+        ctx->sent_headers = true;
+      }
+
+      if (ctx->num_ranges > 1 && !ctx->sent_part_header) {
+        CRYIELD(ctx->pos,
+                http_request_write(hc->rh, ctx->part_header,
+                                   generate_byteranges_part_header(ctx, ctx->cur_range,
+                                                                   ctx->part_header,
+                                                                   sizeof(ctx->part_header)),
+                                   handle_get_request, hc));
+        assert(ev_type == HTTP_REQUEST_WRITE_DONE_EVENT);
+        HTTPRequestWriteDoneEvent *write_part_header_ev = ev;
+        if (write_part_header_ev->err != HTTP_SUCCESS) {
+          http_request_log_error(hc->rh,
+                                 "Error while writing part header, failing write request: %s",
+                                 http_error_to_string(write_part_header_ev->err));
+          goto loop_error;
+        }
+        ctx->sent_part_header = true;
+      }
+
+      if (ctx->rwev.fd >= 0) {
+        CRYIELD(ctx->pos,
+                http_request_sendfile(hc->rh, ctx->rwev.fd, ctx->rwev.offset,
+                                      ctx->rwev.nbyte,
+                                      handle_get_request, hc));
+      }
+      else {
+        CRYIELD(ctx->pos,
+                http_request_write(hc->rh, ctx->rwev.buf, ctx->rwev.nbyte,
+                                   handle_get_request, hc));
+      }
+      assert(ev_type == HTTP_REQUEST_WRITE_DONE_EVENT);
+      HTTPRequestWriteDoneEvent *write_ev = ev;
+      assert(write_ev->request_handle == hc->rh);
+      if (write_ev->err != HTTP_SUCCESS) {
+          http_request_log_error(hc->rh,
+                                 "Error while writing data, failing write request: %s",
+                                 http_error_to_string(write_ev->err));
         goto loop_error;
       }
-      ctx->sent_headers = true;
+
+      ctx->amt_sent += ctx->rwev.nbyte;
+      WebdavGetRequestWriteDoneEvent ev1 = {.error = WEBDAV_ERROR_NONE};
+      if (false) {
+      loop_error:
+        ev1.error = WEBDAV_ERROR_GENERAL;
+      }
+
+      CRYIELD(ctx->pos,
+              ctx->rwev.cb(WEBDAV_GET_REQUEST_WRITE_DONE_EVENT, &ev1, ctx->rwev.cb_ud));
     }
+    WebdavGetRequestEndEvent *request_end_ev = ev;
+    ctx->error = request_end_ev->error;
 
+    if (ctx->error || ++ctx->cur_range >= ctx->num_ranges) break;
+  }
+
+  if (!ctx->error && ctx->num_ranges > 1 && ctx->sent_headers) {
     CRYIELD(ctx->pos,
-            http_request_write(hc->rh, ctx->rwev.buf, ctx->rwev.nbyte,
+            http_request_write(hc->rh, ctx->part_header,
+                               generate_byteranges_part_header(ctx, ctx->num_ranges,
+                                                               ctx->part_header,
+                                                               sizeof(ctx->part_header)),
                                handle_get_request, hc));
     assert(ev_type == HTTP_REQUEST_WRITE_DONE_EVENT);
-    HTTPRequestWriteDoneEvent *write_ev = ev;
-    assert(write_ev->request_handle == hc->rh);
-    if (write_ev->err != HTTP_SUCCESS) {
-        http_request_log_error(hc->rh,
-                               "Error while writing data, failing write request: %s",
-                               http_error_to_string(write_ev->err));
-      goto loop_error;
-    }
-
-    ctx->amt_sent += ctx->rwev.nbyte;
-    WebdavGetRequestWriteDoneEvent ev1 = {.error = WEBDAV_ERROR_NONE};
-    if (false) {
-    loop_error:
-      ev1.error = WEBDAV_ERROR_GENERAL;
+    HTTPRequestWriteDoneEvent *write_trailer_ev = ev;
+    if (write_trailer_ev->err != HTTP_SUCCESS) {
+      http_request_log_error(hc->rh,
+                             "Error while writing final delimiter: %s",
+                             http_error_to_string(write_trailer_ev->err));
+      ctx->error = WEBDAV_ERROR_GENERAL;
     }
+  }
 
-    CRYIELD(ctx->pos,
-            ctx->rwev.cb(WEBDAV_GET_REQUEST_WRITE_DONE_EVENT, &ev1, ctx->rwev.cb_ud));
+  if (ctx->error && ctx->sent_headers) {
+    /* too late to send an error status */
+    http_request_abort_response(hc->rh);
   }
-  WebdavGetRequestEndEvent *request_end_ev = ev;
 
-  switch (request_end_ev->error){
+  switch (ctx->error) {
   case WEBDAV_ERROR_NONE:
     assert(ctx->amt_sent <= ULONG_MAX);
     http_request_log_debug(hc->rh,
                            "Sent %lu bytes of \"%s\"",
                            (long unsigned) ctx->amt_sent, ctx->resource_uri);
-    code = HTTP_STATUS_CODE_OK;
+    code = ctx->ranges ? HTTP_STATUS_CODE_PARTIAL_CONTENT : HTTP_STATUS_CODE_OK;
     break;
   case WEBDAV_ERROR_IS_COL:
     /* NB: if the backend returns this, then we return http method not allowed,
@@ -1441,23 +1964,31 @@ EVENT_HANDLER_DEFINE(handle_get_request, ev_type, ev, ud) {
   default:
     http_request_log_info(hc->rh,
                           "Error on completion backend's completion of \"%s\": %s",
-                          ctx->resource_uri, webdav_error_to_string(request_end_ev->error));
+                          ctx->resource_uri, webdav_error_to_string(ctx->error));
     code = HTTP_STATUS_CODE_INTERNAL_SERVER_ERROR;
     break;
   }
 
  done:
   if (!ctx->sent_headers) {
+    if (code == HTTP_STATUS_CODE_NOT_MODIFIED && ctx->has_etag) {
+      ctx->headers = prepend_header(hc, ctx->headers, HTTP_HEADER_ETAG, ctx->etag);
+    }
+    else if (code == HTTP_STATUS_CODE_METHOD_NOT_ALLOWED) {
+      ctx->headers = prepend_header(hc, ctx->headers, HTTP_HEADER_ALLOW,
+                                    COLLECTION_ALLOWED_METHODS);
+    }
+
     CRYIELD(ctx->pos,
             http_request_simple_response(hc->rh,
                                          code,
                                          "", 0,
                                          "text/plain",
-                                         LINKED_LIST_INITIALIZER,
+                                         ctx->headers,
                                          handle_get_request, ud));
   }
 
-  free(ctx->resource_uri);
+  free(ctx->ranges);
 
   CRRETURN(ctx->pos,
            request_proc(GENERIC_EVENT, NULL, hc));
@@ -1478,6 +2009,8 @@ EVENT_HANDLER_DEFINE(handle_lock_request, ev_type, ev, ud) {
 
   ctx->file_path = NULL;
   ctx->owner_xml = NULL;
+  ctx->lock_token = NULL;
+  ctx->status_path = NULL;
   ctx->refresh_uri = NULL;
   ctx->resource_tag = NULL;
   ctx->resource_tag_path = NULL;
@@ -1485,6 +2018,7 @@ EVENT_HANDLER_DEFINE(handle_lock_request, ev_type, ev, ud) {
   ctx->response_body_len = 0;
   ctx->request_body = NULL;
   ctx->request_body_len = 0;
+  ctx->headers = LINKED_LIST_INITIALIZER;
 
   /* read body first */
   CRYIELD(ctx->pos,
@@ -1564,14 +2098,14 @@ EVENT_HANDLER_DEFINE(handle_lock_request, ev_type, ev, ud) {
   if (!ctx->request_body &&
       if_lock_token_err == IF_LOCK_TOKEN_ERR_SUCCESS &&
       str_equals(ctx->resource_tag_path, ctx->file_path)) {
-    owner_xml_t owner_xml_not_owned;
+    owner_xml_t owner_xml;
     bool is_exclusive;
     webdav_depth_t depth;
     bool refreshed;
     bool success_refresh = refresh_lock(hc->serv, ctx->file_path, ctx->refresh_uri,
                                         ctx->timeout_in_seconds,
                                         &refreshed,
-                                        &owner_xml_not_owned,
+                                        &owner_xml,
                                         &is_exclusive,
                                         &depth);
     if (!success_refresh) {
@@ -1589,12 +2123,12 @@ EVENT_HANDLER_DEFINE(handle_lock_request, ev_type, ev, ud) {
     ASSERT_NOT_NULL(public_uri);
     bool success_generate =
       generate_success_lock_response_body(public_uri, ctx->timeout_in_seconds,
-                                          depth, is_exclusive, owner_xml_not_owned,
+                                          depth, is_exclusive, owner_xml,
                                           ctx->refresh_uri, was_created,
                                           &status_code,
                                           &ctx->response_body,
                                           &ctx->response_body_len);
-    free(public_uri);
+    owner_xml_free(owner_xml);
 
     if (!success_generate) {
       status_code = HTTP_STATUS_CODE_INTERNAL_SERVER_ERROR;
@@ -1632,8 +2166,6 @@ EVENT_HANDLER_DEFINE(handle_lock_request, ev_type, ev, ud) {
   assert(ctx->owner_xml);
 
   /* actually attempt to lock the resource */
-  ctx->lock_token = NULL;
-  ctx->status_path = NULL;
   bool success_perform =
     perform_write_lock(hc->serv,
                        ctx->file_path, ctx->is_collection,
@@ -1671,8 +2203,6 @@ EVENT_HANDLER_DEFINE(handle_lock_request, ev_type, ev, ud) {
     }
   }
 
-  ctx->headers = LINKED_LIST_INITIALIZER;
-
   /* generate lock attempt response */
   bool success_generate;
   if (ctx->is_locked) {
@@ -1685,7 +2215,6 @@ EVENT_HANDLER_DEFINE(handle_lock_request, ev_type, ev, ud) {
                                  &status_code,
                                  &ctx->response_body,
                                  &ctx->response_body_len);
-      free(public_uri);
     }
     else {
       char *const public_uri = public_uri_from_path(hc, ctx->file_path, ctx->is_collection);
@@ -1699,9 +2228,6 @@ EVENT_HANDLER_DEFINE(handle_lock_request, ev_type, ev, ud) {
                                            &status_code,
                                            &ctx->response_body,
                                            &ctx->response_body_len);
-
-      free(public_uri);
-      free(public_status_uri);
     }
   }
   else {
@@ -1716,19 +2242,13 @@ EVENT_HANDLER_DEFINE(handle_lock_request, ev_type, ev, ud) {
                                           &ctx->response_body,
                                           &ctx->response_body_len);
 
-    free(public_uri);
-
     if (success_generate) {
       /* add lock token header if we were locked */
-      EASY_ALLOC(HeaderPair, hp);
-      hp->name = "Lock-Token";
-      char lock_token_header_value[256];
-      int len_written = snprintf(lock_token_header_value, sizeof(lock_token_header_value),
-                                 "<%s>", ctx->lock_token);
-      /* TODO: Lazy */
-      ASSERT_TRUE(!(len_written < 0 || (size_t) len_written >= sizeof(lock_token_header_value)));
-      hp->value = davfuse_util_strdup(lock_token_header_value);
-      ctx->headers = linked_list_prepend(ctx->headers, hp);
+      char *const lock_token_header_value =
+        arena_strcat(&hc->arena, "<", ctx->lock_token, ">", NULL);
+      ASSERT_NOT_NULL(lock_token_header_value);
+      ctx->headers = prepend_header(hc, ctx->headers,
+                                    "Lock-Token", lock_token_header_value);
     }
   }
 
@@ -1746,11 +2266,9 @@ EVENT_HANDLER_DEFINE(handle_lock_request, ev_type, ev, ud) {
   pretty_print_xml(ctx->response_body, ctx->response_body_len, LOG_DEBUG);
 
   free(ctx->request_body);
-  free(ctx->file_path);
   owner_xml_free(ctx->owner_xml);
-  free(ctx->resource_tag);
-  free(ctx->resource_tag_path);
-  free(ctx->refresh_uri);
+  free(ctx->lock_token);
+  free(ctx->status_path);
 
   CRYIELD(ctx->pos,
           http_request_simple_response(hc->rh,
@@ -1764,11 +2282,6 @@ EVENT_HANDLER_DEFINE(handle_lock_request, ev_type, ev, ud) {
   /* if there is an error sending, oh well, just let the request end */
 
   free(ctx->response_body);
-  if (ctx->headers) {
-    free(((HeaderPair *) ctx->headers->elt)->value);
-    free(ctx->headers->elt);
-    linked_list_free(ctx->headers, NULL);
-  }
 
   CRRETURN(ctx->pos,
            request_proc(GENERIC_EVENT, NULL, hc));
@@ -1842,8 +2355,6 @@ EVENT_HANDLER_DEFINE(handle_mkcol_request, ev_type, ev, ud) {
  done:
   assert(status_code);
 
-  free(ctx->request_relative_uri);
-
   CRYIELD(ctx->pos,
           http_request_string_response(hc->rh,
                                        status_code, "",
@@ -1940,10 +2451,10 @@ EVENT_HANDLER_DEFINE(handle_options_request, ev_type, ev, ud) {
     }                                                                   \
     while (0)
 
-    ALLOW_METHOD("LOCK,UNLOCK,PROPFIND,DELETE,MOVE,COPY,OPTIONS,PROPPATCH");
+    ALLOW_METHOD(COLLECTION_ALLOWED_METHODS);
 
     if (!ctx->uri_is_collection) {
-      ALLOW_METHOD(",GET,PUT");
+      ALLOW_METHOD(",GET,HEAD,PUT");
     }
 
     ALLOW_METHOD("\0");
@@ -2005,7 +2516,11 @@ EVENT_HANDLER_DEFINE(handle_propfind_request, ev_type, ev, ud) {
   ctx->request_relative_uri = NULL;
   ctx->buf = NULL;
   ctx->buf_used = 0;
+  ctx->props_to_get = LINKED_LIST_INITIALIZER;
+  ctx->entries = LINKED_LIST_INITIALIZER;
+  ctx->gen = NULL;
   ctx->out_buf = NULL;
+  ctx->out_buf_used = 0;
   ctx->out_buf_size = 0;
 
   if (is_relative_uri_parent(hc->rhs.uri, hc->serv->internal_root)) {
@@ -2082,48 +2597,118 @@ EVENT_HANDLER_DEFINE(handle_propfind_request, ev_type, ev, ud) {
   }
 
   assert(run_propfind_ev->entries);
+  ctx->entries = run_propfind_ev->entries;
+
+  ctx->gen = propfind_response_generator_new(ctx->propfind_req_type,
+                                             ctx->props_to_get);
+  if (!ctx->gen) {
+    status_code = HTTP_STATUS_CODE_INTERNAL_SERVER_ERROR;
+    goto done;
+  }
+
+  /* the response is sent as it's generated, we don't know
+     how long it's going to be so it's sent chunked */
+  bool success_init = http_response_init(&hc->resp);
+  ASSERT_TRUE(success_init);
+
+  bool success_set_code =
+    http_response_set_code(&hc->resp, HTTP_STATUS_CODE_MULTI_STATUS);
+  ASSERT_TRUE(success_set_code);
+
+  bool success_add_header =
+    http_response_add_header(&hc->resp, HTTP_HEADER_CONTENT_TYPE,
+                             "application/xml; charset=\"utf-8\"");
+  ASSERT_TRUE(success_add_header);
+
+  success_add_header =
+    http_response_add_header(&hc->resp, HTTP_HEADER_TRANSFER_ENCODING,
+                             "chunked");
+  ASSERT_TRUE(success_add_header);
+
+  CRYIELD(ctx->pos,
+          http_request_write_headers(hc->rh, &hc->resp,
+                                     handle_propfind_request, hc));
+  assert(ev_type == HTTP_REQUEST_WRITE_HEADERS_DONE_EVENT);
+  const HTTPRequestWriteHeadersDoneEvent *write_headers_ev = ev;
+  if (write_headers_ev->err) goto stream_done;
+
+  const bool success_start =
+    propfind_response_generator_start(ctx->gen,
+                                      &ctx->out_buf, &ctx->out_buf_used,
+                                      &ctx->out_buf_size);
+  if (!success_start) goto stream_error;
+
+  while (ctx->entries) {
+    struct webdav_propfind_entry *propfind_entry;
+    ctx->entries = linked_list_popleft(ctx->entries, (void **) &propfind_entry);
 
-  LINKED_LIST_FOR (struct webdav_propfind_entry, propfind_entry,
-                   run_propfind_ev->entries) {
     /* TODO: we don't support get on collections */
     if (propfind_entry->is_collection) {
       propfind_entry->modified_time = INVALID_WEBDAV_RESOURCE_TIME;
     }
-    /* convert relative uri to public uris for generator */
+    /* convert relative uri to public uris for generator,
+       the public uri is only needed until the entry is added */
+    const ArenaMark mark = arena_mark(&hc->arena);
     char *const relative_uri = propfind_entry->relative_uri;
     propfind_entry->relative_uri = public_uri_from_path(hc, relative_uri,
                                                         propfind_entry->is_collection);
     ASSERT_NOT_NULL(propfind_entry->relative_uri);
-    free(relative_uri);
-  }
-
-  /* now generate response */
-  const bool success_generate =
-    generate_propfind_response(ctx->propfind_req_type,
-                               ctx->props_to_get,
-                               run_propfind_ev->entries,
-                               &ctx->out_buf,
-                               &ctx->out_buf_size,
-                               &status_code);
-  linked_list_free(run_propfind_ev->entries,
-                   (linked_list_elt_handler_t) webdav_destroy_propfind_entry);
 
-  if (!success_generate) {
-    status_code = HTTP_STATUS_CODE_INTERNAL_SERVER_ERROR;
-    goto done;
+    const bool success_add_entry =
+      propfind_response_generator_add_entry(ctx->gen, propfind_entry,
+                                            &ctx->out_buf, &ctx->out_buf_used,
+                                            &ctx->out_buf_size);
+    arena_rewind(&hc->arena, mark);
+    propfind_entry->relative_uri = relative_uri;
+    webdav_destroy_propfind_entry(propfind_entry);
+    if (!success_add_entry) goto stream_error;
+
+    if (ctx->out_buf_used < PROPFIND_RESPONSE_CHUNK_SIZE) continue;
+
+    CRYIELD(ctx->pos,
+            http_request_write(hc->rh, ctx->out_buf, ctx->out_buf_used,
+                               handle_propfind_request, hc));
+    assert(ev_type == HTTP_REQUEST_WRITE_DONE_EVENT);
+    const HTTPRequestWriteDoneEvent *write_ev = ev;
+    if (write_ev->err) goto stream_done;
+    ctx->out_buf_used = 0;
+  }
+
+  const bool success_finish =
+    propfind_response_generator_finish(ctx->gen,
+                                       &ctx->out_buf, &ctx->out_buf_used,
+                                       &ctx->out_buf_size);
+  if (!success_finish) goto stream_error;
+
+  CRYIELD(ctx->pos,
+          http_request_write(hc->rh, ctx->out_buf, ctx->out_buf_used,
+                             handle_propfind_request, hc));
+  assert(ev_type == HTTP_REQUEST_WRITE_DONE_EVENT);
+
+  if (false) {
+  stream_error:
+    http_request_log_error(hc->rh, "Error while generating propfind response");
+    http_request_abort_response(hc->rh);
   }
 
+ stream_done:
+  linked_list_free(ctx->entries,
+                   (linked_list_elt_handler_t) webdav_destroy_propfind_entry);
+  propfind_response_generator_destroy(ctx->gen);
+  linked_list_free(ctx->props_to_get,
+                   (linked_list_elt_handler_t) free_webdav_property);
+  free(ctx->out_buf);
+  free(ctx->buf);
+  CRRETURN(ctx->pos, request_proc(GENERIC_EVENT, NULL, hc));
+
  done:
-  free(ctx->request_relative_uri);
+  linked_list_free(ctx->entries,
+                   (linked_list_elt_handler_t) webdav_destroy_propfind_entry);
   linked_list_free(ctx->props_to_get,
                    (linked_list_elt_handler_t) free_webdav_property);
 
   assert(status_code);
   http_request_log_debug(hc->rh, "Responding with status: %d", status_code);
-  assert(ctx->out_buf_size <= ULONG_MAX);
-  http_request_log_debug(hc->rh, "XML response will be: (%lu bytes)",
-                         (unsigned long) ctx->out_buf_size);
-  pretty_print_xml(ctx->out_buf, ctx->out_buf_size, LOG_DEBUG);
 
   if (status_code == HTTP_STATUS_CODE_METHOD_NOT_ALLOWED) {
     bool success_init = http_response_init(&hc->resp);
@@ -2149,16 +2734,12 @@ EVENT_HANDLER_DEFINE(handle_propfind_request, ev_type, ev, ud) {
     CRYIELD(ctx->pos,
             http_request_simple_response(hc->rh,
                                          status_code,
-                                         ctx->out_buf,
-                                         ctx->out_buf_size,
+                                         NULL, 0,
                                          "application/xml; charset=\"utf-8\"",
                                          LINKED_LIST_INITIALIZER,
                                          handle_propfind_request, hc));
   }
 
-  if (ctx->out_buf) {
-    free(ctx->out_buf);
-  }
   free(ctx->buf);
   CRRETURN(ctx->pos, request_proc(GENERIC_EVENT, NULL, hc));
 
@@ -2285,7 +2866,7 @@ run_proppatch(struct handler_context *hc, const char *uri,
                    (linked_list_elt_handler_t) free_webdav_proppatch_directive);
 
  done:
-  free(file_path);
+  return;
 }
 
 void
@@ -2326,6 +2907,7 @@ EVENT_HANDLER_DEFINE(handle_put_request, ev_type, ev, ud) {
 
   ctx->response_body = NULL;
   ctx->response_body_len = 0;
+  ctx->headers = LINKED_LIST_INITIALIZER;
 
   ctx->request_relative_uri = path_from_request_uri(hc, hc->rhs.uri);
   if (!ctx->request_relative_uri) {
@@ -2343,6 +2925,45 @@ EVENT_HANDLER_DEFINE(handle_put_request, ev_type, ev, ud) {
     goto done;
   }
 
+  if (http_get_header_value(&hc->rhs, HTTP_HEADER_IF_MATCH) ||
+      http_get_header_value(&hc->rhs, HTTP_HEADER_IF_NONE_MATCH)) {
+    CRYIELD(ctx->pos,
+            util_webdav_backend_single_propfind(hc->serv->fs,
+                                                ctx->request_relative_uri,
+                                                handle_put_request, ud));
+    assert(ev_type == UTIL_WEBDAV_BACKEND_SINGLE_PROPFIND_DONE_EVENT);
+    UtilWebdavBackendSinglePropfindDoneEvent *propfind_done_ev = ev;
+    if (propfind_done_ev->error &&
+        propfind_done_ev->error != WEBDAV_ERROR_DOES_NOT_EXIST) {
+      status_code = HTTP_STATUS_CODE_INTERNAL_SERVER_ERROR;
+      goto done;
+    }
+
+    /* a resource that doesn't exist matches nothing, not even "*" */
+    const bool exists = !propfind_done_ev->error;
+    const bool has_etag = exists &&
+      webdav_propfind_entry_etag(&propfind_done_ev->entry,
+                                 ctx->etag, sizeof(ctx->etag));
+
+    const char *if_match_value =
+      http_get_header_value(&hc->rhs, HTTP_HEADER_IF_MATCH);
+    const char *if_none_match_value =
+      http_get_header_value(&hc->rhs, HTTP_HEADER_IF_NONE_MATCH);
+    if ((if_match_value &&
+         !(exists &&
+           http_etag_list_matches(if_match_value,
+                                  has_etag ? ctx->etag : NULL,
+                                  false))) ||
+        (if_none_match_value &&
+         exists &&
+         http_etag_list_matches(if_none_match_value,
+                                has_etag ? ctx->etag : NULL,
+                                true))) {
+      status_code = HTTP_STATUS_CODE_PRECONDITION_FAILED;
+      goto done;
+    }
+  }
+
   CRYIELD(ctx->pos,
           webdav_backend_put(hc->serv->fs,
                              ctx->request_relative_uri,
@@ -2392,7 +3013,23 @@ EVENT_HANDLER_DEFINE(handle_put_request, ev_type, ev, ud) {
     }
   }
   else {
-    status_code = end_ev->resource_existed
+    ctx->resource_existed = end_ev->resource_existed;
+
+    /* let the client know the tag of what it just stored */
+    CRYIELD(ctx->pos,
+            util_webdav_backend_single_propfind(hc->serv->fs,
+                                                ctx->request_relative_uri,
+                                                handle_put_request, ud));
+    assert(ev_type == UTIL_WEBDAV_BACKEND_SINGLE_PROPFIND_DONE_EVENT);
+    UtilWebdavBackendSinglePropfindDoneEvent *propfind_done_ev = ev;
+    if (!propfind_done_ev->error &&
+        webdav_propfind_entry_etag(&propfind_done_ev->entry,
+                                   ctx->etag, sizeof(ctx->etag))) {
+      ctx->headers = prepend_header(hc, ctx->headers,
+                                    HTTP_HEADER_ETAG, ctx->etag);
+    }
+
+    status_code = ctx->resource_existed
       ? HTTP_STATUS_CODE_OK
       : HTTP_STATUS_CODE_CREATED;
   }
@@ -2406,11 +3043,10 @@ EVENT_HANDLER_DEFINE(handle_put_request, ev_type, ev, ud) {
                                        ctx->response_body,
                                        ctx->response_body_len,
                                        "application/xml; charset=\"utf-8\"",
-                                       LINKED_LIST_INITIALIZER,
+                                       ctx->headers,
                                        handle_put_request, ud));
 
   free(ctx->response_body);
-  free(ctx->request_relative_uri);
 
   CRRETURN(ctx->pos,
            request_proc(GENERIC_EVENT, NULL, hc));
@@ -2419,7 +3055,8 @@ EVENT_HANDLER_DEFINE(handle_put_request, ev_type, ev, ud) {
 }
 
 static if_lock_token_err_t
-parse_lock_token_header(const char *lock_token_header,
+parse_lock_token_header(struct handler_context *hc,
+                        const char *lock_token_header,
                         char **lock_token) {
   int i = 0;
 
@@ -2431,10 +3068,13 @@ parse_lock_token_header(const char *lock_token_header,
 
   char *right_bracket_location =
     strchr(lock_token_header + i, ASCII_RIGHT_BRACKET);
+  if (!right_bracket_location) {
+    return IF_LOCK_TOKEN_ERR_BAD_PARSE;
+  }
 
   *lock_token =
-    strndup_x(lock_token_header + i,
-              right_bracket_location - (lock_token_header + i));
+    arena_strndup(&hc->arena, lock_token_header + i,
+                  right_bracket_location - (lock_token_header + i));
   if (!*lock_token) {
     return IF_LOCK_TOKEN_ERR_INTERNAL;
   }
@@ -2465,7 +3105,7 @@ EVENT_HANDLER_DEFINE(handle_unlock_request, ev_type, ev, ud) {
   }
 
   if_lock_token_err_t success_parse =
-    parse_lock_token_header(lock_token_header, &lock_token);
+    parse_lock_token_header(hc, lock_token_header, &lock_token);
 
   if (success_parse == IF_LOCK_TOKEN_ERR_BAD_PARSE) {
     status_code = HTTP_STATUS_CODE_BAD_REQUEST;
@@ -2496,8 +3136,6 @@ EVENT_HANDLER_DEFINE(handle_unlock_request, ev_type, ev, ud) {
   }
 
  done:
-  free(lock_token);
-  free(file_path);
   assert(status_code != HTTP_STATUS_CODE___INVALID);
 
   http_request_string_response(hc->rh,
@@ -2516,14 +3154,118 @@ EVENT_HANDLER_DEFINE(handle_request, ev_type, ev, ud) {
              .serv = ud);
 }
 
+static struct webdav_server_shared *
+_webdav_server_shared_new(void) {
+  struct webdav_server_shared *const shared = malloc(sizeof(*shared));
+  if (!shared) return NULL;
+
+  *shared = (struct webdav_server_shared) {
+    .locks = webdav_lock_table_new(),
+  };
+  if (!shared->locks) goto error;
+
+#ifndef _WIN32
+  const int ret_mutex_init = pthread_mutex_init(&shared->lock, NULL);
+  if (ret_mutex_init) goto error;
+#endif
+
+  return shared;
+
+ error:
+  if (shared->locks) {
+    webdav_lock_table_destroy(shared->locks, free_webdav_lock_descriptor);
+  }
+  free(shared);
+  return NULL;
+}
+
+static void
+_webdav_server_shared_destroy(struct webdav_server_shared *shared) {
+  assert(!shared->servers);
+
+#ifndef _WIN32
+  const int ret_mutex_destroy = pthread_mutex_destroy(&shared->lock);
+  ASSERT_TRUE(!ret_mutex_destroy);
+#endif
+
+  webdav_lock_table_destroy(shared->locks, free_webdav_lock_descriptor);
+  free(shared);
+}
+
+static
+EVENT_HANDLER_DECLARE(stop_request_handler);
+
+static bool
+_webdav_server_stop(struct webdav_server *ws) {
+  const bool success_stop = http_server_stop(ws->http);
+  if (!success_stop) return false;
+
+  /* a pending timer or watch would keep the event loop from returning */
+  ws->is_stopped = true;
+  if (ws->lock_reaper_key) {
+    const bool success_remove =
+      event_loop_timeout_remove(ws->loop, ws->lock_reaper_key);
+    ASSERT_TRUE(success_remove);
+    ws->lock_reaper_key = 0;
+  }
+
+  if (ws->stop_watch_key) {
+    const bool success_remove =
+      event_loop_watch_remove(ws->loop, ws->stop_watch_key);
+    ASSERT_TRUE(success_remove);
+    ws->stop_watch_key = 0;
+  }
+
+  return true;
+}
+
+static
+EVENT_HANDLER_DEFINE(stop_request_handler, ev_type, ev_, ud) {
+  struct webdav_server *const ws = ud;
+
+  UNUSED(ev_type);
+  assert(ev_type == EVENT_LOOP_SOCKET_EVENT);
+  EventLoopSocketEvent *const ev = ev_;
+  /* TODO: handle this better */
+  ASSERT_TRUE(!ev->error);
+
+  /* watches are one-shot */
+  ws->stop_watch_key = 0;
+
+  /* more than one server may have asked us to stop */
+  char toread[16];
+  const socket_ssize_t ret_recv =
+    recv(ws->stop_sockets[STOP_SOCKET_RECV], toread, sizeof(toread), 0);
+  ASSERT_TRUE(ret_recv > 0);
+
+  const bool success_stop = _webdav_server_stop(ws);
+  if (!success_stop) {
+    log_error("Couldn't stop webdav server on request of another server");
+  }
+}
+
 webdav_server_t
 webdav_server_new(event_loop_handle_t loop,
                   socket_t sock,
                   const char *public_uri_root,
                   const char *internal_root,
                   webdav_backend_t fs) {
+  return webdav_server_new_shared(loop, sock,
+                                  public_uri_root, internal_root,
+                                  fs, NULL);
+}
+
+webdav_server_t
+webdav_server_new_shared(event_loop_handle_t loop,
+                         socket_t sock,
+                         const char *public_uri_root,
+                         const char *internal_root,
+                         webdav_backend_t fs,
+                         webdav_server_t share_with) {
   char *public_uri_root_copy = NULL;
   char *internal_root_copy = NULL;
+  struct webdav_server_shared *shared = NULL;
+  socket_t stop_sockets[2] = {INVALID_SOCKET, INVALID_SOCKET};
   http_server_t http = (http_server_t) 0;
   struct webdav_server *serv = NULL;
 
@@ -2538,6 +3280,18 @@ webdav_server_new(event_loop_handle_t loop,
   internal_root_copy = davfuse_util_strdup(internal_root);
   if (!internal_root_copy) goto error;
 
+  if (!share_with) {
+    shared = _webdav_server_shared_new();
+    if (!shared) goto error;
+  }
+
+  const int ret_socketpair = localhost_socketpair(stop_sockets);
+  if (ret_socketpair) {
+    log_error("Couldn't create stop sockets: %s",
+              last_socket_error_message());
+    goto error;
+  }
+
   serv = malloc(sizeof(*serv));
   if (!serv) goto error;
 
@@ -2546,11 +3300,19 @@ webdav_server_new(event_loop_handle_t loop,
 
   *serv = (struct webdav_server) {
     .http = http,
-    .locks = LINKED_LIST_INITIALIZER,
+    .loop = loop,
+    .shared = share_with ? share_with->shared : shared,
+    .stop_sockets = {stop_sockets[0], stop_sockets[1]},
     .fs = fs,
     .public_uri_root = public_uri_root_copy,
     .internal_root = internal_root_copy,
   };
+  arena_chunk_cache_init(&serv->arena_chunks);
+
+  _webdav_server_shared_lock(serv->shared);
+  serv->next_shared = serv->shared->servers;
+  serv->shared->servers = serv;
+  _webdav_server_shared_unlock(serv->shared);
 
   return serv;
 
@@ -2562,6 +3324,13 @@ webdav_server_new(event_loop_handle_t loop,
     }
   }
   free(serv);
+  for (unsigned i = 0; i < NELEMS(stop_sockets); ++i) {
+    if (stop_sockets[i] != INVALID_SOCKET) {
+      const int ret_close = closesocket(stop_sockets[i]);
+      ASSERT_TRUE(!ret_close);
+    }
+  }
+  if (shared) _webdav_server_shared_destroy(shared);
   free(public_uri_root_copy);
   free(internal_root_copy);
 
@@ -2575,9 +3344,40 @@ webdav_server_destroy(webdav_server_t ws) {
   const bool success_http_destroy = http_server_destroy(serv->http);
   if (!success_http_destroy) return false;
 
-  linked_list_free(serv->locks, free_webdav_lock_descriptor);
+  if (serv->lock_reaper_key) {
+    const bool success_remove =
+      event_loop_timeout_remove(serv->loop, serv->lock_reaper_key);
+    ASSERT_TRUE(success_remove);
+  }
+
+  if (serv->stop_watch_key) {
+    const bool success_remove =
+      event_loop_watch_remove(serv->loop, serv->stop_watch_key);
+    ASSERT_TRUE(success_remove);
+  }
+
+  /* once we're off the list nobody else will use our stop sockets */
+  struct webdav_server_shared *const shared = serv->shared;
+  _webdav_server_shared_lock(shared);
+  struct webdav_server **link = &shared->servers;
+  while (*link != serv) link = &(*link)->next_shared;
+  *link = serv->next_shared;
+  const bool is_last = !shared->servers;
+  _webdav_server_shared_unlock(shared);
+
+  if (is_last) _webdav_server_shared_destroy(shared);
+
+  for (unsigned i = 0; i < NELEMS(serv->stop_sockets); ++i) {
+    const int ret_close = closesocket(serv->stop_sockets[i]);
+    if (ret_close) {
+      log_error("Error while closing stop socket %ld: %s",
+                (long) serv->stop_sockets[i], last_socket_error_message());
+    }
+  }
+
   free(serv->public_uri_root);
   free(serv->internal_root);
+  arena_chunk_cache_destroy(&serv->arena_chunks);
 
   free(serv);
 
@@ -2586,12 +3386,46 @@ webdav_server_destroy(webdav_server_t ws) {
 
 bool
 webdav_server_start(webdav_server_t ws) {
-  return http_server_start(ws->http);
+  const bool success_start = http_server_start(ws->http);
+  if (!success_start) return false;
+
+  const bool success_watch =
+    event_loop_socket_watch_add(ws->loop,
+                                ws->stop_sockets[STOP_SOCKET_RECV],
+                                create_stream_events(true, false),
+                                stop_request_handler,
+                                ws,
+                                &ws->stop_watch_key);
+  if (!success_watch) {
+    const bool success_stop = http_server_stop(ws->http);
+    ASSERT_TRUE(success_stop);
+    return false;
+  }
+
+  ws->is_stopped = false;
+  schedule_lock_reaper(ws);
+
+  return true;
 }
 
 bool
 webdav_server_stop(webdav_server_t ws) {
-  return http_server_stop(ws->http);
+  const bool success_stop = _webdav_server_stop(ws);
+  if (!success_stop) return false;
+
+  /* stopping one server stops every server sharing its state,
+     they have to be stopped from their own event loop threads */
+  _webdav_server_shared_lock(ws->shared);
+  for (struct webdav_server *sibling = ws->shared->servers; sibling;
+       sibling = sibling->next_shared) {
+    if (sibling == ws) continue;
+    const socket_ssize_t ret_send =
+      send(sibling->stop_sockets[STOP_SOCKET_SEND], "1", 1, 0);
+    ASSERT_TRUE(ret_send == 1);
+  }
+  _webdav_server_shared_unlock(ws->shared);
+
+  return true;
 }
 
 void
@@ -2599,6 +3433,11 @@ webdav_server_disconnect_existing_clients(webdav_server_t ws) {
   return http_server_disconnect_existing_clients(ws->http);
 }
 
+void
+webdav_server_set_max_request_headers_size(webdav_server_t ws, size_t size) {
+  http_server_set_max_request_headers_size(ws->http, size);
+}
+
 /* private api, specifically helper functions for the xml implementation */
 
 webdav_propfind_entry_t
@@ -2606,7 +3445,8 @@ webdav_new_propfind_entry(const char *relative_uri,
                           webdav_resource_time_t modified_time,
                           webdav_resource_time_t creation_time,
                           bool is_collection,
-                          webdav_resource_size_t length) {
+                          webdav_resource_size_t length,
+                          webdav_resource_id_t id) {
   struct webdav_propfind_entry *elt = malloc(sizeof(*elt));
   if (!elt) {
     return NULL;
@@ -2624,6 +3464,7 @@ webdav_new_propfind_entry(const char *relative_uri,
     .creation_time = creation_time,
     .is_collection = is_collection,
     .length = length,
+    .id = id,
   };
 
   return elt;
@@ -2635,6 +3476,23 @@ webdav_destroy_propfind_entry(struct webdav_propfind_entry *pfe) {
   free(pfe);
 }
 
+bool
+webdav_propfind_entry_etag(const struct webdav_propfind_entry *entry,
+                           char *buf, size_t buf_size) {
+  /* the id tells apart files that were replaced by a rename */
+  if (entry->id == INVALID_WEBDAV_RESOURCE_ID ||
+      entry->modified_time == INVALID_WEBDAV_RESOURCE_TIME) {
+    return false;
+  }
+
+  const int len = snprintf(buf, buf_size, "\"%jx-%jx-%jx\"",
+                           (uintmax_t) entry->id,
+                           (uintmax_t) (entry->length == INVALID_WEBDAV_RESOURCE_SIZE
+                                        ? 0 : entry->length),
+                           (uintmax_t) entry->modified_time);
+  return len >= 0 && (size_t) len < buf_size;
+}
+
 WebdavProperty *
 create_webdav_property(const char *element_name, const char *ns_href) {
   EASY_ALLOC(WebdavProperty, elt);
@@ -19,6 +19,8 @@
 #ifndef WEBDAV_SERVER_H
 #define WEBDAV_SERVER_H
 
+#include <stdint.h>
+
 #include "events.h"
 #include "event_loop.h"
 #include "sockets.h"
@@ -84,6 +86,17 @@ webdav_server_new(event_loop_handle_t loop,
                   const char *internal_root,
                   webdav_backend_t fs);
 
+/* like webdav_server_new() but shares locks with `share_with` (if not NULL),
+   each server can run on its own event loop thread,
+   stopping any of them stops all of them */
+webdav_server_t
+webdav_server_new_shared(event_loop_handle_t loop,
+                         socket_t sock,
+                         const char *public_uri_root,
+                         const char *internal_root,
+                         webdav_backend_t fs,
+                         webdav_server_t share_with);
+
 bool
 webdav_server_destroy(webdav_server_t ws);
 
@@ -96,6 +109,10 @@ webdav_server_stop(webdav_server_t ws);
 void
 webdav_server_disconnect_existing_clients(webdav_server_t ws);
 
+/* limits the request line plus all request headers to `size` bytes */
+void
+webdav_server_set_max_request_headers_size(webdav_server_t ws, size_t size);
+
 void
 webdav_get_request_size_hint(webdav_get_request_ctx_t get_ctx,
                              size_t size,
@@ -106,6 +123,14 @@ webdav_get_request_write(webdav_get_request_ctx_t get_ctx,
                          const void *buf, size_t nbyte,
                          event_handler_t cb, void *cb_ud);
 
+/* zero-copy alternative to webdav_get_request_write(),
+   sends `nbyte` bytes of `fd` starting at `offset`,
+   `fd` must stay open until `cb` is called */
+void
+webdav_get_request_sendfile(webdav_get_request_ctx_t get_ctx,
+                            int fd, uint64_t offset, size_t nbyte,
+                            event_handler_t cb, void *cb_ud);
+
 void
 webdav_get_request_end(webdav_get_request_ctx_t get_ctx, webdav_error_t error);
 
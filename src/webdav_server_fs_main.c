@@ -23,12 +23,14 @@
 
 #ifndef _WIN32
 #define _POSIX_C_SOURCE 200112L
+#include <pthread.h>
 #include <unistd.h>
 #endif
 
 #include <assert.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdlib.h>
 
 #include "c_util.h"
 #include "event_loop.h"
@@ -42,8 +44,10 @@
 #include "webdav_server.h"
 #include "webdav_server_xml.h"
 #include "uthread.h"
+#include "uthread_pool.h"
 #include "util.h"
 #include "util_sockets.h"
+#include "worker_pool.h"
 
 #ifndef _WIN32
 #include "log_printer_stdio.h"
@@ -52,6 +56,45 @@ ASSERT_SAME_IMPL(LOG_PRINTER_IMPL, LOG_PRINTER_STDIO_IMPL);
 
 ASSERT_SAME_IMPL(WEBDAV_BACKEND_IMPL, WEBDAV_BACKEND_FS_IMPL);
 
+enum {
+  DEFAULT_NUM_IO_THREADS=4,
+  MAX_NUM_IO_THREADS=256,
+  DEFAULT_NUM_LOOPS=1,
+#ifndef _WIN32
+  MAX_NUM_LOOPS=256,
+#else
+  MAX_NUM_LOOPS=1,
+#endif
+  LARGEST_MAX_REQUEST_HEADERS_SIZE=16 * 1024 * 1024,
+};
+
+/* everything one event loop thread needs to serve clients,
+   only the file system and the lock table are shared between loops */
+typedef struct {
+  event_loop_handle_t loop;
+  socket_t sock;
+  worker_pool_t pool;
+  webdav_backend_fs_t wd_backend;
+  webdav_server_t ws;
+#ifndef _WIN32
+  pthread_t thread;
+#endif
+} ServerLoop;
+
+#ifndef _WIN32
+static void *
+server_loop_thread(void *ud) {
+  ServerLoop *const server_loop = ud;
+
+  bool success_main_loop = event_loop_main_loop(server_loop->loop);
+  ASSERT_TRUE(success_main_loop);
+
+  uthread_pool_drain();
+
+  return NULL;
+}
+#endif
+
 int
 main(int argc, char *argv[]) {
   /* init logging */
@@ -95,6 +138,51 @@ main(int argc, char *argv[]) {
   /* TODO: handle bad input paths, or sanitize them, you know DWIM... */
   char *base_path = argv[4];
 
+  /* get number of threads that run blocking file system calls,
+     0 runs them on the event loop thread */
+  long num_io_threads = DEFAULT_NUM_IO_THREADS;
+  if (argc > 5) {
+    char *endptr;
+    errno = 0;
+    num_io_threads = strtol(argv[5], &endptr, 10);
+    if (errno || *endptr || endptr == argv[5] ||
+        num_io_threads < 0 ||
+        num_io_threads > MAX_NUM_IO_THREADS) {
+      log_critical("Bad number of io threads: %s", argv[5]);
+      return -1;
+    }
+  }
+
+  /* get number of event loops, each runs on its own thread
+     and accepts connections on its own SO_REUSEPORT listen socket */
+  long num_loops = DEFAULT_NUM_LOOPS;
+  if (argc > 6) {
+    char *endptr;
+    errno = 0;
+    num_loops = strtol(argv[6], &endptr, 10);
+    if (errno || *endptr || endptr == argv[6] ||
+        num_loops < 1 ||
+        num_loops > MAX_NUM_LOOPS) {
+      log_critical("Bad number of event loops: %s", argv[6]);
+      return -1;
+    }
+  }
+
+  /* get the limit on the size of the request line plus headers,
+     0 keeps the server's default */
+  long max_request_headers_size = 0;
+  if (argc > 7) {
+    char *endptr;
+    errno = 0;
+    max_request_headers_size = strtol(argv[7], &endptr, 10);
+    if (errno || *endptr || endptr == argv[7] ||
+        max_request_headers_size < 0 ||
+        max_request_headers_size > LARGEST_MAX_REQUEST_HEADERS_SIZE) {
+      log_critical("Bad max request headers size: %s", argv[7]);
+      return -1;
+    }
+  }
+
   /* init sockets */
   bool success_init_sockets = init_socket_subsystem();
   ASSERT_TRUE(success_init_sockets);
@@ -103,63 +191,120 @@ main(int argc, char *argv[]) {
   bool success_ignore = ignore_sigpipe();
   ASSERT_TRUE(success_ignore);
 
-  /* create event loop */
-  event_loop_handle_t loop = event_loop_default_new();
-  ASSERT_TRUE(loop);
-
-  /* create listen socket */
-  struct sockaddr_in listen_addr;
-  init_sockaddr_in(&listen_addr, INADDR_ANY, to_port);
-  socket_t sock = create_bound_socket((struct sockaddr *) &listen_addr,
-                                      sizeof(listen_addr));
-  ASSERT_TRUE(sock != INVALID_SOCKET);
-
   /* create fs (implementation is compile-time configurable) */
   fs_handle_t fs = fs_default_new();
   ASSERT_TRUE(fs);
 
-  /* create storage backend (implemented by the file system) */
-  webdav_backend_fs_t wd_backend = webdav_backend_fs_new(fs, base_path);
-  ASSERT_TRUE(wd_backend);
-
   /* init xml parser */
   init_xml_parser();
 
-  /* create webdav server */
-  webdav_server_t ws = webdav_server_new(loop, sock,
-                                         public_uri_root,
-                                         internal_root,
-                                         wd_backend);
-  ASSERT_TRUE(ws);
+  ServerLoop *const server_loops = calloc(num_loops, sizeof(*server_loops));
+  ASSERT_NOT_NULL(server_loops);
+
+  for (long i = 0; i < num_loops; ++i) {
+    ServerLoop *const server_loop = &server_loops[i];
+
+    /* create event loop */
+    server_loop->loop = event_loop_default_new();
+    ASSERT_TRUE(server_loop->loop);
+
+    /* create listen socket */
+    struct sockaddr_in listen_addr;
+    init_sockaddr_in(&listen_addr, INADDR_ANY, to_port);
+    server_loop->sock = num_loops > 1
+      ? create_reuseport_bound_socket((struct sockaddr *) &listen_addr,
+                                      sizeof(listen_addr))
+      : create_bound_socket((struct sockaddr *) &listen_addr,
+                            sizeof(listen_addr));
+    if (server_loop->sock == INVALID_SOCKET) {
+      log_critical("Couldn't create listen socket on port %ld", to_port);
+      return -1;
+    }
+
+    /* create worker pool for blocking file system calls */
+    server_loop->pool = worker_pool_new(server_loop->loop, num_io_threads);
+    ASSERT_TRUE(server_loop->pool);
+
+    /* create storage backend (implemented by the file system) */
+    server_loop->wd_backend =
+      webdav_backend_fs_new(fs, server_loop->pool, base_path);
+    ASSERT_TRUE(server_loop->wd_backend);
+
+    /* create webdav server, all of them share one lock table */
+    server_loop->ws =
+      webdav_server_new_shared(server_loop->loop, server_loop->sock,
+                               public_uri_root,
+                               internal_root,
+                               server_loop->wd_backend,
+                               i ? server_loops[0].ws : NULL);
+    ASSERT_TRUE(server_loop->ws);
+
+    if (max_request_headers_size) {
+      webdav_server_set_max_request_headers_size(server_loop->ws,
+                                                 max_request_headers_size);
+    }
+
+    /* start webdav server */
+    bool success_start = webdav_server_start(server_loop->ws);
+    ASSERT_TRUE(success_start);
+  }
+
+  log_info("Starting %ld main loop(s)", num_loops);
 
-  /* start webdav server */
-  bool success_start = webdav_server_start(ws);
-  ASSERT_TRUE(success_start);
+  /* the first loop runs on this thread */
+#ifndef _WIN32
+  for (long i = 1; i < num_loops; ++i) {
+    const int ret_create =
+      pthread_create(&server_loops[i].thread, NULL,
+                     server_loop_thread, &server_loops[i]);
+    ASSERT_TRUE(!ret_create);
+  }
+#endif
 
-  log_info("Starting main loop");
-  bool success_main_loop = event_loop_main_loop(loop);
+  bool success_main_loop = event_loop_main_loop(server_loops[0].loop);
   ASSERT_TRUE(success_main_loop);
 
+#ifndef _WIN32
+  for (long i = 1; i < num_loops; ++i) {
+    const int ret_join = pthread_join(server_loops[i].thread, NULL);
+    ASSERT_TRUE(!ret_join);
+  }
+#endif
+
   log_info("Server stopped");
 
+  for (long i = 0; i < num_loops; ++i) {
+    ServerLoop *const server_loop = &server_loops[i];
+
+    log_info("Destroying webdav server");
+    webdav_server_destroy(server_loop->ws);
+
+    log_info("Destroying webdav storage backend");
+    webdav_backend_fs_destroy(server_loop->wd_backend);
+
+    log_info("Destroying worker pool");
+    worker_pool_destroy(server_loop->pool);
+
+    log_info("Destroying listen socket");
+    closesocket(server_loop->sock);
+
+    log_info("Destroying event loop");
+    event_loop_destroy(server_loop->loop);
+  }
+
+  free(server_loops);
+
   log_info("Shutting down xml parser");
   shutdown_xml_parser();
 
-  log_info("Destroying webdav storage backend");
-  webdav_backend_fs_destroy(wd_backend);
-
   log_info("Destroying file system");
   fs_destroy(fs);
 
-  log_info("Destroying listen socket");
-  closesocket(sock);
-
-  log_info("Destroying event loop");
-  event_loop_destroy(loop);
-
   log_info("Shutting down socket subsystem");
   shutdown_socket_subsystem();
 
+  uthread_pool_drain();
+
   log_info("Shutting down logging, bye!");
   log_printer_shutdown();
 
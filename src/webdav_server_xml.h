@@ -59,13 +59,34 @@ parse_propfind_request(const char *req_data,
                        webdav_propfind_req_type_t *out_propfind_req_type,
                        linked_list_t *out_props_to_get);
 
+/* the multistatus response is generated incrementally, one entry at a
+   time, so it can be sent while it's being generated. each call appends
+   its XML to `*buf`, reallocating it as necessary */
+struct _propfind_response_generator;
+typedef struct _propfind_response_generator *propfind_response_generator_t;
+
+propfind_response_generator_t
+propfind_response_generator_new(webdav_propfind_req_type_t req_type,
+                                linked_list_t props_to_get);
+
+void
+propfind_response_generator_destroy(propfind_response_generator_t gen);
+
+bool
+propfind_response_generator_start(propfind_response_generator_t gen,
+                                  char **buf, size_t *buf_used,
+                                  size_t *buf_size);
+
+bool
+propfind_response_generator_add_entry(propfind_response_generator_t gen,
+                                      const struct webdav_propfind_entry *entry,
+                                      char **buf, size_t *buf_used,
+                                      size_t *buf_size);
+
 bool
-generate_propfind_response(webdav_propfind_req_type_t req_type,
-                           linked_list_t props_to_get,
-                           linked_list_t entries,
-                           char **out_data,
-                           size_t *out_size,
-                           http_status_code_t *out_status_code);
+propfind_response_generator_finish(propfind_response_generator_t gen,
+                                   char **buf, size_t *buf_used,
+                                   size_t *buf_size);
 
 /* LOCK method XML functions */
 xml_parse_code_t
@@ -23,6 +23,7 @@
 
 #include <deque>
 #include <memory>
+#include <new>
 #include <stack>
 #include <string>
 #include <unordered_set>
@@ -890,181 +891,278 @@ default_props_to_get(void) {
     linked_list_prepend(toret,
                         create_webdav_property("resourcetype", DAV_XML_NS));
 
+  toret =
+    linked_list_prepend(toret,
+                        create_webdav_property("getetag", DAV_XML_NS));
+
   return toret;
 }
 
-bool
-generate_propfind_response(webdav_propfind_req_type_t req_type,
-                           linked_list_t props_to_get_,
-                           linked_list_t entries,
-                           char **out_data,
-                           size_t *out_size,
-                           http_status_code_t *out_status_code) {
-  if (req_type == WEBDAV_PROPFIND_PROPNAME) {
-    /* TODO: not supported yet */
-    return false;
-  }
+struct _propfind_response_generator {
+  webdav_propfind_req_type_t req_type;
+  linked_list_t props_to_get;
+  linked_list_t allocated_props_to_get;
+  /* each <D:response> element is built as a child of this, so it sees
+     the xmlns declaration, then serialized and thrown away */
+  tinyxml2::XMLDocument doc;
+  tinyxml2::XMLElement *multistatus_elt;
+};
 
-  const linked_list_t allocated_props_to_get = req_type == WEBDAV_PROPFIND_ALLPROP
-    ? default_props_to_get()
-    : 0;
-  CFreer<linked_list_t, free_linked_list_of_propfind_entries> free_props_to_get(allocated_props_to_get);
+static bool
+appendToBuffer(char **buf, size_t *buf_used, size_t *buf_size,
+               const char *data, size_t size) {
+  if (*buf_size - *buf_used < size) {
+    size_t new_buf_size = MAX(*buf_size, 1);
+    while (new_buf_size - *buf_used < size) {
+      new_buf_size *= 2;
+    }
 
-  linked_list_t props_to_get = req_type == WEBDAV_PROPFIND_ALLPROP
-    ? allocated_props_to_get
-    : props_to_get_;
+    char *const new_buf = (char *) realloc(*buf, new_buf_size);
+    if (!new_buf) return false;
 
-  tinyxml2::XMLDocument doc;
-  initDoc(doc);
+    *buf = new_buf;
+    *buf_size = new_buf_size;
+  }
 
-  auto multistatus_elt = newChildElement(&doc, DAV_XML_NS_PREFIX, "multistatus");
+  memcpy(*buf + *buf_used, data, size);
+  *buf_used += size;
 
-  char *const xmlns_attr_name = super_strcat("xmlns:", DAV_XML_NS_PREFIX, NULL);
-  ASSERT_NOT_NULL(xmlns_attr_name);
-  CStringFreer free_xmlns_attr_name(xmlns_attr_name);
-  multistatus_elt->SetAttribute(xmlns_attr_name, DAV_XML_NS);
-
-  /* TODO: deal with the case where entries == NULL */
-  ASSERT_NOT_NULL(entries);
-  LINKED_LIST_FOR (struct webdav_propfind_entry, propfind_entry, entries) {
-    auto response_elt = newChildElement(multistatus_elt, DAV_XML_NS_PREFIX, "response");
+  return true;
+}
 
-    newChildElementWithText(response_elt, DAV_XML_NS_PREFIX, "href",
-                            propfind_entry->relative_uri);
-
-    auto propstat_not_found_elt = newChildElement(response_elt, DAV_XML_NS_PREFIX, "propstat");
-    auto prop_not_found_elt = newChildElement(propstat_not_found_elt, DAV_XML_NS_PREFIX, "prop");
-    newChildElementWithText(propstat_not_found_elt, DAV_XML_NS_PREFIX, "status",
-                            "HTTP/1.1 404 Not Found");
-
-    auto propstat_success_elt = newChildElement(response_elt, DAV_XML_NS_PREFIX, "propstat");
-    auto prop_success_elt = newChildElement(propstat_success_elt, DAV_XML_NS_PREFIX, "prop");
-    newChildElementWithText(propstat_success_elt, DAV_XML_NS_PREFIX, "status",
-                            "HTTP/1.1 200 OK");
-
-    auto propstat_failure_elt = newChildElement(response_elt, DAV_XML_NS_PREFIX, "propstat");
-    auto prop_failure_elt = newChildElement(propstat_failure_elt, DAV_XML_NS_PREFIX, "prop");
-    newChildElementWithText(propstat_failure_elt, DAV_XML_NS_PREFIX, "status",
-                            "HTTP/1.1 500 Internal Server Error");
-
-    LINKED_LIST_FOR (WebdavProperty, elt, props_to_get) {
-      bool is_get_last_modified;
-      if (str_equals(elt->ns_href, DAV_XML_NS) &&
-          (((is_get_last_modified = str_equals(elt->element_name, "getlastmodified")) &&
-            propfind_entry->modified_time != INVALID_WEBDAV_RESOURCE_TIME) ||
-           (str_equals(elt->element_name, "creationdate") &&
-            propfind_entry->creation_time != INVALID_WEBDAV_RESOURCE_TIME))) {
-        time_t m_time = (time_t) (is_get_last_modified
-                                  ? propfind_entry->modified_time
-                                  : propfind_entry->creation_time);
-        struct tm *tm_ = gmtime(&m_time);
-        char time_buf[400], *time_str;
-
-        const char *fmt = is_get_last_modified
-          ? "%a, %d %b %Y %H:%M:%S GMT"
-          : "%Y-%m-%dT%H:%M:%SZ";
-
-        size_t num_chars = strftime(time_buf, sizeof(time_buf), fmt, tm_);
-        tinyxml2::XMLElement *xml_node;
-
-        if (!num_chars) {
-          log_error("strftime failed!");
-          time_str = NULL;
-          xml_node = prop_failure_elt;
-        }
-        else {
-          time_str = time_buf;
-          xml_node = prop_success_elt;
-        }
+static tinyxml2::XMLElement *
+addPropfindResponse(tinyxml2::XMLElement *multistatus_elt,
+                    webdav_propfind_req_type_t req_type,
+                    linked_list_t props_to_get,
+                    const struct webdav_propfind_entry *propfind_entry) {
+  auto response_elt = newChildElement(multistatus_elt, DAV_XML_NS_PREFIX, "response");
 
-        newChildElementWithText(xml_node, DAV_XML_NS_PREFIX, elt->element_name, time_str);
+  newChildElementWithText(response_elt, DAV_XML_NS_PREFIX, "href",
+                          propfind_entry->relative_uri);
+
+  auto propstat_not_found_elt = newChildElement(response_elt, DAV_XML_NS_PREFIX, "propstat");
+  auto prop_not_found_elt = newChildElement(propstat_not_found_elt, DAV_XML_NS_PREFIX, "prop");
+  newChildElementWithText(propstat_not_found_elt, DAV_XML_NS_PREFIX, "status",
+                          "HTTP/1.1 404 Not Found");
+
+  auto propstat_success_elt = newChildElement(response_elt, DAV_XML_NS_PREFIX, "propstat");
+  auto prop_success_elt = newChildElement(propstat_success_elt, DAV_XML_NS_PREFIX, "prop");
+  newChildElementWithText(propstat_success_elt, DAV_XML_NS_PREFIX, "status",
+                          "HTTP/1.1 200 OK");
+
+  auto propstat_failure_elt = newChildElement(response_elt, DAV_XML_NS_PREFIX, "propstat");
+  auto prop_failure_elt = newChildElement(propstat_failure_elt, DAV_XML_NS_PREFIX, "prop");
+  newChildElementWithText(propstat_failure_elt, DAV_XML_NS_PREFIX, "status",
+                          "HTTP/1.1 500 Internal Server Error");
+
+  char etag_buf[WEBDAV_ETAG_SIZE];
+  LINKED_LIST_FOR (WebdavProperty, elt, props_to_get) {
+    bool is_get_last_modified;
+    if (str_equals(elt->ns_href, DAV_XML_NS) &&
+        (((is_get_last_modified = str_equals(elt->element_name, "getlastmodified")) &&
+          propfind_entry->modified_time != INVALID_WEBDAV_RESOURCE_TIME) ||
+         (str_equals(elt->element_name, "creationdate") &&
+          propfind_entry->creation_time != INVALID_WEBDAV_RESOURCE_TIME))) {
+      time_t m_time = (time_t) (is_get_last_modified
+                                ? propfind_entry->modified_time
+                                : propfind_entry->creation_time);
+      struct tm tm_buf;
+      struct tm *tm_ = gmtime_x(&m_time, &tm_buf);
+      char time_buf[400], *time_str;
+
+      const char *fmt = is_get_last_modified
+        ? "%a, %d %b %Y %H:%M:%S GMT"
+        : "%Y-%m-%dT%H:%M:%SZ";
+
+      size_t num_chars = tm_ ? strftime(time_buf, sizeof(time_buf), fmt, tm_) : 0;
+      tinyxml2::XMLElement *xml_node;
+
+      if (!num_chars) {
+        log_error("strftime failed!");
+        time_str = NULL;
+        xml_node = prop_failure_elt;
       }
-      else if (str_equals(elt->element_name, "getcontentlength") &&
-               str_equals(elt->ns_href, DAV_XML_NS) &&
-               propfind_entry->length != INVALID_WEBDAV_RESOURCE_SIZE) {
-        char length_str[400];
-        int ret_snprintf = snprintf(length_str, sizeof(length_str), "%lu",
-                                    (unsigned long) propfind_entry->length);
-        ASSERT_TRUE(!(ret_snprintf < 0 || (size_t) ret_snprintf >= sizeof(length_str)));
-        newChildElementWithText(prop_success_elt, DAV_XML_NS_PREFIX,
-                                "getcontentlength", length_str);
+      else {
+        time_str = time_buf;
+        xml_node = prop_success_elt;
       }
-      else if (str_equals(elt->element_name, "resourcetype") &&
-               str_equals(elt->ns_href, DAV_XML_NS)) {
-        auto resourcetype_elt = newChildElement(prop_success_elt, DAV_XML_NS_PREFIX, "resourcetype");
 
-        if (propfind_entry->is_collection) {
-          newChildElement(resourcetype_elt, DAV_XML_NS_PREFIX, "collection");
-        }
-      }
-      else if (req_type == WEBDAV_PROPFIND_PROP) {
-        const char *prefix = NULL;
-        bool set_prefix = false;
-        if (elt->ns_href) {
-          prefix = findPrefix(prop_not_found_elt, elt->ns_href);
-        }
-        if (!prefix) {
-          prefix = "random";
-          set_prefix = true;
-        }
-        auto random_elt = newChildElement(prop_not_found_elt, prefix, elt->element_name);
+      newChildElementWithText(xml_node, DAV_XML_NS_PREFIX, elt->element_name, time_str);
+    }
+    else if (str_equals(elt->element_name, "getcontentlength") &&
+             str_equals(elt->ns_href, DAV_XML_NS) &&
+             propfind_entry->length != INVALID_WEBDAV_RESOURCE_SIZE) {
+      char length_str[400];
+      int ret_snprintf = snprintf(length_str, sizeof(length_str), "%lu",
+                                  (unsigned long) propfind_entry->length);
+      ASSERT_TRUE(!(ret_snprintf < 0 || (size_t) ret_snprintf >= sizeof(length_str)));
+      newChildElementWithText(prop_success_elt, DAV_XML_NS_PREFIX,
+                              "getcontentlength", length_str);
+    }
+    else if (str_equals(elt->element_name, "getetag") &&
+             str_equals(elt->ns_href, DAV_XML_NS) &&
+             webdav_propfind_entry_etag(propfind_entry, etag_buf, sizeof(etag_buf))) {
+      newChildElementWithText(prop_success_elt, DAV_XML_NS_PREFIX,
+                              "getetag", etag_buf);
+    }
+    else if (str_equals(elt->element_name, "resourcetype") &&
+             str_equals(elt->ns_href, DAV_XML_NS)) {
+      auto resourcetype_elt = newChildElement(prop_success_elt, DAV_XML_NS_PREFIX, "resourcetype");
 
-        if (set_prefix) {
-          random_elt->SetAttribute("xmlns:random",
-                                   /* clear the random prefix if there is no href */
-                                   elt->ns_href ? elt->ns_href : "");
-        }
+      if (propfind_entry->is_collection) {
+        newChildElement(resourcetype_elt, DAV_XML_NS_PREFIX, "collection");
       }
     }
+    else if (req_type == WEBDAV_PROPFIND_PROP) {
+      const char *prefix = NULL;
+      bool set_prefix = false;
+      if (elt->ns_href) {
+        prefix = findPrefix(prop_not_found_elt, elt->ns_href);
+      }
+      if (!prefix) {
+        prefix = "random";
+        set_prefix = true;
+      }
+      auto random_elt = newChildElement(prop_not_found_elt, prefix, elt->element_name);
 
-    /* NB: here we also add write lock info,
-       this is expected of us in this interface between us and the server */
-    if (req_type == WEBDAV_PROPFIND_ALLPROP) {
-      auto supported_lock_elt =
-        newChildElement(prop_success_elt, DAV_XML_NS_PREFIX, "supportedlock");
-
-      auto lockentry_exclusive_elt =
-        newChildElement(supported_lock_elt, DAV_XML_NS_PREFIX, "lockentry");
-      auto lockscope_exclusive_elt =
-        newChildElement(lockentry_exclusive_elt, DAV_XML_NS_PREFIX, "lockscope");
-      newChildElement(lockscope_exclusive_elt, DAV_XML_NS_PREFIX, "exclusive");
-      auto locktype_exclusive_elt =
-        newChildElement(lockentry_exclusive_elt, DAV_XML_NS_PREFIX, "locktype");
-      newChildElement(locktype_exclusive_elt, DAV_XML_NS_PREFIX, "write");
-
-      auto lockentry_shared_elt =
-        newChildElement(supported_lock_elt, DAV_XML_NS_PREFIX, "lockentry");
-      auto lockscope_shared_elt =
-        newChildElement(lockentry_shared_elt, DAV_XML_NS_PREFIX, "lockscope");
-      newChildElement(lockscope_shared_elt, DAV_XML_NS_PREFIX, "shared");
-      auto locktype_shared_elt =
-        newChildElement(lockentry_shared_elt, DAV_XML_NS_PREFIX, "locktype");
-      newChildElement(locktype_shared_elt, DAV_XML_NS_PREFIX, "write");
+      if (set_prefix) {
+        random_elt->SetAttribute("xmlns:random",
+                                 /* clear the random prefix if there is no href */
+                                 elt->ns_href ? elt->ns_href : "");
+      }
     }
+  }
 
-    /* TODO: add lock discovery here */
+  /* NB: here we also add write lock info,
+     this is expected of us in this interface between us and the server */
+  if (req_type == WEBDAV_PROPFIND_ALLPROP) {
+    auto supported_lock_elt =
+      newChildElement(prop_success_elt, DAV_XML_NS_PREFIX, "supportedlock");
+
+    auto lockentry_exclusive_elt =
+      newChildElement(supported_lock_elt, DAV_XML_NS_PREFIX, "lockentry");
+    auto lockscope_exclusive_elt =
+      newChildElement(lockentry_exclusive_elt, DAV_XML_NS_PREFIX, "lockscope");
+    newChildElement(lockscope_exclusive_elt, DAV_XML_NS_PREFIX, "exclusive");
+    auto locktype_exclusive_elt =
+      newChildElement(lockentry_exclusive_elt, DAV_XML_NS_PREFIX, "locktype");
+    newChildElement(locktype_exclusive_elt, DAV_XML_NS_PREFIX, "write");
+
+    auto lockentry_shared_elt =
+      newChildElement(supported_lock_elt, DAV_XML_NS_PREFIX, "lockentry");
+    auto lockscope_shared_elt =
+      newChildElement(lockentry_shared_elt, DAV_XML_NS_PREFIX, "lockscope");
+    newChildElement(lockscope_shared_elt, DAV_XML_NS_PREFIX, "shared");
+    auto locktype_shared_elt =
+      newChildElement(lockentry_shared_elt, DAV_XML_NS_PREFIX, "locktype");
+    newChildElement(locktype_shared_elt, DAV_XML_NS_PREFIX, "write");
+  }
 
-    if (!prop_not_found_elt->FirstChildElement()) {
-      unlinkNode(propstat_not_found_elt);
-    }
+  /* TODO: add lock discovery here */
 
-    if (!prop_success_elt->FirstChildElement()) {
-      unlinkNode(propstat_success_elt);
-    }
+  if (!prop_not_found_elt->FirstChildElement()) {
+    unlinkNode(propstat_not_found_elt);
+  }
 
-    if (!prop_failure_elt->FirstChildElement()) {
-      unlinkNode(propstat_failure_elt);
-    }
+  if (!prop_success_elt->FirstChildElement()) {
+    unlinkNode(propstat_success_elt);
   }
 
-  const bool success_serialize = serializeDoc(doc, out_data, out_size);
-  if (!success_serialize) {
-    return false;
+  if (!prop_failure_elt->FirstChildElement()) {
+    unlinkNode(propstat_failure_elt);
   }
 
-  *out_status_code = HTTP_STATUS_CODE_MULTI_STATUS;
+  return response_elt;
+}
 
-  return true;
+propfind_response_generator_t
+propfind_response_generator_new(webdav_propfind_req_type_t req_type,
+                                linked_list_t props_to_get) {
+  if (req_type == WEBDAV_PROPFIND_PROPNAME) {
+    /* TODO: not supported yet */
+    return NULL;
+  }
+
+  auto gen = new (std::nothrow) struct _propfind_response_generator;
+  if (!gen) return NULL;
+
+  gen->req_type = req_type;
+  gen->allocated_props_to_get = req_type == WEBDAV_PROPFIND_ALLPROP
+    ? default_props_to_get()
+    : 0;
+  gen->props_to_get = req_type == WEBDAV_PROPFIND_ALLPROP
+    ? gen->allocated_props_to_get
+    : props_to_get;
+
+  gen->multistatus_elt =
+    newChildElement(&gen->doc, DAV_XML_NS_PREFIX, "multistatus");
+
+  char *const xmlns_attr_name = super_strcat("xmlns:", DAV_XML_NS_PREFIX, NULL);
+  ASSERT_NOT_NULL(xmlns_attr_name);
+  CStringFreer free_xmlns_attr_name(xmlns_attr_name);
+  gen->multistatus_elt->SetAttribute(xmlns_attr_name, DAV_XML_NS);
+
+  return gen;
+}
+
+void
+propfind_response_generator_destroy(propfind_response_generator_t gen) {
+  free_linked_list_of_propfind_entries(gen->allocated_props_to_get);
+  delete gen;
+}
+
+bool
+propfind_response_generator_start(propfind_response_generator_t gen,
+                                  char **buf, size_t *buf_used,
+                                  size_t *buf_size) {
+  /* this is what serializeDoc() would output up to the first child
+     of the multistatus element */
+  char *const start_tag =
+    super_strcat("<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+                 "<", DAV_XML_NS_PREFIX, ":multistatus "
+                 "xmlns:", DAV_XML_NS_PREFIX, "=\"", DAV_XML_NS, "\">",
+                 NULL);
+  if (!start_tag) return false;
+  CStringFreer free_start_tag(start_tag);
+
+  UNUSED(gen);
+
+  return appendToBuffer(buf, buf_used, buf_size,
+                        start_tag, strlen(start_tag));
+}
+
+bool
+propfind_response_generator_add_entry(propfind_response_generator_t gen,
+                                      const struct webdav_propfind_entry *entry,
+                                      char **buf, size_t *buf_used,
+                                      size_t *buf_size) {
+  auto response_elt =
+    addPropfindResponse(gen->multistatus_elt, gen->req_type,
+                        gen->props_to_get, entry);
+
+  /* Windows XP can't handle newlines in XML gracefully... */
+  bool compact = true;
+  tinyxml2::XMLPrinter streamer(NULL, compact);
+  response_elt->Accept(&streamer);
+  unlinkNode(response_elt);
+
+  return appendToBuffer(buf, buf_used, buf_size,
+                        streamer.CStr(), streamer.CStrSize() - 1);
+}
+
+bool
+propfind_response_generator_finish(propfind_response_generator_t gen,
+                                   char **buf, size_t *buf_used,
+                                   size_t *buf_size) {
+  char *const end_tag =
+    super_strcat("</", DAV_XML_NS_PREFIX, ":multistatus>", NULL);
+  if (!end_tag) return false;
+  CStringFreer free_end_tag(end_tag);
+
+  UNUSED(gen);
+
+  return appendToBuffer(buf, buf_used, buf_size,
+                        end_tag, strlen(end_tag));
 }
 
 /* LOCK method XML functions */
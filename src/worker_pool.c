@@ -0,0 +1,365 @@
+/*
+  davfuse: FUSE file systems as WebDAV servers
+  Copyright (C) 2012, 2013 Rian Hunter <rian@alum.mit.edu>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#define _ISOC99_SOURCE
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "c_util.h"
+#include "event_loop.h"
+#include "events.h"
+#include "logging.h"
+#include "sockets.h"
+#include "util.h"
+#include "util_sockets.h"
+
+#include "worker_pool.h"
+
+enum {
+  WAKEUP_SOCKET_RECV,
+  WAKEUP_SOCKET_SEND,
+};
+
+typedef struct _worker_pool_job {
+  struct _worker_pool_job *next;
+  worker_pool_work_fn_t work;
+  void *work_ud;
+  event_handler_t cb;
+  void *cb_ud;
+} WorkerPoolJob;
+
+typedef struct {
+  WorkerPoolJob *head;
+  WorkerPoolJob *tail;
+} WorkerPoolJobQueue;
+
+struct _worker_pool {
+  event_loop_handle_t loop;
+  /* only touched by the loop thread */
+  size_t num_outstanding;
+  event_loop_watch_key_t watch_key;
+  socket_t wakeup_sockets[2];
+  size_t num_threads;
+#ifndef _WIN32
+  pthread_t *threads;
+  bool initted_lock;
+  bool initted_cond;
+  /* protects everything below */
+  pthread_mutex_t lock;
+  pthread_cond_t work_available;
+#endif
+  WorkerPoolJobQueue pending;
+  WorkerPoolJobQueue done;
+  bool sent_wakeup;
+  bool should_quit;
+};
+
+static void
+_job_queue_push(WorkerPoolJobQueue *queue, WorkerPoolJob *job) {
+  job->next = NULL;
+  if (queue->tail) {
+    queue->tail->next = job;
+  }
+  else {
+    queue->head = job;
+  }
+  queue->tail = job;
+}
+
+static WorkerPoolJob *
+_job_queue_pop(WorkerPoolJobQueue *queue) {
+  WorkerPoolJob *const job = queue->head;
+  if (job) {
+    queue->head = job->next;
+    if (!queue->head) queue->tail = NULL;
+  }
+  return job;
+}
+
+static void
+_job_queue_free(WorkerPoolJobQueue *queue) {
+  WorkerPoolJob *job;
+  while ((job = _job_queue_pop(queue))) {
+    free(job);
+  }
+}
+
+#ifndef _WIN32
+
+static void
+_worker_pool_lock(struct _worker_pool *pool) {
+  const int ret = pthread_mutex_lock(&pool->lock);
+  ASSERT_TRUE(!ret);
+}
+
+static void
+_worker_pool_unlock(struct _worker_pool *pool) {
+  const int ret = pthread_mutex_unlock(&pool->lock);
+  ASSERT_TRUE(!ret);
+}
+
+static void *
+_worker_pool_thread(void *ud) {
+  struct _worker_pool *const pool = ud;
+
+  _worker_pool_lock(pool);
+  while (true) {
+    while (!pool->pending.head && !pool->should_quit) {
+      const int ret_wait =
+        pthread_cond_wait(&pool->work_available, &pool->lock);
+      ASSERT_TRUE(!ret_wait);
+    }
+
+    if (pool->should_quit) break;
+
+    WorkerPoolJob *const job = _job_queue_pop(&pool->pending);
+    _worker_pool_unlock(pool);
+
+    job->work(job->work_ud);
+
+    _worker_pool_lock(pool);
+    _job_queue_push(&pool->done, job);
+
+    /* only one wakeup byte is ever in flight, the loop thread
+       collects all finished jobs each time it reads it */
+    if (!pool->sent_wakeup) {
+      const socket_ssize_t ret_send =
+        send(pool->wakeup_sockets[WAKEUP_SOCKET_SEND], "1", 1, 0);
+      ASSERT_TRUE(ret_send == 1);
+      pool->sent_wakeup = true;
+    }
+  }
+  _worker_pool_unlock(pool);
+
+  return NULL;
+}
+
+#endif
+
+static
+EVENT_HANDLER_DECLARE(_worker_pool_wakeup_handler);
+
+static void
+_worker_pool_watch_wakeup(struct _worker_pool *pool) {
+  if (pool->watch_key) return;
+
+  const bool success_watch =
+    event_loop_socket_watch_add(pool->loop,
+                                pool->wakeup_sockets[WAKEUP_SOCKET_RECV],
+                                create_stream_events(true, false),
+                                _worker_pool_wakeup_handler,
+                                pool,
+                                &pool->watch_key);
+  /* TODO: handle this better */
+  ASSERT_TRUE(success_watch);
+}
+
+static
+EVENT_HANDLER_DEFINE(_worker_pool_wakeup_handler, ev_type, ev_, ud) {
+  struct _worker_pool *const pool = ud;
+
+  UNUSED(ev_type);
+  assert(ev_type == EVENT_LOOP_SOCKET_EVENT);
+  EventLoopSocketEvent *const ev = ev_;
+  /* TODO: handle this better */
+  ASSERT_TRUE(!ev->error);
+
+  /* watches are one-shot */
+  pool->watch_key = 0;
+
+  WorkerPoolJob *job = NULL;
+#ifndef _WIN32
+  _worker_pool_lock(pool);
+  job = pool->done.head;
+  pool->done = (WorkerPoolJobQueue) {.head = NULL, .tail = NULL};
+  assert(pool->sent_wakeup);
+  char toread;
+  const socket_ssize_t ret_recv =
+    recv(pool->wakeup_sockets[WAKEUP_SOCKET_RECV], &toread, 1, 0);
+  ASSERT_TRUE(ret_recv == 1);
+  pool->sent_wakeup = false;
+  _worker_pool_unlock(pool);
+#endif
+
+  while (job) {
+    WorkerPoolJob *const next = job->next;
+    const event_handler_t cb = job->cb;
+    void *const cb_ud = job->cb_ud;
+    free(job);
+
+    assert(pool->num_outstanding);
+    pool->num_outstanding -= 1;
+    cb(WORKER_POOL_RUN_DONE_EVENT, NULL, cb_ud);
+
+    job = next;
+  }
+
+  if (pool->num_outstanding) _worker_pool_watch_wakeup(pool);
+}
+
+worker_pool_t
+worker_pool_new(event_loop_handle_t loop, size_t num_threads) {
+  struct _worker_pool *const pool = malloc(sizeof(*pool));
+  if (!pool) return NULL;
+
+  *pool = (struct _worker_pool) {
+    .loop = loop,
+    .wakeup_sockets = {INVALID_SOCKET, INVALID_SOCKET},
+  };
+
+#ifdef _WIN32
+  if (num_threads) {
+    log_info("Worker threads aren't supported on this platform, "
+             "running blocking calls inline");
+  }
+#else
+  if (!num_threads) return pool;
+
+  const int ret_socketpair = localhost_socketpair(pool->wakeup_sockets);
+  if (ret_socketpair) {
+    log_error("Couldn't create wakeup sockets: %s",
+              last_socket_error_message());
+    goto error;
+  }
+
+  const int ret_mutex_init = pthread_mutex_init(&pool->lock, NULL);
+  if (ret_mutex_init) goto error;
+  pool->initted_lock = true;
+
+  const int ret_cond_init = pthread_cond_init(&pool->work_available, NULL);
+  if (ret_cond_init) goto error;
+  pool->initted_cond = true;
+
+  pool->threads = malloc(sizeof(pool->threads[0]) * num_threads);
+  if (!pool->threads) goto error;
+
+  for (size_t i = 0; i < num_threads; ++i) {
+    const int ret_create =
+      pthread_create(&pool->threads[i], NULL, _worker_pool_thread, pool);
+    if (ret_create) {
+      log_error("Couldn't create worker thread %lu", (unsigned long) i);
+      goto error;
+    }
+    pool->num_threads += 1;
+  }
+#endif
+
+  return pool;
+
+#ifndef _WIN32
+ error:
+  worker_pool_destroy(pool);
+  return NULL;
+#endif
+}
+
+void
+worker_pool_run(worker_pool_t pool,
+                worker_pool_work_fn_t work, void *work_ud,
+                event_handler_t cb, void *cb_ud) {
+  WorkerPoolJob *job = NULL;
+  if (pool->num_threads) job = malloc(sizeof(*job));
+
+  if (!job) {
+    /* no threads (or no memory for the job), run it inline */
+    work(work_ud);
+    return cb(WORKER_POOL_RUN_DONE_EVENT, NULL, cb_ud);
+  }
+
+  *job = (WorkerPoolJob) {
+    .work = work,
+    .work_ud = work_ud,
+    .cb = cb,
+    .cb_ud = cb_ud,
+  };
+
+  pool->num_outstanding += 1;
+  _worker_pool_watch_wakeup(pool);
+
+#ifndef _WIN32
+  _worker_pool_lock(pool);
+  _job_queue_push(&pool->pending, job);
+  const int ret_signal = pthread_cond_signal(&pool->work_available);
+  ASSERT_TRUE(!ret_signal);
+  _worker_pool_unlock(pool);
+#endif
+}
+
+bool
+worker_pool_destroy(worker_pool_t pool) {
+#ifndef _WIN32
+  if (pool->num_threads) {
+    _worker_pool_lock(pool);
+    pool->should_quit = true;
+    const int ret_broadcast = pthread_cond_broadcast(&pool->work_available);
+    ASSERT_TRUE(!ret_broadcast);
+    _worker_pool_unlock(pool);
+
+    for (size_t i = 0; i < pool->num_threads; ++i) {
+      const int ret_join = pthread_join(pool->threads[i], NULL);
+      ASSERT_TRUE(!ret_join);
+    }
+  }
+
+  free(pool->threads);
+
+  if (pool->initted_cond) {
+    const int ret_cond_destroy = pthread_cond_destroy(&pool->work_available);
+    ASSERT_TRUE(!ret_cond_destroy);
+  }
+
+  if (pool->initted_lock) {
+    const int ret_mutex_destroy = pthread_mutex_destroy(&pool->lock);
+    ASSERT_TRUE(!ret_mutex_destroy);
+  }
+#endif
+
+  if (pool->num_outstanding) {
+    log_warning("Dropping %lu unfinished jobs",
+                (unsigned long) pool->num_outstanding);
+  }
+
+  _job_queue_free(&pool->pending);
+  _job_queue_free(&pool->done);
+
+  if (pool->watch_key) {
+    const bool success_remove =
+      event_loop_watch_remove(pool->loop, pool->watch_key);
+    ASSERT_TRUE(success_remove);
+  }
+
+  for (unsigned i = 0; i < NELEMS(pool->wakeup_sockets); ++i) {
+    if (pool->wakeup_sockets[i] != INVALID_SOCKET) {
+      const int ret_close = closesocket(pool->wakeup_sockets[i]);
+      if (ret_close) {
+        log_error("Error while closing wakeup socket %ld: %s",
+                  (long) pool->wakeup_sockets[i], last_socket_error_message());
+      }
+    }
+  }
+
+  free(pool);
+
+  return true;
+}
@@ -0,0 +1,65 @@
+/*
+  davfuse: FUSE file systems as WebDAV servers
+  Copyright (C) 2012, 2013 Rian Hunter <rian@alum.mit.edu>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _WORKER_POOL_H
+#define _WORKER_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "c_util.h"
+#include "events.h"
+#include "event_loop.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* a bounded set of threads for running blocking calls (e.g. file system
+   calls) off the event loop, completion is signaled back to the loop
+   through a wakeup socket */
+
+struct _worker_pool;
+
+typedef struct _worker_pool *worker_pool_t;
+
+typedef void (*worker_pool_work_fn_t)(void *);
+
+/* with `num_threads` == 0 the work is run inline by worker_pool_run() */
+worker_pool_t
+worker_pool_new(event_loop_handle_t loop, size_t num_threads);
+
+/* runs `work(work_ud)` on a worker thread, then calls `cb` with
+   WORKER_POOL_RUN_DONE_EVENT (and a NULL event) on the loop's thread */
+NON_NULL_ARGS3(1, 2, 4)
+void
+worker_pool_run(worker_pool_t pool,
+                worker_pool_work_fn_t work, void *work_ud,
+                event_handler_t cb, void *cb_ud);
+
+/* waits for the running work to finish, work that hasn't been started
+   yet is dropped without calling its callback */
+NON_NULL_ARGS()
+bool
+worker_pool_destroy(worker_pool_t pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif